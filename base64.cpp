@@ -0,0 +1,143 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "base64.hpp"
+#include <algorithm>
+
+namespace Fossilize
+{
+static char base64(uint32_t v)
+{
+	if (v == 63)
+		return '/';
+	else if (v == 62)
+		return '+';
+	else if (v >= 52)
+		return char('0' + (v - 52));
+	else if (v >= 26)
+		return char('a' + (v - 26));
+	else
+		return char('A' + v);
+}
+
+std::string encode_base64(const void *data_, size_t size)
+{
+	auto *data = static_cast<const uint8_t *>(data_);
+	size_t num_chars = 4 * ((size + 2) / 3);
+	std::string ret;
+	ret.reserve(num_chars);
+
+	for (size_t i = 0; i < size; i += 3)
+	{
+		uint32_t code = data[i] << 16;
+		if (i + 1 < size)
+			code |= data[i + 1] << 8;
+		if (i + 2 < size)
+			code |= data[i + 2] << 0;
+
+		auto c0 = base64((code >> 18) & 63);
+		auto c1 = base64((code >> 12) & 63);
+		auto c2 = base64((code >>  6) & 63);
+		auto c3 = base64((code >>  0) & 63);
+
+		auto outbytes = std::min(size - i, size_t(3));
+		if (outbytes == 1)
+		{
+			c2 = '=';
+			c3 = '=';
+		}
+		else if (outbytes == 2)
+			c3 = '=';
+
+		ret.push_back(c0);
+		ret.push_back(c1);
+		ret.push_back(c2);
+		ret.push_back(c3);
+	}
+
+	return ret;
+}
+
+void decode_base64(uint8_t *buffer, size_t length, const char *data)
+{
+	auto *ptr = buffer;
+
+	const auto base64_index = [](char c) -> uint32_t {
+		if (c >= 'A' && c <= 'Z')
+			return uint32_t(c - 'A');
+		else if (c >= 'a' && c <= 'z')
+			return uint32_t(c - 'a') + 26;
+		else if (c >= '0' && c <= '9')
+			return uint32_t(c - '0') + 52;
+		else if (c == '+')
+			return 62;
+		else if (c == '/')
+			return 63;
+		else
+			return 0;
+	};
+
+	for (uint64_t i = 0; i < length; )
+	{
+		char c0 = *data++;
+		if (c0 == '\0')
+			break;
+		char c1 = *data++;
+		if (c1 == '\0')
+			break;
+		char c2 = *data++;
+		if (c2 == '\0')
+			break;
+		char c3 = *data++;
+		if (c3 == '\0')
+			break;
+
+		uint32_t values =
+				(base64_index(c0) << 18) |
+				(base64_index(c1) << 12) |
+				(base64_index(c2) << 6) |
+				(base64_index(c3) << 0);
+
+		unsigned outbytes = c3 != '=' ? 3 : (c2 != '=' ? 2 : 1);
+		if (i + outbytes > length)
+			break;
+
+		if (outbytes == 1)
+		{
+			*ptr++ = uint8_t(values >> 16);
+		}
+		else if (outbytes == 2)
+		{
+			*ptr++ = uint8_t(values >> 16);
+			*ptr++ = uint8_t(values >> 8);
+		}
+		else
+		{
+			*ptr++ = uint8_t(values >> 16);
+			*ptr++ = uint8_t(values >> 8);
+			*ptr++ = uint8_t(values >> 0);
+		}
+
+		i += outbytes;
+	}
+}
+}
@@ -23,6 +23,13 @@
 #include "file.hpp"
 #include <stdio.h>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace Fossilize
 {
 std::vector<uint8_t> load_buffer_from_file(const char *path)
@@ -76,4 +83,40 @@ bool write_buffer_to_file(const char *path, const void *data, size_t size)
 	fclose(file);
 	return true;
 }
-}
\ No newline at end of file
+
+MappedFile::~MappedFile()
+{
+#ifndef _WIN32
+	if (mapped)
+		munmap(const_cast<uint8_t *>(mapped), mapped_size);
+#endif
+}
+
+bool MappedFile::map(const char *path)
+{
+#ifndef _WIN32
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat s;
+	if (fstat(fd, &s) != 0 || s.st_size <= 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	void *ptr = mmap(nullptr, size_t(s.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED)
+		return false;
+
+	mapped = static_cast<const uint8_t *>(ptr);
+	mapped_size = size_t(s.st_size);
+	return true;
+#else
+	buffer = load_buffer_from_file(path);
+	return !buffer.empty();
+#endif
+}
+}
@@ -31,4 +31,33 @@ namespace Fossilize
 std::vector<uint8_t> load_buffer_from_file(const char *path);
 bool write_string_to_file(const char *path, const char *text);
 bool write_buffer_to_file(const char *path, const void *data, size_t size);
+
+// Read-only view of a whole file. On POSIX systems the file is memory mapped,
+// so only the pages which are actually touched are read from disk.
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	~MappedFile();
+
+	MappedFile(const MappedFile &) = delete;
+	void operator=(const MappedFile &) = delete;
+
+	bool map(const char *path);
+
+	const uint8_t *data() const
+	{
+		return mapped ? mapped : buffer.data();
+	}
+
+	size_t size() const
+	{
+		return mapped ? mapped_size : buffer.size();
+	}
+
+private:
+	const uint8_t *mapped = nullptr;
+	size_t mapped_size = 0;
+	std::vector<uint8_t> buffer;
+};
 }
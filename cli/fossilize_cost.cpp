@@ -0,0 +1,472 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "fossilize.hpp"
+#include "logging.hpp"
+#include "cli_parser.hpp"
+#include "file.hpp"
+#include "spirv_store.hpp"
+#include "thread_pool.hpp"
+#include "spirv_cross.hpp"
+#include <algorithm>
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+using namespace Fossilize;
+
+template <typename T>
+static inline T fake_handle(uint64_t v)
+{
+	return (T)v;
+}
+
+// Handles are index + 1, so references map straight back to the referenced object.
+template <typename T>
+static inline unsigned handle_index(T handle)
+{
+	return unsigned((uint64_t)handle - 1);
+}
+
+struct Cost
+{
+	unsigned stages = 0;
+	uint64_t instructions = 0;
+	uint64_t basic_blocks = 0;
+	uint64_t loops = 0;
+	uint64_t function_calls = 0;
+	uint64_t descriptors = 0;
+	uint64_t spec_constants = 0;
+
+	void add(const Cost &other)
+	{
+		stages += other.stages;
+		instructions += other.instructions;
+		basic_blocks += other.basic_blocks;
+		loops += other.loops;
+		function_calls += other.function_calls;
+		descriptors += other.descriptors;
+		spec_constants += other.spec_constants;
+	}
+};
+
+enum class SortKey
+{
+	Instructions,
+	BasicBlocks,
+	Loops,
+	FunctionCalls,
+	Descriptors,
+	SpecConstants
+};
+
+static bool sort_key_from_string(const char *key, SortKey &sort_key)
+{
+	static const struct
+	{
+		const char *name;
+		SortKey key;
+	} keys[] = {
+		{ "instructions", SortKey::Instructions },
+		{ "blocks", SortKey::BasicBlocks },
+		{ "loops", SortKey::Loops },
+		{ "calls", SortKey::FunctionCalls },
+		{ "descriptors", SortKey::Descriptors },
+		{ "spec-constants", SortKey::SpecConstants },
+	};
+
+	for (auto &k : keys)
+	{
+		if (strcmp(k.name, key) == 0)
+		{
+			sort_key = k.key;
+			return true;
+		}
+	}
+	return false;
+}
+
+static uint64_t get_sort_value(const Cost &cost, SortKey key)
+{
+	switch (key)
+	{
+	case SortKey::BasicBlocks:
+		return cost.basic_blocks;
+	case SortKey::Loops:
+		return cost.loops;
+	case SortKey::FunctionCalls:
+		return cost.function_calls;
+	case SortKey::Descriptors:
+		return cost.descriptors;
+	case SortKey::SpecConstants:
+		return cost.spec_constants;
+	default:
+		return cost.instructions;
+	}
+}
+
+struct PipelineInfo
+{
+	Hash hash;
+	const char *kind;
+	vector<unsigned> modules;
+};
+
+struct CostReplayer : StateCreatorInterface
+{
+	vector<Hash> module_hashes;
+	vector<const VkShaderModuleCreateInfo *> module_infos;
+	vector<PipelineInfo> compute_pipelines;
+	vector<PipelineInfo> graphics_pipelines;
+
+	bool set_num_shader_modules(unsigned count) override
+	{
+		module_hashes.resize(count);
+		module_infos.resize(count);
+		return true;
+	}
+
+	bool set_num_compute_pipelines(unsigned count) override
+	{
+		compute_pipelines.resize(count);
+		return true;
+	}
+
+	bool set_num_graphics_pipelines(unsigned count) override
+	{
+		graphics_pipelines.resize(count);
+		return true;
+	}
+
+	bool enqueue_create_sampler(Hash, unsigned index, const VkSamplerCreateInfo *, VkSampler *sampler) override
+	{
+		*sampler = fake_handle<VkSampler>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_descriptor_set_layout(Hash, unsigned index, const VkDescriptorSetLayoutCreateInfo *, VkDescriptorSetLayout *layout) override
+	{
+		*layout = fake_handle<VkDescriptorSetLayout>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_pipeline_layout(Hash, unsigned index, const VkPipelineLayoutCreateInfo *, VkPipelineLayout *layout) override
+	{
+		*layout = fake_handle<VkPipelineLayout>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_shader_module(Hash hash, unsigned index, const VkShaderModuleCreateInfo *create_info, VkShaderModule *module) override
+	{
+		module_hashes[index] = hash;
+		module_infos[index] = create_info;
+		*module = fake_handle<VkShaderModule>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_render_pass(Hash, unsigned index, const VkRenderPassCreateInfo *, VkRenderPass *render_pass) override
+	{
+		*render_pass = fake_handle<VkRenderPass>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_compute_pipeline(Hash hash, unsigned index, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		auto &info = compute_pipelines[index];
+		info.hash = hash;
+		info.kind = "compute";
+		info.modules.push_back(handle_index(create_info->stage.module));
+		*pipeline = fake_handle<VkPipeline>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_graphics_pipeline(Hash hash, unsigned index, const VkGraphicsPipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		auto &info = graphics_pipelines[index];
+		info.hash = hash;
+		info.kind = "graphics";
+		for (uint32_t i = 0; i < create_info->stageCount; i++)
+			info.modules.push_back(handle_index(create_info->pStages[i].module));
+		*pipeline = fake_handle<VkPipeline>(index + 1);
+		return true;
+	}
+};
+
+// Instruction level metrics come from walking the module, resource usage from SPIRV-Cross reflection.
+static bool analyze_module(const VkShaderModuleCreateInfo &info, Cost &cost)
+{
+	auto *code = info.pCode;
+	size_t count = info.codeSize / sizeof(uint32_t);
+	const size_t header_words = 5;
+	if (!code || count < header_words || code[0] != 0x07230203u)
+		return false;
+
+	cost.stages = 1;
+	for (size_t offset = header_words; offset < count; )
+	{
+		uint32_t length = code[offset] >> 16;
+		if (length == 0 || length > count - offset)
+			return false;
+
+		cost.instructions++;
+		switch (spv::Op(code[offset] & 0xffff))
+		{
+		case spv::OpLabel:
+			cost.basic_blocks++;
+			break;
+		case spv::OpLoopMerge:
+			cost.loops++;
+			break;
+		case spv::OpFunctionCall:
+			cost.function_calls++;
+			break;
+		default:
+			break;
+		}
+		offset += length;
+	}
+
+	try
+	{
+		spirv_cross::Compiler compiler(code, count);
+		auto resources = compiler.get_shader_resources();
+		cost.descriptors = resources.uniform_buffers.size() + resources.storage_buffers.size() +
+		                   resources.subpass_inputs.size() + resources.storage_images.size() +
+		                   resources.sampled_images.size() + resources.atomic_counters.size() +
+		                   resources.separate_images.size() + resources.separate_samplers.size();
+		cost.spec_constants = compiler.get_specialization_constants().size();
+	}
+	catch (const exception &)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+struct Row
+{
+	const char *kind;
+	Hash hash;
+	Cost cost;
+};
+
+static void sort_rows(vector<Row> &rows, SortKey key)
+{
+	sort(begin(rows), end(rows), [key](const Row &a, const Row &b) {
+		uint64_t value_a = get_sort_value(a.cost, key);
+		uint64_t value_b = get_sort_value(b.cost, key);
+		return value_a != value_b ? value_a > value_b : a.hash < b.hash;
+	});
+}
+
+static void write_csv(FILE *file, const vector<Row> &pipelines, const vector<Row> &modules)
+{
+	fprintf(file, "kind,hash,stages,instructions,basic_blocks,loops,function_calls,descriptors,spec_constants\n");
+	for (auto *rows : { &pipelines, &modules })
+	{
+		for (auto &row : *rows)
+		{
+			fprintf(file, "%s,%016llx,%u,%llu,%llu,%llu,%llu,%llu,%llu\n",
+			        row.kind, static_cast<unsigned long long>(row.hash), row.cost.stages,
+			        static_cast<unsigned long long>(row.cost.instructions),
+			        static_cast<unsigned long long>(row.cost.basic_blocks),
+			        static_cast<unsigned long long>(row.cost.loops),
+			        static_cast<unsigned long long>(row.cost.function_calls),
+			        static_cast<unsigned long long>(row.cost.descriptors),
+			        static_cast<unsigned long long>(row.cost.spec_constants));
+		}
+	}
+}
+
+static void write_json_rows(FILE *file, const char *name, const vector<Row> &rows, bool last)
+{
+	fprintf(file, "\t\"%s\": [", name);
+	for (size_t i = 0; i < rows.size(); i++)
+	{
+		auto &row = rows[i];
+		fprintf(file, "%s\n\t\t{ \"kind\": \"%s\", \"hash\": \"%016llx\", \"stages\": %u, \"instructions\": %llu, "
+		              "\"basicBlocks\": %llu, \"loops\": %llu, \"functionCalls\": %llu, \"descriptors\": %llu, "
+		              "\"specConstants\": %llu }",
+		        i ? "," : "", row.kind, static_cast<unsigned long long>(row.hash), row.cost.stages,
+		        static_cast<unsigned long long>(row.cost.instructions),
+		        static_cast<unsigned long long>(row.cost.basic_blocks),
+		        static_cast<unsigned long long>(row.cost.loops),
+		        static_cast<unsigned long long>(row.cost.function_calls),
+		        static_cast<unsigned long long>(row.cost.descriptors),
+		        static_cast<unsigned long long>(row.cost.spec_constants));
+	}
+	fprintf(file, "%s]%s\n", rows.empty() ? "" : "\n\t", last ? "" : ",");
+}
+
+static void write_json(FILE *file, const vector<Row> &pipelines, const vector<Row> &modules)
+{
+	fprintf(file, "{\n");
+	write_json_rows(file, "pipelines", pipelines, false);
+	write_json_rows(file, "modules", modules, true);
+	fprintf(file, "}\n");
+}
+
+static void print_help()
+{
+	LOGI("fossilize-cost\n"
+	     "\t[--help]\n"
+	     "\t[--output <path>]\n"
+	     "\t[--format <csv|json>]\n"
+	     "\t[--sort <instructions|blocks|loops|calls|descriptors|spec-constants>]\n"
+	     "\t[--threads <count>]\n"
+	     "\t[--spirv-store <directory>]\n"
+	     "\tstate.json\n");
+}
+
+int main(int argc, char *argv[])
+{
+	string json_path;
+	string output;
+	string spirv_store_path;
+	bool json = false;
+	SortKey sort_key = SortKey::Instructions;
+	unsigned num_threads = 0;
+	CLICallbacks cbs;
+
+	cbs.default_handler = [&](const char *arg) { json_path = arg; };
+	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
+	cbs.add("--output", [&](CLIParser &parser) { output = parser.next_string(); });
+	cbs.add("--format", [&](CLIParser &parser) {
+		const char *format = parser.next_string();
+		if (strcmp(format, "json") == 0)
+			json = true;
+		else if (strcmp(format, "csv") == 0)
+			json = false;
+		else
+			throw runtime_error("Invalid format.");
+	});
+	cbs.add("--sort", [&](CLIParser &parser) {
+		if (!sort_key_from_string(parser.next_string(), sort_key))
+			throw runtime_error("Invalid sort key.");
+	});
+	cbs.add("--threads", [&](CLIParser &parser) { num_threads = parser.next_uint(); });
+	cbs.add("--spirv-store", [&](CLIParser &parser) { spirv_store_path = parser.next_string(); });
+	cbs.error_handler = [] { print_help(); };
+
+	CLIParser parser(move(cbs), argc - 1, argv + 1);
+	if (!parser.parse())
+		return EXIT_FAILURE;
+	if (parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+	if (json_path.empty())
+	{
+		LOGE("No path to serialized state provided.\n");
+		print_help();
+		return EXIT_FAILURE;
+	}
+
+	// Shader modules from the store point into its mappings, so it must outlive the replayer.
+	DirectorySpirvStore spirv_store(spirv_store_path);
+	CostReplayer replayer;
+	StateReplayer state_replayer;
+	if (!spirv_store_path.empty())
+		state_replayer.set_spirv_store(&spirv_store);
+
+	try
+	{
+		auto state_json = load_buffer_from_file(json_path.c_str());
+		if (state_json.empty())
+		{
+			LOGE("Failed to load state JSON from disk.\n");
+			return EXIT_FAILURE;
+		}
+		state_replayer.parse(replayer, state_json.data(), state_json.size());
+	}
+	catch (const exception &e)
+	{
+		LOGE("StateReplayer threw exception: %s\n", e.what());
+		return EXIT_FAILURE;
+	}
+
+	vector<Cost> module_costs(replayer.module_infos.size());
+	atomic<unsigned> failed(0);
+	{
+		ThreadPool pool(num_threads);
+		for (size_t i = 0; i < module_costs.size(); i++)
+		{
+			pool.enqueue([&replayer, &module_costs, &failed, i]() {
+				auto *info = replayer.module_infos[i];
+				if (!info || !analyze_module(*info, module_costs[i]))
+				{
+					LOGE("Failed to analyze shader module %016llx.\n",
+					     static_cast<unsigned long long>(replayer.module_hashes[i]));
+					module_costs[i] = {};
+					failed++;
+				}
+			});
+		}
+		pool.wait_idle();
+	}
+
+	vector<Row> modules;
+	modules.reserve(module_costs.size());
+	for (size_t i = 0; i < module_costs.size(); i++)
+		modules.push_back({ "module", replayer.module_hashes[i], module_costs[i] });
+
+	// Pipelines are costed as the sum of their stages.
+	vector<Row> pipelines;
+	for (auto *infos : { &replayer.compute_pipelines, &replayer.graphics_pipelines })
+	{
+		for (auto &info : *infos)
+		{
+			Row row = { info.kind, info.hash, {} };
+			for (auto module : info.modules)
+				if (module < module_costs.size())
+					row.cost.add(module_costs[module]);
+			pipelines.push_back(row);
+		}
+	}
+
+	sort_rows(pipelines, sort_key);
+	sort_rows(modules, sort_key);
+
+	FILE *file = stdout;
+	if (!output.empty())
+	{
+		file = fopen(output.c_str(), "w");
+		if (!file)
+		{
+			LOGE("Failed to open %s for writing.\n", output.c_str());
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (json)
+		write_json(file, pipelines, modules);
+	else
+		write_csv(file, pipelines, modules);
+
+	if (file != stdout)
+		fclose(file);
+
+	LOGI("Analyzed %u shader modules and %u pipelines, %u modules failed.\n",
+	     unsigned(modules.size()), unsigned(pipelines.size()), failed.load());
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
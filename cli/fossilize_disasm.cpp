@@ -23,10 +23,13 @@
 #include "volk.h"
 #include "device.hpp"
 #include "fossilize.hpp"
+#include "spirv_store.hpp"
 #include "cli_parser.hpp"
 #include "logging.hpp"
 #include "file.hpp"
+#include "thread_pool.hpp"
 
+#include <atomic>
 #include <string>
 #include <unordered_map>
 #include <stdlib.h>
@@ -123,6 +126,7 @@ struct DisasmReplayer : StateCreatorInterface
 	{
 		compute_pipelines.resize(count);
 		compute_infos.resize(count);
+		compute_hashes.resize(count);
 		return true;
 	}
 
@@ -130,6 +134,7 @@ struct DisasmReplayer : StateCreatorInterface
 	{
 		graphics_pipelines.resize(count);
 		graphics_infos.resize(count);
+		graphics_hashes.resize(count);
 		return true;
 	}
 
@@ -238,7 +243,7 @@ struct DisasmReplayer : StateCreatorInterface
 		return true;
 	}
 
-	bool enqueue_create_compute_pipeline(Hash, unsigned index, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	bool enqueue_create_compute_pipeline(Hash hash, unsigned index, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override
 	{
 		if (device)
 		{
@@ -257,10 +262,11 @@ struct DisasmReplayer : StateCreatorInterface
 		compute_pipelines[index] = *pipeline;
 		compute_to_index[*pipeline] = index;
 		compute_infos[index] = create_info;
+		compute_hashes[index] = hash;
 		return true;
 	}
 
-	bool enqueue_create_graphics_pipeline(Hash, unsigned index, const VkGraphicsPipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	bool enqueue_create_graphics_pipeline(Hash hash, unsigned index, const VkGraphicsPipelineCreateInfo *create_info, VkPipeline *pipeline) override
 	{
 		if (device)
 		{
@@ -279,6 +285,7 @@ struct DisasmReplayer : StateCreatorInterface
 		graphics_pipelines[index] = *pipeline;
 		graphics_to_index[*pipeline] = index;
 		graphics_infos[index] = create_info;
+		graphics_hashes[index] = hash;
 		return true;
 	}
 
@@ -291,6 +298,8 @@ struct DisasmReplayer : StateCreatorInterface
 	vector<const VkRenderPassCreateInfo *> render_pass_infos;
 	vector<const VkGraphicsPipelineCreateInfo *> graphics_infos;
 	vector<const VkComputePipelineCreateInfo *> compute_infos;
+	vector<Hash> graphics_hashes;
+	vector<Hash> compute_hashes;
 
 	unordered_map<VkSampler, unsigned> sampler_to_index;
 	unordered_map<VkDescriptorSetLayout, unsigned> set_to_index;
@@ -351,6 +360,40 @@ static VkShaderStageFlagBits stage_from_string(const char *stage)
 	}
 }
 
+static const char *stage_to_string(VkShaderStageFlagBits stage)
+{
+	switch (stage)
+	{
+	case VK_SHADER_STAGE_VERTEX_BIT:
+		return "vert";
+	case VK_SHADER_STAGE_FRAGMENT_BIT:
+		return "frag";
+	case VK_SHADER_STAGE_GEOMETRY_BIT:
+		return "geom";
+	case VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT:
+		return "tesc";
+	case VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT:
+		return "tese";
+	case VK_SHADER_STAGE_COMPUTE_BIT:
+		return "comp";
+	default:
+		return "unknown";
+	}
+}
+
+static const char *method_to_extension(DisasmMethod method)
+{
+	switch (method)
+	{
+	case DisasmMethod::Asm:
+		return "asm";
+	case DisasmMethod::GLSL:
+		return "glsl";
+	default:
+		return "amd";
+	}
+}
+
 static string disassemble_spirv_asm(const VkShaderModuleCreateInfo *create_info)
 {
 	string str;
@@ -450,6 +493,101 @@ static string disassemble_spirv(const VulkanDevice &device, VkPipeline pipeline,
 	}
 }
 
+// Disassembles every stage of every pipeline into <directory>/<pipeline hash>.<stage>.<target>.
+// asm and glsl only depend on the module, entry point and stage, so stages which share those are disassembled once.
+static bool disassemble_all(const VulkanDevice &device, const DisasmReplayer &replayer, DisasmMethod method,
+                            const string &directory, unsigned num_threads)
+{
+	struct Job
+	{
+		VkPipeline pipeline;
+		VkShaderStageFlagBits stage;
+		const VkShaderModuleCreateInfo *module_info;
+		const char *entry;
+		vector<string> paths;
+	};
+	vector<Job> jobs;
+	unordered_map<string, unsigned> job_indices;
+
+	const auto add_stage = [&](Hash hash, VkPipeline pipeline, const VkPipelineShaderStageCreateInfo &stage) {
+		char name[64];
+		snprintf(name, sizeof(name), "%016llx.%s.%s", static_cast<unsigned long long>(hash),
+		         stage_to_string(stage.stage), method_to_extension(method));
+		auto path = directory + "/" + name;
+
+		auto module_itr = replayer.module_to_index.find(stage.module);
+		if (module_itr == end(replayer.module_to_index))
+		{
+			LOGE("Pipeline %016llx refers to an unknown shader module.\n", static_cast<unsigned long long>(hash));
+			return;
+		}
+
+		string key;
+		if (method != DisasmMethod::AMD)
+		{
+			key = to_string(module_itr->second) + ":" + stage_to_string(stage.stage) + ":" + stage.pName;
+			auto itr = job_indices.find(key);
+			if (itr != end(job_indices))
+			{
+				jobs[itr->second].paths.push_back(move(path));
+				return;
+			}
+			job_indices[key] = unsigned(jobs.size());
+		}
+
+		jobs.push_back({ pipeline, stage.stage, replayer.shader_module_infos[module_itr->second], stage.pName, { move(path) } });
+	};
+
+	for (size_t i = 0; i < replayer.compute_infos.size(); i++)
+		add_stage(replayer.compute_hashes[i], replayer.compute_pipelines[i], replayer.compute_infos[i]->stage);
+
+	for (size_t i = 0; i < replayer.graphics_infos.size(); i++)
+	{
+		auto *info = replayer.graphics_infos[i];
+		for (uint32_t j = 0; j < info->stageCount; j++)
+			add_stage(replayer.graphics_hashes[i], replayer.graphics_pipelines[i], info->pStages[j]);
+	}
+
+	atomic<unsigned> failed(0);
+	{
+		ThreadPool pool(num_threads);
+		for (auto &job_ref : jobs)
+		{
+			const Job &job = job_ref;
+			pool.enqueue([&device, &failed, &job, method]() {
+				string disassembled;
+				try
+				{
+					disassembled = disassemble_spirv(device, job.pipeline, method, job.stage, job.module_info, job.entry);
+				}
+				catch (const exception &e)
+				{
+					LOGE("Failed to disassemble %s: %s\n", job.paths.front().c_str(), e.what());
+				}
+
+				if (disassembled.empty())
+				{
+					failed++;
+					return;
+				}
+
+				for (auto &path : job.paths)
+				{
+					if (!write_string_to_file(path.c_str(), disassembled.c_str()))
+					{
+						LOGE("Failed to write disassembly to file: %s\n", path.c_str());
+						failed++;
+					}
+				}
+			});
+		}
+		pool.wait_idle();
+	}
+
+	LOGI("Disassembled %u shader stages, %u failed.\n", unsigned(jobs.size()), failed.load());
+	return failed == 0;
+}
+
 static void print_help()
 {
 	LOGI("fossilize-disasm\n"
@@ -458,9 +596,12 @@ static void print_help()
 	     "\t[--enable-validation]\n"
 	     "\t[--graphics-pipeline <index>]\n"
 	     "\t[--compute-pipeline <index>]\n"
+	     "\t[--all]\n"
+	     "\t[--threads <count>]\n"
 	     "\t[--stage vert/frag/comp/geom/tesc/tese]\n"
-	     "\t[--output <path>]\n"
+	     "\t[--output <path, or directory with --all>]\n"
 	     "\t[--target asm/glsl/amd]\n"
+	     "\t[--spirv-store <directory>]\n"
 	     "state.json\n");
 }
 
@@ -468,12 +609,15 @@ int main(int argc, char *argv[])
 {
 	string json_path;
 	string output;
+	string spirv_store_path;
 	VulkanDevice::Options opts;
 	DisasmMethod method = DisasmMethod::Asm;
 	VkShaderStageFlagBits stage = VK_SHADER_STAGE_ALL;
 
 	int graphics_index = -1;
 	int compute_index = -1;
+	bool all = false;
+	unsigned num_threads = 0;
 
 	CLICallbacks cbs;
 	cbs.default_handler = [&](const char *arg) { json_path = arg; };
@@ -482,8 +626,11 @@ int main(int argc, char *argv[])
 	cbs.add("--enable-validation", [&](CLIParser &) { opts.enable_validation = true; });
 	cbs.add("--graphics-pipeline", [&](CLIParser &parser) { graphics_index = parser.next_uint(); });
 	cbs.add("--compute-pipeline", [&](CLIParser &parser) { compute_index = parser.next_uint(); });
+	cbs.add("--all", [&](CLIParser &) { all = true; });
+	cbs.add("--threads", [&](CLIParser &parser) { num_threads = parser.next_uint(); });
 	cbs.add("--stage", [&](CLIParser &parser) { stage = stage_from_string(parser.next_string()); });
 	cbs.add("--output", [&](CLIParser &parser) { output = parser.next_string(); });
+	cbs.add("--spirv-store", [&](CLIParser &parser) { spirv_store_path = parser.next_string(); });
 	cbs.add("--target", [&](CLIParser &parser) {
 		method = method_from_string(parser.next_string());
 	});
@@ -502,19 +649,30 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	if (compute_index >= 0)
-		stage = VK_SHADER_STAGE_COMPUTE_BIT;
-
-	if (stage == VK_SHADER_STAGE_ALL)
+	if (all)
 	{
-		LOGE("Must choose --stage!\n");
-		return EXIT_FAILURE;
+		if (output.empty())
+		{
+			LOGE("--all requires an --output directory.\n");
+			return EXIT_FAILURE;
+		}
 	}
-
-	if (((graphics_index >= 0 && compute_index >= 0)) || ((graphics_index < 0) && (compute_index < 0)))
+	else
 	{
-		LOGE("Use either --graphics-pipeline or --compute-pipeline.\n");
-		return EXIT_FAILURE;
+		if (compute_index >= 0)
+			stage = VK_SHADER_STAGE_COMPUTE_BIT;
+
+		if (stage == VK_SHADER_STAGE_ALL)
+		{
+			LOGE("Must choose --stage!\n");
+			return EXIT_FAILURE;
+		}
+
+		if (((graphics_index >= 0 && compute_index >= 0)) || ((graphics_index < 0) && (compute_index < 0)))
+		{
+			LOGE("Use either --graphics-pipeline or --compute-pipeline.\n");
+			return EXIT_FAILURE;
+		}
 	}
 
 	VulkanDevice device;
@@ -527,18 +685,36 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	// Shader modules from the store point into its mappings, so it must outlive the replayer.
+	DirectorySpirvStore spirv_store(spirv_store_path);
+
+	// Create infos can point into the archive, so it must outlive the replayer as well.
+	MappedFile state_json;
+
 	DisasmReplayer replayer(device.get_device() ? &device : nullptr);
 	StateReplayer state_replayer;
+	if (!spirv_store_path.empty())
+		state_replayer.set_spirv_store(&spirv_store);
 
 	try
 	{
-		auto state_json = load_buffer_from_file(json_path.c_str());
-		if (state_json.empty())
+		if (!state_json.map(json_path.c_str()))
 		{
 			LOGE("Failed to load state JSON from disk.\n");
 			return EXIT_FAILURE;
 		}
-		state_replayer.parse(replayer, state_json.data(), state_json.size());
+
+		if (!all && StateReplayer::has_index(state_json.data(), state_json.size()))
+		{
+			// Only parse, decode and create the selected pipeline and the objects it depends on.
+			state_replayer.parse_index(replayer, state_json.data(), state_json.size());
+			if (compute_index >= 0)
+				state_replayer.parse_object_at(replayer, ObjectType::ComputePipeline, unsigned(compute_index));
+			else
+				state_replayer.parse_object_at(replayer, ObjectType::GraphicsPipeline, unsigned(graphics_index));
+		}
+		else
+			state_replayer.parse(replayer, state_json.data(), state_json.size());
 	}
 	catch (const exception &e)
 	{
@@ -546,6 +722,9 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	if (all)
+		return disassemble_all(device, replayer, method, output, num_threads) ? EXIT_SUCCESS : EXIT_FAILURE;
+
 	string disassembled;
 	if (compute_index >= 0)
 	{
@@ -557,6 +736,12 @@ int main(int argc, char *argv[])
 		}
 
 		auto *info = replayer.compute_infos[compute_index];
+		if (!info)
+		{
+			LOGE("Compute pipeline %d failed to parse.\n", compute_index);
+			return EXIT_FAILURE;
+		}
+
 		auto *module_info = replayer.shader_module_infos[replayer.module_to_index[info->stage.module]];
 		disassembled = disassemble_spirv(device, replayer.compute_pipelines[compute_index], method, stage, module_info, info->stage.pName);
 	}
@@ -570,6 +755,11 @@ int main(int argc, char *argv[])
 		}
 
 		auto *info = replayer.graphics_infos[graphics_index];
+		if (!info)
+		{
+			LOGE("Graphics pipeline %d failed to parse.\n", graphics_index);
+			return EXIT_FAILURE;
+		}
 
 		VkShaderModule module = VK_NULL_HANDLE;
 		const char *entry = nullptr;
@@ -0,0 +1,404 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "fossilize.hpp"
+#include "spirv_store.hpp"
+#include "thread_pool.hpp"
+#include "logging.hpp"
+#include "cli_parser.hpp"
+#include "file.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <unordered_map>
+
+using namespace std;
+using namespace Fossilize;
+
+template <typename T>
+static inline T fake_handle(uint64_t v)
+{
+	return (T)v;
+}
+
+// Objects of one input. They are only added to the merged state once the whole input parsed,
+// so an input which fails partway does not leave some of its objects behind.
+// Handles are unique across inputs, so they can be aliased to merged objects while the input is committed.
+struct StagedInput : StateCreatorInterface
+{
+	template <typename CreateInfo, typename Handle>
+	struct Staged
+	{
+		Hash hash;
+		const CreateInfo *create_info;
+		Handle handle;
+	};
+
+	explicit StagedInput(atomic<uint64_t> &next_handle)
+		: next_handle(next_handle)
+	{
+	}
+
+	atomic<uint64_t> &next_handle;
+
+	// Create infos are owned by the replayer which parsed the input.
+	vector<Staged<VkSamplerCreateInfo, VkSampler>> samplers;
+	vector<Staged<VkDescriptorSetLayoutCreateInfo, VkDescriptorSetLayout>> set_layouts;
+	vector<Staged<VkPipelineLayoutCreateInfo, VkPipelineLayout>> pipeline_layouts;
+	vector<Staged<VkShaderModuleCreateInfo, VkShaderModule>> shader_modules;
+	vector<Staged<VkRenderPassCreateInfo, VkRenderPass>> render_passes;
+	vector<Staged<VkComputePipelineCreateInfo, VkPipeline>> compute_pipelines;
+	vector<Staged<VkGraphicsPipelineCreateInfo, VkPipeline>> graphics_pipelines;
+
+	template <typename CreateInfo, typename Handle>
+	bool stage(vector<Staged<CreateInfo, Handle>> &objects, Hash hash, const CreateInfo *create_info, Handle *handle)
+	{
+		*handle = fake_handle<Handle>(next_handle++);
+		objects.push_back({ hash, create_info, *handle });
+		return true;
+	}
+
+	bool enqueue_create_sampler(Hash hash, unsigned, const VkSamplerCreateInfo *create_info, VkSampler *sampler) override
+	{
+		return stage(samplers, hash, create_info, sampler);
+	}
+
+	bool enqueue_create_descriptor_set_layout(Hash hash, unsigned, const VkDescriptorSetLayoutCreateInfo *create_info, VkDescriptorSetLayout *layout) override
+	{
+		return stage(set_layouts, hash, create_info, layout);
+	}
+
+	bool enqueue_create_pipeline_layout(Hash hash, unsigned, const VkPipelineLayoutCreateInfo *create_info, VkPipelineLayout *layout) override
+	{
+		return stage(pipeline_layouts, hash, create_info, layout);
+	}
+
+	bool enqueue_create_shader_module(Hash hash, unsigned, const VkShaderModuleCreateInfo *create_info, VkShaderModule *module) override
+	{
+		return stage(shader_modules, hash, create_info, module);
+	}
+
+	bool enqueue_create_render_pass(Hash hash, unsigned, const VkRenderPassCreateInfo *create_info, VkRenderPass *render_pass) override
+	{
+		return stage(render_passes, hash, create_info, render_pass);
+	}
+
+	bool enqueue_create_compute_pipeline(Hash hash, unsigned, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		return stage(compute_pipelines, hash, create_info, pipeline);
+	}
+
+	bool enqueue_create_graphics_pipeline(Hash hash, unsigned, const VkGraphicsPipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		return stage(graphics_pipelines, hash, create_info, pipeline);
+	}
+};
+
+// The merged archive. Objects are deduplicated by hash, so every object is recorded once,
+// no matter how many inputs it appears in.
+struct MergedState
+{
+	StateRecorder recorder;
+	mutex lock;
+	condition_variable commit_cond;
+	unsigned next_input = 0;
+	atomic<uint64_t> next_handle{ 1 };
+	unsigned unique_objects = 0;
+	unsigned duplicate_objects = 0;
+
+	// Recorder indices of merged objects.
+	unordered_map<Hash, unsigned> samplers;
+	unordered_map<Hash, unsigned> set_layouts;
+	unordered_map<Hash, unsigned> pipeline_layouts;
+	unordered_map<Hash, unsigned> shader_modules;
+	unordered_map<Hash, unsigned> render_passes;
+	unordered_map<Hash, unsigned> compute_pipelines;
+	unordered_map<Hash, unsigned> graphics_pipelines;
+
+	// Inputs are committed in the order they were given, whatever order they finish parsing in,
+	// so the merged archive does not depend on thread timing. Inputs which failed to parse commit nullptr.
+	// Staged handles are mapped to merged objects while the input is committed,
+	// so the recorder translates references in create infos, and are unmapped again afterwards.
+	void commit(unsigned input_index, const StagedInput *staged)
+	{
+		unique_lock<mutex> holder{ lock };
+		commit_cond.wait(holder, [&]() { return next_input == input_index; });
+
+		// The next input still waits for the lock, so it can be woken before this one is added,
+		// which keeps it from waiting forever if adding throws.
+		next_input++;
+		commit_cond.notify_all();
+		if (!staged)
+			return;
+
+		auto &input = *staged;
+		add(samplers, input.samplers, &StateRecorder::register_sampler, &StateRecorder::set_sampler_handle);
+		add(set_layouts, input.set_layouts,
+		    &StateRecorder::register_descriptor_set_layout, &StateRecorder::set_descriptor_set_layout_handle);
+		add(pipeline_layouts, input.pipeline_layouts,
+		    &StateRecorder::register_pipeline_layout, &StateRecorder::set_pipeline_layout_handle);
+		add(shader_modules, input.shader_modules,
+		    &StateRecorder::register_shader_module, &StateRecorder::set_shader_module_handle);
+		add(render_passes, input.render_passes,
+		    &StateRecorder::register_render_pass, &StateRecorder::set_render_pass_handle);
+		add(compute_pipelines, input.compute_pipelines,
+		    &StateRecorder::register_compute_pipeline, &StateRecorder::set_compute_pipeline_handle);
+		add(graphics_pipelines, input.graphics_pipelines,
+		    &StateRecorder::register_graphics_pipeline, &StateRecorder::set_graphics_pipeline_handle);
+
+		unmap(input.samplers, &StateRecorder::remove_sampler_handle);
+		unmap(input.set_layouts, &StateRecorder::remove_descriptor_set_layout_handle);
+		unmap(input.pipeline_layouts, &StateRecorder::remove_pipeline_layout_handle);
+		unmap(input.shader_modules, &StateRecorder::remove_shader_module_handle);
+		unmap(input.render_passes, &StateRecorder::remove_render_pass_handle);
+		unmap(input.compute_pipelines, &StateRecorder::remove_compute_pipeline_handle);
+		unmap(input.graphics_pipelines, &StateRecorder::remove_graphics_pipeline_handle);
+	}
+
+	template <typename CreateInfo, typename Handle>
+	void add(unordered_map<Hash, unsigned> &indices, const vector<StagedInput::Staged<CreateInfo, Handle>> &objects,
+	         unsigned (StateRecorder::*register_object)(Hash, const CreateInfo &),
+	         void (StateRecorder::*set_handle)(unsigned, Handle))
+	{
+		for (auto &object : objects)
+		{
+			unsigned index;
+			auto itr = indices.find(object.hash);
+			if (itr != end(indices))
+			{
+				index = itr->second;
+				duplicate_objects++;
+			}
+			else
+			{
+				index = (recorder.*register_object)(object.hash, *object.create_info);
+				indices[object.hash] = index;
+				unique_objects++;
+			}
+			(recorder.*set_handle)(index, object.handle);
+		}
+	}
+
+	template <typename CreateInfo, typename Handle>
+	void unmap(const vector<StagedInput::Staged<CreateInfo, Handle>> &objects, void (StateRecorder::*remove_handle)(Handle))
+	{
+		for (auto &object : objects)
+			(recorder.*remove_handle)(object.handle);
+	}
+};
+
+// One path per line, so lists of captures do not have to fit on the command line.
+static bool load_input_list(const char *path, vector<string> &inputs)
+{
+	auto list = load_buffer_from_file(path);
+	if (list.empty())
+		return false;
+
+	string line;
+	for (auto c : list)
+	{
+		if (c == '\n' || c == '\r')
+		{
+			if (!line.empty())
+				inputs.push_back(move(line));
+			line.clear();
+		}
+		else
+			line.push_back(char(c));
+	}
+
+	if (!line.empty())
+		inputs.push_back(move(line));
+	return true;
+}
+
+static void log_unreferenced_objects(const StateRecorder &recorder)
+{
+	LOGI("Pruning %u samplers, %u set layouts, %u pipeline layouts, %u shader modules and %u render passes.\n",
+	     recorder.get_num_unreferenced_objects(ObjectType::Sampler),
+	     recorder.get_num_unreferenced_objects(ObjectType::DescriptorSetLayout),
+	     recorder.get_num_unreferenced_objects(ObjectType::PipelineLayout),
+	     recorder.get_num_unreferenced_objects(ObjectType::ShaderModule),
+	     recorder.get_num_unreferenced_objects(ObjectType::RenderPass));
+}
+
+static void print_help()
+{
+	LOGI("fossilize-merge\n"
+	     "\t[--help]\n"
+	     "\t[--output state.json]\n"
+	     "\t[--input-list <file>]\n"
+	     "\t[--threads <count>]\n"
+	     "\t[--skip-invalid]\n"
+	     "\t[--spirv-store <directory>]\n"
+	     "\t[--output-spirv-store <directory>]\n"
+	     "\t[--smolv]\n"
+	     "\t[--compress]\n"
+	     "\t[--compact]\n"
+	     "\t[--canonical]\n"
+	     "\t[--prune]\n"
+	     "\tinput.json...\n");
+}
+
+int main(int argc, char *argv[])
+{
+	vector<string> inputs;
+	string input_list_path;
+	string output_path;
+	string spirv_store_path;
+	string output_spirv_store_path;
+	unsigned num_threads = 0;
+	bool skip_invalid = false;
+	bool smolv = false;
+	bool compress = false;
+	bool compact = false;
+	bool canonical = false;
+	bool prune = false;
+	CLICallbacks cbs;
+
+	cbs.default_handler = [&](const char *arg) { inputs.push_back(arg); };
+	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
+	cbs.add("--output", [&](CLIParser &parser) { output_path = parser.next_string(); });
+	cbs.add("--input-list", [&](CLIParser &parser) { input_list_path = parser.next_string(); });
+	cbs.add("--threads", [&](CLIParser &parser) { num_threads = parser.next_uint(); });
+	cbs.add("--skip-invalid", [&](CLIParser &) { skip_invalid = true; });
+	cbs.add("--spirv-store", [&](CLIParser &parser) { spirv_store_path = parser.next_string(); });
+	cbs.add("--output-spirv-store", [&](CLIParser &parser) { output_spirv_store_path = parser.next_string(); });
+	cbs.add("--smolv", [&](CLIParser &) { smolv = true; });
+	cbs.add("--compress", [&](CLIParser &) { compress = true; });
+	cbs.add("--compact", [&](CLIParser &) { compact = true; });
+	cbs.add("--canonical", [&](CLIParser &) { canonical = true; });
+	cbs.add("--prune", [&](CLIParser &) { prune = true; });
+	cbs.error_handler = [] { print_help(); };
+
+	CLIParser parser(move(cbs), argc - 1, argv + 1);
+	if (!parser.parse())
+		return EXIT_FAILURE;
+	if (parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+	if (!input_list_path.empty() && !load_input_list(input_list_path.c_str(), inputs))
+	{
+		LOGE("Failed to load input list: %s.\n", input_list_path.c_str());
+		return EXIT_FAILURE;
+	}
+
+	if (inputs.empty())
+	{
+		LOGE("No inputs provided.\n");
+		print_help();
+		return EXIT_FAILURE;
+	}
+
+	if (output_path.empty())
+	{
+		LOGE("No output path provided.\n");
+		print_help();
+		return EXIT_FAILURE;
+	}
+
+	MergedState merged;
+	DirectorySpirvStore spirv_store(spirv_store_path);
+	DirectorySpirvStore output_spirv_store(output_spirv_store_path);
+	atomic<unsigned> failed_inputs(0);
+
+	// Each input is loaded, decompressed and parsed on its own thread, only committing its objects is serialized.
+	// At most one input per thread is in memory at a time, besides the merged state itself.
+	// The pool runs tasks in order, so the input a thread waits on to commit first has always been started.
+	{
+		ThreadPool pool(num_threads);
+		for (unsigned i = 0; i < unsigned(inputs.size()); i++)
+		{
+			auto *path = inputs[i].c_str();
+			pool.enqueue([&, path, i]() {
+				// Staged create infos point into the replayer, so it has to outlive the commit.
+				StateReplayer replayer;
+				StagedInput staged(merged.next_handle);
+				bool parsed = false;
+				try
+				{
+					auto buffer = load_buffer_from_file(path);
+					if (buffer.empty())
+						throw runtime_error("Failed to load file.");
+
+					replayer.set_num_threads(1);
+					if (!spirv_store_path.empty())
+						replayer.set_spirv_store(&spirv_store);
+
+					replayer.parse(staged, buffer.data(), buffer.size());
+					parsed = true;
+				}
+				catch (const exception &e)
+				{
+					LOGE("Failed to merge %s: %s\n", path, e.what());
+					failed_inputs++;
+				}
+
+				try
+				{
+					merged.commit(i, parsed ? &staged : nullptr);
+				}
+				catch (const exception &e)
+				{
+					LOGE("Failed to merge %s: %s\n", path, e.what());
+					failed_inputs++;
+				}
+			});
+		}
+		pool.wait_idle();
+	}
+
+	if (failed_inputs && !skip_invalid)
+	{
+		LOGE("%u of %u inputs could not be merged.\n", failed_inputs.load(), unsigned(inputs.size()));
+		return EXIT_FAILURE;
+	}
+
+	LOGI("Merged %u inputs: %u unique objects, %u duplicates dropped.\n",
+	     unsigned(inputs.size()) - failed_inputs.load(), merged.unique_objects, merged.duplicate_objects);
+
+	try
+	{
+		auto &recorder = merged.recorder;
+		if (smolv)
+			recorder.set_spirv_encoding(SpirvEncoding::SmolV);
+		recorder.set_compression(compress);
+		recorder.set_compact_json(compact);
+		recorder.set_canonical_order(canonical);
+		recorder.set_prune_unreferenced(prune);
+		if (prune)
+			log_unreferenced_objects(recorder);
+		recorder.set_num_threads(num_threads);
+		if (!output_spirv_store_path.empty())
+			recorder.set_spirv_store(&output_spirv_store);
+
+		// The archive is streamed, so it never has to fit in memory next to the merged state.
+		recorder.serialize_to_file(output_path.c_str());
+	}
+	catch (const exception &e)
+	{
+		LOGE("StateRecorder threw exception: %s\n", e.what());
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
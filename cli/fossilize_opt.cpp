@@ -21,10 +21,21 @@
  */
 
 #include "fossilize.hpp"
+#include "spirv_store.hpp"
 #include "logging.hpp"
 #include "cli_parser.hpp"
 #include "file.hpp"
+#include "thread_pool.hpp"
 #include "spirv-tools/optimizer.hpp"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+#include <unordered_map>
 
 using namespace std;
 using namespace Fossilize;
@@ -39,6 +50,101 @@ struct OptimizeReplayer : StateCreatorInterface
 {
 	StateRecorder recorder;
 
+	explicit OptimizeReplayer(unsigned num_threads)
+		: pool(num_threads)
+	{
+	}
+
+	// "performance", "size", or a comma separated list of spirv-opt flags, e.g. "merge-blocks,eliminate-dead-code-aggressive".
+	bool set_passes(const string &pass_list)
+	{
+		passes = pass_list;
+		flags.clear();
+		if (passes != "performance" && passes != "size")
+		{
+			size_t offset = 0;
+			while (offset <= passes.size())
+			{
+				size_t end = passes.find(',', offset);
+				if (end == string::npos)
+					end = passes.size();
+				auto flag = passes.substr(offset, end - offset);
+				if (flag.empty())
+					return false;
+				flags.push_back(flag.compare(0, 2, "--") == 0 ? flag : "--" + flag);
+				offset = end + 1;
+			}
+		}
+
+		optimizers.clear();
+		spvtools::Optimizer optimizer(target_env);
+		return register_passes(optimizer);
+	}
+
+	void set_target_env(spv_target_env env)
+	{
+		target_env = env;
+		optimizers.clear();
+	}
+
+	// Optimized modules are looked up in and added to the cache, keyed by the hash of the input module,
+	// the passes, the target environment and the SPIRV-Tools version. Must be set after the passes.
+	void set_cache(SpirvStore *store)
+	{
+		cache = store;
+		Hasher h;
+		h.string(passes.c_str());
+		h.u32(uint32_t(target_env));
+		h.string(spvSoftwareVersionDetailsString());
+		cache_key = h.get();
+	}
+
+	// Every pipeline stage with specialization constants gets a module with those constants frozen, folded
+	// and dead code eliminated. Such stages drop their VkSpecializationInfo, and pipelines are rehashed.
+	void set_fold_spec_constants(bool enable)
+	{
+		fold_spec_constants = enable;
+	}
+
+	// Strips debug info before optimizing, and rehashes modules and pipelines. Modules which only differed
+	// in debug info, and pipelines which only differed in such modules, are recorded once.
+	void set_strip_debug_info(bool enable)
+	{
+		strip_debug_info = enable;
+		recorder.set_strip_debug_info(enable);
+	}
+
+	unsigned get_num_specialized_stages() const
+	{
+		return num_specialized_stages;
+	}
+
+	unsigned get_num_specialized_modules() const
+	{
+		return num_specialized_modules;
+	}
+
+	// Prints words before and after, and time spent for every module to stdout.
+	void set_report(bool enable)
+	{
+		report = enable;
+	}
+
+	unsigned get_num_cache_hits() const
+	{
+		return cache_hits.load();
+	}
+
+	unsigned get_num_modules() const
+	{
+		return num_modules;
+	}
+
+	unsigned get_num_failed() const
+	{
+		return num_failed;
+	}
+
 	bool enqueue_create_sampler(Hash hash, unsigned index, const VkSamplerCreateInfo *create_info, VkSampler *sampler) override
 	{
 		unsigned record_index = recorder.register_sampler(hash, *create_info);
@@ -63,23 +169,50 @@ struct OptimizeReplayer : StateCreatorInterface
 		return true;
 	}
 
+	bool set_num_shader_modules(unsigned count) override
+	{
+		modules.clear();
+		modules.resize(count);
+		return true;
+	}
+
+	// Modules are optimized on the thread pool, and recorded in their original order in wait_enqueue(),
+	// which the replayer calls after the last module and before any pipeline refers to them.
 	bool enqueue_create_shader_module(Hash hash, unsigned index, const VkShaderModuleCreateInfo *create_info, VkShaderModule *module) override
 	{
-		vector<uint32_t> compiled_spirv;
-		spvtools::Optimizer optimizer(SPV_ENV_VULKAN_1_0);
-		optimizer.RegisterPerformancePasses();
-		if (!optimizer.Run(create_info->pCode, create_info->codeSize / sizeof(uint32_t), &compiled_spirv))
-			return false;
-		auto info = *create_info;
-		info.pCode = compiled_spirv.data();
-		info.codeSize = compiled_spirv.size() * sizeof(uint32_t);
+		auto &pending = modules[index];
+		pending.hash = hash;
+		pending.info = *create_info;
+		pending.spirv.assign(create_info->pCode, create_info->pCode + create_info->codeSize / sizeof(uint32_t));
+		pending.original_words = pending.spirv.size();
+		if (strip_debug_info)
+		{
+			pending.spirv = strip_spirv_debug_info(create_info->pCode, create_info->codeSize);
+			pending.info.pCode = pending.spirv.data();
+			pending.info.codeSize = pending.spirv.size() * sizeof(uint32_t);
+			pending.hash = Hashing::compute_hash_shader_module(recorder, pending.info);
+		}
+
+		num_modules++;
+
+		pool.enqueue([this, &pending]() {
+			auto start = chrono::steady_clock::now();
+			optimize_module(pending);
+			pending.time = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+		});
 
-		unsigned record_index = recorder.register_shader_module(hash, info);
 		*module = fake_handle<VkShaderModule>(index + 1);
-		recorder.set_shader_module_handle(record_index, *module);
 		return true;
 	}
 
+	void wait_enqueue() override
+	{
+		pool.wait_idle();
+		record_modules();
+		record_specialized_modules();
+		record_pipelines();
+	}
+
 	bool enqueue_create_render_pass(Hash hash, unsigned index, const VkRenderPassCreateInfo *create_info, VkRenderPass *render_pass) override
 	{
 		unsigned record_index = recorder.register_render_pass(hash, *create_info);
@@ -90,39 +223,518 @@ struct OptimizeReplayer : StateCreatorInterface
 
 	bool enqueue_create_compute_pipeline(Hash hash, unsigned index, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override
 	{
-		unsigned record_index = recorder.register_compute_pipeline(hash, *create_info);
 		*pipeline = fake_handle<VkPipeline>(index + 1);
-		recorder.set_compute_pipeline_handle(record_index, *pipeline);
+		if (fold_spec_constants)
+		{
+			PendingPipeline pending;
+			pending.hash = hash;
+			pending.handle = *pipeline;
+			pending.compute_info = *create_info;
+			pending.stages.push_back(create_info->stage);
+			queue_specializations(pending);
+			pipelines.push_back(move(pending));
+			return true;
+		}
+
+		record_compute_pipeline(hash, *create_info, *pipeline, false);
 		return true;
 	}
 
 	bool enqueue_create_graphics_pipeline(Hash hash, unsigned index, const VkGraphicsPipelineCreateInfo *create_info, VkPipeline *pipeline) override
 	{
-		unsigned record_index = recorder.register_graphics_pipeline(hash, *create_info);
 		*pipeline = fake_handle<VkPipeline>(index + 1);
-		recorder.set_graphics_pipeline_handle(record_index, *pipeline);
+		if (fold_spec_constants)
+		{
+			PendingPipeline pending;
+			pending.hash = hash;
+			pending.handle = *pipeline;
+			pending.graphics = true;
+			pending.graphics_info = *create_info;
+			pending.stages.assign(create_info->pStages, create_info->pStages + create_info->stageCount);
+			queue_specializations(pending);
+			pipelines.push_back(move(pending));
+			return true;
+		}
+
+		record_graphics_pipeline(hash, *create_info, *pipeline, false);
 		return true;
 	}
+
+private:
+	enum class ModuleResult
+	{
+		Optimized,
+		Cached,
+		Failed
+	};
+
+	struct PendingModule
+	{
+		Hash hash = 0;
+		VkShaderModuleCreateInfo info = {};
+		vector<uint32_t> spirv;
+		size_t original_words = 0;
+		ModuleResult result = ModuleResult::Failed;
+		chrono::microseconds time{ 0 };
+	};
+	vector<PendingModule> modules;
+	ThreadPool pool;
+
+	struct RecordedModule
+	{
+		Hash hash;
+		vector<uint32_t> spirv;
+	};
+	// SPIR-V of recorded modules, only kept when specializing.
+	vector<RecordedModule> recorded_modules;
+
+	struct Specialization
+	{
+		Hash key = 0;
+		unsigned module_index = 0;
+		unordered_map<uint32_t, vector<uint32_t>> values;
+		vector<uint32_t> spirv;
+		bool success = false;
+		VkShaderModule handle = VK_NULL_HANDLE;
+	};
+	// Deque, as tasks hold references while more specializations are added.
+	deque<Specialization> specializations;
+	unordered_map<Hash, unsigned> specialization_keys;
+	// Record indices by hash, used to drop duplicates when stripping debug info.
+	unordered_map<Hash, unsigned> module_indices;
+	unordered_map<Hash, unsigned> compute_pipeline_indices;
+	unordered_map<Hash, unsigned> graphics_pipeline_indices;
+
+	// Handles of all recorded modules by hash, only kept when specializing.
+	unordered_map<Hash, VkShaderModule> module_handles;
+	unsigned num_specialized_modules = 0;
+	unsigned num_recorded_specializations = 0;
+	unsigned num_specialized_stages = 0;
+
+	struct PendingPipeline
+	{
+		Hash hash = 0;
+		VkPipeline handle = VK_NULL_HANDLE;
+		bool graphics = false;
+		VkComputePipelineCreateInfo compute_info = {};
+		VkGraphicsPipelineCreateInfo graphics_info = {};
+		vector<VkPipelineShaderStageCreateInfo> stages;
+		// Index into specializations for every stage, or -1.
+		vector<int> stage_specializations;
+	};
+	vector<PendingPipeline> pipelines;
+
+	void record_modules()
+	{
+		if (modules.empty())
+			return;
+
+		if (report)
+			printf("Module       Hash              Words before  Words after    Time (ms)  Result\n");
+
+		size_t words_before = 0;
+		size_t words_after = 0;
+		for (unsigned i = 0; i < modules.size(); i++)
+		{
+			auto &pending = modules[i];
+			if (pending.result == ModuleResult::Failed)
+			{
+				LOGE("Failed to optimize shader module %016llx, keeping the original.\n",
+				     static_cast<unsigned long long>(pending.hash));
+				num_failed++;
+			}
+
+			words_before += pending.original_words;
+			words_after += pending.spirv.size();
+			if (report)
+			{
+				printf("#%-10u  %016llx  %12llu %12llu %12.3f  %s\n", i, static_cast<unsigned long long>(pending.hash),
+				       static_cast<unsigned long long>(pending.original_words),
+				       static_cast<unsigned long long>(pending.spirv.size()),
+				       pending.time.count() / 1000.0, result_to_string(pending.result));
+			}
+
+			auto handle = fake_handle<VkShaderModule>(i + 1);
+			auto itr = module_indices.find(pending.hash);
+			if (strip_debug_info && itr != end(module_indices))
+				recorder.set_shader_module_handle(itr->second, handle);
+			else
+			{
+				pending.info.pCode = pending.spirv.data();
+				pending.info.codeSize = pending.spirv.size() * sizeof(uint32_t);
+				unsigned record_index = recorder.register_shader_module(pending.hash, pending.info);
+				recorder.set_shader_module_handle(record_index, handle);
+				module_indices[pending.hash] = record_index;
+			}
+
+			if (fold_spec_constants)
+			{
+				module_handles.insert({ pending.hash, handle });
+				recorded_modules.push_back({ pending.hash, move(pending.spirv) });
+			}
+		}
+
+		if (report)
+		{
+			printf("Total                          %12llu %12llu\n", static_cast<unsigned long long>(words_before),
+			       static_cast<unsigned long long>(words_after));
+		}
+		modules.clear();
+	}
+
+	void queue_specializations(PendingPipeline &pending)
+	{
+		for (auto &stage : pending.stages)
+		{
+			int spec_index = -1;
+			auto *spec = stage.pSpecializationInfo;
+			if (spec && stage.module != VK_NULL_HANDLE)
+			{
+				unsigned module_index = unsigned((uint64_t)stage.module - 1);
+				Hasher h;
+				h.u64(recorded_modules[module_index].hash);
+
+				unordered_map<uint32_t, vector<uint32_t>> values;
+				for (uint32_t i = 0; i < spec->mapEntryCount; i++)
+				{
+					auto &entry = spec->pMapEntries[i];
+					if (entry.size == 0 || entry.offset + entry.size > spec->dataSize)
+						continue;
+
+					vector<uint32_t> words((entry.size + 3) / 4);
+					memcpy(words.data(), static_cast<const uint8_t *>(spec->pData) + entry.offset, entry.size);
+					h.u32(entry.constantID);
+					h.u32(uint32_t(words.size()));
+					for (auto word : words)
+						h.u32(word);
+					values[entry.constantID] = move(words);
+				}
+
+				auto itr = specialization_keys.find(h.get());
+				if (itr != end(specialization_keys))
+					spec_index = int(itr->second);
+				else
+				{
+					spec_index = int(specializations.size());
+					specialization_keys[h.get()] = unsigned(spec_index);
+					specializations.emplace_back();
+					auto &specialization = specializations.back();
+					specialization.key = h.get();
+					specialization.module_index = module_index;
+					specialization.values = move(values);
+					pool.enqueue([this, &specialization]() {
+						specialize_module(specialization);
+					});
+				}
+			}
+			pending.stage_specializations.push_back(spec_index);
+		}
+	}
+
+	void specialize_module(Specialization &specialization)
+	{
+		Hasher key(cache_key);
+		key.u64(specialization.key);
+
+		size_t cached_size = 0;
+		const uint32_t *cached = cache ? cache->load(key.get(), &cached_size) : nullptr;
+		if (cached)
+		{
+			specialization.spirv.assign(cached, cached + cached_size / sizeof(uint32_t));
+			specialization.success = true;
+			cache_hits++;
+			return;
+		}
+
+		// Each specialization has its own constants, so the optimizer cannot be reused.
+		spvtools::Optimizer optimizer(target_env);
+		optimizer.RegisterPass(spvtools::CreateSetSpecConstantDefaultValuePass(specialization.values));
+		optimizer.RegisterPass(spvtools::CreateFreezeSpecConstantValuePass());
+		optimizer.RegisterPass(spvtools::CreateFoldSpecConstantOpAndCompositePass());
+		optimizer.RegisterPass(spvtools::CreateUnifyConstantPass());
+		optimizer.RegisterPass(spvtools::CreateEliminateDeadConstantPass());
+		optimizer.RegisterPass(spvtools::CreateDeadBranchElimPass());
+		optimizer.RegisterPass(spvtools::CreateAggressiveDCEPass());
+		register_passes(optimizer);
+
+		auto &source = recorded_modules[specialization.module_index].spirv;
+		specialization.success = optimizer.Run(source.data(), source.size(), &specialization.spirv);
+		if (specialization.success && cache &&
+		    !cache->store(key.get(), specialization.spirv.data(), specialization.spirv.size() * sizeof(uint32_t)))
+		{
+			LOGE("Failed to write specialized shader module %016llx to cache.\n",
+			     static_cast<unsigned long long>(recorded_modules[specialization.module_index].hash));
+		}
+	}
+
+	// Specialized modules are deduplicated by the hash of their SPIR-V, also against the original modules,
+	// and recorded in the order they were first used.
+	void record_specialized_modules()
+	{
+		for (; num_recorded_specializations < specializations.size(); num_recorded_specializations++)
+		{
+			auto &specialization = specializations[num_recorded_specializations];
+			if (!specialization.success)
+			{
+				LOGE("Failed to specialize shader module %016llx, keeping specialization constants.\n",
+				     static_cast<unsigned long long>(recorded_modules[specialization.module_index].hash));
+				continue;
+			}
+
+			VkShaderModuleCreateInfo info = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+			info.pCode = specialization.spirv.data();
+			info.codeSize = specialization.spirv.size() * sizeof(uint32_t);
+			Hash hash = Hashing::compute_hash_shader_module(recorder, info);
+
+			auto itr = module_handles.find(hash);
+			if (itr != end(module_handles))
+				specialization.handle = itr->second;
+			else
+			{
+				specialization.handle = fake_handle<VkShaderModule>(recorded_modules.size() + num_specialized_modules + 1);
+				unsigned record_index = recorder.register_shader_module(hash, info);
+				recorder.set_shader_module_handle(record_index, specialization.handle);
+				module_handles[hash] = specialization.handle;
+				num_specialized_modules++;
+			}
+			vector<uint32_t>().swap(specialization.spirv);
+		}
+	}
+
+	void record_pipelines()
+	{
+		for (auto &pending : pipelines)
+		{
+			bool specialized = false;
+			for (size_t i = 0; i < pending.stages.size(); i++)
+			{
+				int spec_index = pending.stage_specializations[i];
+				if (spec_index < 0 || specializations[spec_index].handle == VK_NULL_HANDLE)
+					continue;
+
+				pending.stages[i].module = specializations[spec_index].handle;
+				pending.stages[i].pSpecializationInfo = nullptr;
+				num_specialized_stages++;
+				specialized = true;
+			}
+
+			if (pending.graphics)
+			{
+				auto info = pending.graphics_info;
+				info.pStages = pending.stages.data();
+				record_graphics_pipeline(pending.hash, info, pending.handle, specialized);
+			}
+			else
+			{
+				auto info = pending.compute_info;
+				info.stage = pending.stages.front();
+				record_compute_pipeline(pending.hash, info, pending.handle, specialized);
+			}
+		}
+		pipelines.clear();
+	}
+
+	// Pipelines which refer to rewritten modules need a new hash, and pipelines which end up identical are recorded once.
+	void record_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo &info, VkPipeline handle, bool rehash)
+	{
+		if (rehash || strip_debug_info)
+			hash = Hashing::compute_hash_compute_pipeline(recorder, info);
+
+		auto itr = compute_pipeline_indices.find(hash);
+		if ((rehash || strip_debug_info) && itr != end(compute_pipeline_indices))
+		{
+			recorder.set_compute_pipeline_handle(itr->second, handle);
+			return;
+		}
+
+		unsigned record_index = recorder.register_compute_pipeline(hash, info);
+		recorder.set_compute_pipeline_handle(record_index, handle);
+		compute_pipeline_indices[hash] = record_index;
+	}
+
+	void record_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo &info, VkPipeline handle, bool rehash)
+	{
+		if (rehash || strip_debug_info)
+			hash = Hashing::compute_hash_graphics_pipeline(recorder, info);
+
+		auto itr = graphics_pipeline_indices.find(hash);
+		if ((rehash || strip_debug_info) && itr != end(graphics_pipeline_indices))
+		{
+			recorder.set_graphics_pipeline_handle(itr->second, handle);
+			return;
+		}
+
+		unsigned record_index = recorder.register_graphics_pipeline(hash, info);
+		recorder.set_graphics_pipeline_handle(record_index, handle);
+		graphics_pipeline_indices[hash] = record_index;
+	}
+
+	string passes = "performance";
+	vector<string> flags;
+	spv_target_env target_env = SPV_ENV_VULKAN_1_0;
+	SpirvStore *cache = nullptr;
+	Hash cache_key = 0;
+	atomic<unsigned> cache_hits{ 0 };
+	unsigned num_modules = 0;
+	unsigned num_failed = 0;
+	bool report = false;
+	bool fold_spec_constants = false;
+	bool strip_debug_info = false;
+
+	static const char *result_to_string(ModuleResult result)
+	{
+		switch (result)
+		{
+		case ModuleResult::Optimized:
+			return "optimized";
+		case ModuleResult::Cached:
+			return "cached";
+		default:
+			return "failed, kept original";
+		}
+	}
+
+	bool register_passes(spvtools::Optimizer &optimizer) const
+	{
+		if (passes == "performance")
+			optimizer.RegisterPerformancePasses();
+		else if (passes == "size")
+			optimizer.RegisterSizePasses();
+		else
+			return optimizer.RegisterPassesFromFlags(flags);
+		return true;
+	}
+
+	// On failure, the module keeps its original SPIR-V so one bad module does not fail the whole archive.
+	void optimize_module(PendingModule &pending)
+	{
+		Hasher key(cache_key);
+		key.u64(pending.hash);
+
+		size_t cached_size = 0;
+		const uint32_t *cached = cache ? cache->load(key.get(), &cached_size) : nullptr;
+		if (cached)
+		{
+			pending.spirv.assign(cached, cached + cached_size / sizeof(uint32_t));
+			pending.result = ModuleResult::Cached;
+			cache_hits++;
+			return;
+		}
+
+		auto optimizer = acquire_optimizer();
+		vector<uint32_t> optimized;
+		bool success = optimizer->Run(pending.spirv.data(), pending.spirv.size(), &optimized);
+		release_optimizer(move(optimizer));
+		if (!success)
+		{
+			pending.result = ModuleResult::Failed;
+			return;
+		}
+
+		pending.spirv = move(optimized);
+		pending.result = ModuleResult::Optimized;
+		if (cache && !cache->store(key.get(), pending.spirv.data(), pending.spirv.size() * sizeof(uint32_t)))
+			LOGE("Failed to write optimized shader module %016llx to cache.\n", static_cast<unsigned long long>(pending.hash));
+	}
+
+	// Optimizers are expensive to set up, so each worker reuses one rather than creating one per module.
+	vector<unique_ptr<spvtools::Optimizer>> optimizers;
+	mutex optimizer_lock;
+
+	unique_ptr<spvtools::Optimizer> acquire_optimizer()
+	{
+		{
+			lock_guard<mutex> holder(optimizer_lock);
+			if (!optimizers.empty())
+			{
+				auto optimizer = move(optimizers.back());
+				optimizers.pop_back();
+				return optimizer;
+			}
+		}
+
+		unique_ptr<spvtools::Optimizer> optimizer(new spvtools::Optimizer(target_env));
+		register_passes(*optimizer);
+		return optimizer;
+	}
+
+	void release_optimizer(unique_ptr<spvtools::Optimizer> optimizer)
+	{
+		lock_guard<mutex> holder(optimizer_lock);
+		optimizers.push_back(move(optimizer));
+	}
 };
 
+static void log_unreferenced_objects(const StateRecorder &recorder)
+{
+	LOGI("Pruning %u samplers, %u set layouts, %u pipeline layouts, %u shader modules and %u render passes.\n",
+	     recorder.get_num_unreferenced_objects(ObjectType::Sampler),
+	     recorder.get_num_unreferenced_objects(ObjectType::DescriptorSetLayout),
+	     recorder.get_num_unreferenced_objects(ObjectType::PipelineLayout),
+	     recorder.get_num_unreferenced_objects(ObjectType::ShaderModule),
+	     recorder.get_num_unreferenced_objects(ObjectType::RenderPass));
+}
+
 static void print_help()
 {
 	LOGI("fossilize-opt\n"
 	     "\t[--help]\n"
 	     "\t[--input state.json]\n"
-	     "\t[--output state.json]\n");
+	     "\t[--output state.json]\n"
+	     "\t[--smolv]\n"
+	     "\t[--compress]\n"
+	     "\t[--compact]\n"
+	     "\t[--canonical]\n"
+	     "\t[--prune]\n"
+	     "\t[--threads <count>]\n"
+	     "\t[--cache <directory>]\n"
+	     "\t[--passes <performance/size/pass,pass,...>]\n"
+	     "\t[--target-env <env>]\n"
+	     "\t[--report]\n"
+	     "\t[--fold-spec-constants]\n"
+	     "\t[--strip-debug-info]\n"
+	     "\t[--spirv-store <directory>]\n"
+	     "\t[--output-spirv-store <directory>]\n");
 }
 
 int main(int argc, char *argv[])
 {
 	string json_path;
 	string json_output_path;
+	bool smolv = false;
+	bool compress = false;
+	bool compact = false;
+	bool canonical = false;
+	bool prune = false;
+	unsigned num_threads = 0;
+	string cache_path;
+	string passes = "performance";
+	string target_env;
+	bool report = false;
+	bool fold_spec_constants = false;
+	bool strip_debug_info = false;
+	string spirv_store_path;
+	string output_spirv_store_path;
 	CLICallbacks cbs;
 
 	cbs.default_handler = [&](const char *arg) { json_path = arg; };
 	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
 	cbs.add("--input", [&](CLIParser &parser) { json_path = parser.next_string(); });
 	cbs.add("--output", [&](CLIParser &parser) { json_output_path = parser.next_string(); });
+	cbs.add("--smolv", [&](CLIParser &) { smolv = true; });
+	cbs.add("--compress", [&](CLIParser &) { compress = true; });
+	cbs.add("--compact", [&](CLIParser &) { compact = true; });
+	cbs.add("--canonical", [&](CLIParser &) { canonical = true; });
+	cbs.add("--prune", [&](CLIParser &) { prune = true; });
+	cbs.add("--threads", [&](CLIParser &parser) { num_threads = parser.next_uint(); });
+	cbs.add("--cache", [&](CLIParser &parser) { cache_path = parser.next_string(); });
+	cbs.add("--passes", [&](CLIParser &parser) { passes = parser.next_string(); });
+	cbs.add("--target-env", [&](CLIParser &parser) { target_env = parser.next_string(); });
+	cbs.add("--report", [&](CLIParser &) { report = true; });
+	cbs.add("--fold-spec-constants", [&](CLIParser &) { fold_spec_constants = true; });
+	cbs.add("--strip-debug-info", [&](CLIParser &) { strip_debug_info = true; });
+	cbs.add("--spirv-store", [&](CLIParser &parser) { spirv_store_path = parser.next_string(); });
+	cbs.add("--output-spirv-store", [&](CLIParser &parser) { output_spirv_store_path = parser.next_string(); });
 	cbs.error_handler = [] { print_help(); };
 
 	CLIParser parser(move(cbs), argc - 1, argv + 1);
@@ -147,8 +759,34 @@ int main(int argc, char *argv[])
 
 	try
 	{
-		OptimizeReplayer replayer;
+		// Optimized modules keep the hash of the original module, so they need a store of their own.
+		DirectorySpirvStore spirv_store(spirv_store_path);
+		DirectorySpirvStore output_spirv_store(output_spirv_store_path);
+		DirectorySpirvStore cache(cache_path);
+		OptimizeReplayer replayer(num_threads);
+
+		spv_target_env env = SPV_ENV_VULKAN_1_0;
+		if (!target_env.empty() && !spvParseTargetEnv(target_env.c_str(), &env))
+		{
+			LOGE("Unknown target environment: %s.\n", target_env.c_str());
+			return EXIT_FAILURE;
+		}
+		replayer.set_target_env(env);
+
+		if (!replayer.set_passes(passes))
+		{
+			LOGE("Invalid pass list: %s.\n", passes.c_str());
+			return EXIT_FAILURE;
+		}
+
+		replayer.set_report(report);
+		replayer.set_fold_spec_constants(fold_spec_constants);
+		replayer.set_strip_debug_info(strip_debug_info);
+		if (!cache_path.empty())
+			replayer.set_cache(&cache);
 		StateReplayer state_replayer;
+		if (!spirv_store_path.empty())
+			state_replayer.set_spirv_store(&spirv_store);
 		auto state_json = load_buffer_from_file(json_path.c_str());
 		if (state_json.empty())
 		{
@@ -157,6 +795,27 @@ int main(int argc, char *argv[])
 		}
 
 		state_replayer.parse(replayer, state_json.data(), state_json.size());
+		if (!cache_path.empty())
+			LOGI("%u of %u shader modules were found in the cache.\n", replayer.get_num_cache_hits(), replayer.get_num_modules());
+		if (fold_spec_constants)
+		{
+			LOGI("%u pipeline stages were specialized into %u shader modules.\n",
+			     replayer.get_num_specialized_stages(), replayer.get_num_specialized_modules());
+		}
+		if (replayer.get_num_failed())
+			LOGE("%u of %u shader modules failed to optimize.\n", replayer.get_num_failed(), replayer.get_num_modules());
+
+		if (smolv)
+			replayer.recorder.set_spirv_encoding(SpirvEncoding::SmolV);
+		replayer.recorder.set_compression(compress);
+		replayer.recorder.set_compact_json(compact);
+		replayer.recorder.set_canonical_order(canonical);
+		replayer.recorder.set_prune_unreferenced(prune);
+		if (prune)
+			log_unreferenced_objects(replayer.recorder);
+		replayer.recorder.set_num_threads(num_threads);
+		if (!output_spirv_store_path.empty())
+			replayer.recorder.set_spirv_store(&output_spirv_store);
 		auto serialized = replayer.recorder.serialize();
 		if (!write_buffer_to_file(json_output_path.c_str(), serialized.data(), serialized.size()))
 		{
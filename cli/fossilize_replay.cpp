@@ -23,6 +23,7 @@
 #include "volk.h"
 #include "device.hpp"
 #include "fossilize.hpp"
+#include "spirv_store.hpp"
 #include "cli_parser.hpp"
 #include "logging.hpp"
 #include "file.hpp"
@@ -251,12 +252,14 @@ static void print_help()
 	     "\t[--filter-compute <index>]\n"
 	     "\t[--filter-graphics <index>]\n"
 	     "\t[--pipeline-cache]\n"
+	     "\t[--spirv-store <directory>]\n"
 	     "\tstate.json\n");
 }
 
 int main(int argc, char *argv[])
 {
 	string json_path;
+	string spirv_store_path;
 	VulkanDevice::Options opts;
 	DumbReplayer::Options replayer_opts;
 
@@ -271,6 +274,7 @@ int main(int argc, char *argv[])
 	cbs.add("--pipeline-cache", [&](CLIParser &) { replayer_opts.pipeline_cache = true; });
 	cbs.add("--filter-compute", [&](CLIParser &parser) { filter_compute.insert(parser.next_uint()); });
 	cbs.add("--filter-graphics", [&](CLIParser &parser) { filter_graphics.insert(parser.next_uint()); });
+	cbs.add("--spirv-store", [&](CLIParser &parser) { spirv_store_path = parser.next_string(); });
 	cbs.error_handler = [] { print_help(); };
 
 	CLIParser parser(move(cbs), argc - 1, argv + 1);
@@ -293,7 +297,10 @@ int main(int argc, char *argv[])
 			return EXIT_FAILURE;
 
 		DumbReplayer replayer(device, replayer_opts, filter_graphics, filter_compute);
+		DirectorySpirvStore spirv_store(spirv_store_path);
 		StateReplayer state_replayer;
+		if (!spirv_store_path.empty())
+			state_replayer.set_spirv_store(&spirv_store);
 		auto state_json = load_buffer_from_file(json_path.c_str());
 		if (state_json.empty())
 		{
@@ -0,0 +1,362 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "fossilize.hpp"
+#include "logging.hpp"
+#include "cli_parser.hpp"
+#include "file.hpp"
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <unordered_set>
+
+using namespace std;
+using namespace Fossilize;
+
+template <typename T>
+static inline T fake_handle(uint64_t v)
+{
+	return (T)v;
+}
+
+// Handles are index + 1, so references map straight back to the referenced object.
+template <typename T>
+static inline unsigned handle_index(T handle)
+{
+	return unsigned((uint64_t)handle - 1);
+}
+
+struct ObjectStats
+{
+	const char *name;
+	vector<Hash> hashes;
+	// How often each object is referenced by other objects.
+	vector<unsigned> references;
+
+	explicit ObjectStats(const char *name)
+		: name(name)
+	{
+	}
+
+	void reset(unsigned count)
+	{
+		hashes.assign(count, 0);
+		references.assign(count, 0);
+	}
+
+	unsigned count_unique() const
+	{
+		return unsigned(unordered_set<Hash>(begin(hashes), end(hashes)).size());
+	}
+};
+
+struct StatReplayer : StateCreatorInterface
+{
+	ObjectStats samplers{ "Samplers" };
+	ObjectStats set_layouts{ "Descriptor set layouts" };
+	ObjectStats pipeline_layouts{ "Pipeline layouts" };
+	ObjectStats shader_modules{ "Shader modules" };
+	ObjectStats render_passes{ "Render passes" };
+	ObjectStats compute_pipelines{ "Compute pipelines" };
+	ObjectStats graphics_pipelines{ "Graphics pipelines" };
+	vector<size_t> module_sizes;
+
+	bool set_num_samplers(unsigned count) override
+	{
+		samplers.reset(count);
+		return true;
+	}
+
+	bool set_num_descriptor_set_layouts(unsigned count) override
+	{
+		set_layouts.reset(count);
+		return true;
+	}
+
+	bool set_num_pipeline_layouts(unsigned count) override
+	{
+		pipeline_layouts.reset(count);
+		return true;
+	}
+
+	bool set_num_shader_modules(unsigned count) override
+	{
+		shader_modules.reset(count);
+		module_sizes.assign(count, 0);
+		return true;
+	}
+
+	bool set_num_render_passes(unsigned count) override
+	{
+		render_passes.reset(count);
+		return true;
+	}
+
+	bool set_num_compute_pipelines(unsigned count) override
+	{
+		compute_pipelines.reset(count);
+		return true;
+	}
+
+	bool set_num_graphics_pipelines(unsigned count) override
+	{
+		graphics_pipelines.reset(count);
+		return true;
+	}
+
+	bool enqueue_create_sampler(Hash hash, unsigned index, const VkSamplerCreateInfo *, VkSampler *sampler) override
+	{
+		samplers.hashes[index] = hash;
+		*sampler = fake_handle<VkSampler>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_descriptor_set_layout(Hash hash, unsigned index, const VkDescriptorSetLayoutCreateInfo *create_info, VkDescriptorSetLayout *layout) override
+	{
+		set_layouts.hashes[index] = hash;
+		for (uint32_t i = 0; i < create_info->bindingCount; i++)
+		{
+			auto &binding = create_info->pBindings[i];
+			if (binding.pImmutableSamplers)
+				for (uint32_t j = 0; j < binding.descriptorCount; j++)
+					add_reference(samplers, binding.pImmutableSamplers[j]);
+		}
+		*layout = fake_handle<VkDescriptorSetLayout>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_pipeline_layout(Hash hash, unsigned index, const VkPipelineLayoutCreateInfo *create_info, VkPipelineLayout *layout) override
+	{
+		pipeline_layouts.hashes[index] = hash;
+		for (uint32_t i = 0; i < create_info->setLayoutCount; i++)
+			add_reference(set_layouts, create_info->pSetLayouts[i]);
+		*layout = fake_handle<VkPipelineLayout>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_shader_module(Hash hash, unsigned index, const VkShaderModuleCreateInfo *create_info, VkShaderModule *module) override
+	{
+		shader_modules.hashes[index] = hash;
+		module_sizes[index] = create_info->codeSize;
+		*module = fake_handle<VkShaderModule>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_render_pass(Hash hash, unsigned index, const VkRenderPassCreateInfo *, VkRenderPass *render_pass) override
+	{
+		render_passes.hashes[index] = hash;
+		*render_pass = fake_handle<VkRenderPass>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_compute_pipeline(Hash hash, unsigned index, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		compute_pipelines.hashes[index] = hash;
+		add_reference(pipeline_layouts, create_info->layout);
+		add_reference(shader_modules, create_info->stage.module);
+		add_reference(compute_pipelines, create_info->basePipelineHandle);
+		*pipeline = fake_handle<VkPipeline>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_graphics_pipeline(Hash hash, unsigned index, const VkGraphicsPipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		graphics_pipelines.hashes[index] = hash;
+		add_reference(pipeline_layouts, create_info->layout);
+		add_reference(render_passes, create_info->renderPass);
+
+		// A module which backs several stages of one pipeline still counts as one pipeline using it.
+		for (uint32_t i = 0; i < create_info->stageCount; i++)
+		{
+			auto module = create_info->pStages[i].module;
+			bool seen = false;
+			for (uint32_t j = 0; j < i && !seen; j++)
+				seen = create_info->pStages[j].module == module;
+			if (!seen)
+				add_reference(shader_modules, module);
+		}
+		add_reference(graphics_pipelines, create_info->basePipelineHandle);
+		*pipeline = fake_handle<VkPipeline>(index + 1);
+		return true;
+	}
+
+	template <typename T>
+	static void add_reference(ObjectStats &stats, T handle)
+	{
+		if (handle != VK_NULL_HANDLE && handle_index(handle) < stats.references.size())
+			stats.references[handle_index(handle)]++;
+	}
+};
+
+static void print_counts(const ObjectStats &stats)
+{
+	unsigned total = unsigned(stats.hashes.size());
+	unsigned unique = stats.count_unique();
+	printf("  %-24s %10u %10u %10u\n", stats.name, total, unique, total - unique);
+}
+
+static void print_top_referenced(const ObjectStats &stats, const char *referrer, unsigned top)
+{
+	vector<unsigned> order(stats.hashes.size());
+	for (unsigned i = 0; i < order.size(); i++)
+		order[i] = i;
+	stable_sort(begin(order), end(order), [&](unsigned a, unsigned b) {
+		return stats.references[a] > stats.references[b];
+	});
+
+	if (order.size() > top)
+		order.resize(top);
+
+	printf("\nTop %s by %s:\n", stats.name, referrer);
+	for (auto index : order)
+		printf("  #%-8u %016llx %10u\n", index, static_cast<unsigned long long>(stats.hashes[index]), stats.references[index]);
+}
+
+static void print_module_stats(const StatReplayer &replayer, unsigned top)
+{
+	auto &modules = replayer.shader_modules;
+	auto &sizes = replayer.module_sizes;
+
+	size_t total = 0;
+	size_t max_size = 0;
+	size_t min_size = sizes.empty() ? 0 : sizes.front();
+	for (auto size : sizes)
+	{
+		total += size;
+		max_size = std::max(max_size, size);
+		min_size = std::min(min_size, size);
+	}
+
+	unsigned unused = 0;
+	unsigned shared = 0;
+	unsigned max_pipelines = 0;
+	for (auto references : modules.references)
+	{
+		if (references == 0)
+			unused++;
+		else if (references > 1)
+			shared++;
+		max_pipelines = std::max(max_pipelines, references);
+	}
+
+	printf("\nSPIR-V:\n");
+	printf("  Total bytes              %10llu\n", static_cast<unsigned long long>(total));
+	printf("  Bytes per module         %10llu min %10llu avg %10llu max\n",
+	       static_cast<unsigned long long>(min_size),
+	       static_cast<unsigned long long>(sizes.empty() ? 0 : total / sizes.size()),
+	       static_cast<unsigned long long>(max_size));
+	printf("  Modules without pipeline %10u\n", unused);
+	printf("  Modules in 2+ pipelines  %10u\n", shared);
+	printf("  Max pipelines per module %10u\n", max_pipelines);
+
+	vector<unsigned> order(sizes.size());
+	for (unsigned i = 0; i < order.size(); i++)
+		order[i] = i;
+	stable_sort(begin(order), end(order), [&](unsigned a, unsigned b) {
+		return sizes[a] > sizes[b];
+	});
+	if (order.size() > top)
+		order.resize(top);
+
+	printf("\nLargest shader modules (bytes, pipelines):\n");
+	for (auto index : order)
+	{
+		printf("  #%-8u %016llx %10llu %10u\n", index, static_cast<unsigned long long>(modules.hashes[index]),
+		       static_cast<unsigned long long>(sizes[index]), modules.references[index]);
+	}
+}
+
+static void print_help()
+{
+	LOGI("fossilize-stat\n"
+	     "\t[--help]\n"
+	     "\t[--top <count>]\n"
+	     "\tstate.json\n");
+}
+
+int main(int argc, char *argv[])
+{
+	string json_path;
+	unsigned top = 10;
+	CLICallbacks cbs;
+
+	cbs.default_handler = [&](const char *arg) { json_path = arg; };
+	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
+	cbs.add("--top", [&](CLIParser &parser) { top = parser.next_uint(); });
+	cbs.error_handler = [] { print_help(); };
+
+	CLIParser parser(move(cbs), argc - 1, argv + 1);
+	if (!parser.parse())
+		return EXIT_FAILURE;
+	if (parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+	if (json_path.empty())
+	{
+		LOGE("No path to serialized state provided.\n");
+		print_help();
+		return EXIT_FAILURE;
+	}
+
+	auto start = chrono::steady_clock::now();
+	StatReplayer replayer;
+
+	try
+	{
+		auto state_json = load_buffer_from_file(json_path.c_str());
+		if (state_json.empty())
+		{
+			LOGE("Failed to load state JSON from disk.\n");
+			return EXIT_FAILURE;
+		}
+
+		// Only create infos are needed, so SPIR-V is never decompressed or decoded.
+		StateReplayer state_replayer;
+		state_replayer.set_skip_shader_code(true);
+		state_replayer.parse(replayer, state_json.data(), state_json.size());
+	}
+	catch (const exception &e)
+	{
+		LOGE("StateReplayer threw exception: %s\n", e.what());
+		return EXIT_FAILURE;
+	}
+
+	auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+
+	printf("Objects:                       total     unique  duplicate\n");
+	print_counts(replayer.samplers);
+	print_counts(replayer.set_layouts);
+	print_counts(replayer.pipeline_layouts);
+	print_counts(replayer.shader_modules);
+	print_counts(replayer.render_passes);
+	print_counts(replayer.compute_pipelines);
+	print_counts(replayer.graphics_pipelines);
+
+	print_module_stats(replayer, top);
+	print_top_referenced(replayer.shader_modules, "pipeline count", top);
+	print_top_referenced(replayer.pipeline_layouts, "pipeline count", top);
+	print_top_referenced(replayer.render_passes, "pipeline count", top);
+	print_top_referenced(replayer.set_layouts, "pipeline layout count", top);
+
+	printf("\nParsed in %lld ms.\n", static_cast<long long>(elapsed.count()));
+	return EXIT_SUCCESS;
+}
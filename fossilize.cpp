@@ -21,18 +21,81 @@
  */
 
 #include <stddef.h>
+#include <stdio.h>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
 #include "fossilize.hpp"
 #include <stdexcept>
 #include <algorithm>
 #include <string.h>
 #include "rapidjson/prettywriter.h"
 #include "varint.hpp"
+#include "base64.hpp"
+#include "smolv.hpp"
+#include "lz.hpp"
+#include "thread_pool.hpp"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <functional>
 
 using namespace std;
 using namespace rapidjson;
 
 namespace Fossilize
 {
+enum
+{
+	FOSSILIZE_LZ_BLOCK_SIZE = 256 * 1024,
+	FOSSILIZE_LZ_BLOCK_STORED_BIT = 0x80000000u,
+	// An LZ sequence of n bytes decodes to at most 255 * n bytes, see lz.cpp.
+	FOSSILIZE_LZ_MAX_EXPANSION = 255,
+	FOSSILIZE_SCRATCH_BLOCK_SIZE = 64 * 1024,
+	// Anything larger gets its own allocation, so big blobs do not waste the tail of a block.
+	FOSSILIZE_SCRATCH_DEDICATED_THRESHOLD = FOSSILIZE_SCRATCH_BLOCK_SIZE / 4,
+	// Pointers and 64-bit handles are the most strictly aligned members in create infos.
+	FOSSILIZE_FOOTPRINT_ALIGNMENT = 8,
+	FOSSILIZE_FOOTPRINT_BLOB_ALIGNMENT = 64,
+	// Objects serialized per job when serializing on multiple threads.
+	FOSSILIZE_SERIALIZE_BATCH_SIZE = 64,
+	// Objects serialized at a time when streaming an archive to a file.
+	FOSSILIZE_STREAM_BATCH_SIZE = 1024,
+	// Bytes buffered before they are written out. A multiple of the LZ block size, so blocks line up with serialize().
+	FOSSILIZE_STREAM_BUFFER_SIZE = 16 * FOSSILIZE_LZ_BLOCK_SIZE
+};
+
+// Types of index entries. Shared states follow the object types, they have no hash and are found through dependencies.
+enum
+{
+	FOSSILIZE_INDEX_TESSELLATION_STATE = uint32_t(ObjectType::GraphicsPipeline) + 1,
+	FOSSILIZE_INDEX_DYNAMIC_STATE,
+	FOSSILIZE_INDEX_MULTISAMPLE_STATE,
+	FOSSILIZE_INDEX_VERTEX_INPUT_STATE,
+	FOSSILIZE_INDEX_RASTERIZATION_STATE,
+	FOSSILIZE_INDEX_INPUT_ASSEMBLY_STATE,
+	FOSSILIZE_INDEX_COLOR_BLEND_STATE,
+	FOSSILIZE_INDEX_VIEWPORT_STATE,
+	FOSSILIZE_INDEX_DEPTH_STENCIL_STATE,
+	FOSSILIZE_INDEX_TYPE_COUNT = FOSSILIZE_INDEX_DEPTH_STENCIL_STATE
+};
+
+// One object in the index chunk. The chunk starts with the entry and dependency counts,
+// followed by the entries and the dependency list, which holds indices of other entries.
+struct IndexEntry
+{
+	uint32_t type;
+	uint32_t ordinal; // 1-indexed position in its JSON array.
+	Hash hash;
+	uint64_t json_offset;
+	uint64_t json_size;
+	uint32_t first_dependency;
+	uint32_t dependency_count;
+};
+static_assert(sizeof(IndexEntry) == 40, "IndexEntry must be tightly packed.");
+
 // reinterpret_cast does not work reliably on MSVC 2013 for Vulkan objects.
 template <typename T, typename U>
 static inline T api_object_cast(U obj)
@@ -41,6 +104,85 @@ static inline T api_object_cast(U obj)
 	return (T)obj;
 }
 
+// Debug info which does not change what a module does.
+static bool is_spirv_debug_instruction(uint32_t opcode, bool keep_strings)
+{
+	switch (opcode)
+	{
+	case 2: // OpSourceContinued
+	case 3: // OpSource
+	case 4: // OpSourceExtension
+	case 5: // OpName
+	case 6: // OpMemberName
+	case 8: // OpLine
+	case 317: // OpNoLine
+	case 330: // OpModuleProcessed
+		return true;
+	case 7: // OpString
+		return !keep_strings;
+	default:
+		return false;
+	}
+}
+
+// Calls func(words, count) for every range of a module which is kept when debug info is stripped.
+// Modules which do not parse as SPIR-V are kept as they are.
+template <typename Func>
+static void for_each_semantic_range(const uint32_t *code, size_t count, const Func &func)
+{
+	const size_t header_words = 5;
+	if (count < header_words || code[0] != 0x07230203u)
+	{
+		func(code, count);
+		return;
+	}
+
+	// Extended debug info instructions refer to OpString.
+	bool keep_strings = false;
+	for (size_t offset = header_words; offset < count; offset += code[offset] >> 16)
+	{
+		uint32_t len = code[offset] >> 16;
+		if (len == 0 || offset + len > count)
+		{
+			func(code, count);
+			return;
+		}
+
+		const uint32_t op_ext_inst_import = 11;
+		if ((code[offset] & 0xffff) == op_ext_inst_import && len > 2)
+		{
+			auto *name = reinterpret_cast<const char *>(code + offset + 2);
+			size_t name_len = strnlen(name, (len - 2) * sizeof(uint32_t));
+			string import(name, name_len);
+			if (import.find("DebugInfo") != string::npos || import.compare(0, 12, "NonSemantic.") == 0)
+				keep_strings = true;
+		}
+	}
+
+	size_t range_begin = 0;
+	for (size_t offset = header_words; offset < count; offset += code[offset] >> 16)
+	{
+		if (is_spirv_debug_instruction(code[offset] & 0xffff, keep_strings))
+		{
+			if (offset > range_begin)
+				func(code + range_begin, offset - range_begin);
+			range_begin = offset + (code[offset] >> 16);
+		}
+	}
+
+	if (count > range_begin)
+		func(code + range_begin, count - range_begin);
+}
+
+vector<uint32_t> strip_spirv_debug_info(const uint32_t *code, size_t size)
+{
+	vector<uint32_t> stripped;
+	for_each_semantic_range(code, size / sizeof(uint32_t), [&](const uint32_t *words, size_t count) {
+		stripped.insert(stripped.end(), words, words + count);
+	});
+	return stripped;
+}
+
 namespace Hashing
 {
 Hash compute_hash_sampler(const StateRecorder &, const VkSamplerCreateInfo &sampler)
@@ -120,10 +262,18 @@ Hash compute_hash_pipeline_layout(const StateRecorder &recorder, const VkPipelin
 	return h.get();
 }
 
-Hash compute_hash_shader_module(const StateRecorder &, const VkShaderModuleCreateInfo &create_info)
+Hash compute_hash_shader_module(const StateRecorder &recorder, const VkShaderModuleCreateInfo &create_info)
 {
 	Hasher h;
-	h.data(create_info.pCode, create_info.codeSize);
+	if (recorder.get_strip_debug_info())
+	{
+		// Hashes the same as the module with its debug info stripped.
+		for_each_semantic_range(create_info.pCode, create_info.codeSize / sizeof(uint32_t), [&](const uint32_t *words, size_t count) {
+			h.data(words, count * sizeof(uint32_t));
+		});
+	}
+	else
+		h.data(create_info.pCode, create_info.codeSize);
 	h.u32(create_info.flags);
 	return h.get();
 }
@@ -565,72 +715,6 @@ Hash compute_hash_render_pass(const StateRecorder &, const VkRenderPassCreateInf
 }
 }
 
-static uint8_t *decode_base64(ScratchAllocator &allocator, const char *data, size_t length)
-{
-	auto *buf = static_cast<uint8_t *>(allocator.allocate_raw(length, 16));
-	auto *ptr = buf;
-
-	const auto base64_index = [](char c) -> uint32_t {
-		if (c >= 'A' && c <= 'Z')
-			return uint32_t(c - 'A');
-		else if (c >= 'a' && c <= 'z')
-			return uint32_t(c - 'a') + 26;
-		else if (c >= '0' && c <= '9')
-			return uint32_t(c - '0') + 52;
-		else if (c == '+')
-			return 62;
-		else if (c == '/')
-			return 63;
-		else
-			return 0;
-	};
-
-	for (uint64_t i = 0; i < length; )
-	{
-		char c0 = *data++;
-		if (c0 == '\0')
-			break;
-		char c1 = *data++;
-		if (c1 == '\0')
-			break;
-		char c2 = *data++;
-		if (c2 == '\0')
-			break;
-		char c3 = *data++;
-		if (c3 == '\0')
-			break;
-
-		uint32_t values =
-				(base64_index(c0) << 18) |
-				(base64_index(c1) << 12) |
-				(base64_index(c2) << 6) |
-				(base64_index(c3) << 0);
-
-		unsigned outbytes = 3;
-		if (c2 == '=' && c3 == '=')
-		{
-			outbytes = 1;
-			*ptr++ = uint8_t(values >> 16);
-		}
-		else if (c3 == '=')
-		{
-			outbytes = 2;
-			*ptr++ = uint8_t(values >> 16);
-			*ptr++ = uint8_t(values >> 8);
-		}
-		else
-		{
-			*ptr++ = uint8_t(values >> 16);
-			*ptr++ = uint8_t(values >> 8);
-			*ptr++ = uint8_t(values >> 0);
-		}
-
-		i += outbytes;
-	}
-
-	return buf;
-}
-
 const char *StateReplayer::duplicate_string(const char *str, size_t len)
 {
 	auto *c = allocator.allocate_n<char>(len + 1);
@@ -709,130 +793,167 @@ VkDescriptorSetLayout *StateReplayer::parse_set_layouts(const Value &layouts)
 	return ret;
 }
 
-void StateReplayer::parse_shader_modules(StateCreatorInterface &iface, const Value &modules, const uint8_t *buffer, size_t size)
+void StateReplayer::parse_shader_module(StateCreatorInterface &iface, const Value &obj, unsigned index,
+                                        const uint8_t *buffer, size_t size, SpirvEncoding encoding)
+{
+	auto &info = *allocator.allocate_cleared<VkShaderModuleCreateInfo>();
+	info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	info.flags = obj["flags"].GetUint();
+	info.codeSize = obj["codeSize"].GetUint64();
+	Hash hash = obj["hash"].GetUint64();
+
+	if (skip_shader_code)
+	{
+		if (!iface.enqueue_create_shader_module(hash, index, &info, &replayed_shader_modules[index]))
+			FOSSILIZE_THROW("Failed to create shader module.");
+		return;
+	}
+
+	if (obj.HasMember("codeInStore"))
+	{
+		if (!spirv_store)
+			FOSSILIZE_THROW("Shader module is in a SPIR-V store, but no store was set.");
+
+		size_t stored_size = 0;
+		info.pCode = spirv_store->load(hash, &stored_size);
+		if (!info.pCode)
+			FOSSILIZE_THROW("Shader module is missing from SPIR-V store.");
+		if (stored_size != info.codeSize)
+			FOSSILIZE_THROW("Shader module in SPIR-V store has wrong size.");
+
+		if (!iface.enqueue_create_shader_module(hash, index, &info, &replayed_shader_modules[index]))
+			FOSSILIZE_THROW("Failed to create shader module.");
+		return;
+	}
+
+	uint64_t code_offset = obj["codeBinaryOffset"].GetUint64();
+	uint64_t code_size = obj["codeBinarySize"].GetUint64();
+	if (code_offset + code_size > size)
+		FOSSILIZE_THROW("Code buffer out of range.");
+	uint32_t *decode_buffer = allocator.allocate_n<uint32_t>(info.codeSize / sizeof(uint32_t));
+	info.pCode = decode_buffer;
+
+	bool decoded;
+	if (encoding == SpirvEncoding::SmolV)
+		decoded = decode_smolv(decode_buffer, info.codeSize / sizeof(uint32_t), buffer + code_offset, code_size);
+	else
+		decoded = decode_varint(decode_buffer, info.codeSize / sizeof(uint32_t), buffer + code_offset, code_size);
+
+	if (!decoded)
+		FOSSILIZE_THROW("Failed to decode SPIR-V buffer.");
+	if (!iface.enqueue_create_shader_module(hash, index, &info, &replayed_shader_modules[index]))
+		FOSSILIZE_THROW("Failed to create shader module.");
+}
+
+void StateReplayer::parse_shader_modules(StateCreatorInterface &iface, const Value &modules, const uint8_t *buffer, size_t size,
+                                         SpirvEncoding encoding)
 {
 	iface.set_num_shader_modules(modules.Size());
 	replayed_shader_modules.resize(modules.Size());
-	auto *infos = allocator.allocate_n_cleared<VkShaderModuleCreateInfo>(modules.Size());
 
 	unsigned index = 0;
 	for (auto itr = modules.Begin(); itr != modules.End(); ++itr, index++)
+		parse_shader_module(iface, *itr, index, buffer, size, encoding);
+	iface.wait_enqueue();
+}
+
+void StateReplayer::parse_pipeline_layout(StateCreatorInterface &iface, const Value &obj, unsigned index)
+{
+	auto &info = *allocator.allocate_cleared<VkPipelineLayoutCreateInfo>();
+	info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+
+	info.flags = obj["flags"].GetUint();
+
+	if (obj.HasMember("pushConstantRanges"))
 	{
-		auto &obj = *itr;
-		auto &info = infos[index];
-		info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-		info.flags = obj["flags"].GetUint();
-		info.codeSize = obj["codeSize"].GetUint64();
-
-		uint64_t code_offset = obj["codeBinaryOffset"].GetUint64();
-		uint64_t code_size = obj["codeBinarySize"].GetUint64();
-		if (code_offset + code_size > size)
-			FOSSILIZE_THROW("Code buffer out of range.");
-		uint32_t *decode_buffer = allocator.allocate_n<uint32_t>(info.codeSize / sizeof(uint32_t));
-		info.pCode = decode_buffer;
-
-		if (!decode_varint(decode_buffer, info.codeSize / sizeof(uint32_t), buffer + code_offset, code_size))
-			FOSSILIZE_THROW("Failed to decode varint buffer.");
-		if (!iface.enqueue_create_shader_module(obj["hash"].GetUint64(), index, &info, &replayed_shader_modules[index]))
-			FOSSILIZE_THROW("Failed to create shader module.");
+		info.pushConstantRangeCount = obj["pushConstantRanges"].Size();
+		info.pPushConstantRanges = parse_push_constant_ranges(obj["pushConstantRanges"]);
 	}
-	iface.wait_enqueue();
+
+	if (obj.HasMember("setLayouts"))
+	{
+		info.setLayoutCount = obj["setLayouts"].Size();
+		info.pSetLayouts = parse_set_layouts(obj["setLayouts"]);
+	}
+
+	if (!iface.enqueue_create_pipeline_layout(obj["hash"].GetUint64(), index, &info, &replayed_pipeline_layouts[index]))
+		FOSSILIZE_THROW("Failed to create pipeline layout.");
 }
 
 void StateReplayer::parse_pipeline_layouts(StateCreatorInterface &iface, const Value &layouts)
 {
 	iface.set_num_pipeline_layouts(layouts.Size());
 	replayed_pipeline_layouts.resize(layouts.Size());
-	auto *infos = allocator.allocate_n_cleared<VkPipelineLayoutCreateInfo>(layouts.Size());
 
 	unsigned index = 0;
 	for (auto itr = layouts.Begin(); itr != layouts.End(); ++itr, index++)
-	{
-		auto &obj = *itr;
-		auto &info = infos[index];
-		info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-
-		info.flags = obj["flags"].GetUint();
-
-		if (obj.HasMember("pushConstantRanges"))
-		{
-			info.pushConstantRangeCount = obj["pushConstantRanges"].Size();
-			info.pPushConstantRanges = parse_push_constant_ranges(obj["pushConstantRanges"]);
-		}
+		parse_pipeline_layout(iface, *itr, index);
+	iface.wait_enqueue();
+}
 
-		if (obj.HasMember("setLayouts"))
-		{
-			info.setLayoutCount = obj["setLayouts"].Size();
-			info.pSetLayouts = parse_set_layouts(obj["setLayouts"]);
-		}
+void StateReplayer::parse_descriptor_set_layout(StateCreatorInterface &iface, const Value &obj, unsigned index)
+{
+	auto &info = *allocator.allocate_cleared<VkDescriptorSetLayoutCreateInfo>();
+	info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
 
-		if (!iface.enqueue_create_pipeline_layout(obj["hash"].GetUint64(), index, &info, &replayed_pipeline_layouts[index]))
-			FOSSILIZE_THROW("Failed to create pipeline layout.");
+	info.flags = obj["flags"].GetUint();
+	if (obj.HasMember("bindings"))
+	{
+		auto &bindings = obj["bindings"];
+		info.bindingCount = bindings.Size();
+		auto *allocated_bindings = parse_descriptor_set_bindings(bindings);
+		info.pBindings = allocated_bindings;
 	}
-	iface.wait_enqueue();
+
+	if (!iface.enqueue_create_descriptor_set_layout(obj["hash"].GetUint64(), index, &info, &replayed_descriptor_set_layouts[index]))
+		FOSSILIZE_THROW("Failed to create descriptor set layout.");
 }
 
 void StateReplayer::parse_descriptor_set_layouts(StateCreatorInterface &iface, const Value &layouts)
 {
 	iface.set_num_descriptor_set_layouts(layouts.Size());
 	replayed_descriptor_set_layouts.resize(layouts.Size());
-	auto *infos = allocator.allocate_n_cleared<VkDescriptorSetLayoutCreateInfo>(layouts.Size());
 
 	unsigned index = 0;
 	for (auto itr = layouts.Begin(); itr != layouts.End(); ++itr, index++)
-	{
-		auto &obj = *itr;
-		auto &info = infos[index];
-		info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-
-		info.flags = obj["flags"].GetUint();
-		if (obj.HasMember("bindings"))
-		{
-			auto &bindings = obj["bindings"];
-			info.bindingCount = bindings.Size();
-			auto *allocated_bindings = parse_descriptor_set_bindings(bindings);
-			info.pBindings = allocated_bindings;
-		}
-
-		if (!iface.enqueue_create_descriptor_set_layout(obj["hash"].GetUint64(), index, &info, &replayed_descriptor_set_layouts[index]))
-			FOSSILIZE_THROW("Failed to create descriptor set layout.");
-	}
+		parse_descriptor_set_layout(iface, *itr, index);
 	iface.wait_enqueue();
 }
 
+void StateReplayer::parse_sampler(StateCreatorInterface &iface, const Value &obj, unsigned index)
+{
+	auto &info = *allocator.allocate_cleared<VkSamplerCreateInfo>();
+	info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+
+	info.addressModeU = static_cast<VkSamplerAddressMode>(obj["addressModeU"].GetUint());
+	info.addressModeV = static_cast<VkSamplerAddressMode>(obj["addressModeV"].GetUint());
+	info.addressModeW = static_cast<VkSamplerAddressMode>(obj["addressModeW"].GetUint());
+	info.anisotropyEnable = obj["anisotropyEnable"].GetUint();
+	info.borderColor = static_cast<VkBorderColor>(obj["borderColor"].GetUint());
+	info.compareEnable = obj["compareEnable"].GetUint();
+	info.compareOp = static_cast<VkCompareOp>(obj["compareOp"].GetUint());
+	info.flags = obj["flags"].GetUint();
+	info.magFilter = static_cast<VkFilter>(obj["magFilter"].GetUint());
+	info.minFilter = static_cast<VkFilter>(obj["minFilter"].GetUint());
+	info.maxAnisotropy = obj["maxAnisotropy"].GetFloat();
+	info.mipmapMode = static_cast<VkSamplerMipmapMode>(obj["mipmapMode"].GetUint());
+	info.maxLod = obj["maxLod"].GetFloat();
+	info.minLod = obj["minLod"].GetFloat();
+	info.mipLodBias = obj["mipLodBias"].GetFloat();
+	info.unnormalizedCoordinates = obj["unnormalizedCoordinates"].GetUint();
+
+	if (!iface.enqueue_create_sampler(obj["hash"].GetUint64(), index, &info, &replayed_samplers[index]))
+		FOSSILIZE_THROW("Failed to create sampler.");
+}
+
 void StateReplayer::parse_samplers(StateCreatorInterface &iface, const Value &samplers)
 {
 	iface.set_num_samplers(samplers.Size());
 	replayed_samplers.resize(samplers.Size());
-	auto *infos = allocator.allocate_n_cleared<VkSamplerCreateInfo>(samplers.Size());
 
 	unsigned index = 0;
 	for (auto itr = samplers.Begin(); itr != samplers.End(); ++itr, index++)
-	{
-		auto &obj = *itr;
-		auto &info = infos[index];
-		info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-
-		info.addressModeU = static_cast<VkSamplerAddressMode>(obj["addressModeU"].GetUint());
-		info.addressModeV = static_cast<VkSamplerAddressMode>(obj["addressModeV"].GetUint());
-		info.addressModeW = static_cast<VkSamplerAddressMode>(obj["addressModeW"].GetUint());
-		info.anisotropyEnable = obj["anisotropyEnable"].GetUint();
-		info.borderColor = static_cast<VkBorderColor>(obj["borderColor"].GetUint());
-		info.compareEnable = obj["compareEnable"].GetUint();
-		info.compareOp = static_cast<VkCompareOp>(obj["compareOp"].GetUint());
-		info.flags = obj["flags"].GetUint();
-		info.magFilter = static_cast<VkFilter>(obj["magFilter"].GetUint());
-		info.minFilter = static_cast<VkFilter>(obj["minFilter"].GetUint());
-		info.maxAnisotropy = obj["maxAnisotropy"].GetFloat();
-		info.mipmapMode = static_cast<VkSamplerMipmapMode>(obj["mipmapMode"].GetUint());
-		info.maxLod = obj["maxLod"].GetFloat();
-		info.minLod = obj["minLod"].GetFloat();
-		info.mipLodBias = obj["mipLodBias"].GetFloat();
-		info.unnormalizedCoordinates = obj["unnormalizedCoordinates"].GetUint();
-
-		if (!iface.enqueue_create_sampler(obj["hash"].GetUint64(), index, &info, &replayed_samplers[index]))
-			FOSSILIZE_THROW("Failed to create sampler.");
-	}
+		parse_sampler(iface, *itr, index);
 	iface.wait_enqueue();
 }
 
@@ -948,42 +1069,43 @@ VkSubpassDescription *StateReplayer::parse_render_pass_subpasses(const Value &su
 	return ret;
 }
 
-void StateReplayer::parse_render_passes(StateCreatorInterface &iface, const Value &passes)
+void StateReplayer::parse_render_pass(StateCreatorInterface &iface, const Value &obj, unsigned index)
 {
-	iface.set_num_render_passes(passes.Size());
-	replayed_render_passes.resize(passes.Size());
-	auto *infos = allocator.allocate_n_cleared<VkRenderPassCreateInfo>(passes.Size());
+	auto &info = *allocator.allocate_cleared<VkRenderPassCreateInfo>();
+	info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
 
-	unsigned index = 0;
-	for (auto itr = passes.Begin(); itr != passes.End(); ++itr, index++)
+	info.flags = obj["flags"].GetUint();
+
+	if (obj.HasMember("attachments"))
 	{
-		auto &obj = *itr;
-		auto &info = infos[index];
-		info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+		info.attachmentCount = obj["attachments"].Size();
+		info.pAttachments = parse_render_pass_attachments(obj["attachments"]);
+	}
 
-		info.flags = obj["flags"].GetUint();
+	if (obj.HasMember("dependencies"))
+	{
+		info.dependencyCount = obj["dependencies"].Size();
+		info.pDependencies = parse_render_pass_dependencies(obj["dependencies"]);
+	}
 
-		if (obj.HasMember("attachments"))
-		{
-			info.attachmentCount = obj["attachments"].Size();
-			info.pAttachments = parse_render_pass_attachments(obj["attachments"]);
-		}
+	if (obj.HasMember("subpasses"))
+	{
+		info.subpassCount = obj["subpasses"].Size();
+		info.pSubpasses = parse_render_pass_subpasses(obj["subpasses"]);
+	}
 
-		if (obj.HasMember("dependencies"))
-		{
-			info.dependencyCount = obj["dependencies"].Size();
-			info.pDependencies = parse_render_pass_dependencies(obj["dependencies"]);
-		}
+	if (!iface.enqueue_create_render_pass(obj["hash"].GetUint64(), index, &info, &replayed_render_passes[index]))
+		FOSSILIZE_THROW("Failed to create render pass.");
+}
 
-		if (obj.HasMember("subpasses"))
-		{
-			info.subpassCount = obj["subpasses"].Size();
-			info.pSubpasses = parse_render_pass_subpasses(obj["subpasses"]);
-		}
+void StateReplayer::parse_render_passes(StateCreatorInterface &iface, const Value &passes)
+{
+	iface.set_num_render_passes(passes.Size());
+	replayed_render_passes.resize(passes.Size());
 
-		if (!iface.enqueue_create_render_pass(obj["hash"].GetUint64(), index, &info, &replayed_render_passes[index]))
-			FOSSILIZE_THROW("Failed to create render pass.");
-	}
+	unsigned index = 0;
+	for (auto itr = passes.Begin(); itr != passes.End(); ++itr, index++)
+		parse_render_pass(iface, *itr, index);
 
 	iface.wait_enqueue();
 }
@@ -1008,7 +1130,9 @@ VkSpecializationInfo *StateReplayer::parse_specialization_info(const Value &spec
 {
 	auto *spec = allocator.allocate_cleared<VkSpecializationInfo>();
 	spec->dataSize = spec_info["dataSize"].GetUint();
-	spec->pData = decode_base64(allocator, spec_info["data"].GetString(), spec->dataSize);
+	auto *data = static_cast<uint8_t *>(allocator.get_thread_allocator().allocate_raw(spec->dataSize, 16));
+	decode_base64(data, spec->dataSize, spec_info["data"].GetString());
+	spec->pData = data;
 	if (spec_info.HasMember("mapEntries"))
 	{
 		spec->mapEntryCount = spec_info["mapEntries"].Size();
@@ -1017,59 +1141,60 @@ VkSpecializationInfo *StateReplayer::parse_specialization_info(const Value &spec
 	return spec;
 }
 
-void StateReplayer::parse_compute_pipelines(StateCreatorInterface &iface, const Value &pipelines)
+void StateReplayer::parse_compute_pipeline(StateCreatorInterface &iface, const Value &obj, unsigned index)
 {
-	iface.set_num_compute_pipelines(pipelines.Size());
-	replayed_compute_pipelines.resize(pipelines.Size());
-	auto *infos = allocator.allocate_n_cleared<VkComputePipelineCreateInfo>(pipelines.Size());
-
-	unsigned index = 0;
-	for (auto itr = pipelines.Begin(); itr != pipelines.End(); ++itr, index++)
+	auto &info = *allocator.allocate_cleared<VkComputePipelineCreateInfo>();
+	info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	info.flags = obj["flags"].GetUint();
+	info.basePipelineIndex = obj["basePipelineIndex"].GetUint();
+
+	auto pipeline = obj["basePipelineHandle"].GetUint64();
+	if (pipeline > replayed_compute_pipelines.size())
+		FOSSILIZE_THROW("Base pipeline index out of range.");
+	else if (pipeline > 0)
 	{
-		auto &obj = *itr;
-		auto &info = infos[index];
-		info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
-		info.flags = obj["flags"].GetUint();
-		info.basePipelineIndex = obj["basePipelineIndex"].GetUint();
+		iface.wait_enqueue();
+		info.basePipelineHandle = replayed_compute_pipelines[pipeline - 1];
+	}
+	else
+		info.basePipelineHandle = VK_NULL_HANDLE;
 
-		auto pipeline = obj["basePipelineHandle"].GetUint64();
-		if (pipeline > replayed_shader_modules.size())
-			FOSSILIZE_THROW("Base pipeline index out of range.");
-		else if (pipeline > 0)
-		{
-			iface.wait_enqueue();
-			info.basePipelineHandle = replayed_compute_pipelines[pipeline - 1];
-		}
-		else
-			info.basePipelineHandle = VK_NULL_HANDLE;
+	auto layout = obj["layout"].GetUint64();
+	if (layout > replayed_pipeline_layouts.size())
+		FOSSILIZE_THROW("Pipeline layout index out of range.");
+	else if (layout > 0)
+		info.layout = replayed_pipeline_layouts[layout - 1];
+	else
+		info.layout = VK_NULL_HANDLE;
 
-		auto layout = obj["layout"].GetUint64();
-		if (layout > replayed_pipeline_layouts.size())
-			FOSSILIZE_THROW("Pipeline layout index out of range.");
-		else if (layout > 0)
-			info.layout = replayed_pipeline_layouts[layout - 1];
-		else
-			info.layout = VK_NULL_HANDLE;
+	auto &stage = obj["stage"];
+	info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	info.stage.stage = static_cast<VkShaderStageFlagBits>(stage["stage"].GetUint());
 
-		auto &stage = obj["stage"];
-		info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-		info.stage.stage = static_cast<VkShaderStageFlagBits>(stage["stage"].GetUint());
+	auto module = stage["module"].GetUint64();
+	if (module > replayed_shader_modules.size())
+		FOSSILIZE_THROW("Shader module index out of range.");
+	else if (module > 0)
+		info.stage.module = api_object_cast<VkShaderModule>(replayed_shader_modules[module - 1]);
+	else
+		info.stage.module = VK_NULL_HANDLE;
 
-		auto module = stage["module"].GetUint64();
-		if (module > replayed_shader_modules.size())
-			FOSSILIZE_THROW("Shader module index out of range.");
-		else if (module > 0)
-			info.stage.module = api_object_cast<VkShaderModule>(replayed_shader_modules[module - 1]);
-		else
-			info.stage.module = VK_NULL_HANDLE;
+	info.stage.pName = duplicate_string(stage["name"].GetString(), stage["name"].GetStringLength());
+	if (stage.HasMember("specializationInfo"))
+		info.stage.pSpecializationInfo = parse_specialization_info(stage["specializationInfo"]);
 
-		info.stage.pName = duplicate_string(stage["name"].GetString(), stage["name"].GetStringLength());
-		if (stage.HasMember("specializationInfo"))
-			info.stage.pSpecializationInfo = parse_specialization_info(stage["specializationInfo"]);
+	if (!iface.enqueue_create_compute_pipeline(obj["hash"].GetUint64(), index, &info, &replayed_compute_pipelines[index]))
+		FOSSILIZE_THROW("Failed to create compute pipeline.");
+}
 
-		if (!iface.enqueue_create_compute_pipeline(obj["hash"].GetUint64(), index, &info, &replayed_compute_pipelines[index]))
-			FOSSILIZE_THROW("Failed to create compute pipeline.");
-	}
+void StateReplayer::parse_compute_pipelines(StateCreatorInterface &iface, const Value &pipelines)
+{
+	iface.set_num_compute_pipelines(pipelines.Size());
+	replayed_compute_pipelines.resize(pipelines.Size());
+
+	unsigned index = 0;
+	for (auto itr = pipelines.Begin(); itr != pipelines.End(); ++itr, index++)
+		parse_compute_pipeline(iface, *itr, index);
 	iface.wait_enqueue();
 }
 
@@ -1354,133 +1479,519 @@ VkPipelineShaderStageCreateInfo *StateReplayer::parse_stages(const rapidjson::Va
 	return ret;
 }
 
-void StateReplayer::parse_graphics_pipelines(StateCreatorInterface &iface, const Value &pipelines)
+template <typename T>
+void StateReplayer::parse_state_table(const Value &states, const char *name, vector<const T *> &table,
+                                      T *(StateReplayer::*parse)(const Value &))
 {
-	iface.set_num_graphics_pipelines(pipelines.Size());
-	replayed_graphics_pipelines.resize(pipelines.Size());
-	auto *infos = allocator.allocate_n_cleared<VkGraphicsPipelineCreateInfo>(pipelines.Size());
-	unsigned index = 0;
+	table.clear();
+	if (!states.HasMember(name))
+		return;
+
+	auto &values = states[name];
+	table.reserve(values.Size());
+	for (auto itr = values.Begin(); itr != values.End(); ++itr)
+		table.push_back((this->*parse)(*itr));
+}
 
-	for (auto itr = pipelines.Begin(); itr != pipelines.End(); ++itr, index++)
-	{
-		auto &obj = *itr;
-		auto &info = infos[index];
-		info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-		info.flags = obj["flags"].GetUint();
-		info.basePipelineIndex = obj["basePipelineIndex"].GetUint();
+void StateReplayer::parse_states(const Value &states)
+{
+	parse_state_table(states, "tessellationState", replayed_tessellation_states, &StateReplayer::parse_tessellation_state);
+	parse_state_table(states, "colorBlendState", replayed_color_blend_states, &StateReplayer::parse_color_blend_state);
+	parse_state_table(states, "vertexInputState", replayed_vertex_input_states, &StateReplayer::parse_vertex_input_state);
+	parse_state_table(states, "multisampleState", replayed_multisample_states, &StateReplayer::parse_multisample_state);
+	parse_state_table(states, "dynamicState", replayed_dynamic_states, &StateReplayer::parse_dynamic_state);
+	parse_state_table(states, "viewportState", replayed_viewport_states, &StateReplayer::parse_viewport_state);
+	parse_state_table(states, "inputAssemblyState", replayed_input_assembly_states, &StateReplayer::parse_input_assembly_state);
+	parse_state_table(states, "depthStencilState", replayed_depth_stencil_states, &StateReplayer::parse_depth_stencil_state);
+	parse_state_table(states, "rasterizationState", replayed_rasterization_states, &StateReplayer::parse_rasterization_state);
+}
 
-		auto pipeline = obj["basePipelineHandle"].GetUint64();
-		if (pipeline > replayed_shader_modules.size())
-			FOSSILIZE_THROW("Base pipeline index out of range.");
-		else if (pipeline > 0)
-		{
-			iface.wait_enqueue();
-			info.basePipelineHandle = replayed_graphics_pipelines[pipeline - 1];
-		}
-		else
-			info.basePipelineHandle = VK_NULL_HANDLE;
+// Version 2 refers to shared states by 1-indexed ID, version 1 stores them inline.
+template <typename T>
+const T *StateReplayer::resolve_state(const Value &value, const vector<const T *> &states,
+                                      T *(StateReplayer::*parse)(const Value &))
+{
+	if (value.IsObject())
+		return (this->*parse)(value);
 
-		auto layout = obj["layout"].GetUint64();
-		if (layout > replayed_pipeline_layouts.size())
-			FOSSILIZE_THROW("Pipeline layout index out of range.");
-		else if (layout > 0)
-			info.layout = replayed_pipeline_layouts[layout - 1];
-		else
-			info.layout = VK_NULL_HANDLE;
+	auto id = value.GetUint64();
+	if (id == 0 || id > states.size())
+		FOSSILIZE_THROW("State index out of range.");
+	return states[id - 1];
+}
 
-		auto render_pass = obj["renderPass"].GetUint64();
-		if (render_pass > replayed_render_passes.size())
-			FOSSILIZE_THROW("Render pass index out of range.");
-		else if (render_pass > 0)
-			info.renderPass = replayed_render_passes[render_pass - 1];
-		else
-			info.renderPass = VK_NULL_HANDLE;
+void StateReplayer::parse_graphics_pipeline(StateCreatorInterface &iface, const Value &obj, unsigned index)
+{
+	auto &info = *allocator.allocate_cleared<VkGraphicsPipelineCreateInfo>();
+	info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	info.flags = obj["flags"].GetUint();
+	info.basePipelineIndex = obj["basePipelineIndex"].GetUint();
+
+	auto pipeline = obj["basePipelineHandle"].GetUint64();
+	if (pipeline > replayed_graphics_pipelines.size())
+		FOSSILIZE_THROW("Base pipeline index out of range.");
+	else if (pipeline > 0)
+	{
+		iface.wait_enqueue();
+		info.basePipelineHandle = replayed_graphics_pipelines[pipeline - 1];
+	}
+	else
+		info.basePipelineHandle = VK_NULL_HANDLE;
 
-		info.subpass = obj["subpass"].GetUint();
+	auto layout = obj["layout"].GetUint64();
+	if (layout > replayed_pipeline_layouts.size())
+		FOSSILIZE_THROW("Pipeline layout index out of range.");
+	else if (layout > 0)
+		info.layout = replayed_pipeline_layouts[layout - 1];
+	else
+		info.layout = VK_NULL_HANDLE;
 
-		if (obj.HasMember("stages"))
-		{
-			info.stageCount = obj["stages"].Size();
-			info.pStages = parse_stages(obj["stages"]);
-		}
+	auto render_pass = obj["renderPass"].GetUint64();
+	if (render_pass > replayed_render_passes.size())
+		FOSSILIZE_THROW("Render pass index out of range.");
+	else if (render_pass > 0)
+		info.renderPass = replayed_render_passes[render_pass - 1];
+	else
+		info.renderPass = VK_NULL_HANDLE;
 
-		if (obj.HasMember("rasterizationState"))
-			info.pRasterizationState = parse_rasterization_state(obj["rasterizationState"]);
-		if (obj.HasMember("tessellationState"))
-			info.pTessellationState = parse_tessellation_state(obj["tessellationState"]);
-		if (obj.HasMember("colorBlendState"))
-			info.pColorBlendState = parse_color_blend_state(obj["colorBlendState"]);
-		if (obj.HasMember("depthStencilState"))
-			info.pDepthStencilState = parse_depth_stencil_state(obj["depthStencilState"]);
-		if (obj.HasMember("dynamicState"))
-			info.pDynamicState = parse_dynamic_state(obj["dynamicState"]);
-		if (obj.HasMember("viewportState"))
-			info.pViewportState = parse_viewport_state(obj["viewportState"]);
-		if (obj.HasMember("multisampleState"))
-			info.pMultisampleState = parse_multisample_state(obj["multisampleState"]);
-		if (obj.HasMember("inputAssemblyState"))
-			info.pInputAssemblyState = parse_input_assembly_state(obj["inputAssemblyState"]);
-		if (obj.HasMember("vertexInputState"))
-			info.pVertexInputState = parse_vertex_input_state(obj["vertexInputState"]);
+	info.subpass = obj["subpass"].GetUint();
 
-		if (!iface.enqueue_create_graphics_pipeline(obj["hash"].GetUint64(), index, &info, &replayed_graphics_pipelines[index]))
-			FOSSILIZE_THROW("Failed to create graphics pipeline.");
+	if (obj.HasMember("stages"))
+	{
+		info.stageCount = obj["stages"].Size();
+		info.pStages = parse_stages(obj["stages"]);
 	}
 
-	iface.wait_enqueue();
+	if (obj.HasMember("rasterizationState"))
+	{
+		info.pRasterizationState = resolve_state(obj["rasterizationState"], replayed_rasterization_states,
+		                                         &StateReplayer::parse_rasterization_state);
+	}
+	if (obj.HasMember("tessellationState"))
+	{
+		info.pTessellationState = resolve_state(obj["tessellationState"], replayed_tessellation_states,
+		                                        &StateReplayer::parse_tessellation_state);
+	}
+	if (obj.HasMember("colorBlendState"))
+	{
+		info.pColorBlendState = resolve_state(obj["colorBlendState"], replayed_color_blend_states,
+		                                      &StateReplayer::parse_color_blend_state);
+	}
+	if (obj.HasMember("depthStencilState"))
+	{
+		info.pDepthStencilState = resolve_state(obj["depthStencilState"], replayed_depth_stencil_states,
+		                                        &StateReplayer::parse_depth_stencil_state);
+	}
+	if (obj.HasMember("dynamicState"))
+	{
+		info.pDynamicState = resolve_state(obj["dynamicState"], replayed_dynamic_states,
+		                                   &StateReplayer::parse_dynamic_state);
+	}
+	if (obj.HasMember("viewportState"))
+	{
+		info.pViewportState = resolve_state(obj["viewportState"], replayed_viewport_states,
+		                                    &StateReplayer::parse_viewport_state);
+	}
+	if (obj.HasMember("multisampleState"))
+	{
+		info.pMultisampleState = resolve_state(obj["multisampleState"], replayed_multisample_states,
+		                                       &StateReplayer::parse_multisample_state);
+	}
+	if (obj.HasMember("inputAssemblyState"))
+	{
+		info.pInputAssemblyState = resolve_state(obj["inputAssemblyState"], replayed_input_assembly_states,
+		                                         &StateReplayer::parse_input_assembly_state);
+	}
+	if (obj.HasMember("vertexInputState"))
+	{
+		info.pVertexInputState = resolve_state(obj["vertexInputState"], replayed_vertex_input_states,
+		                                       &StateReplayer::parse_vertex_input_state);
+	}
+
+	if (!iface.enqueue_create_graphics_pipeline(obj["hash"].GetUint64(), index, &info, &replayed_graphics_pipelines[index]))
+		FOSSILIZE_THROW("Failed to create graphics pipeline.");
 }
 
-void StateReplayer::parse(StateCreatorInterface &iface, const void *buffer_, size_t size)
+void StateReplayer::parse_graphics_pipelines(StateCreatorInterface &iface, const Value &pipelines)
 {
-	auto *buffer = static_cast<const uint8_t *>(buffer_);
-	auto *buffer_accum = buffer;
-	if (size < FOSSILIZE_MAGIC_LEN + 2 * sizeof(uint64_t))
-		FOSSILIZE_THROW("Buffer too small.");
+	iface.set_num_graphics_pipelines(pipelines.Size());
+	replayed_graphics_pipelines.resize(pipelines.Size());
 
-	if (memcmp(buffer_accum, FOSSILIZE_MAGIC, FOSSILIZE_MAGIC_LEN) != 0)
-		FOSSILIZE_THROW("Magic invalid.");
-	buffer_accum += FOSSILIZE_MAGIC_LEN;
+	unsigned index = 0;
+	for (auto itr = pipelines.Begin(); itr != pipelines.End(); ++itr, index++)
+		parse_graphics_pipeline(iface, *itr, index);
 
-	uint64_t state_size = 0;
-	memcpy(&state_size, buffer_accum, sizeof(uint64_t));
-	if (state_size != size)
-		FOSSILIZE_THROW("Buffer size mismatch.");
-	buffer_accum += sizeof(uint64_t);
+	iface.wait_enqueue();
+}
 
-	if (memcmp(buffer_accum, FOSSILIZE_JSON_MAGIC, sizeof(uint64_t)) != 0)
-		FOSSILIZE_THROW("JSON magic mismatch.");
-	buffer_accum += sizeof(uint64_t);
+namespace
+{
+struct LZBlock
+{
+	const uint8_t *encoded;
+	size_t encoded_size;
+	uint8_t *data;
+	size_t size;
+	bool stored;
+};
+}
 
-	uint64_t json_size = 0;
-	memcpy(&json_size, buffer_accum, sizeof(uint64_t));
-	buffer_accum += sizeof(uint64_t);
-	if (uint64_t((buffer_accum + json_size) - buffer) > size)
-		FOSSILIZE_THROW("Buffer too small.");
+// Block LZ chunks contain the magic of the wrapped chunk, its uncompressed size, the block size, the block count
+// and a block index with the encoded size of every block, followed by the encoded blocks.
+static const uint8_t *prepare_block_lz_chunk(const uint8_t *chunk, uint64_t chunk_size, uint64_t &inflated_size,
+                                             vector<unique_ptr<uint8_t[]>> &storage, vector<LZBlock> &blocks)
+{
+	const size_t header_size = 2 * sizeof(uint64_t) + 2 * sizeof(uint32_t);
+	if (chunk_size < header_size)
+		FOSSILIZE_THROW("Block LZ chunk too small.");
+
+	uint32_t block_size = 0;
+	uint32_t block_count = 0;
+	memcpy(&inflated_size, chunk + sizeof(uint64_t), sizeof(uint64_t));
+	memcpy(&block_size, chunk + 2 * sizeof(uint64_t), sizeof(uint32_t));
+	memcpy(&block_count, chunk + 2 * sizeof(uint64_t) + sizeof(uint32_t), sizeof(uint32_t));
+
+	// The writer never uses larger blocks, so anything else is rejected before sizes derived from it are trusted.
+	if (block_size == 0 || block_size > FOSSILIZE_LZ_BLOCK_SIZE || (chunk_size - header_size) / sizeof(uint32_t) < block_count)
+		FOSSILIZE_THROW("Block LZ chunk is corrupt.");
+	if (inflated_size / block_size + (inflated_size % block_size != 0 ? 1 : 0) != block_count)
+		FOSSILIZE_THROW("Block LZ chunk is corrupt.");
+
+	const uint8_t *index = chunk + header_size;
+	const uint8_t *encoded_begin = index + block_count * sizeof(uint32_t);
+	const uint8_t *encoded_end = chunk + chunk_size;
+
+	// Validate the whole index before allocating, so a corrupt chunk cannot request more memory than
+	// its encoded blocks could ever expand to.
+	uint64_t total_encoded_size = 0;
+	for (uint32_t i = 0; i < block_count; i++)
+	{
+		uint32_t entry = 0;
+		memcpy(&entry, index + i * sizeof(uint32_t), sizeof(uint32_t));
+		bool stored = (entry & FOSSILIZE_LZ_BLOCK_STORED_BIT) != 0;
+		uint64_t encoded_size = entry & ~uint32_t(FOSSILIZE_LZ_BLOCK_STORED_BIT);
+		uint64_t size = std::min<uint64_t>(block_size, inflated_size - uint64_t(i) * block_size);
+
+		if (stored ? encoded_size != size : size > encoded_size * FOSSILIZE_LZ_MAX_EXPANSION)
+			FOSSILIZE_THROW("Block LZ chunk is corrupt.");
+		total_encoded_size += encoded_size;
+	}
 
-	Document doc;
-	doc.Parse(reinterpret_cast<const char *>(buffer_accum), json_size);
+	if (total_encoded_size != uint64_t(encoded_end - encoded_begin))
+		FOSSILIZE_THROW("Block LZ chunk is corrupt.");
 
-	if (doc.HasParseError())
-		FOSSILIZE_THROW("JSON parse error.");
+	storage.emplace_back(new uint8_t[inflated_size]);
+	uint8_t *data = storage.back().get();
 
-	buffer_accum += json_size;
-	if (memcmp(buffer_accum, FOSSILIZE_SPIRV_MAGIC, sizeof(uint64_t)) != 0)
-		FOSSILIZE_THROW("SPIR-V magic mismatch.");
-	buffer_accum += sizeof(uint64_t);
-	uint64_t spirv_size = 0;
-	memcpy(&spirv_size, buffer_accum, sizeof(uint64_t));
-	buffer_accum += sizeof(uint64_t);
-	if (uint64_t((buffer_accum + spirv_size) - buffer) != size)
-		FOSSILIZE_THROW("Buffer size mismatch.");
+	const uint8_t *encoded = encoded_begin;
+	for (uint32_t i = 0; i < block_count; i++)
+	{
+		uint32_t entry = 0;
+		memcpy(&entry, index + i * sizeof(uint32_t), sizeof(uint32_t));
+		bool stored = (entry & FOSSILIZE_LZ_BLOCK_STORED_BIT) != 0;
+		size_t encoded_size = entry & ~uint32_t(FOSSILIZE_LZ_BLOCK_STORED_BIT);
+
+		uint64_t block_offset = uint64_t(i) * block_size;
+		size_t size = size_t(std::min<uint64_t>(block_size, inflated_size - block_offset));
+		blocks.push_back({ encoded, encoded_size, data + block_offset, size, stored });
+		encoded += encoded_size;
+	}
 
-	if (!doc.HasMember("version"))
-		FOSSILIZE_THROW("JSON does not contain version.");
+	return data;
+}
 
-	if (doc["version"].GetInt() != FOSSILIZE_FORMAT_VERSION)
+static bool decompress_block(const LZBlock &block)
+{
+	if (block.stored)
+	{
+		memcpy(block.data, block.encoded, block.size);
+		return true;
+	}
+	else
+		return decode_lz(block.data, block.size, block.encoded, block.encoded_size);
+}
+
+static void decompress_blocks(const vector<LZBlock> &blocks, unsigned num_threads)
+{
+	const auto decompress = [&blocks](size_t index) -> bool {
+		return decompress_block(blocks[index]);
+	};
+
+	if (num_threads == 0)
+		num_threads = ThreadPool::get_default_num_threads();
+	num_threads = unsigned(std::min<size_t>(num_threads, blocks.size()));
+
+	std::atomic<bool> failed(false);
+	if (num_threads <= 1)
+	{
+		for (size_t i = 0; i < blocks.size(); i++)
+			if (!decompress(i))
+				failed = true;
+	}
+	else
+	{
+		ThreadPool pool(num_threads);
+		for (size_t i = 0; i < blocks.size(); i++)
+		{
+			pool.enqueue([&, i]() {
+				if (!decompress(i))
+					failed = true;
+			});
+		}
+		pool.wait_idle();
+	}
+
+	if (failed)
+		FOSSILIZE_THROW("Failed to decompress block.");
+}
+
+namespace
+{
+struct ArchiveChunk
+{
+	const uint8_t *data = nullptr;
+	uint64_t size = 0;
+	bool compressed = false;
+};
+
+struct ArchiveChunks
+{
+	ArchiveChunk json;
+	ArchiveChunk spirv;
+	ArchiveChunk index;
+	SpirvEncoding spirv_encoding = SpirvEncoding::Varint;
+};
+}
+
+// Validates the container and finds the chunks we understand. Compressed chunks point to the block LZ payload.
+static ArchiveChunks find_archive_chunks(const uint8_t *buffer, size_t size)
+{
+	auto *buffer_accum = buffer;
+	auto *buffer_end = buffer + size;
+	if (size < FOSSILIZE_MAGIC_LEN + sizeof(uint64_t))
+		FOSSILIZE_THROW("Buffer too small.");
+
+	if (memcmp(buffer_accum, FOSSILIZE_MAGIC, FOSSILIZE_MAGIC_LEN) != 0)
+		FOSSILIZE_THROW("Magic invalid.");
+	buffer_accum += FOSSILIZE_MAGIC_LEN;
+
+	uint64_t state_size = 0;
+	memcpy(&state_size, buffer_accum, sizeof(uint64_t));
+	if (state_size != size)
+		FOSSILIZE_THROW("Buffer size mismatch.");
+	buffer_accum += sizeof(uint64_t);
+
+	ArchiveChunks chunks;
+	while (buffer_accum != buffer_end)
+	{
+		if (size_t(buffer_end - buffer_accum) < 2 * sizeof(uint64_t))
+			FOSSILIZE_THROW("Buffer too small.");
+
+		const uint8_t *magic = buffer_accum;
+		uint64_t chunk_size = 0;
+		memcpy(&chunk_size, buffer_accum + sizeof(uint64_t), sizeof(uint64_t));
+		buffer_accum += 2 * sizeof(uint64_t);
+		if (chunk_size > uint64_t(buffer_end - buffer_accum))
+			FOSSILIZE_THROW("Buffer too small.");
+
+		const uint8_t *chunk = buffer_accum;
+		buffer_accum += chunk_size;
+
+		bool compressed = memcmp(magic, FOSSILIZE_BLOCK_LZ_MAGIC, sizeof(uint64_t)) == 0;
+		if (compressed)
+		{
+			if (chunk_size < sizeof(uint64_t))
+				FOSSILIZE_THROW("Block LZ chunk too small.");
+			magic = chunk;
+		}
+
+		ArchiveChunk *target;
+		if (memcmp(magic, FOSSILIZE_JSON_MAGIC, sizeof(uint64_t)) == 0)
+			target = &chunks.json;
+		else if (memcmp(magic, FOSSILIZE_SPIRV_MAGIC, sizeof(uint64_t)) == 0)
+		{
+			target = &chunks.spirv;
+			chunks.spirv_encoding = SpirvEncoding::Varint;
+		}
+		else if (memcmp(magic, FOSSILIZE_SMOLV_MAGIC, sizeof(uint64_t)) == 0)
+		{
+			target = &chunks.spirv;
+			chunks.spirv_encoding = SpirvEncoding::SmolV;
+		}
+		else if (memcmp(magic, FOSSILIZE_INDEX_MAGIC, sizeof(uint64_t)) == 0)
+			target = &chunks.index;
+		else
+		{
+			// Skip unknown chunks, so optional chunks can be added without breaking older readers.
+			continue;
+		}
+
+		target->data = chunk;
+		target->size = chunk_size;
+		target->compressed = compressed;
+	}
+
+	if (!chunks.json.data)
+		FOSSILIZE_THROW("JSON chunk missing.");
+	if (!chunks.spirv.data)
+		FOSSILIZE_THROW("SPIR-V chunk missing.");
+
+	return chunks;
+}
+
+// Returns the contents of a chunk. Compressed chunks are inflated into storage once their blocks are decompressed.
+static const uint8_t *prepare_chunk(const ArchiveChunk &chunk, uint64_t &size,
+                                    vector<unique_ptr<uint8_t[]>> &storage, vector<LZBlock> &blocks)
+{
+	if (chunk.compressed)
+		return prepare_block_lz_chunk(chunk.data, chunk.size, size, storage, blocks);
+
+	size = chunk.size;
+	return chunk.data;
+}
+
+namespace
+{
+// A chunk which is only decompressed where it is read.
+struct LazyChunk
+{
+	const uint8_t *data = nullptr;
+	uint64_t size = 0;
+	vector<unique_ptr<uint8_t[]>> storage;
+	vector<LZBlock> blocks;
+	vector<bool> decoded;
+
+	void init(const ArchiveChunk &chunk)
+	{
+		storage.clear();
+		blocks.clear();
+		data = prepare_chunk(chunk, size, storage, blocks);
+		decoded.assign(blocks.size(), false);
+	}
+
+	// Decompresses the blocks which cover [offset, offset + len).
+	const uint8_t *get(uint64_t offset, uint64_t len)
+	{
+		if (offset > size || len > size - offset)
+			FOSSILIZE_THROW("Offset out of range.");
+
+		auto itr = upper_bound(begin(blocks), end(blocks), data + offset, [](const uint8_t *ptr, const LZBlock &block) {
+			return ptr < block.data;
+		});
+		if (itr != begin(blocks))
+			--itr;
+
+		for (; itr != end(blocks) && itr->data < data + offset + len; ++itr)
+		{
+			size_t index = size_t(itr - begin(blocks));
+			if (decoded[index])
+				continue;
+			if (!decompress_block(*itr))
+				FOSSILIZE_THROW("Failed to decompress block.");
+			decoded[index] = true;
+		}
+
+		return data + offset;
+	}
+};
+}
+
+struct StateReplayer::IndexedArchive
+{
+	enum EntryState : uint8_t
+	{
+		Pending,
+		InProgress,
+		Created
+	};
+
+	LazyChunk json;
+	LazyChunk spirv;
+	SpirvEncoding spirv_encoding = SpirvEncoding::Varint;
+	vector<IndexEntry> entries;
+	vector<uint32_t> dependencies;
+	vector<EntryState> entry_states;
+};
+
+StateReplayer::StateReplayer()
+{
+}
+
+StateReplayer::~StateReplayer()
+{
+}
+
+void StateReplayer::set_num_threads(unsigned count)
+{
+	num_threads = count;
+}
+
+void StateReplayer::set_spirv_store(SpirvStore *store)
+{
+	spirv_store = store;
+}
+
+void StateReplayer::set_skip_shader_code(bool skip)
+{
+	skip_shader_code = skip;
+}
+
+void StateReplayer::reset()
+{
+	allocator.reset();
+	replayed_samplers.clear();
+	replayed_descriptor_set_layouts.clear();
+	replayed_pipeline_layouts.clear();
+	replayed_shader_modules.clear();
+	replayed_render_passes.clear();
+	replayed_compute_pipelines.clear();
+	replayed_graphics_pipelines.clear();
+	replayed_tessellation_states.clear();
+	replayed_color_blend_states.clear();
+	replayed_vertex_input_states.clear();
+	replayed_multisample_states.clear();
+	replayed_dynamic_states.clear();
+	replayed_viewport_states.clear();
+	replayed_input_assembly_states.clear();
+	replayed_depth_stencil_states.clear();
+	replayed_rasterization_states.clear();
+	archive.reset();
+}
+
+void StateReplayer::parse(StateCreatorInterface &iface, const void *buffer, size_t size)
+{
+	auto chunks = find_archive_chunks(static_cast<const uint8_t *>(buffer), size);
+
+	// Compressed chunks are inflated into here, they must outlive parsing.
+	vector<unique_ptr<uint8_t[]>> inflated_chunks;
+	vector<LZBlock> blocks;
+
+	uint64_t json_size = 0;
+	uint64_t spirv_size = 0;
+	const uint8_t *json_data = prepare_chunk(chunks.json, json_size, inflated_chunks, blocks);
+	const uint8_t *spirv_data = nullptr;
+	if (!skip_shader_code)
+		spirv_data = prepare_chunk(chunks.spirv, spirv_size, inflated_chunks, blocks);
+	SpirvEncoding spirv_encoding = chunks.spirv_encoding;
+
+	if (!blocks.empty())
+		decompress_blocks(blocks, num_threads);
+
+	Document doc;
+	doc.Parse(reinterpret_cast<const char *>(json_data), json_size);
+
+	if (doc.HasParseError())
+		FOSSILIZE_THROW("JSON parse error.");
+
+	if (!doc.HasMember("version"))
+		FOSSILIZE_THROW("JSON does not contain version.");
+
+	int version = doc["version"].GetInt();
+	if (version < 1 || version > FOSSILIZE_FORMAT_VERSION)
 		FOSSILIZE_THROW("JSON version mismatches.");
 
 	if (doc.HasMember("shaderModules"))
-		parse_shader_modules(iface, doc["shaderModules"], buffer_accum, spirv_size);
+		parse_shader_modules(iface, doc["shaderModules"], spirv_data, spirv_size, spirv_encoding);
 	else
 		iface.set_num_shader_modules(0);
 
@@ -1509,12 +2020,260 @@ void StateReplayer::parse(StateCreatorInterface &iface, const void *buffer_, siz
 	else
 		iface.set_num_compute_pipelines(0);
 
+	if (doc.HasMember("states"))
+		parse_states(doc["states"]);
+	else
+		parse_states(Value(kObjectType));
+
 	if (doc.HasMember("graphicsPipelines"))
 		parse_graphics_pipelines(iface, doc["graphicsPipelines"]);
 	else
 		iface.set_num_graphics_pipelines(0);
 }
 
+void StateReplayer::parse_index(StateCreatorInterface &iface, const void *buffer, size_t size)
+{
+	auto chunks = find_archive_chunks(static_cast<const uint8_t *>(buffer), size);
+	if (!chunks.index.data)
+		FOSSILIZE_THROW("Archive has no index.");
+
+	// Create infos from an earlier archive might still be in use, so they are not freed here.
+	archive.reset(new IndexedArchive);
+	auto &index = *archive;
+	index.json.init(chunks.json);
+	index.spirv.init(chunks.spirv);
+	index.spirv_encoding = chunks.spirv_encoding;
+
+	LazyChunk index_chunk;
+	index_chunk.init(chunks.index);
+	if (index_chunk.size < 2 * sizeof(uint32_t))
+		FOSSILIZE_THROW("Index chunk too small.");
+
+	uint32_t entry_count = 0;
+	uint32_t dependency_count = 0;
+	const uint8_t *header = index_chunk.get(0, 2 * sizeof(uint32_t));
+	memcpy(&entry_count, header, sizeof(uint32_t));
+	memcpy(&dependency_count, header + sizeof(uint32_t), sizeof(uint32_t));
+
+	uint64_t entries_size = uint64_t(entry_count) * sizeof(IndexEntry);
+	uint64_t dependencies_size = uint64_t(dependency_count) * sizeof(uint32_t);
+	if (index_chunk.size != 2 * sizeof(uint32_t) + entries_size + dependencies_size)
+		FOSSILIZE_THROW("Index chunk is corrupt.");
+
+	index.entries.resize(entry_count);
+	index.dependencies.resize(dependency_count);
+	memcpy(index.entries.data(), index_chunk.get(2 * sizeof(uint32_t), entries_size), entries_size);
+	memcpy(index.dependencies.data(), index_chunk.get(2 * sizeof(uint32_t) + entries_size, dependencies_size), dependencies_size);
+	index.entry_states.assign(entry_count, IndexedArchive::Pending);
+
+	uint32_t counts[FOSSILIZE_INDEX_TYPE_COUNT + 1] = {};
+	for (auto &entry : index.entries)
+	{
+		if (entry.type == 0 || entry.type > FOSSILIZE_INDEX_TYPE_COUNT)
+			FOSSILIZE_THROW("Index entry has invalid type.");
+		if (entry.first_dependency > dependency_count || entry.dependency_count > dependency_count - entry.first_dependency)
+			FOSSILIZE_THROW("Index entry dependencies out of range.");
+		counts[entry.type]++;
+	}
+
+	for (auto &entry : index.entries)
+		if (entry.ordinal == 0 || entry.ordinal > counts[entry.type])
+			FOSSILIZE_THROW("Index entry ordinal out of range.");
+
+	for (auto dependency : index.dependencies)
+		if (dependency >= entry_count)
+			FOSSILIZE_THROW("Index dependency out of range.");
+
+	iface.set_num_samplers(counts[uint32_t(ObjectType::Sampler)]);
+	iface.set_num_descriptor_set_layouts(counts[uint32_t(ObjectType::DescriptorSetLayout)]);
+	iface.set_num_pipeline_layouts(counts[uint32_t(ObjectType::PipelineLayout)]);
+	iface.set_num_shader_modules(counts[uint32_t(ObjectType::ShaderModule)]);
+	iface.set_num_render_passes(counts[uint32_t(ObjectType::RenderPass)]);
+	iface.set_num_compute_pipelines(counts[uint32_t(ObjectType::ComputePipeline)]);
+	iface.set_num_graphics_pipelines(counts[uint32_t(ObjectType::GraphicsPipeline)]);
+
+	replayed_samplers.assign(counts[uint32_t(ObjectType::Sampler)], VK_NULL_HANDLE);
+	replayed_descriptor_set_layouts.assign(counts[uint32_t(ObjectType::DescriptorSetLayout)], VK_NULL_HANDLE);
+	replayed_pipeline_layouts.assign(counts[uint32_t(ObjectType::PipelineLayout)], VK_NULL_HANDLE);
+	replayed_shader_modules.assign(counts[uint32_t(ObjectType::ShaderModule)], VK_NULL_HANDLE);
+	replayed_render_passes.assign(counts[uint32_t(ObjectType::RenderPass)], VK_NULL_HANDLE);
+	replayed_compute_pipelines.assign(counts[uint32_t(ObjectType::ComputePipeline)], VK_NULL_HANDLE);
+	replayed_graphics_pipelines.assign(counts[uint32_t(ObjectType::GraphicsPipeline)], VK_NULL_HANDLE);
+
+	replayed_tessellation_states.assign(counts[FOSSILIZE_INDEX_TESSELLATION_STATE], nullptr);
+	replayed_dynamic_states.assign(counts[FOSSILIZE_INDEX_DYNAMIC_STATE], nullptr);
+	replayed_multisample_states.assign(counts[FOSSILIZE_INDEX_MULTISAMPLE_STATE], nullptr);
+	replayed_vertex_input_states.assign(counts[FOSSILIZE_INDEX_VERTEX_INPUT_STATE], nullptr);
+	replayed_rasterization_states.assign(counts[FOSSILIZE_INDEX_RASTERIZATION_STATE], nullptr);
+	replayed_input_assembly_states.assign(counts[FOSSILIZE_INDEX_INPUT_ASSEMBLY_STATE], nullptr);
+	replayed_color_blend_states.assign(counts[FOSSILIZE_INDEX_COLOR_BLEND_STATE], nullptr);
+	replayed_viewport_states.assign(counts[FOSSILIZE_INDEX_VIEWPORT_STATE], nullptr);
+	replayed_depth_stencil_states.assign(counts[FOSSILIZE_INDEX_DEPTH_STENCIL_STATE], nullptr);
+}
+
+bool StateReplayer::parse_object(StateCreatorInterface &iface, ObjectType type, Hash hash)
+{
+	if (!archive)
+		FOSSILIZE_THROW("No index was parsed.");
+
+	auto &entries = archive->entries;
+	auto itr = lower_bound(begin(entries), end(entries), make_pair(uint32_t(type), hash),
+	                       [](const IndexEntry &entry, const pair<uint32_t, Hash> &key) {
+		                       return entry.type != key.first ? entry.type < key.first : entry.hash < key.second;
+	                       });
+
+	if (itr == end(entries) || itr->type != uint32_t(type) || itr->hash != hash)
+		return false;
+
+	materialize_object(iface, uint32_t(itr - begin(entries)));
+	return true;
+}
+
+bool StateReplayer::parse_object_at(StateCreatorInterface &iface, ObjectType type, unsigned index)
+{
+	if (!archive)
+		FOSSILIZE_THROW("No index was parsed.");
+
+	// Entries are sorted by hash, so the position in the archive needs a linear search.
+	auto &entries = archive->entries;
+	auto itr = find_if(begin(entries), end(entries), [&](const IndexEntry &entry) {
+		return entry.type == uint32_t(type) && entry.ordinal == index + 1;
+	});
+
+	if (itr == end(entries))
+		return false;
+
+	materialize_object(iface, uint32_t(itr - begin(entries)));
+	return true;
+}
+
+bool StateReplayer::has_index(const void *buffer, size_t size)
+{
+	if (size < FOSSILIZE_MAGIC_LEN || memcmp(buffer, FOSSILIZE_MAGIC, FOSSILIZE_MAGIC_LEN) != 0)
+		return false;
+
+	try
+	{
+		return find_archive_chunks(static_cast<const uint8_t *>(buffer), size).index.data != nullptr;
+	}
+	catch (...)
+	{
+		return false;
+	}
+}
+
+void StateReplayer::materialize_object(StateCreatorInterface &iface, uint32_t index)
+{
+	auto &state = archive->entry_states[index];
+	if (state == IndexedArchive::Created)
+		return;
+	if (state == IndexedArchive::InProgress)
+		FOSSILIZE_THROW("Index has cyclic dependencies.");
+	state = IndexedArchive::InProgress;
+
+	// An object which fails to materialize can be retried later, so it must not be left looking like a cycle.
+	try
+	{
+		const IndexEntry &entry = archive->entries[index];
+		for (uint32_t i = 0; i < entry.dependency_count; i++)
+			materialize_object(iface, archive->dependencies[entry.first_dependency + i]);
+		parse_indexed_object(iface, index);
+	}
+	catch (...)
+	{
+		state = IndexedArchive::Pending;
+		throw;
+	}
+
+	state = IndexedArchive::Created;
+}
+
+void StateReplayer::parse_indexed_object(StateCreatorInterface &iface, uint32_t index)
+{
+	const IndexEntry &entry = archive->entries[index];
+	auto *json = archive->json.get(entry.json_offset, entry.json_size);
+	Document doc;
+	doc.Parse(reinterpret_cast<const char *>(json), entry.json_size);
+	if (doc.HasParseError())
+		FOSSILIZE_THROW("JSON parse error.");
+
+	unsigned ordinal_index = entry.ordinal - 1;
+	switch (entry.type)
+	{
+	case uint32_t(ObjectType::Sampler):
+		parse_sampler(iface, doc, ordinal_index);
+		break;
+
+	case uint32_t(ObjectType::DescriptorSetLayout):
+		parse_descriptor_set_layout(iface, doc, ordinal_index);
+		break;
+
+	case uint32_t(ObjectType::PipelineLayout):
+		parse_pipeline_layout(iface, doc, ordinal_index);
+		break;
+
+	case uint32_t(ObjectType::ShaderModule):
+	{
+		auto &spirv = archive->spirv;
+		if (!skip_shader_code && doc.HasMember("codeBinaryOffset"))
+			spirv.get(doc["codeBinaryOffset"].GetUint64(), doc["codeBinarySize"].GetUint64());
+		parse_shader_module(iface, doc, ordinal_index, spirv.data, spirv.size, archive->spirv_encoding);
+		break;
+	}
+
+	case uint32_t(ObjectType::RenderPass):
+		parse_render_pass(iface, doc, ordinal_index);
+		break;
+
+	case uint32_t(ObjectType::ComputePipeline):
+		parse_compute_pipeline(iface, doc, ordinal_index);
+		break;
+
+	case uint32_t(ObjectType::GraphicsPipeline):
+		parse_graphics_pipeline(iface, doc, ordinal_index);
+		break;
+
+	case FOSSILIZE_INDEX_TESSELLATION_STATE:
+		replayed_tessellation_states[ordinal_index] = parse_tessellation_state(doc);
+		break;
+
+	case FOSSILIZE_INDEX_DYNAMIC_STATE:
+		replayed_dynamic_states[ordinal_index] = parse_dynamic_state(doc);
+		break;
+
+	case FOSSILIZE_INDEX_MULTISAMPLE_STATE:
+		replayed_multisample_states[ordinal_index] = parse_multisample_state(doc);
+		break;
+
+	case FOSSILIZE_INDEX_VERTEX_INPUT_STATE:
+		replayed_vertex_input_states[ordinal_index] = parse_vertex_input_state(doc);
+		break;
+
+	case FOSSILIZE_INDEX_RASTERIZATION_STATE:
+		replayed_rasterization_states[ordinal_index] = parse_rasterization_state(doc);
+		break;
+
+	case FOSSILIZE_INDEX_INPUT_ASSEMBLY_STATE:
+		replayed_input_assembly_states[ordinal_index] = parse_input_assembly_state(doc);
+		break;
+
+	case FOSSILIZE_INDEX_COLOR_BLEND_STATE:
+		replayed_color_blend_states[ordinal_index] = parse_color_blend_state(doc);
+		break;
+
+	case FOSSILIZE_INDEX_VIEWPORT_STATE:
+		replayed_viewport_states[ordinal_index] = parse_viewport_state(doc);
+		break;
+
+	case FOSSILIZE_INDEX_DEPTH_STENCIL_STATE:
+		replayed_depth_stencil_states[ordinal_index] = parse_depth_stencil_state(doc);
+		break;
+	}
+
+	// Objects referring to this one need its handle.
+	iface.wait_enqueue();
+}
+
 template <typename T>
 T *StateReplayer::copy(const T *src, size_t count)
 {
@@ -1533,121 +2292,379 @@ T *StateRecorder::copy(const T *src, size_t count)
 	return new_data;
 }
 
-ScratchAllocator::Block::Block(size_t size)
+ScratchPagePool::~ScratchPagePool()
 {
-	blob.resize(size);
+	for (auto *page : free_pages)
+		delete[] page;
 }
 
-void ScratchAllocator::add_block(size_t minimum_size)
+uint8_t *ScratchPagePool::allocate_page()
 {
-	if (minimum_size < 64 * 1024)
-		minimum_size = 64 * 1024;
-	blocks.emplace_back(minimum_size);
+	{
+		lock_guard<mutex> holder{ lock };
+		if (!free_pages.empty())
+		{
+			uint8_t *page = free_pages.back();
+			free_pages.pop_back();
+			return page;
+		}
+	}
+
+	return new uint8_t[FOSSILIZE_SCRATCH_BLOCK_SIZE];
 }
 
-void *ScratchAllocator::allocate_raw_cleared(size_t size, size_t alignment)
+void ScratchPagePool::free_page(uint8_t *page)
 {
-	void *ret = allocate_raw(size, alignment);
-	if (ret)
-		memset(ret, 0, size);
-	return ret;
+	lock_guard<mutex> holder{ lock };
+	free_pages.push_back(page);
 }
 
-void *ScratchAllocator::allocate_raw(size_t size, size_t alignment)
+size_t ScratchPagePool::get_page_size() const
 {
-	if (blocks.empty())
-		add_block(size + alignment);
+	return FOSSILIZE_SCRATCH_BLOCK_SIZE;
+}
 
-	auto &block = blocks.back();
+ScratchAllocator::ScratchAllocator(ScratchPagePool *pool)
+	: pool(pool)
+{
+}
 
-	size_t offset = (block.offset + alignment - 1) & ~(alignment - 1);
-	size_t required_size = offset + size;
-	if (required_size <= block.blob.size())
+ScratchAllocator::~ScratchAllocator()
+{
+	for (auto &block : blocks)
 	{
-		void *ret = block.blob.data() + offset;
-		block.offset = required_size;
-		return ret;
+		if (pool)
+			pool->free_page(block.blob);
+		else
+			delete[] block.blob;
 	}
-
-	add_block(size + alignment);
-	return allocate_raw(size, alignment);
 }
 
-void StateRecorder::set_compute_pipeline_handle(unsigned index, VkPipeline pipeline)
+static inline uint8_t *align_pointer(uint8_t *ptr, size_t alignment)
 {
-	compute_pipeline_to_index[pipeline] = index;
+	auto addr = reinterpret_cast<uintptr_t>(ptr);
+	return ptr + (((addr + alignment - 1) & ~uintptr_t(alignment - 1)) - addr);
 }
 
-void StateRecorder::set_descriptor_set_layout_handle(unsigned index, VkDescriptorSetLayout layout)
+void *ScratchAllocator::allocate_raw_cleared(size_t size, size_t alignment)
 {
-	descriptor_set_layout_to_index[layout] = index;
+	void *ret = allocate_raw(size, alignment);
+	if (ret)
+		memset(ret, 0, size);
+	return ret;
 }
 
-void StateRecorder::set_graphics_pipeline_handle(unsigned index, VkPipeline pipeline)
+void *ScratchAllocator::allocate_dedicated(size_t size, size_t alignment)
 {
-	graphics_pipeline_to_index[pipeline] = index;
+	dedicated.emplace_back(new uint8_t[size + alignment]);
+	bytes_dedicated += size + alignment;
+	bytes_used += size;
+	bytes_wasted += alignment;
+	return align_pointer(dedicated.back().get(), alignment);
 }
 
-void StateRecorder::set_pipeline_layout_handle(unsigned index, VkPipelineLayout layout)
+void *ScratchAllocator::allocate_raw(size_t size, size_t alignment)
 {
-	pipeline_layout_to_index[layout] = index;
+	if (size + alignment > FOSSILIZE_SCRATCH_DEDICATED_THRESHOLD)
+		return allocate_dedicated(size, alignment);
+
+	// Blocks past current_block are either fresh or left over from before a reset.
+	for (;;)
+	{
+		if (current_block == blocks.size())
+		{
+			Block block;
+			block.offset = 0;
+			block.blob = pool ? pool->allocate_page() : new uint8_t[FOSSILIZE_SCRATCH_BLOCK_SIZE];
+			blocks.push_back(block);
+		}
+
+		auto &block = blocks[current_block];
+		uint8_t *ptr = align_pointer(block.blob + block.offset, alignment);
+		size_t offset = size_t(ptr - block.blob);
+
+		if (offset + size <= FOSSILIZE_SCRATCH_BLOCK_SIZE)
+		{
+			bytes_wasted += offset - block.offset;
+			bytes_used += size;
+			block.offset = offset + size;
+			return ptr;
+		}
+
+		bytes_wasted += FOSSILIZE_SCRATCH_BLOCK_SIZE - block.offset;
+		current_block++;
+	}
 }
 
-void StateRecorder::set_render_pass_handle(unsigned index, VkRenderPass render_pass)
+void ScratchAllocator::reset()
 {
-	render_pass_to_index[render_pass] = index;
+	for (auto &block : blocks)
+		block.offset = 0;
+	current_block = 0;
+	dedicated.clear();
+	bytes_dedicated = 0;
+	bytes_used = 0;
+	bytes_wasted = 0;
 }
 
-void StateRecorder::set_shader_module_handle(unsigned index, VkShaderModule module)
+ScratchAllocator::Marker ScratchAllocator::get_marker() const
 {
-	shader_module_to_index[module] = index;
+	Marker marker;
+	marker.block_index = current_block;
+	marker.offset = current_block < blocks.size() ? blocks[current_block].offset : 0;
+	marker.dedicated_count = dedicated.size();
+	marker.bytes_dedicated = bytes_dedicated;
+	marker.bytes_used = bytes_used;
+	marker.bytes_wasted = bytes_wasted;
+	return marker;
 }
 
-void StateRecorder::set_sampler_handle(unsigned index, VkSampler sampler)
+void ScratchAllocator::rewind(const Marker &marker)
 {
-	sampler_to_index[sampler] = index;
+	for (size_t i = marker.block_index; i < blocks.size(); i++)
+		blocks[i].offset = 0;
+	if (marker.block_index < blocks.size())
+		blocks[marker.block_index].offset = marker.offset;
+	current_block = marker.block_index;
+
+	while (dedicated.size() > marker.dedicated_count)
+		dedicated.pop_back();
+
+	bytes_dedicated = marker.bytes_dedicated;
+	bytes_used = marker.bytes_used;
+	bytes_wasted = marker.bytes_wasted;
 }
 
-unsigned StateRecorder::register_descriptor_set_layout(Hash hash, const VkDescriptorSetLayoutCreateInfo &layout_info)
+size_t ScratchAllocator::get_bytes_used() const
 {
-	auto index = unsigned(descriptor_sets.size());
-	descriptor_sets.push_back({ hash, copy_descriptor_set_layout(layout_info) });
-	return index;
+	return bytes_used;
 }
 
-unsigned StateRecorder::register_pipeline_layout(Hash hash, const VkPipelineLayoutCreateInfo &layout_info)
+size_t ScratchAllocator::get_bytes_wasted() const
 {
-	auto index = unsigned(pipeline_layouts.size());
-	pipeline_layouts.push_back({ hash, copy_pipeline_layout(layout_info) });
-	return index;
+	return bytes_wasted;
 }
 
-unsigned StateRecorder::register_sampler(Hash hash, const VkSamplerCreateInfo &create_info)
+size_t ScratchAllocator::get_bytes_reserved() const
 {
-	if (create_info.pNext)
-		FOSSILIZE_THROW("pNext in VkSamplerCreateInfo not supported.");
-
-	auto index = unsigned(samplers.size());
-	samplers.push_back({ hash, copy_sampler(create_info) });
-	return index;
+	return blocks.size() * FOSSILIZE_SCRATCH_BLOCK_SIZE + bytes_dedicated;
 }
 
-unsigned StateRecorder::register_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo &create_info)
+ScratchAllocator::ScopedMarker::ScopedMarker(ScratchAllocator &allocator)
+	: allocator(allocator), marker(allocator.get_marker())
 {
-	if (create_info.pNext)
-		FOSSILIZE_THROW("pNext in VkGraphicsPipelineCreateInfo not supported.");
-	auto index = unsigned(graphics_pipelines.size());
-	graphics_pipelines.push_back({ hash, copy_graphics_pipeline(create_info) });
-	return index;
 }
 
-unsigned StateRecorder::register_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo &create_info)
+ScratchAllocator::ScopedMarker::~ScopedMarker()
 {
-	if (create_info.pNext)
-		FOSSILIZE_THROW("pNext in VkComputePipelineCreateInfo not supported.");
-	auto index = unsigned(compute_pipelines.size());
-	compute_pipelines.push_back({ hash, copy_compute_pipeline(create_info) });
-	return index;
+	allocator.rewind(marker);
+}
+
+static atomic<uint64_t> concurrent_allocator_id;
+
+ConcurrentScratchAllocator::ConcurrentScratchAllocator()
+	: id(++concurrent_allocator_id)
+{
+}
+
+ScratchAllocator &ConcurrentScratchAllocator::get_thread_allocator()
+{
+	// Allocator IDs are never reused, so stale entries from destroyed allocators never match.
+	struct CacheEntry
+	{
+		uint64_t id;
+		ScratchAllocator *allocator;
+	};
+	static thread_local CacheEntry cache[4];
+	static thread_local unsigned cache_replace_index;
+
+	for (auto &entry : cache)
+		if (entry.id == id)
+			return *entry.allocator;
+
+	ScratchAllocator *allocator = nullptr;
+	auto thread = this_thread::get_id();
+	{
+		lock_guard<mutex> holder{ lock };
+		for (auto &thread_allocator : thread_allocators)
+		{
+			if (thread_allocator.thread == thread)
+			{
+				allocator = thread_allocator.allocator.get();
+				break;
+			}
+		}
+
+		if (!allocator)
+		{
+			ThreadAllocator thread_allocator;
+			thread_allocator.thread = thread;
+			thread_allocator.allocator.reset(new ScratchAllocator(&pool));
+			allocator = thread_allocator.allocator.get();
+			thread_allocators.push_back(move(thread_allocator));
+		}
+	}
+
+	auto &entry = cache[cache_replace_index++ % 4];
+	entry.id = id;
+	entry.allocator = allocator;
+	return *allocator;
+}
+
+void *ConcurrentScratchAllocator::allocate_raw(size_t size, size_t alignment)
+{
+	return get_thread_allocator().allocate_raw(size, alignment);
+}
+
+void *ConcurrentScratchAllocator::allocate_raw_cleared(size_t size, size_t alignment)
+{
+	return get_thread_allocator().allocate_raw_cleared(size, alignment);
+}
+
+void ConcurrentScratchAllocator::reset()
+{
+	lock_guard<mutex> holder{ lock };
+	for (auto &thread_allocator : thread_allocators)
+		thread_allocator.allocator->reset();
+}
+
+size_t ConcurrentScratchAllocator::get_bytes_used() const
+{
+	lock_guard<mutex> holder{ lock };
+	size_t size = 0;
+	for (auto &thread_allocator : thread_allocators)
+		size += thread_allocator.allocator->get_bytes_used();
+	return size;
+}
+
+size_t ConcurrentScratchAllocator::get_bytes_wasted() const
+{
+	lock_guard<mutex> holder{ lock };
+	size_t size = 0;
+	for (auto &thread_allocator : thread_allocators)
+		size += thread_allocator.allocator->get_bytes_wasted();
+	return size;
+}
+
+size_t ConcurrentScratchAllocator::get_bytes_reserved() const
+{
+	lock_guard<mutex> holder{ lock };
+	size_t size = 0;
+	for (auto &thread_allocator : thread_allocators)
+		size += thread_allocator.allocator->get_bytes_reserved();
+	return size;
+}
+
+void StateRecorder::remove_descriptor_set_layout_handle(VkDescriptorSetLayout layout)
+{
+	descriptor_set_layout_to_index.erase(layout);
+}
+
+void StateRecorder::remove_pipeline_layout_handle(VkPipelineLayout layout)
+{
+	pipeline_layout_to_index.erase(layout);
+}
+
+void StateRecorder::remove_shader_module_handle(VkShaderModule module)
+{
+	shader_module_to_index.erase(module);
+}
+
+void StateRecorder::remove_graphics_pipeline_handle(VkPipeline pipeline)
+{
+	graphics_pipeline_to_index.erase(pipeline);
+}
+
+void StateRecorder::remove_compute_pipeline_handle(VkPipeline pipeline)
+{
+	compute_pipeline_to_index.erase(pipeline);
+}
+
+void StateRecorder::remove_render_pass_handle(VkRenderPass render_pass)
+{
+	render_pass_to_index.erase(render_pass);
+}
+
+void StateRecorder::remove_sampler_handle(VkSampler sampler)
+{
+	sampler_to_index.erase(sampler);
+}
+
+void StateRecorder::set_compute_pipeline_handle(unsigned index, VkPipeline pipeline)
+{
+	compute_pipeline_to_index[pipeline] = index;
+}
+
+void StateRecorder::set_descriptor_set_layout_handle(unsigned index, VkDescriptorSetLayout layout)
+{
+	descriptor_set_layout_to_index[layout] = index;
+}
+
+void StateRecorder::set_graphics_pipeline_handle(unsigned index, VkPipeline pipeline)
+{
+	graphics_pipeline_to_index[pipeline] = index;
+}
+
+void StateRecorder::set_pipeline_layout_handle(unsigned index, VkPipelineLayout layout)
+{
+	pipeline_layout_to_index[layout] = index;
+}
+
+void StateRecorder::set_render_pass_handle(unsigned index, VkRenderPass render_pass)
+{
+	render_pass_to_index[render_pass] = index;
+}
+
+void StateRecorder::set_shader_module_handle(unsigned index, VkShaderModule module)
+{
+	shader_module_to_index[module] = index;
+}
+
+void StateRecorder::set_sampler_handle(unsigned index, VkSampler sampler)
+{
+	sampler_to_index[sampler] = index;
+}
+
+unsigned StateRecorder::register_descriptor_set_layout(Hash hash, const VkDescriptorSetLayoutCreateInfo &layout_info)
+{
+	auto index = unsigned(descriptor_sets.size());
+	descriptor_sets.push_back({ hash, copy_descriptor_set_layout(layout_info) });
+	return index;
+}
+
+unsigned StateRecorder::register_pipeline_layout(Hash hash, const VkPipelineLayoutCreateInfo &layout_info)
+{
+	auto index = unsigned(pipeline_layouts.size());
+	pipeline_layouts.push_back({ hash, copy_pipeline_layout(layout_info) });
+	return index;
+}
+
+unsigned StateRecorder::register_sampler(Hash hash, const VkSamplerCreateInfo &create_info)
+{
+	if (create_info.pNext)
+		FOSSILIZE_THROW("pNext in VkSamplerCreateInfo not supported.");
+
+	auto index = unsigned(samplers.size());
+	samplers.push_back({ hash, copy_sampler(create_info) });
+	return index;
+}
+
+unsigned StateRecorder::register_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo &create_info)
+{
+	if (create_info.pNext)
+		FOSSILIZE_THROW("pNext in VkGraphicsPipelineCreateInfo not supported.");
+	auto index = unsigned(graphics_pipelines.size());
+	graphics_pipelines.push_back({ hash, copy_graphics_pipeline(create_info) });
+	return index;
+}
+
+unsigned StateRecorder::register_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo &create_info)
+{
+	if (create_info.pNext)
+		FOSSILIZE_THROW("pNext in VkComputePipelineCreateInfo not supported.");
+	auto index = unsigned(compute_pipelines.size());
+	compute_pipelines.push_back({ hash, copy_compute_pipeline(create_info) });
+	return index;
 }
 
 unsigned StateRecorder::register_render_pass(Hash hash, const VkRenderPassCreateInfo &create_info)
@@ -1670,71 +2687,86 @@ unsigned StateRecorder::register_shader_module(Hash hash, const VkShaderModuleCr
 
 Hash StateRecorder::get_hash_for_compute_pipeline_handle(VkPipeline pipeline) const
 {
-	auto itr = compute_pipeline_to_index.find(pipeline);
-	if (itr == end(compute_pipeline_to_index))
+	auto *index = compute_pipeline_to_index.find(pipeline);
+	if (!index)
 		FOSSILIZE_THROW("Handle is not registered.");
 	else
-		return compute_pipelines[itr->second].hash;
+		return compute_pipelines[*index].hash;
 }
 
 Hash StateRecorder::get_hash_for_graphics_pipeline_handle(VkPipeline pipeline) const
 {
-	auto itr = graphics_pipeline_to_index.find(pipeline);
-	if (itr == end(graphics_pipeline_to_index))
+	auto *index = graphics_pipeline_to_index.find(pipeline);
+	if (!index)
 		FOSSILIZE_THROW("Handle is not registered.");
 	else
-		return graphics_pipelines[itr->second].hash;
+		return graphics_pipelines[*index].hash;
 }
 
 Hash StateRecorder::get_hash_for_sampler(VkSampler sampler) const
 {
-	auto itr = sampler_to_index.find(sampler);
-	if (itr == end(sampler_to_index))
+	auto *index = sampler_to_index.find(sampler);
+	if (!index)
 		FOSSILIZE_THROW("Handle is not registered.");
 	else
-		return samplers[itr->second].hash;
+		return samplers[*index].hash;
 }
 
 Hash StateRecorder::get_hash_for_shader_module(VkShaderModule module) const
 {
-	auto itr = shader_module_to_index.find(module);
-	if (itr == end(shader_module_to_index))
+	auto *index = shader_module_to_index.find(module);
+	if (!index)
 		FOSSILIZE_THROW("Handle is not registered.");
 	else
-		return shader_modules[itr->second].hash;
+		return shader_modules[*index].hash;
 }
 
 Hash StateRecorder::get_hash_for_pipeline_layout(VkPipelineLayout layout) const
 {
-	auto itr = pipeline_layout_to_index.find(layout);
-	if (itr == end(pipeline_layout_to_index))
+	auto *index = pipeline_layout_to_index.find(layout);
+	if (!index)
 		FOSSILIZE_THROW("Handle is not registered.");
 	else
-		return pipeline_layouts[itr->second].hash;
+		return pipeline_layouts[*index].hash;
 }
 
 Hash StateRecorder::get_hash_for_descriptor_set_layout(VkDescriptorSetLayout layout) const
 {
-	auto itr = descriptor_set_layout_to_index.find(layout);
-	if (itr == end(descriptor_set_layout_to_index))
+	auto *index = descriptor_set_layout_to_index.find(layout);
+	if (!index)
 		FOSSILIZE_THROW("Handle is not registered.");
 	else
-		return descriptor_sets[itr->second].hash;
+		return descriptor_sets[*index].hash;
 }
 
 Hash StateRecorder::get_hash_for_render_pass(VkRenderPass render_pass) const
 {
-	auto itr = render_pass_to_index.find(render_pass);
-	if (itr == end(render_pass_to_index))
+	auto *index = render_pass_to_index.find(render_pass);
+	if (!index)
 		FOSSILIZE_THROW("Handle is not registered.");
 	else
-		return render_passes[itr->second].hash;
+		return render_passes[*index].hash;
 }
 
 VkShaderModuleCreateInfo StateRecorder::copy_shader_module(const VkShaderModuleCreateInfo &create_info)
 {
 	auto info = create_info;
-	info.pCode = copy(info.pCode, info.codeSize / sizeof(uint32_t));
+	if (strip_debug_info)
+	{
+		size_t words = 0;
+		for_each_semantic_range(info.pCode, info.codeSize / sizeof(uint32_t), [&](const uint32_t *, size_t count) {
+			words += count;
+		});
+
+		auto *code = allocator.allocate_n<uint32_t>(words);
+		info.pCode = code;
+		info.codeSize = words * sizeof(uint32_t);
+		for_each_semantic_range(create_info.pCode, create_info.codeSize / sizeof(uint32_t), [&](const uint32_t *src, size_t count) {
+			code = std::copy(src, src + count, code);
+		});
+	}
+	else
+		info.pCode = copy(info.pCode, info.codeSize / sizeof(uint32_t));
 	return info;
 }
 
@@ -1776,843 +2808,2747 @@ VkPipelineLayoutCreateInfo StateRecorder::copy_pipeline_layout(const VkPipelineL
 	return info;
 }
 
-VkSpecializationInfo *StateRecorder::copy_specialization_info(const VkSpecializationInfo *info)
-{
-	auto *ret = copy(info, 1);
-	ret->pMapEntries = copy(ret->pMapEntries, ret->mapEntryCount);
-	ret->pData = copy(static_cast<const uint8_t *>(ret->pData), ret->dataSize);
-	return ret;
-}
-
-VkComputePipelineCreateInfo StateRecorder::copy_compute_pipeline(const VkComputePipelineCreateInfo &create_info)
-{
-	auto info = create_info;
-	if (info.stage.pSpecializationInfo)
-		info.stage.pSpecializationInfo = copy_specialization_info(info.stage.pSpecializationInfo);
-	if (info.stage.pNext)
-		FOSSILIZE_THROW("pNext in VkPipelineShaderStageCreateInfo not supported.");
-	info.stage.module = remap_shader_module_handle(info.stage.module);
-	info.stage.pName = copy(info.stage.pName, strlen(info.stage.pName) + 1);
-	info.layout = remap_pipeline_layout_handle(info.layout);
-	if (info.basePipelineHandle != VK_NULL_HANDLE)
-		info.basePipelineHandle = remap_compute_pipeline_handle(info.basePipelineHandle);
-	return info;
-}
-
-VkGraphicsPipelineCreateInfo StateRecorder::copy_graphics_pipeline(const VkGraphicsPipelineCreateInfo &create_info)
+// Lays out a create info graph in one contiguous blob.
+// Running without a blob only measures the footprint, running again with a blob of that size copies.
+class CreateInfoPlacer
 {
-	auto info = create_info;
-
-	info.pStages = copy(info.pStages, info.stageCount);
-	if (info.pTessellationState)
-	{
-		if (info.pTessellationState->pNext)
-			FOSSILIZE_THROW("pNext in VkPipelineTessellationStateCreateInfo not supported.");
-		info.pTessellationState = copy(info.pTessellationState, 1);
-	}
-
-	if (info.pColorBlendState)
-	{
-		if (info.pColorBlendState->pNext)
-			FOSSILIZE_THROW("pNext in VkPipelineColorBlendStateCreateInfo not supported.");
-		info.pColorBlendState = copy(info.pColorBlendState, 1);
-	}
-
-	if (info.pVertexInputState)
-	{
-		if (info.pColorBlendState->pNext)
-			FOSSILIZE_THROW("pNext in VkPipelineTessellationStateCreateInfo not supported.");
-		info.pVertexInputState = copy(info.pVertexInputState, 1);
-	}
-
-	if (info.pMultisampleState)
-	{
-		if (info.pMultisampleState->pNext)
-			FOSSILIZE_THROW("pNext in VkPipelineMultisampleStateCreateInfo not supported.");
-		info.pMultisampleState = copy(info.pMultisampleState, 1);
-	}
-
-	if (info.pVertexInputState)
-	{
-		if (info.pVertexInputState->pNext)
-			FOSSILIZE_THROW("pNext in VkPipelineVertexInputStateCreateInfo not supported.");
-		info.pVertexInputState = copy(info.pVertexInputState, 1);
-	}
-
-	if (info.pViewportState)
-	{
-		if (info.pViewportState->pNext)
-			FOSSILIZE_THROW("pNext in VkPipelineViewportStateCreateInfo not supported.");
-		info.pViewportState = copy(info.pViewportState, 1);
-	}
-
-	if (info.pInputAssemblyState)
+public:
+	explicit CreateInfoPlacer(uint8_t *blob = nullptr)
+		: blob(blob)
 	{
-		if (info.pInputAssemblyState->pNext)
-			FOSSILIZE_THROW("pNext in VkPipelineInputAssemblyStateCreateInfo not supported.");
-		info.pInputAssemblyState = copy(info.pInputAssemblyState, 1);
 	}
 
-	if (info.pDepthStencilState)
+	template <typename T>
+	T *copy(const T *src, size_t count)
 	{
-		if (info.pDepthStencilState->pNext)
-			FOSSILIZE_THROW("pNext in VkPipelineDepthStencilStateCreateInfo not supported.");
-		info.pDepthStencilState = copy(info.pDepthStencilState, 1);
-	}
+		if (!src || count == 0)
+			return nullptr;
 
-	if (info.pRasterizationState)
-	{
-		if (info.pRasterizationState->pNext)
-			FOSSILIZE_THROW("pNext in VkPipelineRasterizationCreateInfo not supported.");
-		info.pRasterizationState = copy(info.pRasterizationState, 1);
+		offset = (offset + FOSSILIZE_FOOTPRINT_ALIGNMENT - 1) & ~size_t(FOSSILIZE_FOOTPRINT_ALIGNMENT - 1);
+		T *ret = nullptr;
+		if (blob)
+		{
+			ret = reinterpret_cast<T *>(blob + offset);
+			memcpy(ret, src, count * sizeof(T));
+		}
+		offset += count * sizeof(T);
+		return ret;
 	}
 
-	if (info.pDynamicState)
+	size_t get_size() const
 	{
-		if (info.pDynamicState->pNext)
-			FOSSILIZE_THROW("pNext in VkPipelineDynamicStateCreateInfo not supported.");
-		info.pDynamicState = copy(info.pDynamicState, 1);
+		return offset;
 	}
 
-	info.renderPass = remap_render_pass_handle(info.renderPass);
-	info.layout = remap_pipeline_layout_handle(info.layout);
-	if (info.basePipelineHandle != VK_NULL_HANDLE)
-		info.basePipelineHandle = remap_graphics_pipeline_handle(info.basePipelineHandle);
-
-	for (uint32_t i = 0; i < info.stageCount; i++)
-	{
-		auto &stage = const_cast<VkPipelineShaderStageCreateInfo &>(info.pStages[i]);
-		if (stage.pNext)
-			FOSSILIZE_THROW("pNext in VkPipelineShaderStageCreateInfo not supported.");
-		stage.pName = copy(stage.pName, strlen(stage.pName) + 1);
-		if (stage.pSpecializationInfo)
-			stage.pSpecializationInfo = copy_specialization_info(stage.pSpecializationInfo);
-		stage.module = remap_shader_module_handle(stage.module);
-	}
+private:
+	uint8_t *blob;
+	size_t offset = 0;
+};
 
-	if (info.pColorBlendState)
-	{
-		auto &blend = const_cast<VkPipelineColorBlendStateCreateInfo &>(*info.pColorBlendState);
-		blend.pAttachments = copy(blend.pAttachments, blend.attachmentCount);
-	}
+static VkSpecializationInfo *place_specialization_info(CreateInfoPlacer &placer, const VkSpecializationInfo *src)
+{
+	if (!src)
+		return nullptr;
 
-	if (info.pVertexInputState)
+	auto *info = placer.copy(src, 1);
+	auto *entries = placer.copy(src->pMapEntries, src->mapEntryCount);
+	auto *data = placer.copy(static_cast<const uint8_t *>(src->pData), src->dataSize);
+	if (info)
 	{
-		auto &vs = const_cast<VkPipelineVertexInputStateCreateInfo &>(*info.pVertexInputState);
-		vs.pVertexAttributeDescriptions = copy(vs.pVertexAttributeDescriptions, vs.vertexAttributeDescriptionCount);
-		vs.pVertexBindingDescriptions = copy(vs.pVertexBindingDescriptions, vs.vertexBindingDescriptionCount);
+		info->pMapEntries = entries;
+		info->pData = data;
 	}
+	return info;
+}
 
-	if (info.pMultisampleState)
-	{
-		auto &ms = const_cast<VkPipelineMultisampleStateCreateInfo &>(*info.pMultisampleState);
-		if (ms.pSampleMask)
-			ms.pSampleMask = copy(ms.pSampleMask, (ms.rasterizationSamples + 31) / 32);
-	}
+static void place_shader_stage(CreateInfoPlacer &placer, VkPipelineShaderStageCreateInfo *dst,
+                               const VkPipelineShaderStageCreateInfo &src)
+{
+	if (src.pNext)
+		FOSSILIZE_THROW("pNext in VkPipelineShaderStageCreateInfo not supported.");
 
-	if (info.pDynamicState)
+	auto *name = placer.copy(src.pName, strlen(src.pName) + 1);
+	auto *spec = place_specialization_info(placer, src.pSpecializationInfo);
+	if (dst)
 	{
-		const_cast<VkPipelineDynamicStateCreateInfo *>(info.pDynamicState)->pDynamicStates =
-				copy(info.pDynamicState->pDynamicStates, info.pDynamicState->dynamicStateCount);
+		dst->pName = name;
+		dst->pSpecializationInfo = spec;
 	}
+}
 
+static VkComputePipelineCreateInfo place_compute_pipeline(CreateInfoPlacer &placer, const VkComputePipelineCreateInfo &src)
+{
+	auto info = src;
+	place_shader_stage(placer, &info.stage, src.stage);
 	return info;
 }
 
-VkRenderPassCreateInfo StateRecorder::copy_render_pass(const VkRenderPassCreateInfo &create_info)
+static VkGraphicsPipelineCreateInfo place_graphics_pipeline(CreateInfoPlacer &placer, const VkGraphicsPipelineCreateInfo &src)
 {
-	auto info = create_info;
-	info.pAttachments = copy(info.pAttachments, info.attachmentCount);
-	info.pSubpasses = copy(info.pSubpasses, info.subpassCount);
-	info.pDependencies = copy(info.pDependencies, info.dependencyCount);
-
-	for (uint32_t i = 0; i < info.subpassCount; i++)
-	{
-		auto &sub = const_cast<VkSubpassDescription &>(info.pSubpasses[i]);
-		if (sub.pDepthStencilAttachment)
-			sub.pDepthStencilAttachment = copy(sub.pDepthStencilAttachment, 1);
-		if (sub.pColorAttachments)
-			sub.pColorAttachments = copy(sub.pColorAttachments, sub.colorAttachmentCount);
-		if (sub.pResolveAttachments)
-			sub.pResolveAttachments = copy(sub.pResolveAttachments, sub.colorAttachmentCount);
-		if (sub.pInputAttachments)
-			sub.pInputAttachments = copy(sub.pInputAttachments, sub.inputAttachmentCount);
-		if (sub.pPreserveAttachments)
-			sub.pPreserveAttachments = copy(sub.pPreserveAttachments, sub.preserveAttachmentCount);
-	}
-
+	auto info = src;
+	auto *stages = placer.copy(src.pStages, src.stageCount);
+	for (uint32_t i = 0; i < src.stageCount; i++)
+		place_shader_stage(placer, stages ? &stages[i] : nullptr, src.pStages[i]);
+	info.pStages = stages;
 	return info;
 }
 
-VkSampler StateRecorder::remap_sampler_handle(VkSampler sampler) const
+static VkPipelineTessellationStateCreateInfo *place_state(CreateInfoPlacer &placer, const VkPipelineTessellationStateCreateInfo &src)
 {
-	auto itr = sampler_to_index.find(sampler);
-	if (itr == end(sampler_to_index))
-		FOSSILIZE_THROW("Cannot find sampler in hashmap.");
-	return api_object_cast<VkSampler>(uint64_t(itr->second + 1));
+	if (src.pNext)
+		FOSSILIZE_THROW("pNext in VkPipelineTessellationStateCreateInfo not supported.");
+	return placer.copy(&src, 1);
 }
 
-VkDescriptorSetLayout StateRecorder::remap_descriptor_set_layout_handle(VkDescriptorSetLayout layout) const
+static VkPipelineColorBlendStateCreateInfo *place_state(CreateInfoPlacer &placer, const VkPipelineColorBlendStateCreateInfo &src)
 {
-	auto itr = descriptor_set_layout_to_index.find(layout);
-	if (itr == end(descriptor_set_layout_to_index))
-		FOSSILIZE_THROW("Cannot find descriptor set layout in hashmap.");
-	return api_object_cast<VkDescriptorSetLayout>(uint64_t(itr->second + 1));
+	if (src.pNext)
+		FOSSILIZE_THROW("pNext in VkPipelineColorBlendStateCreateInfo not supported.");
+	auto *state = placer.copy(&src, 1);
+	auto *attachments = placer.copy(src.pAttachments, src.attachmentCount);
+	if (state)
+		state->pAttachments = attachments;
+	return state;
 }
 
-VkPipelineLayout StateRecorder::remap_pipeline_layout_handle(VkPipelineLayout layout) const
+static VkPipelineVertexInputStateCreateInfo *place_state(CreateInfoPlacer &placer, const VkPipelineVertexInputStateCreateInfo &src)
 {
-	auto itr = pipeline_layout_to_index.find(layout);
-	if (itr == end(pipeline_layout_to_index))
-		FOSSILIZE_THROW("Cannot find pipeline layout in hashmap.");
-	return api_object_cast<VkPipelineLayout>(uint64_t(itr->second + 1));
+	if (src.pNext)
+		FOSSILIZE_THROW("pNext in VkPipelineVertexInputStateCreateInfo not supported.");
+	auto *state = placer.copy(&src, 1);
+	auto *attributes = placer.copy(src.pVertexAttributeDescriptions, src.vertexAttributeDescriptionCount);
+	auto *bindings = placer.copy(src.pVertexBindingDescriptions, src.vertexBindingDescriptionCount);
+	if (state)
+	{
+		state->pVertexAttributeDescriptions = attributes;
+		state->pVertexBindingDescriptions = bindings;
+	}
+	return state;
 }
 
-VkShaderModule StateRecorder::remap_shader_module_handle(VkShaderModule module) const
+static VkPipelineMultisampleStateCreateInfo *place_state(CreateInfoPlacer &placer, const VkPipelineMultisampleStateCreateInfo &src)
 {
-	auto itr = shader_module_to_index.find(module);
-	if (itr == end(shader_module_to_index))
-		FOSSILIZE_THROW("Cannot find shader module in hashmap.");
-	return api_object_cast<VkShaderModule>(uint64_t(itr->second + 1));
+	if (src.pNext)
+		FOSSILIZE_THROW("pNext in VkPipelineMultisampleStateCreateInfo not supported.");
+	auto *state = placer.copy(&src, 1);
+	auto *mask = placer.copy(src.pSampleMask, (src.rasterizationSamples + 31) / 32);
+	if (state)
+		state->pSampleMask = mask;
+	return state;
 }
 
-VkRenderPass StateRecorder::remap_render_pass_handle(VkRenderPass render_pass) const
+static VkPipelineDynamicStateCreateInfo *place_state(CreateInfoPlacer &placer, const VkPipelineDynamicStateCreateInfo &src)
 {
-	auto itr = render_pass_to_index.find(render_pass);
-	if (itr == end(render_pass_to_index))
-		FOSSILIZE_THROW("Cannot find render pass in hashmap.");
-	return api_object_cast<VkRenderPass>(uint64_t(itr->second + 1));
+	if (src.pNext)
+		FOSSILIZE_THROW("pNext in VkPipelineDynamicStateCreateInfo not supported.");
+	auto *state = placer.copy(&src, 1);
+	auto *states = placer.copy(src.pDynamicStates, src.dynamicStateCount);
+	if (state)
+		state->pDynamicStates = states;
+	return state;
 }
 
-VkPipeline StateRecorder::remap_graphics_pipeline_handle(VkPipeline pipeline) const
+// Viewports and scissors are ignored when they are dynamic, and the pointers may be garbage.
+static VkPipelineViewportStateCreateInfo *place_state(CreateInfoPlacer &placer, const VkPipelineViewportStateCreateInfo &src,
+                                                      bool dynamic_viewport, bool dynamic_scissor)
 {
-	auto itr = graphics_pipeline_to_index.find(pipeline);
-	if (itr == end(graphics_pipeline_to_index))
-		FOSSILIZE_THROW("Cannot find graphics pipeline in hashmap.");
-	return api_object_cast<VkPipeline>(uint64_t(itr->second + 1));
+	if (src.pNext)
+		FOSSILIZE_THROW("pNext in VkPipelineViewportStateCreateInfo not supported.");
+	auto *state = placer.copy(&src, 1);
+	auto *viewports = dynamic_viewport ? nullptr : placer.copy(src.pViewports, src.viewportCount);
+	auto *scissors = dynamic_scissor ? nullptr : placer.copy(src.pScissors, src.scissorCount);
+	if (state)
+	{
+		state->pViewports = viewports;
+		state->pScissors = scissors;
+	}
+	return state;
 }
 
-VkPipeline StateRecorder::remap_compute_pipeline_handle(VkPipeline pipeline) const
+static VkPipelineInputAssemblyStateCreateInfo *place_state(CreateInfoPlacer &placer, const VkPipelineInputAssemblyStateCreateInfo &src)
 {
-	auto itr = compute_pipeline_to_index.find(pipeline);
-	if (itr == end(compute_pipeline_to_index))
-		FOSSILIZE_THROW("Cannot find compute pipeline in hashmap.");
-	return api_object_cast<VkPipeline>(uint64_t(itr->second + 1));
+	if (src.pNext)
+		FOSSILIZE_THROW("pNext in VkPipelineInputAssemblyStateCreateInfo not supported.");
+	return placer.copy(&src, 1);
 }
 
-static char base64(uint32_t v)
+static VkPipelineDepthStencilStateCreateInfo *place_state(CreateInfoPlacer &placer, const VkPipelineDepthStencilStateCreateInfo &src)
 {
-	if (v == 63)
-		return '/';
-	else if (v == 62)
-		return '+';
-	else if (v >= 52)
-		return char('0' + (v - 52));
-	else if (v >= 26)
-		return char('a' + (v - 26));
-	else
-		return char('A' + v);
+	if (src.pNext)
+		FOSSILIZE_THROW("pNext in VkPipelineDepthStencilStateCreateInfo not supported.");
+	return placer.copy(&src, 1);
 }
 
-static std::string encode_base64(const void *data_, size_t size)
+static VkPipelineRasterizationStateCreateInfo *place_state(CreateInfoPlacer &placer, const VkPipelineRasterizationStateCreateInfo &src)
 {
-	auto *data = static_cast<const uint8_t *>(data_);
-	size_t num_chars = 4 * ((size + 2) / 3);
-	std::string ret;
-	ret.reserve(num_chars);
+	if (src.pNext)
+		FOSSILIZE_THROW("pNext in VkPipelineRasterizationCreateInfo not supported.");
+	return placer.copy(&src, 1);
+}
+
+// Flattens a pipeline sub-state into words, so interned states can be hashed and compared bit-exactly.
+struct StateKey
+{
+	vector<uint32_t> words;
 
-	for (size_t i = 0; i < size; i += 3)
+	void u32(uint32_t value)
 	{
-		uint32_t code = data[i] << 16;
-		if (i + 1 < size)
-			code |= data[i + 1] << 8;
-		if (i + 2 < size)
-			code |= data[i + 2] << 0;
+		words.push_back(value);
+	}
 
-		auto c0 = base64((code >> 18) & 63);
-		auto c1 = base64((code >> 12) & 63);
-		auto c2 = base64((code >>  6) & 63);
-		auto c3 = base64((code >>  0) & 63);
+	void s32(int32_t value)
+	{
+		words.push_back(uint32_t(value));
+	}
+
+	void f32(float value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		words.push_back(bits);
+	}
+
+	Hash get_hash() const
+	{
+		Hasher h;
+		for (auto word : words)
+			h.u32(word);
+		return h.get();
+	}
+};
+
+static void build_state_key(StateKey &key, const VkPipelineTessellationStateCreateInfo &state)
+{
+	key.u32(state.flags);
+	key.u32(state.patchControlPoints);
+}
+
+static void build_state_key(StateKey &key, const VkPipelineColorBlendStateCreateInfo &state)
+{
+	key.u32(state.flags);
+	key.u32(state.logicOpEnable);
+	key.u32(state.logicOp);
+	for (auto &c : state.blendConstants)
+		key.f32(c);
+	key.u32(state.attachmentCount);
+	for (uint32_t i = 0; i < state.attachmentCount; i++)
+	{
+		auto &a = state.pAttachments[i];
+		key.u32(a.blendEnable);
+		key.u32(a.srcColorBlendFactor);
+		key.u32(a.dstColorBlendFactor);
+		key.u32(a.colorBlendOp);
+		key.u32(a.srcAlphaBlendFactor);
+		key.u32(a.dstAlphaBlendFactor);
+		key.u32(a.alphaBlendOp);
+		key.u32(a.colorWriteMask);
+	}
+}
+
+static void build_state_key(StateKey &key, const VkPipelineVertexInputStateCreateInfo &state)
+{
+	key.u32(state.flags);
+	key.u32(state.vertexAttributeDescriptionCount);
+	for (uint32_t i = 0; i < state.vertexAttributeDescriptionCount; i++)
+	{
+		auto &a = state.pVertexAttributeDescriptions[i];
+		key.u32(a.location);
+		key.u32(a.binding);
+		key.u32(a.format);
+		key.u32(a.offset);
+	}
+
+	key.u32(state.vertexBindingDescriptionCount);
+	for (uint32_t i = 0; i < state.vertexBindingDescriptionCount; i++)
+	{
+		auto &b = state.pVertexBindingDescriptions[i];
+		key.u32(b.binding);
+		key.u32(b.stride);
+		key.u32(b.inputRate);
+	}
+}
+
+static void build_state_key(StateKey &key, const VkPipelineMultisampleStateCreateInfo &state)
+{
+	key.u32(state.flags);
+	key.u32(state.rasterizationSamples);
+	key.u32(state.sampleShadingEnable);
+	key.f32(state.minSampleShading);
+	key.u32(state.alphaToCoverageEnable);
+	key.u32(state.alphaToOneEnable);
+	if (state.pSampleMask)
+	{
+		uint32_t entries = (state.rasterizationSamples + 31) / 32;
+		key.u32(entries);
+		for (uint32_t i = 0; i < entries; i++)
+			key.u32(state.pSampleMask[i]);
+	}
+	else
+		key.u32(0);
+}
+
+static void build_state_key(StateKey &key, const VkPipelineDynamicStateCreateInfo &state)
+{
+	key.u32(state.flags);
+	key.u32(state.dynamicStateCount);
+	for (uint32_t i = 0; i < state.dynamicStateCount; i++)
+		key.u32(state.pDynamicStates[i]);
+}
+
+static void build_state_key(StateKey &key, const VkPipelineViewportStateCreateInfo &state)
+{
+	key.u32(state.flags);
+	key.u32(state.viewportCount);
+	key.u32(state.scissorCount);
+
+	key.u32(state.pViewports != nullptr);
+	if (state.pViewports)
+	{
+		for (uint32_t i = 0; i < state.viewportCount; i++)
+		{
+			auto &vp = state.pViewports[i];
+			key.f32(vp.x);
+			key.f32(vp.y);
+			key.f32(vp.width);
+			key.f32(vp.height);
+			key.f32(vp.minDepth);
+			key.f32(vp.maxDepth);
+		}
+	}
+
+	key.u32(state.pScissors != nullptr);
+	if (state.pScissors)
+	{
+		for (uint32_t i = 0; i < state.scissorCount; i++)
+		{
+			auto &sci = state.pScissors[i];
+			key.s32(sci.offset.x);
+			key.s32(sci.offset.y);
+			key.u32(sci.extent.width);
+			key.u32(sci.extent.height);
+		}
+	}
+}
+
+static void build_state_key(StateKey &key, const VkPipelineInputAssemblyStateCreateInfo &state)
+{
+	key.u32(state.flags);
+	key.u32(state.topology);
+	key.u32(state.primitiveRestartEnable);
+}
+
+static void build_state_key(StateKey &key, const VkStencilOpState &state)
+{
+	key.u32(state.failOp);
+	key.u32(state.passOp);
+	key.u32(state.depthFailOp);
+	key.u32(state.compareOp);
+	key.u32(state.compareMask);
+	key.u32(state.writeMask);
+	key.u32(state.reference);
+}
+
+static void build_state_key(StateKey &key, const VkPipelineDepthStencilStateCreateInfo &state)
+{
+	key.u32(state.flags);
+	key.u32(state.depthTestEnable);
+	key.u32(state.depthWriteEnable);
+	key.u32(state.depthCompareOp);
+	key.u32(state.depthBoundsTestEnable);
+	key.u32(state.stencilTestEnable);
+	build_state_key(key, state.front);
+	build_state_key(key, state.back);
+	key.f32(state.minDepthBounds);
+	key.f32(state.maxDepthBounds);
+}
+
+static void build_state_key(StateKey &key, const VkPipelineRasterizationStateCreateInfo &state)
+{
+	key.u32(state.flags);
+	key.u32(state.depthClampEnable);
+	key.u32(state.rasterizerDiscardEnable);
+	key.u32(state.polygonMode);
+	key.u32(state.cullMode);
+	key.u32(state.frontFace);
+	key.u32(state.depthBiasEnable);
+	key.f32(state.depthBiasConstantFactor);
+	key.f32(state.depthBiasClamp);
+	key.f32(state.depthBiasSlopeFactor);
+	key.f32(state.lineWidth);
+}
+
+template <typename T>
+static bool state_equal(const T &a, const StateKey &b)
+{
+	StateKey key;
+	build_state_key(key, a);
+	return key.words == b.words;
+}
+
+// Copies a sub-state into the arena, unless an identical one has been interned already.
+template <typename T, typename... Args>
+const T *StateRecorder::intern_state(StateInternTable<T> &table, const T *src, Args... args)
+{
+	if (!src)
+		return nullptr;
+
+	CreateInfoPlacer measure;
+	place_state(measure, *src, args...);
+
+	auto &scratch = allocator.get_thread_allocator();
+	auto marker = scratch.get_marker();
+	CreateInfoPlacer placer(static_cast<uint8_t *>(scratch.allocate_raw(measure.get_size(), FOSSILIZE_FOOTPRINT_ALIGNMENT)));
+	const T *state = place_state(placer, *src, args...);
+
+	StateKey key;
+	build_state_key(key, *state);
+	auto &candidates = table[key.get_hash()];
+	for (auto *candidate : candidates)
+	{
+		if (state_equal(*candidate, key))
+		{
+			scratch.rewind(marker);
+			return candidate;
+		}
+	}
+
+	candidates.push_back(state);
+	return state;
+}
+
+size_t StateRecorder::compute_compute_pipeline_footprint(const VkComputePipelineCreateInfo &create_info)
+{
+	CreateInfoPlacer placer;
+	place_compute_pipeline(placer, create_info);
+	return placer.get_size();
+}
+
+size_t StateRecorder::compute_graphics_pipeline_footprint(const VkGraphicsPipelineCreateInfo &create_info)
+{
+	CreateInfoPlacer placer;
+	place_graphics_pipeline(placer, create_info);
+	return placer.get_size();
+}
+
+VkComputePipelineCreateInfo StateRecorder::copy_compute_pipeline(const VkComputePipelineCreateInfo &create_info)
+{
+	size_t size = compute_compute_pipeline_footprint(create_info);
+	CreateInfoPlacer placer(static_cast<uint8_t *>(allocator.allocate_raw(size, FOSSILIZE_FOOTPRINT_BLOB_ALIGNMENT)));
+	auto info = place_compute_pipeline(placer, create_info);
+
+	info.stage.module = remap_shader_module_handle(info.stage.module);
+	info.layout = remap_pipeline_layout_handle(info.layout);
+	if (info.basePipelineHandle != VK_NULL_HANDLE)
+		info.basePipelineHandle = remap_compute_pipeline_handle(info.basePipelineHandle);
+	return info;
+}
+
+VkGraphicsPipelineCreateInfo StateRecorder::copy_graphics_pipeline(const VkGraphicsPipelineCreateInfo &create_info)
+{
+	size_t size = compute_graphics_pipeline_footprint(create_info);
+	CreateInfoPlacer placer(static_cast<uint8_t *>(allocator.allocate_raw(size, FOSSILIZE_FOOTPRINT_BLOB_ALIGNMENT)));
+	auto info = place_graphics_pipeline(placer, create_info);
+
+	for (uint32_t i = 0; i < info.stageCount; i++)
+	{
+		auto &stage = const_cast<VkPipelineShaderStageCreateInfo &>(info.pStages[i]);
+		stage.module = remap_shader_module_handle(stage.module);
+	}
+
+	bool dynamic_viewport = false;
+	bool dynamic_scissor = false;
+	if (info.pDynamicState)
+	{
+		for (uint32_t i = 0; i < info.pDynamicState->dynamicStateCount; i++)
+		{
+			if (info.pDynamicState->pDynamicStates[i] == VK_DYNAMIC_STATE_VIEWPORT)
+				dynamic_viewport = true;
+			else if (info.pDynamicState->pDynamicStates[i] == VK_DYNAMIC_STATE_SCISSOR)
+				dynamic_scissor = true;
+		}
+	}
+
+	info.pTessellationState = intern_state(tessellation_states, info.pTessellationState);
+	info.pColorBlendState = intern_state(color_blend_states, info.pColorBlendState);
+	info.pVertexInputState = intern_state(vertex_input_states, info.pVertexInputState);
+	info.pMultisampleState = intern_state(multisample_states, info.pMultisampleState);
+	info.pDynamicState = intern_state(dynamic_states, info.pDynamicState);
+	info.pViewportState = intern_state(viewport_states, info.pViewportState, dynamic_viewport, dynamic_scissor);
+	info.pInputAssemblyState = intern_state(input_assembly_states, info.pInputAssemblyState);
+	info.pDepthStencilState = intern_state(depth_stencil_states, info.pDepthStencilState);
+	info.pRasterizationState = intern_state(rasterization_states, info.pRasterizationState);
+
+	info.renderPass = remap_render_pass_handle(info.renderPass);
+	info.layout = remap_pipeline_layout_handle(info.layout);
+	if (info.basePipelineHandle != VK_NULL_HANDLE)
+		info.basePipelineHandle = remap_graphics_pipeline_handle(info.basePipelineHandle);
+	return info;
+}
+
+VkRenderPassCreateInfo StateRecorder::copy_render_pass(const VkRenderPassCreateInfo &create_info)
+{
+	auto info = create_info;
+	info.pAttachments = copy(info.pAttachments, info.attachmentCount);
+	info.pSubpasses = copy(info.pSubpasses, info.subpassCount);
+	info.pDependencies = copy(info.pDependencies, info.dependencyCount);
+
+	for (uint32_t i = 0; i < info.subpassCount; i++)
+	{
+		auto &sub = const_cast<VkSubpassDescription &>(info.pSubpasses[i]);
+		if (sub.pDepthStencilAttachment)
+			sub.pDepthStencilAttachment = copy(sub.pDepthStencilAttachment, 1);
+		if (sub.pColorAttachments)
+			sub.pColorAttachments = copy(sub.pColorAttachments, sub.colorAttachmentCount);
+		if (sub.pResolveAttachments)
+			sub.pResolveAttachments = copy(sub.pResolveAttachments, sub.colorAttachmentCount);
+		if (sub.pInputAttachments)
+			sub.pInputAttachments = copy(sub.pInputAttachments, sub.inputAttachmentCount);
+		if (sub.pPreserveAttachments)
+			sub.pPreserveAttachments = copy(sub.pPreserveAttachments, sub.preserveAttachmentCount);
+	}
+
+	return info;
+}
+
+VkSampler StateRecorder::remap_sampler_handle(VkSampler sampler) const
+{
+	auto *index = sampler_to_index.find(sampler);
+	if (!index)
+		FOSSILIZE_THROW("Cannot find sampler in hashmap.");
+	return api_object_cast<VkSampler>(uint64_t(*index + 1));
+}
+
+VkDescriptorSetLayout StateRecorder::remap_descriptor_set_layout_handle(VkDescriptorSetLayout layout) const
+{
+	auto *index = descriptor_set_layout_to_index.find(layout);
+	if (!index)
+		FOSSILIZE_THROW("Cannot find descriptor set layout in hashmap.");
+	return api_object_cast<VkDescriptorSetLayout>(uint64_t(*index + 1));
+}
+
+VkPipelineLayout StateRecorder::remap_pipeline_layout_handle(VkPipelineLayout layout) const
+{
+	auto *index = pipeline_layout_to_index.find(layout);
+	if (!index)
+		FOSSILIZE_THROW("Cannot find pipeline layout in hashmap.");
+	return api_object_cast<VkPipelineLayout>(uint64_t(*index + 1));
+}
+
+VkShaderModule StateRecorder::remap_shader_module_handle(VkShaderModule module) const
+{
+	auto *index = shader_module_to_index.find(module);
+	if (!index)
+		FOSSILIZE_THROW("Cannot find shader module in hashmap.");
+	return api_object_cast<VkShaderModule>(uint64_t(*index + 1));
+}
+
+VkRenderPass StateRecorder::remap_render_pass_handle(VkRenderPass render_pass) const
+{
+	auto *index = render_pass_to_index.find(render_pass);
+	if (!index)
+		FOSSILIZE_THROW("Cannot find render pass in hashmap.");
+	return api_object_cast<VkRenderPass>(uint64_t(*index + 1));
+}
+
+VkPipeline StateRecorder::remap_graphics_pipeline_handle(VkPipeline pipeline) const
+{
+	auto *index = graphics_pipeline_to_index.find(pipeline);
+	if (!index)
+		FOSSILIZE_THROW("Cannot find graphics pipeline in hashmap.");
+	return api_object_cast<VkPipeline>(uint64_t(*index + 1));
+}
+
+VkPipeline StateRecorder::remap_compute_pipeline_handle(VkPipeline pipeline) const
+{
+	auto *index = compute_pipeline_to_index.find(pipeline);
+	if (!index)
+		FOSSILIZE_THROW("Cannot find compute pipeline in hashmap.");
+	return api_object_cast<VkPipeline>(uint64_t(*index + 1));
+}
+
+void StateRecorder::set_spirv_encoding(SpirvEncoding encoding)
+{
+	spirv_encoding = encoding;
+}
+
+void StateRecorder::set_compression(bool enable)
+{
+	compression = enable;
+}
+
+void StateRecorder::set_num_threads(unsigned count)
+{
+	num_threads = count;
+}
+
+void StateRecorder::set_compact_json(bool enable)
+{
+	compact_json = enable;
+}
+
+void StateRecorder::set_canonical_order(bool enable)
+{
+	canonical_order = enable;
+}
+
+void StateRecorder::set_prune_unreferenced(bool enable)
+{
+	prune_unreferenced = enable;
+}
+
+void StateRecorder::set_strip_debug_info(bool enable)
+{
+	strip_debug_info = enable;
+}
+
+bool StateRecorder::get_strip_debug_info() const
+{
+	return strip_debug_info;
+}
+
+void StateRecorder::set_write_index(bool enable)
+{
+	write_index = enable;
+}
+
+void StateRecorder::set_spirv_store(SpirvStore *store)
+{
+	spirv_store = store;
+}
+
+// Runs serialization work in batches on a thread pool, or inline when serializing on one thread.
+// Every batch writes to its own output slots, so results do not depend on scheduling.
+class SerializationJobs
+{
+public:
+	explicit SerializationJobs(unsigned num_threads)
+	{
+		if (num_threads != 1)
+			pool.reset(new ThreadPool(num_threads));
+	}
+
+	template <typename Func>
+	void run(size_t count, size_t batch_size, const Func &func)
+	{
+		if (!pool)
+		{
+			func(0, count);
+			return;
+		}
+
+		for (size_t begin = 0; begin < count; begin += batch_size)
+		{
+			size_t end = std::min(count, begin + batch_size);
+			pool->enqueue([this, func, begin, end]() {
+				try
+				{
+					func(begin, end);
+				}
+				catch (...)
+				{
+					failed = true;
+				}
+			});
+		}
+	}
+
+	void wait()
+	{
+		if (pool)
+			pool->wait_idle();
+		if (failed)
+			FOSSILIZE_THROW("Failed to serialize state.");
+	}
+
+private:
+	unique_ptr<ThreadPool> pool;
+	std::atomic<bool> failed{ false };
+};
+
+template <typename T>
+static void append_value(vector<uint8_t> &buffer, T value)
+{
+	size_t offset = buffer.size();
+	buffer.resize(offset + sizeof(T));
+	memcpy(buffer.data() + offset, &value, sizeof(T));
+}
+
+static void append_chunk(vector<uint8_t> &buffer, const char *magic, const uint8_t *data, size_t size)
+{
+	buffer.insert(buffer.end(), magic, magic + sizeof(uint64_t));
+	append_value<uint64_t>(buffer, size);
+	buffer.insert(buffer.end(), data, data + size);
+}
+
+// Blocks which do not compress are stored as-is, which is signalled by an empty encoded block.
+static void encode_block(vector<uint8_t> &encoded, const uint8_t *block, size_t block_size)
+{
+	encoded.resize(compute_max_size_lz(block_size));
+	size_t encoded_size = encode_lz(encoded.data(), block, block_size);
+	encoded.resize(encoded_size < block_size ? encoded_size : 0);
+}
+
+// Wraps a chunk in a block LZ chunk, see prepare_block_lz_chunk().
+static void append_compressed_chunk(vector<uint8_t> &buffer, const char *magic, const uint8_t *data, size_t size,
+                                    SerializationJobs &jobs)
+{
+	size_t block_count = (size + FOSSILIZE_LZ_BLOCK_SIZE - 1) / FOSSILIZE_LZ_BLOCK_SIZE;
+
+	buffer.insert(buffer.end(), FOSSILIZE_BLOCK_LZ_MAGIC, FOSSILIZE_BLOCK_LZ_MAGIC + sizeof(uint64_t));
+	size_t chunk_size_offset = buffer.size();
+	append_value<uint64_t>(buffer, 0);
+	size_t chunk_offset = buffer.size();
+
+	buffer.insert(buffer.end(), magic, magic + sizeof(uint64_t));
+	append_value<uint64_t>(buffer, size);
+	append_value<uint32_t>(buffer, FOSSILIZE_LZ_BLOCK_SIZE);
+	append_value<uint32_t>(buffer, uint32_t(block_count));
+	size_t index_offset = buffer.size();
+	buffer.resize(index_offset + block_count * sizeof(uint32_t));
+
+	vector<vector<uint8_t>> encoded(block_count);
+	jobs.run(block_count, 1, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+		{
+			const uint8_t *block = data + i * FOSSILIZE_LZ_BLOCK_SIZE;
+			size_t block_size = std::min<size_t>(FOSSILIZE_LZ_BLOCK_SIZE, size - i * FOSSILIZE_LZ_BLOCK_SIZE);
+			encode_block(encoded[i], block, block_size);
+		}
+	});
+	jobs.wait();
+
+	for (size_t i = 0; i < block_count; i++)
+	{
+		const uint8_t *block = data + i * FOSSILIZE_LZ_BLOCK_SIZE;
+		size_t block_size = std::min<size_t>(FOSSILIZE_LZ_BLOCK_SIZE, size - i * FOSSILIZE_LZ_BLOCK_SIZE);
+
+		uint32_t entry;
+		if (!encoded[i].empty())
+		{
+			entry = uint32_t(encoded[i].size());
+			buffer.insert(buffer.end(), encoded[i].begin(), encoded[i].end());
+		}
+		else
+		{
+			entry = uint32_t(block_size) | FOSSILIZE_LZ_BLOCK_STORED_BIT;
+			buffer.insert(buffer.end(), block, block + block_size);
+		}
+		memcpy(buffer.data() + index_offset + i * sizeof(uint32_t), &entry, sizeof(uint32_t));
+	}
+
+	uint64_t chunk_size = buffer.size() - chunk_offset;
+	memcpy(buffer.data() + chunk_size_offset, &chunk_size, sizeof(uint64_t));
+}
+
+// Writes an archive front to back. Sizes which are only known once a chunk is complete are patched in place.
+// The archive is written to a temporary file next to the destination, which only replaces the destination
+// once it is closed successfully. A failed write removes the temporary file and leaves an existing archive alone.
+class ArchiveFileWriter
+{
+public:
+	explicit ArchiveFileWriter(const char *path)
+		: path(path)
+	{
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".%u.tmp", get_process_id());
+		temp_path = this->path + suffix;
+
+		file = fopen(temp_path.c_str(), "wb");
+		if (!file)
+			FOSSILIZE_THROW("Failed to open archive for writing.");
+	}
+
+	~ArchiveFileWriter()
+	{
+		if (file)
+		{
+			fclose(file);
+			remove(temp_path.c_str());
+		}
+	}
+
+	void write(const void *data, size_t size)
+	{
+		if (size && fwrite(data, 1, size, file) != size)
+			FOSSILIZE_THROW("Failed to write archive.");
+		offset += size;
+	}
+
+	template <typename T>
+	void write_value(T value)
+	{
+		write(&value, sizeof(T));
+	}
+
+	void patch(uint64_t patch_offset, const void *data, size_t size)
+	{
+		if (!seek(patch_offset) || fwrite(data, 1, size, file) != size || !seek(offset))
+			FOSSILIZE_THROW("Failed to write archive.");
+	}
+
+	uint64_t get_offset() const
+	{
+		return offset;
+	}
+
+	void close()
+	{
+		FILE *closing = file;
+		file = nullptr;
+		bool success = fclose(closing) == 0;
+#ifdef _WIN32
+		// rename() does not replace existing files on Windows.
+		if (success)
+			remove(path.c_str());
+#endif
+		if (!success || rename(temp_path.c_str(), path.c_str()) != 0)
+		{
+			remove(temp_path.c_str());
+			FOSSILIZE_THROW("Failed to write archive.");
+		}
+	}
+
+private:
+	FILE *file = nullptr;
+	string path;
+	string temp_path;
+	uint64_t offset = 0;
+
+	static unsigned get_process_id()
+	{
+#ifdef _WIN32
+		return unsigned(_getpid());
+#else
+		return unsigned(getpid());
+#endif
+	}
+
+	bool seek(uint64_t target)
+	{
+#ifdef _WIN32
+		return _fseeki64(file, int64_t(target), SEEK_SET) == 0;
+#else
+		return fseeko(file, off_t(target), SEEK_SET) == 0;
+#endif
+	}
+};
+
+// Streams the payload of one chunk to an archive, and doubles as a rapidjson output stream.
+// A compressed chunk needs its size up front, as the block index precedes the blocks.
+// Blocks are compressed in batches of FOSSILIZE_STREAM_BUFFER_SIZE, so memory use does not depend on the chunk size.
+class ChunkWriter
+{
+public:
+	typedef char Ch;
+
+	ChunkWriter(ArchiveFileWriter &file, SerializationJobs &jobs, const char *magic, bool compress, uint64_t size)
+		: file(file), jobs(jobs), compress(compress), size(size)
+	{
+		if (compress)
+		{
+			file.write(FOSSILIZE_BLOCK_LZ_MAGIC, sizeof(uint64_t));
+			chunk_size_offset = file.get_offset();
+			file.write_value<uint64_t>(0);
+			chunk_offset = file.get_offset();
+
+			size_t block_count = size_t((size + FOSSILIZE_LZ_BLOCK_SIZE - 1) / FOSSILIZE_LZ_BLOCK_SIZE);
+			file.write(magic, sizeof(uint64_t));
+			file.write_value<uint64_t>(size);
+			file.write_value<uint32_t>(FOSSILIZE_LZ_BLOCK_SIZE);
+			file.write_value<uint32_t>(uint32_t(block_count));
+			index_offset = file.get_offset();
+			block_entries.resize(block_count);
+			file.write(block_entries.data(), block_count * sizeof(uint32_t));
+			block_entries.clear();
+		}
+		else
+		{
+			file.write(magic, sizeof(uint64_t));
+			chunk_size_offset = file.get_offset();
+			file.write_value<uint64_t>(0);
+			chunk_offset = file.get_offset();
+		}
+
+		pending.reserve(FOSSILIZE_STREAM_BUFFER_SIZE);
+	}
+
+	void Put(char c)
+	{
+		pending.push_back(uint8_t(c));
+		if (pending.size() == FOSSILIZE_STREAM_BUFFER_SIZE)
+			flush_pending();
+	}
+
+	void Flush()
+	{
+	}
+
+	size_t GetSize() const
+	{
+		return size_t(written + pending.size());
+	}
+
+	void write(const uint8_t *data, size_t data_size)
+	{
+		while (data_size)
+		{
+			size_t to_copy = std::min<size_t>(data_size, FOSSILIZE_STREAM_BUFFER_SIZE - pending.size());
+			pending.insert(pending.end(), data, data + to_copy);
+			data += to_copy;
+			data_size -= to_copy;
+			if (pending.size() == FOSSILIZE_STREAM_BUFFER_SIZE)
+				flush_pending();
+		}
+	}
+
+	void finish()
+	{
+		flush_pending();
+
+		if (compress)
+		{
+			if (written != size)
+				FOSSILIZE_THROW("Chunk size does not match the size it was created with.");
+			file.patch(index_offset, block_entries.data(), block_entries.size() * sizeof(uint32_t));
+		}
+
+		uint64_t chunk_size = file.get_offset() - chunk_offset;
+		file.patch(chunk_size_offset, &chunk_size, sizeof(uint64_t));
+	}
+
+private:
+	ArchiveFileWriter &file;
+	SerializationJobs &jobs;
+	bool compress;
+	uint64_t size;
+	uint64_t written = 0;
+	uint64_t chunk_size_offset = 0;
+	uint64_t chunk_offset = 0;
+	uint64_t index_offset = 0;
+	vector<uint32_t> block_entries;
+	vector<uint8_t> pending;
+	vector<vector<uint8_t>> encoded;
+
+	void flush_pending()
+	{
+		if (!compress)
+		{
+			file.write(pending.data(), pending.size());
+			written += pending.size();
+			pending.clear();
+			return;
+		}
+
+		if (written + pending.size() > size)
+			FOSSILIZE_THROW("Chunk size does not match the size it was created with.");
+
+		// Only the last batch can end in a partial block, as batches are a multiple of the block size.
+		size_t pending_size = pending.size();
+		size_t block_count = (pending_size + FOSSILIZE_LZ_BLOCK_SIZE - 1) / FOSSILIZE_LZ_BLOCK_SIZE;
+		encoded.resize(block_count);
+		jobs.run(block_count, 1, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++)
+			{
+				size_t block_size = std::min<size_t>(FOSSILIZE_LZ_BLOCK_SIZE, pending_size - i * FOSSILIZE_LZ_BLOCK_SIZE);
+				encode_block(encoded[i], pending.data() + i * FOSSILIZE_LZ_BLOCK_SIZE, block_size);
+			}
+		});
+		jobs.wait();
+
+		for (size_t i = 0; i < block_count; i++)
+		{
+			const uint8_t *block = pending.data() + i * FOSSILIZE_LZ_BLOCK_SIZE;
+			size_t block_size = std::min<size_t>(FOSSILIZE_LZ_BLOCK_SIZE, pending_size - i * FOSSILIZE_LZ_BLOCK_SIZE);
+			if (!encoded[i].empty())
+			{
+				block_entries.push_back(uint32_t(encoded[i].size()));
+				file.write(encoded[i].data(), encoded[i].size());
+			}
+			else
+			{
+				block_entries.push_back(uint32_t(block_size) | FOSSILIZE_LZ_BLOCK_STORED_BIT);
+				file.write(block, block_size);
+			}
+		}
+
+		written += pending_size;
+		pending.clear();
+	}
+};
+
+// Measures the JSON chunk, so a compressed chunk can be streamed.
+class CountingStream
+{
+public:
+	typedef char Ch;
+
+	void Put(char)
+	{
+		size++;
+	}
+
+	void Flush()
+	{
+	}
+
+	size_t GetSize() const
+	{
+		return size;
+	}
+
+private:
+	size_t size = 0;
+};
+
+static Value serialize_tessellation_state(const VkPipelineTessellationStateCreateInfo &state, Document::AllocatorType &alloc)
+{
+	Value tess(kObjectType);
+	tess.AddMember("flags", state.flags, alloc);
+	tess.AddMember("patchControlPoints", state.patchControlPoints, alloc);
+	return tess;
+}
+
+static Value serialize_dynamic_state(const VkPipelineDynamicStateCreateInfo &state, Document::AllocatorType &alloc)
+{
+	Value dyn(kObjectType);
+	dyn.AddMember("flags", state.flags, alloc);
+	Value dynamics(kArrayType);
+	for (uint32_t i = 0; i < state.dynamicStateCount; i++)
+		dynamics.PushBack(state.pDynamicStates[i], alloc);
+	dyn.AddMember("dynamicState", dynamics, alloc);
+	return dyn;
+}
+
+static Value serialize_multisample_state(const VkPipelineMultisampleStateCreateInfo &state, Document::AllocatorType &alloc)
+{
+	Value ms(kObjectType);
+	ms.AddMember("flags", state.flags, alloc);
+	ms.AddMember("rasterizationSamples", state.rasterizationSamples, alloc);
+	ms.AddMember("sampleShadingEnable", state.sampleShadingEnable, alloc);
+	ms.AddMember("minSampleShading", state.minSampleShading, alloc);
+	ms.AddMember("alphaToOneEnable", state.alphaToOneEnable, alloc);
+	ms.AddMember("alphaToCoverageEnable", state.alphaToCoverageEnable, alloc);
+
+	Value sm(kArrayType);
+	if (state.pSampleMask)
+	{
+		auto entries = uint32_t(state.rasterizationSamples + 31) / 32;
+		for (uint32_t i = 0; i < entries; i++)
+			sm.PushBack(state.pSampleMask[i], alloc);
+		ms.AddMember("sampleMask", sm, alloc);
+	}
+
+	return ms;
+}
+
+static Value serialize_vertex_input_state(const VkPipelineVertexInputStateCreateInfo &state, Document::AllocatorType &alloc)
+{
+	Value vi(kObjectType);
+
+	Value attribs(kArrayType);
+	Value bindings(kArrayType);
+	vi.AddMember("flags", state.flags, alloc);
+
+	for (uint32_t i = 0; i < state.vertexAttributeDescriptionCount; i++)
+	{
+		auto &a = state.pVertexAttributeDescriptions[i];
+		Value attrib(kObjectType);
+		attrib.AddMember("location", a.location, alloc);
+		attrib.AddMember("binding", a.binding, alloc);
+		attrib.AddMember("offset", a.offset, alloc);
+		attrib.AddMember("format", a.format, alloc);
+		attribs.PushBack(attrib, alloc);
+	}
+
+	for (uint32_t i = 0; i < state.vertexBindingDescriptionCount; i++)
+	{
+		auto &b = state.pVertexBindingDescriptions[i];
+		Value binding(kObjectType);
+		binding.AddMember("binding", b.binding, alloc);
+		binding.AddMember("stride", b.stride, alloc);
+		binding.AddMember("inputRate", b.inputRate, alloc);
+		bindings.PushBack(binding, alloc);
+	}
+	vi.AddMember("attributes", attribs, alloc);
+	vi.AddMember("bindings", bindings, alloc);
+
+	return vi;
+}
+
+static Value serialize_rasterization_state(const VkPipelineRasterizationStateCreateInfo &state, Document::AllocatorType &alloc)
+{
+	Value rs(kObjectType);
+	rs.AddMember("flags", state.flags, alloc);
+	rs.AddMember("depthBiasConstantFactor", state.depthBiasConstantFactor, alloc);
+	rs.AddMember("depthBiasSlopeFactor", state.depthBiasSlopeFactor, alloc);
+	rs.AddMember("depthBiasClamp", state.depthBiasClamp, alloc);
+	rs.AddMember("depthBiasEnable", state.depthBiasEnable, alloc);
+	rs.AddMember("depthClampEnable", state.depthClampEnable, alloc);
+	rs.AddMember("polygonMode", state.polygonMode, alloc);
+	rs.AddMember("rasterizerDiscardEnable", state.rasterizerDiscardEnable, alloc);
+	rs.AddMember("frontFace", state.frontFace, alloc);
+	rs.AddMember("lineWidth", state.lineWidth, alloc);
+	rs.AddMember("cullMode", state.cullMode, alloc);
+	return rs;
+}
+
+static Value serialize_input_assembly_state(const VkPipelineInputAssemblyStateCreateInfo &state, Document::AllocatorType &alloc)
+{
+	Value ia(kObjectType);
+	ia.AddMember("flags", state.flags, alloc);
+	ia.AddMember("topology", state.topology, alloc);
+	ia.AddMember("primitiveRestartEnable", state.primitiveRestartEnable, alloc);
+	return ia;
+}
+
+static Value serialize_color_blend_state(const VkPipelineColorBlendStateCreateInfo &state, Document::AllocatorType &alloc)
+{
+	Value cb(kObjectType);
+	cb.AddMember("flags", state.flags, alloc);
+	cb.AddMember("logicOp", state.logicOp, alloc);
+	cb.AddMember("logicOpEnable", state.logicOpEnable, alloc);
+	Value blend_constants(kArrayType);
+	for (auto &c : state.blendConstants)
+		blend_constants.PushBack(c, alloc);
+	cb.AddMember("blendConstants", blend_constants, alloc);
+	Value attachments(kArrayType);
+	for (uint32_t i = 0; i < state.attachmentCount; i++)
+	{
+		auto &a = state.pAttachments[i];
+		Value att(kObjectType);
+		att.AddMember("dstAlphaBlendFactor", a.dstAlphaBlendFactor, alloc);
+		att.AddMember("srcAlphaBlendFactor", a.srcAlphaBlendFactor, alloc);
+		att.AddMember("dstColorBlendFactor", a.dstColorBlendFactor, alloc);
+		att.AddMember("srcColorBlendFactor", a.srcColorBlendFactor, alloc);
+		att.AddMember("colorWriteMask", a.colorWriteMask, alloc);
+		att.AddMember("alphaBlendOp", a.alphaBlendOp, alloc);
+		att.AddMember("colorBlendOp", a.colorBlendOp, alloc);
+		att.AddMember("blendEnable", a.blendEnable, alloc);
+		attachments.PushBack(att, alloc);
+	}
+	cb.AddMember("attachments", attachments, alloc);
+	return cb;
+}
+
+static Value serialize_viewport_state(const VkPipelineViewportStateCreateInfo &state, Document::AllocatorType &alloc)
+{
+	Value vp(kObjectType);
+	vp.AddMember("flags", state.flags, alloc);
+	vp.AddMember("viewportCount", state.viewportCount, alloc);
+	vp.AddMember("scissorCount", state.scissorCount, alloc);
+	if (state.pViewports)
+	{
+		Value viewports(kArrayType);
+		for (uint32_t i = 0; i < state.viewportCount; i++)
+		{
+			Value viewport(kObjectType);
+			viewport.AddMember("x", state.pViewports[i].x, alloc);
+			viewport.AddMember("y", state.pViewports[i].y, alloc);
+			viewport.AddMember("width", state.pViewports[i].width, alloc);
+			viewport.AddMember("height", state.pViewports[i].height, alloc);
+			viewport.AddMember("minDepth", state.pViewports[i].minDepth, alloc);
+			viewport.AddMember("maxDepth", state.pViewports[i].maxDepth, alloc);
+			viewports.PushBack(viewport, alloc);
+		}
+		vp.AddMember("viewports", viewports, alloc);
+	}
+
+	if (state.pScissors)
+	{
+		Value scissors(kArrayType);
+		for (uint32_t i = 0; i < state.scissorCount; i++)
+		{
+			Value scissor(kObjectType);
+			scissor.AddMember("x", state.pScissors[i].offset.x, alloc);
+			scissor.AddMember("y", state.pScissors[i].offset.y, alloc);
+			scissor.AddMember("width", state.pScissors[i].extent.width, alloc);
+			scissor.AddMember("height", state.pScissors[i].extent.height, alloc);
+			scissors.PushBack(scissor, alloc);
+		}
+		vp.AddMember("scissors", scissors, alloc);
+	}
+	return vp;
+}
+
+static Value serialize_depth_stencil_state(const VkPipelineDepthStencilStateCreateInfo &state, Document::AllocatorType &alloc)
+{
+	Value ds(kObjectType);
+	ds.AddMember("flags", state.flags, alloc);
+	ds.AddMember("stencilTestEnable", state.stencilTestEnable, alloc);
+	ds.AddMember("maxDepthBounds", state.maxDepthBounds, alloc);
+	ds.AddMember("minDepthBounds", state.minDepthBounds, alloc);
+	ds.AddMember("depthBoundsTestEnable", state.depthBoundsTestEnable, alloc);
+	ds.AddMember("depthWriteEnable", state.depthWriteEnable, alloc);
+	ds.AddMember("depthTestEnable", state.depthTestEnable, alloc);
+	ds.AddMember("depthCompareOp", state.depthCompareOp, alloc);
+
+	const auto serialize_stencil = [&](Value &v, const VkStencilOpState &state) {
+		v.AddMember("compareOp", state.compareOp, alloc);
+		v.AddMember("writeMask", state.writeMask, alloc);
+		v.AddMember("reference", state.reference, alloc);
+		v.AddMember("compareMask", state.compareMask, alloc);
+		v.AddMember("passOp", state.passOp, alloc);
+		v.AddMember("failOp", state.failOp, alloc);
+		v.AddMember("depthFailOp", state.depthFailOp, alloc);
+	};
+	Value front(kObjectType);
+	Value back(kObjectType);
+	serialize_stencil(front, state.front);
+	serialize_stencil(back, state.back);
+	ds.AddMember("front", front, alloc);
+	ds.AddMember("back", back, alloc);
+	return ds;
+}
+
+// Objects refer to each other with 1-based indices into the arrays of the archive.
+// Normally these are the indices in recording order, which the recorder stores in place of handles.
+// Canonical archives reorder objects, so references are translated through these tables.
+struct ReferenceRemap
+{
+	vector<uint64_t> samplers;
+	vector<uint64_t> set_layouts;
+	vector<uint64_t> pipeline_layouts;
+	vector<uint64_t> shader_modules;
+	vector<uint64_t> render_passes;
+	vector<uint64_t> compute_pipelines;
+	vector<uint64_t> graphics_pipelines;
+
+	uint64_t sampler(VkSampler sampler) const
+	{
+		return remap(samplers, sampler);
+	}
+
+	uint64_t set_layout(VkDescriptorSetLayout layout) const
+	{
+		return remap(set_layouts, layout);
+	}
+
+	uint64_t pipeline_layout(VkPipelineLayout layout) const
+	{
+		return remap(pipeline_layouts, layout);
+	}
+
+	uint64_t shader_module(VkShaderModule module) const
+	{
+		return remap(shader_modules, module);
+	}
+
+	uint64_t render_pass(VkRenderPass render_pass) const
+	{
+		return remap(render_passes, render_pass);
+	}
+
+	uint64_t compute_pipeline(VkPipeline pipeline) const
+	{
+		return remap(compute_pipelines, pipeline);
+	}
+
+	uint64_t graphics_pipeline(VkPipeline pipeline) const
+	{
+		return remap(graphics_pipelines, pipeline);
+	}
+
+	// An empty table keeps references as they are.
+	template <typename T>
+	static uint64_t remap(const vector<uint64_t> &table, T handle)
+	{
+		auto ref = api_object_cast<uint64_t>(handle);
+		return ref && !table.empty() ? table[ref - 1] : ref;
+	}
+};
+
+static Value serialize_sampler(const HashedInfo<VkSamplerCreateInfo> &sampler, Document::AllocatorType &alloc)
+{
+	Value s(kObjectType);
+	s.AddMember("hash", sampler.hash, alloc);
+	s.AddMember("flags", sampler.info.flags, alloc);
+	s.AddMember("minFilter", sampler.info.minFilter, alloc);
+	s.AddMember("magFilter", sampler.info.magFilter, alloc);
+	s.AddMember("maxAnisotropy", sampler.info.maxAnisotropy, alloc);
+	s.AddMember("compareOp", sampler.info.compareOp, alloc);
+	s.AddMember("anisotropyEnable", sampler.info.anisotropyEnable, alloc);
+	s.AddMember("mipmapMode", sampler.info.mipmapMode, alloc);
+	s.AddMember("addressModeU", sampler.info.addressModeU, alloc);
+	s.AddMember("addressModeV", sampler.info.addressModeV, alloc);
+	s.AddMember("addressModeW", sampler.info.addressModeW, alloc);
+	s.AddMember("borderColor", sampler.info.borderColor, alloc);
+	s.AddMember("unnormalizedCoordinates", sampler.info.unnormalizedCoordinates, alloc);
+	s.AddMember("compareEnable", sampler.info.compareEnable, alloc);
+	s.AddMember("mipLodBias", sampler.info.mipLodBias, alloc);
+	s.AddMember("minLod", sampler.info.minLod, alloc);
+	s.AddMember("maxLod", sampler.info.maxLod, alloc);
+	return s;
+}
+
+static Value serialize_descriptor_set_layout(const HashedInfo<VkDescriptorSetLayoutCreateInfo> &layout, const ReferenceRemap &remap,
+                                             Document::AllocatorType &alloc)
+{
+	Value l(kObjectType);
+	l.AddMember("hash", layout.hash, alloc);
+	l.AddMember("flags", layout.info.flags, alloc);
+
+	Value bindings(kArrayType);
+	for (uint32_t i = 0; i < layout.info.bindingCount; i++)
+	{
+		auto &b = layout.info.pBindings[i];
+		Value binding(kObjectType);
+		binding.AddMember("descriptorType", b.descriptorType, alloc);
+		binding.AddMember("descriptorCount", b.descriptorCount, alloc);
+		binding.AddMember("stageFlags", b.stageFlags, alloc);
+		binding.AddMember("binding", b.binding, alloc);
+		if (b.pImmutableSamplers)
+		{
+			Value immutables(kArrayType);
+			for (uint32_t j = 0; j < b.descriptorCount; j++)
+				immutables.PushBack(remap.sampler(b.pImmutableSamplers[j]), alloc);
+			binding.AddMember("immutableSamplers", immutables, alloc);
+		}
+		bindings.PushBack(binding, alloc);
+	}
+	l.AddMember("bindings", bindings, alloc);
+	return l;
+}
+
+static Value serialize_pipeline_layout(const HashedInfo<VkPipelineLayoutCreateInfo> &layout, const ReferenceRemap &remap,
+                                       Document::AllocatorType &alloc)
+{
+	Value p(kObjectType);
+	p.AddMember("hash", layout.hash, alloc);
+	p.AddMember("flags", layout.info.flags, alloc);
+	Value push(kArrayType);
+	for (uint32_t i = 0; i < layout.info.pushConstantRangeCount; i++)
+	{
+		Value range(kObjectType);
+		range.AddMember("stageFlags", layout.info.pPushConstantRanges[i].stageFlags, alloc);
+		range.AddMember("size", layout.info.pPushConstantRanges[i].size, alloc);
+		range.AddMember("offset", layout.info.pPushConstantRanges[i].offset, alloc);
+		push.PushBack(range, alloc);
+	}
+	p.AddMember("pushConstantRanges", push, alloc);
+
+	Value set_layouts(kArrayType);
+	for (uint32_t i = 0; i < layout.info.setLayoutCount; i++)
+		set_layouts.PushBack(remap.set_layout(layout.info.pSetLayouts[i]), alloc);
+	p.AddMember("setLayouts", set_layouts, alloc);
+	return p;
+}
+
+static void encode_shader_module(vector<uint8_t> &encoded, const VkShaderModuleCreateInfo &info, SpirvEncoding encoding)
+{
+	size_t word_count = info.codeSize / sizeof(uint32_t);
+	if (encoding == SpirvEncoding::SmolV)
+		encode_smolv(encoded, info.pCode, word_count);
+	else
+	{
+		encoded.resize(compute_size_varint(info.pCode, word_count));
+		encode_varint(encoded.data(), info.pCode, word_count);
+	}
+}
+
+static Value serialize_shader_module(const HashedInfo<VkShaderModuleCreateInfo> &module,
+                                     uint64_t spirv_offset, uint64_t spirv_size, Document::AllocatorType &alloc)
+{
+	Value m(kObjectType);
+	m.AddMember("hash", module.hash, alloc);
+	m.AddMember("flags", module.info.flags, alloc);
+	m.AddMember("codeSize", module.info.codeSize, alloc);
+	m.AddMember("codeBinaryOffset", spirv_offset, alloc);
+	m.AddMember("codeBinarySize", spirv_size, alloc);
+	return m;
+}
+
+// The code lives in a SPIR-V store under the module hash.
+static Value serialize_stored_shader_module(const HashedInfo<VkShaderModuleCreateInfo> &module, Document::AllocatorType &alloc)
+{
+	Value m(kObjectType);
+	m.AddMember("hash", module.hash, alloc);
+	m.AddMember("flags", module.info.flags, alloc);
+	m.AddMember("codeSize", module.info.codeSize, alloc);
+	m.AddMember("codeInStore", true, alloc);
+	return m;
+}
+
+static Value serialize_render_pass(const HashedInfo<VkRenderPassCreateInfo> &pass, Document::AllocatorType &alloc)
+{
+	Value p(kObjectType);
+	p.AddMember("hash", pass.hash, alloc);
+	p.AddMember("flags", pass.info.flags, alloc);
+
+	Value deps(kArrayType);
+	Value subpasses(kArrayType);
+	Value attachments(kArrayType);
+
+	if (pass.info.pDependencies)
+	{
+		for (uint32_t i = 0; i < pass.info.dependencyCount; i++)
+		{
+			auto &d = pass.info.pDependencies[i];
+			Value dep(kObjectType);
+			dep.AddMember("dependencyFlags", d.dependencyFlags, alloc);
+			dep.AddMember("dstAccessMask", d.dstAccessMask, alloc);
+			dep.AddMember("srcAccessMask", d.srcAccessMask, alloc);
+			dep.AddMember("dstStageMask", d.dstStageMask, alloc);
+			dep.AddMember("srcStageMask", d.srcStageMask, alloc);
+			dep.AddMember("dstSubpass", d.dstSubpass, alloc);
+			dep.AddMember("srcSubpass", d.srcSubpass, alloc);
+			deps.PushBack(dep, alloc);
+		}
+		p.AddMember("dependencies", deps, alloc);
+	}
+
+	if (pass.info.pAttachments)
+	{
+		for (uint32_t i = 0; i < pass.info.attachmentCount; i++)
+		{
+			auto &a = pass.info.pAttachments[i];
+			Value att(kObjectType);
+
+			att.AddMember("flags", a.flags, alloc);
+			att.AddMember("format", a.format, alloc);
+			att.AddMember("finalLayout", a.finalLayout, alloc);
+			att.AddMember("initialLayout", a.initialLayout, alloc);
+			att.AddMember("loadOp", a.loadOp, alloc);
+			att.AddMember("storeOp", a.storeOp, alloc);
+			att.AddMember("samples", a.samples, alloc);
+			att.AddMember("stencilLoadOp", a.stencilLoadOp, alloc);
+			att.AddMember("stencilStoreOp", a.stencilStoreOp, alloc);
+
+			attachments.PushBack(att, alloc);
+		}
+		p.AddMember("attachments", attachments, alloc);
+	}
+
+	for (uint32_t i = 0; i < pass.info.subpassCount; i++)
+	{
+		auto &sub = pass.info.pSubpasses[i];
+		Value p(kObjectType);
+		p.AddMember("flags", sub.flags, alloc);
+		p.AddMember("pipelineBindPoint", sub.pipelineBindPoint, alloc);
+
+		if (sub.pPreserveAttachments)
+		{
+			Value preserves(kArrayType);
+			for (uint32_t j = 0; j < sub.preserveAttachmentCount; j++)
+				preserves.PushBack(sub.pPreserveAttachments[j], alloc);
+			p.AddMember("preserveAttachments", preserves, alloc);
+		}
+
+		if (sub.pInputAttachments)
+		{
+			Value inputs(kArrayType);
+			for (uint32_t j = 0; j < sub.inputAttachmentCount; j++)
+			{
+				Value input(kObjectType);
+				auto &ia = sub.pInputAttachments[j];
+				input.AddMember("attachment", ia.attachment, alloc);
+				input.AddMember("layout", ia.layout, alloc);
+				inputs.PushBack(input, alloc);
+			}
+			p.AddMember("inputAttachments", inputs, alloc);
+		}
+
+		if (sub.pColorAttachments)
+		{
+			Value colors(kArrayType);
+			for (uint32_t j = 0; j < sub.colorAttachmentCount; j++)
+			{
+				Value color(kObjectType);
+				auto &c = sub.pColorAttachments[j];
+				color.AddMember("attachment", c.attachment, alloc);
+				color.AddMember("layout", c.layout, alloc);
+				colors.PushBack(color, alloc);
+			}
+			p.AddMember("colorAttachments", colors, alloc);
+		}
+
+		if (sub.pResolveAttachments)
+		{
+			Value resolves(kArrayType);
+			for (uint32_t j = 0; j < sub.colorAttachmentCount; j++)
+			{
+				Value resolve(kObjectType);
+				auto &r = sub.pResolveAttachments[j];
+				resolve.AddMember("attachment", r.attachment, alloc);
+				resolve.AddMember("layout", r.layout, alloc);
+				resolves.PushBack(resolve, alloc);
+			}
+			p.AddMember("resolveAttachments", resolves, alloc);
+		}
+
+		if (sub.pDepthStencilAttachment)
+		{
+			Value depth_stencil(kObjectType);
+			depth_stencil.AddMember("attachment", sub.pDepthStencilAttachment->attachment, alloc);
+			depth_stencil.AddMember("layout", sub.pDepthStencilAttachment->layout, alloc);
+			p.AddMember("depthStencilAttachment", depth_stencil, alloc);
+		}
+
+		subpasses.PushBack(p, alloc);
+	}
+	p.AddMember("subpasses", subpasses, alloc);
+	return p;
+}
+
+static Value serialize_specialization_info(const VkSpecializationInfo &info, Document::AllocatorType &alloc)
+{
+	Value spec(kObjectType);
+	spec.AddMember("dataSize", info.dataSize, alloc);
+	spec.AddMember("data", encode_base64(info.pData, info.dataSize), alloc);
+	Value map_entries(kArrayType);
+	for (uint32_t i = 0; i < info.mapEntryCount; i++)
+	{
+		auto &e = info.pMapEntries[i];
+		Value map_entry(kObjectType);
+		map_entry.AddMember("offset", e.offset, alloc);
+		map_entry.AddMember("size", e.size, alloc);
+		map_entry.AddMember("constantID", e.constantID, alloc);
+		map_entries.PushBack(map_entry, alloc);
+	}
+	spec.AddMember("mapEntries", map_entries, alloc);
+	return spec;
+}
+
+static Value serialize_compute_pipeline(const HashedInfo<VkComputePipelineCreateInfo> &pipe, const ReferenceRemap &remap,
+                                        Document::AllocatorType &alloc)
+{
+	Value p(kObjectType);
+	p.AddMember("hash", pipe.hash, alloc);
+	p.AddMember("flags", pipe.info.flags, alloc);
+	p.AddMember("layout", remap.pipeline_layout(pipe.info.layout), alloc);
+	p.AddMember("basePipelineHandle", remap.compute_pipeline(pipe.info.basePipelineHandle), alloc);
+	p.AddMember("basePipelineIndex", pipe.info.basePipelineIndex, alloc);
+	Value stage(kObjectType);
+	stage.AddMember("flags", pipe.info.stage.flags, alloc);
+	stage.AddMember("stage", pipe.info.stage.stage, alloc);
+	stage.AddMember("module", remap.shader_module(pipe.info.stage.module), alloc);
+	stage.AddMember("name", StringRef(pipe.info.stage.pName), alloc);
+	if (pipe.info.stage.pSpecializationInfo)
+		stage.AddMember("specializationInfo", serialize_specialization_info(*pipe.info.stage.pSpecializationInfo, alloc), alloc);
+	p.AddMember("stage", stage, alloc);
+	return p;
+}
+
+static string write_fragment(const Value &value)
+{
+	StringBuffer buffer;
+	Writer<StringBuffer> writer(buffer);
+	value.Accept(writer);
+	return string(buffer.GetString(), buffer.GetSize());
+}
+
+// Interned states are shared by pointer, so the first pipeline which refers to a state assigns its ID.
+template <typename T>
+struct SerializedStateTable
+{
+	using SerializeFunc = Value (*)(const T &, Document::AllocatorType &);
+
+	explicit SerializedStateTable(SerializeFunc serialize)
+		: serialize(serialize)
+	{
+	}
+
+	SerializeFunc serialize;
+	unordered_map<const T *, unsigned> ids;
+	vector<const T *> states;
+	vector<string> fragments;
+
+	// IDs are assigned up front, so pipelines which refer to the states can be serialized in any order.
+	void add(const T *state)
+	{
+		if (state && ids.find(state) == ids.end())
+		{
+			states.push_back(state);
+			ids[state] = unsigned(states.size());
+		}
+	}
+
+	unsigned get_id(const T *state) const
+	{
+		return ids.find(state)->second;
+	}
+
+	void clear()
+	{
+		ids.clear();
+		states.clear();
+		fragments.clear();
+	}
+};
+
+struct StateTables
+{
+	SerializedStateTable<VkPipelineTessellationStateCreateInfo> tessellation_state;
+	SerializedStateTable<VkPipelineDynamicStateCreateInfo> dynamic_state;
+	SerializedStateTable<VkPipelineMultisampleStateCreateInfo> multisample_state;
+	SerializedStateTable<VkPipelineVertexInputStateCreateInfo> vertex_input_state;
+	SerializedStateTable<VkPipelineRasterizationStateCreateInfo> rasterization_state;
+	SerializedStateTable<VkPipelineInputAssemblyStateCreateInfo> input_assembly_state;
+	SerializedStateTable<VkPipelineColorBlendStateCreateInfo> color_blend_state;
+	SerializedStateTable<VkPipelineViewportStateCreateInfo> viewport_state;
+	SerializedStateTable<VkPipelineDepthStencilStateCreateInfo> depth_stencil_state;
+
+	StateTables()
+		: tessellation_state(serialize_tessellation_state),
+		  dynamic_state(serialize_dynamic_state),
+		  multisample_state(serialize_multisample_state),
+		  vertex_input_state(serialize_vertex_input_state),
+		  rasterization_state(serialize_rasterization_state),
+		  input_assembly_state(serialize_input_assembly_state),
+		  color_blend_state(serialize_color_blend_state),
+		  viewport_state(serialize_viewport_state),
+		  depth_stencil_state(serialize_depth_stencil_state)
+	{
+	}
+
+	void add(const VkGraphicsPipelineCreateInfo &info)
+	{
+		tessellation_state.add(info.pTessellationState);
+		dynamic_state.add(info.pDynamicState);
+		multisample_state.add(info.pMultisampleState);
+		vertex_input_state.add(info.pVertexInputState);
+		rasterization_state.add(info.pRasterizationState);
+		input_assembly_state.add(info.pInputAssemblyState);
+		color_blend_state.add(info.pColorBlendState);
+		viewport_state.add(info.pViewportState);
+		depth_stencil_state.add(info.pDepthStencilState);
+	}
+
+	void clear()
+	{
+		tessellation_state.clear();
+		dynamic_state.clear();
+		multisample_state.clear();
+		vertex_input_state.clear();
+		rasterization_state.clear();
+		input_assembly_state.clear();
+		color_blend_state.clear();
+		viewport_state.clear();
+		depth_stencil_state.clear();
+	}
+};
+
+static Value serialize_graphics_pipeline(const HashedInfo<VkGraphicsPipelineCreateInfo> &pipe, const StateTables &states,
+                                         const ReferenceRemap &remap, Document::AllocatorType &alloc)
+{
+	Value p(kObjectType);
+	p.AddMember("hash", pipe.hash, alloc);
+	p.AddMember("flags", pipe.info.flags, alloc);
+	p.AddMember("basePipelineHandle", remap.graphics_pipeline(pipe.info.basePipelineHandle), alloc);
+	p.AddMember("basePipelineIndex", pipe.info.basePipelineIndex, alloc);
+	p.AddMember("layout", remap.pipeline_layout(pipe.info.layout), alloc);
+	p.AddMember("renderPass", remap.render_pass(pipe.info.renderPass), alloc);
+	p.AddMember("subpass", pipe.info.subpass, alloc);
+
+	if (pipe.info.pTessellationState)
+		p.AddMember("tessellationState", states.tessellation_state.get_id(pipe.info.pTessellationState), alloc);
+	if (pipe.info.pDynamicState)
+		p.AddMember("dynamicState", states.dynamic_state.get_id(pipe.info.pDynamicState), alloc);
+	if (pipe.info.pMultisampleState)
+		p.AddMember("multisampleState", states.multisample_state.get_id(pipe.info.pMultisampleState), alloc);
+	if (pipe.info.pVertexInputState)
+		p.AddMember("vertexInputState", states.vertex_input_state.get_id(pipe.info.pVertexInputState), alloc);
+	if (pipe.info.pRasterizationState)
+		p.AddMember("rasterizationState", states.rasterization_state.get_id(pipe.info.pRasterizationState), alloc);
+	if (pipe.info.pInputAssemblyState)
+		p.AddMember("inputAssemblyState", states.input_assembly_state.get_id(pipe.info.pInputAssemblyState), alloc);
+	if (pipe.info.pColorBlendState)
+		p.AddMember("colorBlendState", states.color_blend_state.get_id(pipe.info.pColorBlendState), alloc);
+	if (pipe.info.pViewportState)
+		p.AddMember("viewportState", states.viewport_state.get_id(pipe.info.pViewportState), alloc);
+	if (pipe.info.pDepthStencilState)
+		p.AddMember("depthStencilState", states.depth_stencil_state.get_id(pipe.info.pDepthStencilState), alloc);
+
+	Value stages(kArrayType);
+	for (uint32_t i = 0; i < pipe.info.stageCount; i++)
+	{
+		auto &s = pipe.info.pStages[i];
+		Value stage(kObjectType);
+		stage.AddMember("flags", s.flags, alloc);
+		stage.AddMember("name", StringRef(s.pName), alloc);
+		stage.AddMember("module", remap.shader_module(s.module), alloc);
+		stage.AddMember("stage", s.stage, alloc);
+		if (s.pSpecializationInfo)
+			stage.AddMember("specializationInfo", serialize_specialization_info(*s.pSpecializationInfo, alloc), alloc);
+		stages.PushBack(stage, alloc);
+	}
+	p.AddMember("stages", stages, alloc);
+	return p;
+}
+
+// Serialized form of a set of objects, stored in the order they appear in the archive.
+struct SerializedObjects
+{
+	vector<string> samplers;
+	vector<string> set_layouts;
+	vector<string> pipeline_layouts;
+	vector<string> shader_modules;
+	vector<string> render_passes;
+	vector<string> compute_pipelines;
+	vector<string> graphics_pipelines;
+	StateTables states;
+
+	// Encoded SPIR-V of shader_modules.
+	vector<uint8_t> spirv_blob;
+
+	void clear()
+	{
+		samplers.clear();
+		set_layouts.clear();
+		pipeline_layouts.clear();
+		shader_modules.clear();
+		render_passes.clear();
+		compute_pipelines.clear();
+		graphics_pipelines.clear();
+		states.clear();
+		spirv_blob.clear();
+	}
+};
+
+// Recorded objects are immutable, so each object is converted to compact JSON once,
+// and serialize() only has to encode objects which were recorded since the previous call.
+struct StateRecorder::SerializationCache : SerializedObjects
+{
+	std::mutex lock;
+
+	// The cached SPIR-V blob is only valid for one encoding, and shader modules for one store.
+	SpirvEncoding spirv_encoding = SpirvEncoding::Varint;
+	SpirvStore *spirv_store = nullptr;
+};
+
+StateRecorder::StateRecorder()
+	: serialization_cache(new SerializationCache)
+{
+}
+
+StateRecorder::~StateRecorder()
+{
+}
+
+void StateRecorder::reset()
+{
+	descriptor_sets.clear();
+	pipeline_layouts.clear();
+	shader_modules.clear();
+	graphics_pipelines.clear();
+	compute_pipelines.clear();
+	render_passes.clear();
+	samplers.clear();
+
+	descriptor_set_layout_to_index.clear();
+	pipeline_layout_to_index.clear();
+	shader_module_to_index.clear();
+	graphics_pipeline_to_index.clear();
+	compute_pipeline_to_index.clear();
+	render_pass_to_index.clear();
+	sampler_to_index.clear();
+
+	tessellation_states.clear();
+	color_blend_states.clear();
+	vertex_input_states.clear();
+	multisample_states.clear();
+	dynamic_states.clear();
+	viewport_states.clear();
+	input_assembly_states.clear();
+	depth_stencil_states.clear();
+	rasterization_states.clear();
+
+	{
+		lock_guard<mutex> holder{ serialization_cache->lock };
+		serialization_cache->clear();
+	}
+
+	allocator.reset();
+}
+
+struct RecordedObjects
+{
+	const vector<HashedInfo<VkSamplerCreateInfo>> *samplers;
+	const vector<HashedInfo<VkDescriptorSetLayoutCreateInfo>> *set_layouts;
+	const vector<HashedInfo<VkPipelineLayoutCreateInfo>> *pipeline_layouts;
+	const vector<HashedInfo<VkShaderModuleCreateInfo>> *shader_modules;
+	const vector<HashedInfo<VkRenderPassCreateInfo>> *render_passes;
+	const vector<HashedInfo<VkComputePipelineCreateInfo>> *compute_pipelines;
+	const vector<HashedInfo<VkGraphicsPipelineCreateInfo>> *graphics_pipelines;
+};
+
+template <typename T>
+static uint64_t get_base_reference(const T &)
+{
+	return 0;
+}
+
+static uint64_t get_base_reference(const VkComputePipelineCreateInfo &info)
+{
+	return api_object_cast<uint64_t>(info.basePipelineHandle);
+}
+
+static uint64_t get_base_reference(const VkGraphicsPipelineCreateInfo &info)
+{
+	return api_object_cast<uint64_t>(info.basePipelineHandle);
+}
+
+// Objects which are referenced by a pipeline, directly or through other objects. Pipelines are always reachable.
+struct ReachableObjects
+{
+	vector<bool> samplers;
+	vector<bool> set_layouts;
+	vector<bool> pipeline_layouts;
+	vector<bool> shader_modules;
+	vector<bool> render_passes;
+};
+
+static void mark_reachable(vector<bool> &reachable, uint64_t ref)
+{
+	if (ref)
+		reachable[ref - 1] = true;
+}
+
+static void find_reachable_objects(const RecordedObjects &in, ReachableObjects &reachable)
+{
+	reachable.samplers.assign(in.samplers->size(), false);
+	reachable.set_layouts.assign(in.set_layouts->size(), false);
+	reachable.pipeline_layouts.assign(in.pipeline_layouts->size(), false);
+	reachable.shader_modules.assign(in.shader_modules->size(), false);
+	reachable.render_passes.assign(in.render_passes->size(), false);
+
+	for (auto &pipe : *in.compute_pipelines)
+	{
+		mark_reachable(reachable.pipeline_layouts, api_object_cast<uint64_t>(pipe.info.layout));
+		mark_reachable(reachable.shader_modules, api_object_cast<uint64_t>(pipe.info.stage.module));
+	}
+
+	for (auto &pipe : *in.graphics_pipelines)
+	{
+		mark_reachable(reachable.pipeline_layouts, api_object_cast<uint64_t>(pipe.info.layout));
+		mark_reachable(reachable.render_passes, api_object_cast<uint64_t>(pipe.info.renderPass));
+		for (uint32_t i = 0; i < pipe.info.stageCount; i++)
+			mark_reachable(reachable.shader_modules, api_object_cast<uint64_t>(pipe.info.pStages[i].module));
+	}
+
+	auto &pipeline_layouts = *in.pipeline_layouts;
+	for (size_t i = 0; i < pipeline_layouts.size(); i++)
+	{
+		if (!reachable.pipeline_layouts[i])
+			continue;
+		auto &info = pipeline_layouts[i].info;
+		for (uint32_t j = 0; j < info.setLayoutCount; j++)
+			mark_reachable(reachable.set_layouts, api_object_cast<uint64_t>(info.pSetLayouts[j]));
+	}
 
-		auto outbytes = std::min(size - i, size_t(3));
-		if (outbytes == 1)
+	auto &set_layouts = *in.set_layouts;
+	for (size_t i = 0; i < set_layouts.size(); i++)
+	{
+		if (!reachable.set_layouts[i])
+			continue;
+		auto &info = set_layouts[i].info;
+		for (uint32_t j = 0; j < info.bindingCount; j++)
 		{
-			c2 = '=';
-			c3 = '=';
+			auto &binding = info.pBindings[j];
+			if (binding.pImmutableSamplers &&
+			    (binding.descriptorType == VK_DESCRIPTOR_TYPE_SAMPLER ||
+			     binding.descriptorType == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER))
+			{
+				for (uint32_t k = 0; k < binding.descriptorCount; k++)
+					mark_reachable(reachable.samplers, api_object_cast<uint64_t>(binding.pImmutableSamplers[k]));
+			}
 		}
-		else if (outbytes == 2)
-			c3 = '=';
+	}
+}
 
-		ret.push_back(c0);
-		ret.push_back(c1);
-		ret.push_back(c2);
-		ret.push_back(c3);
+// Keeps objects in recording order, but drops those which are not reachable.
+// An empty reachable set keeps all objects.
+template <typename T>
+static void filter_objects(const vector<HashedInfo<T>> &objects, const vector<bool> &reachable,
+                           vector<HashedInfo<T>> &kept, vector<uint64_t> &remap)
+{
+	remap.assign(objects.size(), 0);
+	for (size_t i = 0; i < objects.size(); i++)
+	{
+		if (reachable.empty() || reachable[i])
+		{
+			kept.push_back(objects[i]);
+			remap[i] = kept.size();
+		}
 	}
+}
 
-	return ret;
+// Orders objects by hash and drops objects with a hash which was already seen, as well as objects which are not reachable.
+// Hashes cover referenced objects as well, so equal hashes imply equal state.
+// Base pipelines are placed before pipelines deriving from them, as the replayer creates pipelines in order.
+template <typename T>
+static void canonicalize_objects(const vector<HashedInfo<T>> &objects, const vector<bool> &reachable,
+                                 vector<HashedInfo<T>> &sorted, vector<uint64_t> &remap)
+{
+	vector<unsigned> order;
+	order.reserve(objects.size());
+	for (unsigned i = 0; i < objects.size(); i++)
+		if (reachable.empty() || reachable[i])
+			order.push_back(i);
+	stable_sort(begin(order), end(order), [&](unsigned a, unsigned b) {
+		return objects[b].hash > objects[a].hash;
+	});
+
+	remap.assign(objects.size(), 0);
+	unordered_map<Hash, uint64_t> hash_to_ref;
+
+	const function<void (unsigned)> place = [&](unsigned index) {
+		if (remap[index])
+			return;
+
+		auto &object = objects[index];
+		auto itr = hash_to_ref.find(object.hash);
+		if (itr != end(hash_to_ref))
+		{
+			remap[index] = itr->second;
+			return;
+		}
+
+		uint64_t base = get_base_reference(object.info);
+		if (base)
+			place(unsigned(base - 1));
+
+		sorted.push_back(object);
+		remap[index] = hash_to_ref[object.hash] = sorted.size();
+	};
+
+	for (auto index : order)
+		place(index);
 }
 
-vector<uint8_t> StateRecorder::serialize() const
+// Reserves slots for objects recorded since the previous call and fills them in as jobs.
+template <typename T, typename Func>
+static void enqueue_fragments(SerializationJobs &jobs, vector<string> &fragments, const vector<T> &objects, const Func &func)
 {
-	uint64_t varint_spirv_offset = 0;
+	size_t first = fragments.size();
+	fragments.resize(objects.size());
+	jobs.run(objects.size() - first, FOSSILIZE_SERIALIZE_BATCH_SIZE, [&fragments, &objects, func, first](size_t begin, size_t end) {
+		Document::AllocatorType alloc;
+		for (size_t i = first + begin; i < first + end; i++)
+			fragments[i] = write_fragment(func(objects[i], alloc));
+	});
+}
 
-	Document doc;
-	doc.SetObject();
-	auto &alloc = doc.GetAllocator();
-
-	doc.AddMember("version", FOSSILIZE_FORMAT_VERSION, alloc);
-
-	Value samplers(kArrayType);
-	for (auto &sampler : this->samplers)
-	{
-		Value s(kObjectType);
-		s.AddMember("hash", sampler.hash, alloc);
-		s.AddMember("flags", sampler.info.flags, alloc);
-		s.AddMember("minFilter", sampler.info.minFilter, alloc);
-		s.AddMember("magFilter", sampler.info.magFilter, alloc);
-		s.AddMember("maxAnisotropy", sampler.info.maxAnisotropy, alloc);
-		s.AddMember("compareOp", sampler.info.compareOp, alloc);
-		s.AddMember("anisotropyEnable", sampler.info.anisotropyEnable, alloc);
-		s.AddMember("mipmapMode", sampler.info.mipmapMode, alloc);
-		s.AddMember("addressModeU", sampler.info.addressModeU, alloc);
-		s.AddMember("addressModeV", sampler.info.addressModeV, alloc);
-		s.AddMember("addressModeW", sampler.info.addressModeW, alloc);
-		s.AddMember("borderColor", sampler.info.borderColor, alloc);
-		s.AddMember("unnormalizedCoordinates", sampler.info.unnormalizedCoordinates, alloc);
-		s.AddMember("compareEnable", sampler.info.compareEnable, alloc);
-		s.AddMember("mipLodBias", sampler.info.mipLodBias, alloc);
-		s.AddMember("minLod", sampler.info.minLod, alloc);
-		s.AddMember("maxLod", sampler.info.maxLod, alloc);
-		samplers.PushBack(s, alloc);
-	}
-	doc.AddMember("samplers", samplers, alloc);
+template <typename T>
+static void enqueue_state_fragments(SerializationJobs &jobs, SerializedStateTable<T> &table)
+{
+	auto serialize = table.serialize;
+	enqueue_fragments(jobs, table.fragments, table.states, [serialize](const T *state, Document::AllocatorType &alloc) {
+		return serialize(*state, alloc);
+	});
+}
 
-	Value set_layouts(kArrayType);
-	for (auto &layout : this->descriptor_sets)
-	{
-		Value l(kObjectType);
-		l.AddMember("hash", layout.hash, alloc);
-		l.AddMember("flags", layout.info.flags, alloc);
-
-		Value bindings(kArrayType);
-		for (uint32_t i = 0; i < layout.info.bindingCount; i++)
-		{
-			auto &b = layout.info.pBindings[i];
-			Value binding(kObjectType);
-			binding.AddMember("descriptorType", b.descriptorType, alloc);
-			binding.AddMember("descriptorCount", b.descriptorCount, alloc);
-			binding.AddMember("stageFlags", b.stageFlags, alloc);
-			binding.AddMember("binding", b.binding, alloc);
-			if (b.pImmutableSamplers)
+// Serializes the objects in `in` which are not in `out` yet.
+// With a SPIR-V store, new shader modules are written to the store rather than to out.spirv_blob.
+static void serialize_new_objects(SerializationJobs &jobs, SerializedObjects &out, const RecordedObjects &in,
+                                  const ReferenceRemap &remap, SpirvEncoding encoding, SpirvStore *store)
+{
+	auto &shader_modules = *in.shader_modules;
+	auto &graphics_pipelines = *in.graphics_pipelines;
+
+	for (size_t i = out.graphics_pipelines.size(); i < graphics_pipelines.size(); i++)
+		out.states.add(graphics_pipelines[i].info);
+
+	// SPIR-V is encoded in parallel, but every module needs to know where the previous module ended.
+	size_t first_module = out.shader_modules.size();
+	vector<vector<uint8_t>> encoded_modules(store ? 0 : shader_modules.size() - first_module);
+	if (store)
+	{
+		jobs.run(shader_modules.size() - first_module, FOSSILIZE_SERIALIZE_BATCH_SIZE, [&](size_t begin, size_t end) {
+			for (size_t i = first_module + begin; i < first_module + end; i++)
 			{
-				Value immutables(kArrayType);
-				for (uint32_t j = 0; j < b.descriptorCount; j++)
-					immutables.PushBack(api_object_cast<uint64_t>(b.pImmutableSamplers[j]), alloc);
-				binding.AddMember("immutableSamplers", immutables, alloc);
+				auto &module = shader_modules[i];
+				if (!store->store(module.hash, module.info.pCode, module.info.codeSize))
+					FOSSILIZE_THROW("Failed to write shader module to SPIR-V store.");
 			}
-			bindings.PushBack(binding, alloc);
-		}
-		l.AddMember("bindings", bindings, alloc);
+		});
+	}
+	else
+	{
+		jobs.run(encoded_modules.size(), FOSSILIZE_SERIALIZE_BATCH_SIZE, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++)
+				encode_shader_module(encoded_modules[i], shader_modules[first_module + i].info, encoding);
+		});
+	}
+	jobs.wait();
 
-		set_layouts.PushBack(l, alloc);
+	vector<uint64_t> module_offsets(shader_modules.size() + 1);
+	module_offsets[first_module] = out.spirv_blob.size();
+	for (size_t i = 0; i < encoded_modules.size(); i++)
+	{
+		out.spirv_blob.insert(out.spirv_blob.end(), encoded_modules[i].begin(), encoded_modules[i].end());
+		module_offsets[first_module + i + 1] = out.spirv_blob.size();
 	}
-	doc.AddMember("setLayouts", set_layouts, alloc);
 
-	Value pipeline_layouts(kArrayType);
-	for (auto &layout : this->pipeline_layouts)
+	enqueue_fragments(jobs, out.samplers, *in.samplers, serialize_sampler);
+	enqueue_fragments(jobs, out.set_layouts, *in.set_layouts,
+	                  [&remap](const HashedInfo<VkDescriptorSetLayoutCreateInfo> &layout, Document::AllocatorType &alloc) {
+		                  return serialize_descriptor_set_layout(layout, remap, alloc);
+	                  });
+	enqueue_fragments(jobs, out.pipeline_layouts, *in.pipeline_layouts,
+	                  [&remap](const HashedInfo<VkPipelineLayoutCreateInfo> &layout, Document::AllocatorType &alloc) {
+		                  return serialize_pipeline_layout(layout, remap, alloc);
+	                  });
+	enqueue_fragments(jobs, out.shader_modules, shader_modules,
+	                  [&](const HashedInfo<VkShaderModuleCreateInfo> &module, Document::AllocatorType &alloc) {
+		                  if (store)
+			                  return serialize_stored_shader_module(module, alloc);
+		                  size_t index = &module - shader_modules.data();
+		                  return serialize_shader_module(module, module_offsets[index],
+		                                                 module_offsets[index + 1] - module_offsets[index], alloc);
+	                  });
+	enqueue_fragments(jobs, out.render_passes, *in.render_passes, serialize_render_pass);
+	enqueue_fragments(jobs, out.compute_pipelines, *in.compute_pipelines,
+	                  [&remap](const HashedInfo<VkComputePipelineCreateInfo> &pipe, Document::AllocatorType &alloc) {
+		                  return serialize_compute_pipeline(pipe, remap, alloc);
+	                  });
+
+	auto &states = out.states;
+	enqueue_fragments(jobs, out.graphics_pipelines, graphics_pipelines,
+	                  [&](const HashedInfo<VkGraphicsPipelineCreateInfo> &pipe, Document::AllocatorType &alloc) {
+		                  return serialize_graphics_pipeline(pipe, states, remap, alloc);
+	                  });
+
+	enqueue_state_fragments(jobs, states.tessellation_state);
+	enqueue_state_fragments(jobs, states.dynamic_state);
+	enqueue_state_fragments(jobs, states.multisample_state);
+	enqueue_state_fragments(jobs, states.vertex_input_state);
+	enqueue_state_fragments(jobs, states.rasterization_state);
+	enqueue_state_fragments(jobs, states.input_assembly_state);
+	enqueue_state_fragments(jobs, states.color_blend_state);
+	enqueue_state_fragments(jobs, states.viewport_state);
+	enqueue_state_fragments(jobs, states.depth_stencil_state);
+	jobs.wait();
+}
+
+// Fragments which were already serialized up front.
+struct CachedFragments
+{
+	const SerializedObjects &objects;
+
+	const vector<string> &get(uint32_t type) const
 	{
-		Value p(kObjectType);
-		p.AddMember("hash", layout.hash, alloc);
-		p.AddMember("flags", layout.info.flags, alloc);
-		Value push(kArrayType);
-		for (uint32_t i = 0; i < layout.info.pushConstantRangeCount; i++)
+		switch (type)
 		{
-			Value range(kObjectType);
-			range.AddMember("stageFlags", layout.info.pPushConstantRanges[i].stageFlags, alloc);
-			range.AddMember("size", layout.info.pPushConstantRanges[i].size, alloc);
-			range.AddMember("offset", layout.info.pPushConstantRanges[i].offset, alloc);
-			push.PushBack(range, alloc);
+		case uint32_t(ObjectType::Sampler):
+			return objects.samplers;
+		case uint32_t(ObjectType::DescriptorSetLayout):
+			return objects.set_layouts;
+		case uint32_t(ObjectType::PipelineLayout):
+			return objects.pipeline_layouts;
+		case uint32_t(ObjectType::ShaderModule):
+			return objects.shader_modules;
+		case uint32_t(ObjectType::RenderPass):
+			return objects.render_passes;
+		case uint32_t(ObjectType::ComputePipeline):
+			return objects.compute_pipelines;
+		case uint32_t(ObjectType::GraphicsPipeline):
+			return objects.graphics_pipelines;
+		case FOSSILIZE_INDEX_TESSELLATION_STATE:
+			return objects.states.tessellation_state.fragments;
+		case FOSSILIZE_INDEX_DYNAMIC_STATE:
+			return objects.states.dynamic_state.fragments;
+		case FOSSILIZE_INDEX_MULTISAMPLE_STATE:
+			return objects.states.multisample_state.fragments;
+		case FOSSILIZE_INDEX_VERTEX_INPUT_STATE:
+			return objects.states.vertex_input_state.fragments;
+		case FOSSILIZE_INDEX_RASTERIZATION_STATE:
+			return objects.states.rasterization_state.fragments;
+		case FOSSILIZE_INDEX_INPUT_ASSEMBLY_STATE:
+			return objects.states.input_assembly_state.fragments;
+		case FOSSILIZE_INDEX_COLOR_BLEND_STATE:
+			return objects.states.color_blend_state.fragments;
+		case FOSSILIZE_INDEX_VIEWPORT_STATE:
+			return objects.states.viewport_state.fragments;
+		default:
+			return objects.states.depth_stencil_state.fragments;
 		}
-		p.AddMember("pushConstantRanges", push, alloc);
-
-		Value set_layouts(kArrayType);
-		for (uint32_t i = 0; i < layout.info.setLayoutCount; i++)
-			set_layouts.PushBack(api_object_cast<uint64_t>(layout.info.pSetLayouts[i]), alloc);
-		p.AddMember("setLayouts", set_layouts, alloc);
-
-		pipeline_layouts.PushBack(p, alloc);
 	}
-	doc.AddMember("pipelineLayouts", pipeline_layouts, alloc);
 
-	Value shader_modules(kArrayType);
-	for (auto &module : this->shader_modules)
+	size_t count(uint32_t type) const
 	{
-		Value m(kObjectType);
-		m.AddMember("hash", module.hash, alloc);
-		m.AddMember("flags", module.info.flags, alloc);
-		m.AddMember("codeSize", module.info.codeSize, alloc);
-		m.AddMember("codeBinaryOffset", varint_spirv_offset, alloc);
-		size_t varint_size = compute_size_varint(module.info.pCode, module.info.codeSize / sizeof(uint32_t));
-		m.AddMember("codeBinarySize", varint_size, alloc);
-		varint_spirv_offset += varint_size;
-		shader_modules.PushBack(m, alloc);
+		return get(type).size();
 	}
-	doc.AddMember("shaderModules", shader_modules, alloc);
 
-	Value render_passes(kArrayType);
-	for (auto &pass : this->render_passes)
+	template <typename Func>
+	void for_each(uint32_t type, const Func &func) const
 	{
-		Value p(kObjectType);
-		p.AddMember("hash", pass.hash, alloc);
-		p.AddMember("flags", pass.info.flags, alloc);
+		for (auto &fragment : get(type))
+			func(fragment);
+	}
+};
+
+// Serializes fragments in batches while the JSON chunk is written, so only one batch is in memory at a time.
+struct StreamedFragments
+{
+	SerializationJobs &jobs;
+	const RecordedObjects &in;
+	const ReferenceRemap &remap;
+	const StateTables &states;
 
-		Value deps(kArrayType);
-		Value subpasses(kArrayType);
-		Value attachments(kArrayType);
+	// Where each shader module starts in the SPIR-V chunk, or empty if modules live in a SPIR-V store.
+	const vector<uint64_t> &module_offsets;
 
-		if (pass.info.pDependencies)
+	size_t count(uint32_t type) const
+	{
+		switch (type)
 		{
-			for (uint32_t i = 0; i < pass.info.dependencyCount; i++)
-			{
-				auto &d = pass.info.pDependencies[i];
-				Value dep(kObjectType);
-				dep.AddMember("dependencyFlags", d.dependencyFlags, alloc);
-				dep.AddMember("dstAccessMask", d.dstAccessMask, alloc);
-				dep.AddMember("srcAccessMask", d.srcAccessMask, alloc);
-				dep.AddMember("dstStageMask", d.dstStageMask, alloc);
-				dep.AddMember("srcStageMask", d.srcStageMask, alloc);
-				dep.AddMember("dstSubpass", d.dstSubpass, alloc);
-				dep.AddMember("srcSubpass", d.srcSubpass, alloc);
-				deps.PushBack(dep, alloc);
-			}
-			p.AddMember("dependencies", deps, alloc);
+		case uint32_t(ObjectType::Sampler):
+			return in.samplers->size();
+		case uint32_t(ObjectType::DescriptorSetLayout):
+			return in.set_layouts->size();
+		case uint32_t(ObjectType::PipelineLayout):
+			return in.pipeline_layouts->size();
+		case uint32_t(ObjectType::ShaderModule):
+			return in.shader_modules->size();
+		case uint32_t(ObjectType::RenderPass):
+			return in.render_passes->size();
+		case uint32_t(ObjectType::ComputePipeline):
+			return in.compute_pipelines->size();
+		case uint32_t(ObjectType::GraphicsPipeline):
+			return in.graphics_pipelines->size();
+		case FOSSILIZE_INDEX_TESSELLATION_STATE:
+			return states.tessellation_state.states.size();
+		case FOSSILIZE_INDEX_DYNAMIC_STATE:
+			return states.dynamic_state.states.size();
+		case FOSSILIZE_INDEX_MULTISAMPLE_STATE:
+			return states.multisample_state.states.size();
+		case FOSSILIZE_INDEX_VERTEX_INPUT_STATE:
+			return states.vertex_input_state.states.size();
+		case FOSSILIZE_INDEX_RASTERIZATION_STATE:
+			return states.rasterization_state.states.size();
+		case FOSSILIZE_INDEX_INPUT_ASSEMBLY_STATE:
+			return states.input_assembly_state.states.size();
+		case FOSSILIZE_INDEX_COLOR_BLEND_STATE:
+			return states.color_blend_state.states.size();
+		case FOSSILIZE_INDEX_VIEWPORT_STATE:
+			return states.viewport_state.states.size();
+		default:
+			return states.depth_stencil_state.states.size();
 		}
+	}
 
-		if (pass.info.pAttachments)
+	template <typename Func>
+	void for_each(uint32_t type, const Func &func) const
+	{
+		switch (type)
 		{
-			for (uint32_t i = 0; i < pass.info.attachmentCount; i++)
-			{
-				auto &a = pass.info.pAttachments[i];
-				Value att(kObjectType);
-
-				att.AddMember("flags", a.flags, alloc);
-				att.AddMember("format", a.format, alloc);
-				att.AddMember("finalLayout", a.finalLayout, alloc);
-				att.AddMember("initialLayout", a.initialLayout, alloc);
-				att.AddMember("loadOp", a.loadOp, alloc);
-				att.AddMember("storeOp", a.storeOp, alloc);
-				att.AddMember("samples", a.samples, alloc);
-				att.AddMember("stencilLoadOp", a.stencilLoadOp, alloc);
-				att.AddMember("stencilStoreOp", a.stencilStoreOp, alloc);
-
-				attachments.PushBack(att, alloc);
-			}
-			p.AddMember("attachments", attachments, alloc);
+		case uint32_t(ObjectType::Sampler):
+			stream(*in.samplers, serialize_sampler, func);
+			break;
+		case uint32_t(ObjectType::DescriptorSetLayout):
+			stream(*in.set_layouts,
+			       [this](const HashedInfo<VkDescriptorSetLayoutCreateInfo> &layout, Document::AllocatorType &alloc) {
+				       return serialize_descriptor_set_layout(layout, remap, alloc);
+			       }, func);
+			break;
+		case uint32_t(ObjectType::PipelineLayout):
+			stream(*in.pipeline_layouts,
+			       [this](const HashedInfo<VkPipelineLayoutCreateInfo> &layout, Document::AllocatorType &alloc) {
+				       return serialize_pipeline_layout(layout, remap, alloc);
+			       }, func);
+			break;
+		case uint32_t(ObjectType::ShaderModule):
+			stream(*in.shader_modules,
+			       [this](const HashedInfo<VkShaderModuleCreateInfo> &module, Document::AllocatorType &alloc) {
+				       if (module_offsets.empty())
+					       return serialize_stored_shader_module(module, alloc);
+				       size_t index = &module - in.shader_modules->data();
+				       return serialize_shader_module(module, module_offsets[index],
+				                                      module_offsets[index + 1] - module_offsets[index], alloc);
+			       }, func);
+			break;
+		case uint32_t(ObjectType::RenderPass):
+			stream(*in.render_passes, serialize_render_pass, func);
+			break;
+		case uint32_t(ObjectType::ComputePipeline):
+			stream(*in.compute_pipelines,
+			       [this](const HashedInfo<VkComputePipelineCreateInfo> &pipe, Document::AllocatorType &alloc) {
+				       return serialize_compute_pipeline(pipe, remap, alloc);
+			       }, func);
+			break;
+		case uint32_t(ObjectType::GraphicsPipeline):
+			stream(*in.graphics_pipelines,
+			       [this](const HashedInfo<VkGraphicsPipelineCreateInfo> &pipe, Document::AllocatorType &alloc) {
+				       return serialize_graphics_pipeline(pipe, states, remap, alloc);
+			       }, func);
+			break;
+		case FOSSILIZE_INDEX_TESSELLATION_STATE:
+			stream_states(states.tessellation_state, func);
+			break;
+		case FOSSILIZE_INDEX_DYNAMIC_STATE:
+			stream_states(states.dynamic_state, func);
+			break;
+		case FOSSILIZE_INDEX_MULTISAMPLE_STATE:
+			stream_states(states.multisample_state, func);
+			break;
+		case FOSSILIZE_INDEX_VERTEX_INPUT_STATE:
+			stream_states(states.vertex_input_state, func);
+			break;
+		case FOSSILIZE_INDEX_RASTERIZATION_STATE:
+			stream_states(states.rasterization_state, func);
+			break;
+		case FOSSILIZE_INDEX_INPUT_ASSEMBLY_STATE:
+			stream_states(states.input_assembly_state, func);
+			break;
+		case FOSSILIZE_INDEX_COLOR_BLEND_STATE:
+			stream_states(states.color_blend_state, func);
+			break;
+		case FOSSILIZE_INDEX_VIEWPORT_STATE:
+			stream_states(states.viewport_state, func);
+			break;
+		default:
+			stream_states(states.depth_stencil_state, func);
+			break;
 		}
+	}
 
-		for (uint32_t i = 0; i < pass.info.subpassCount; i++)
+	template <typename T, typename Serialize, typename Func>
+	void stream(const vector<T> &objects, const Serialize &serialize, const Func &func) const
+	{
+		vector<string> fragments;
+		for (size_t first = 0; first < objects.size(); first += FOSSILIZE_STREAM_BATCH_SIZE)
 		{
-			auto &sub = pass.info.pSubpasses[i];
-			Value p(kObjectType);
-			p.AddMember("flags", sub.flags, alloc);
-			p.AddMember("pipelineBindPoint", sub.pipelineBindPoint, alloc);
-
-			if (sub.pPreserveAttachments)
-			{
-				Value preserves(kArrayType);
-				for (uint32_t j = 0; j < sub.preserveAttachmentCount; j++)
-					preserves.PushBack(sub.pPreserveAttachments[j], alloc);
-				p.AddMember("preserveAttachments", preserves, alloc);
-			}
+			size_t count = std::min<size_t>(FOSSILIZE_STREAM_BATCH_SIZE, objects.size() - first);
+			fragments.resize(count);
+			jobs.run(count, FOSSILIZE_SERIALIZE_BATCH_SIZE, [&fragments, &objects, serialize, first](size_t begin, size_t end) {
+				Document::AllocatorType alloc;
+				for (size_t i = begin; i < end; i++)
+					fragments[i] = write_fragment(serialize(objects[first + i], alloc));
+			});
+			jobs.wait();
+
+			for (size_t i = 0; i < count; i++)
+				func(fragments[i]);
+		}
+	}
 
-			if (sub.pInputAttachments)
-			{
-				Value inputs(kArrayType);
-				for (uint32_t j = 0; j < sub.inputAttachmentCount; j++)
-				{
-					Value input(kObjectType);
-					auto &ia = sub.pInputAttachments[j];
-					input.AddMember("attachment", ia.attachment, alloc);
-					input.AddMember("layout", ia.layout, alloc);
-					inputs.PushBack(input, alloc);
-				}
-				p.AddMember("inputAttachments", inputs, alloc);
-			}
+	template <typename T, typename Func>
+	void stream_states(const SerializedStateTable<T> &table, const Func &func) const
+	{
+		auto serialize = table.serialize;
+		stream(table.states, [serialize](const T *state, Document::AllocatorType &alloc) {
+			return serialize(*state, alloc);
+		}, func);
+	}
+};
 
-			if (sub.pColorAttachments)
-			{
-				Value colors(kArrayType);
-				for (uint32_t j = 0; j < sub.colorAttachmentCount; j++)
-				{
-					Value color(kObjectType);
-					auto &c = sub.pColorAttachments[j];
-					color.AddMember("attachment", c.attachment, alloc);
-					color.AddMember("layout", c.layout, alloc);
-					colors.PushBack(color, alloc);
-				}
-				p.AddMember("colorAttachments", colors, alloc);
-			}
+// Records where each fragment ends up in the JSON chunk, so the index can point at it.
+template <typename JSONWriter, typename Stream, typename Fragments>
+static void write_fragments(JSONWriter &writer, const Stream &stream, const char *name, const Fragments &fragments,
+                            uint32_t type, vector<IndexEntry> *entries)
+{
+	writer.Key(name);
+	writer.StartArray();
+	uint32_t ordinal = 0;
+	fragments.for_each(type, [&](const string &fragment) {
+		writer.RawValue(fragment.data(), fragment.size(), kObjectType);
+		ordinal++;
+		if (entries)
+			entries->push_back({ type, ordinal, 0, stream.GetSize() - fragment.size(), fragment.size(), 0, 0 });
+	});
+	writer.EndArray();
+}
 
-			if (sub.pResolveAttachments)
-			{
-				Value resolves(kArrayType);
-				for (uint32_t j = 0; j < sub.colorAttachmentCount; j++)
-				{
-					Value resolve(kObjectType);
-					auto &r = sub.pResolveAttachments[j];
-					resolve.AddMember("attachment", r.attachment, alloc);
-					resolve.AddMember("layout", r.layout, alloc);
-					resolves.PushBack(resolve, alloc);
-				}
-				p.AddMember("resolveAttachments", resolves, alloc);
-			}
+template <typename JSONWriter, typename Stream, typename Fragments>
+static void write_state_fragments(JSONWriter &writer, const Stream &stream, const char *name, const Fragments &fragments,
+                                  uint32_t type, vector<IndexEntry> *entries)
+{
+	if (fragments.count(type))
+		write_fragments(writer, stream, name, fragments, type, entries);
+}
 
-			if (sub.pDepthStencilAttachment)
-			{
-				Value depth_stencil(kObjectType);
-				depth_stencil.AddMember("attachment", sub.pDepthStencilAttachment->attachment, alloc);
-				depth_stencil.AddMember("layout", sub.pDepthStencilAttachment->layout, alloc);
-				p.AddMember("depthStencilAttachment", depth_stencil, alloc);
-			}
+template <typename JSONWriter, typename Stream, typename Fragments>
+static void write_json(JSONWriter &writer, const Stream &stream, const Fragments &fragments, vector<IndexEntry> *entries)
+{
+	writer.StartObject();
+	writer.Key("version");
+	writer.Int(FOSSILIZE_FORMAT_VERSION);
+	write_fragments(writer, stream, "samplers", fragments, uint32_t(ObjectType::Sampler), entries);
+	write_fragments(writer, stream, "setLayouts", fragments, uint32_t(ObjectType::DescriptorSetLayout), entries);
+	write_fragments(writer, stream, "pipelineLayouts", fragments, uint32_t(ObjectType::PipelineLayout), entries);
+	write_fragments(writer, stream, "shaderModules", fragments, uint32_t(ObjectType::ShaderModule), entries);
+	write_fragments(writer, stream, "renderPasses", fragments, uint32_t(ObjectType::RenderPass), entries);
+	write_fragments(writer, stream, "computePipelines", fragments, uint32_t(ObjectType::ComputePipeline), entries);
+
+	writer.Key("states");
+	writer.StartObject();
+	write_state_fragments(writer, stream, "tessellationState", fragments, FOSSILIZE_INDEX_TESSELLATION_STATE, entries);
+	write_state_fragments(writer, stream, "dynamicState", fragments, FOSSILIZE_INDEX_DYNAMIC_STATE, entries);
+	write_state_fragments(writer, stream, "multisampleState", fragments, FOSSILIZE_INDEX_MULTISAMPLE_STATE, entries);
+	write_state_fragments(writer, stream, "vertexInputState", fragments, FOSSILIZE_INDEX_VERTEX_INPUT_STATE, entries);
+	write_state_fragments(writer, stream, "rasterizationState", fragments, FOSSILIZE_INDEX_RASTERIZATION_STATE, entries);
+	write_state_fragments(writer, stream, "inputAssemblyState", fragments, FOSSILIZE_INDEX_INPUT_ASSEMBLY_STATE, entries);
+	write_state_fragments(writer, stream, "colorBlendState", fragments, FOSSILIZE_INDEX_COLOR_BLEND_STATE, entries);
+	write_state_fragments(writer, stream, "viewportState", fragments, FOSSILIZE_INDEX_VIEWPORT_STATE, entries);
+	write_state_fragments(writer, stream, "depthStencilState", fragments, FOSSILIZE_INDEX_DEPTH_STENCIL_STATE, entries);
+	writer.EndObject();
+
+	write_fragments(writer, stream, "graphicsPipelines", fragments, uint32_t(ObjectType::GraphicsPipeline), entries);
+	writer.EndObject();
+}
 
-			subpasses.PushBack(p, alloc);
-		}
-		p.AddMember("subpasses", subpasses, alloc);
-		render_passes.PushBack(p, alloc);
+template <typename Stream, typename Fragments>
+static void write_json_chunk(Stream &stream, const Fragments &fragments, bool compact, vector<IndexEntry> *entries)
+{
+	if (compact)
+	{
+		Writer<Stream> writer(stream);
+		write_json(writer, stream, fragments, entries);
+	}
+	else
+	{
+		PrettyWriter<Stream> writer(stream);
+		write_json(writer, stream, fragments, entries);
 	}
-	doc.AddMember("renderPasses", render_passes, alloc);
+}
+
+namespace
+{
+struct IndexBuilder
+{
+	const RecordedObjects &in;
+	const ReferenceRemap &remap;
+	const StateTables &states;
 
-	Value compute_pipelines(kArrayType);
-	for (auto &pipe : this->compute_pipelines)
+	// Entry of each object after sorting, by type and archive ordinal.
+	vector<uint32_t> positions[FOSSILIZE_INDEX_TYPE_COUNT + 1];
+	vector<uint32_t> dependencies;
+
+	void add(uint32_t type, uint64_t ref)
 	{
-		Value p(kObjectType);
-		p.AddMember("hash", pipe.hash, alloc);
-		p.AddMember("flags", pipe.info.flags, alloc);
-		p.AddMember("layout", api_object_cast<uint64_t>(pipe.info.layout), alloc);
-		p.AddMember("basePipelineHandle", api_object_cast<uint64_t>(pipe.info.basePipelineHandle), alloc);
-		p.AddMember("basePipelineIndex", pipe.info.basePipelineIndex, alloc);
-		Value stage(kObjectType);
-		stage.AddMember("flags", pipe.info.stage.flags, alloc);
-		stage.AddMember("stage", pipe.info.stage.stage, alloc);
-		stage.AddMember("module", api_object_cast<uint64_t>(pipe.info.stage.module), alloc);
-		stage.AddMember("name", StringRef(pipe.info.stage.pName), alloc);
-		if (pipe.info.stage.pSpecializationInfo)
-		{
-			Value spec(kObjectType);
-			spec.AddMember("dataSize", pipe.info.stage.pSpecializationInfo->dataSize, alloc);
-			spec.AddMember("data",
-			               encode_base64(pipe.info.stage.pSpecializationInfo->pData,
-			                             pipe.info.stage.pSpecializationInfo->dataSize), alloc);
-			Value map_entries(kArrayType);
-			for (uint32_t i = 0; i < pipe.info.stage.pSpecializationInfo->mapEntryCount; i++)
-			{
-				auto &e = pipe.info.stage.pSpecializationInfo->pMapEntries[i];
-				Value map_entry(kObjectType);
-				map_entry.AddMember("offset", e.offset, alloc);
-				map_entry.AddMember("size", e.size, alloc);
-				map_entry.AddMember("constantID", e.constantID, alloc);
-				map_entries.PushBack(map_entry, alloc);
-			}
-			spec.AddMember("mapEntries", map_entries, alloc);
-			stage.AddMember("specializationInfo", spec, alloc);
-		}
-		p.AddMember("stage", stage, alloc);
-		compute_pipelines.PushBack(p, alloc);
+		if (!ref)
+			return;
+		if (ref > positions[type].size())
+			FOSSILIZE_THROW("Reference out of range.");
+		dependencies.push_back(positions[type][ref - 1]);
 	}
-	doc.AddMember("computePipelines", compute_pipelines, alloc);
 
-	Value graphics_pipelines(kArrayType);
-	for (auto &pipe : this->graphics_pipelines)
+	template <typename T>
+	void add_state(uint32_t type, const SerializedStateTable<T> &table, const T *state)
 	{
-		Value p(kObjectType);
-		p.AddMember("hash", pipe.hash, alloc);
-		p.AddMember("flags", pipe.info.flags, alloc);
-		p.AddMember("basePipelineHandle", api_object_cast<uint64_t>(pipe.info.basePipelineHandle), alloc);
-		p.AddMember("basePipelineIndex", pipe.info.basePipelineIndex, alloc);
-		p.AddMember("layout", api_object_cast<uint64_t>(pipe.info.layout), alloc);
-		p.AddMember("renderPass", api_object_cast<uint64_t>(pipe.info.renderPass), alloc);
-		p.AddMember("subpass", pipe.info.subpass, alloc);
+		if (state)
+			add(type, table.get_id(state));
+	}
 
-		if (pipe.info.pTessellationState)
+	Hash get_hash(const IndexEntry &entry) const
+	{
+		unsigned index = entry.ordinal - 1;
+		switch (ObjectType(entry.type))
 		{
-			Value tess(kObjectType);
-			tess.AddMember("flags", pipe.info.pTessellationState->flags, alloc);
-			tess.AddMember("patchControlPoints", pipe.info.pTessellationState->patchControlPoints, alloc);
-			p.AddMember("tessellationState", tess, alloc);
+		case ObjectType::Sampler:
+			return (*in.samplers)[index].hash;
+		case ObjectType::DescriptorSetLayout:
+			return (*in.set_layouts)[index].hash;
+		case ObjectType::PipelineLayout:
+			return (*in.pipeline_layouts)[index].hash;
+		case ObjectType::ShaderModule:
+			return (*in.shader_modules)[index].hash;
+		case ObjectType::RenderPass:
+			return (*in.render_passes)[index].hash;
+		case ObjectType::ComputePipeline:
+			return (*in.compute_pipelines)[index].hash;
+		case ObjectType::GraphicsPipeline:
+			return (*in.graphics_pipelines)[index].hash;
+		default:
+			return 0;
 		}
+	}
 
-		if (pipe.info.pDynamicState)
+	void add_dependencies(const IndexEntry &entry)
+	{
+		unsigned index = entry.ordinal - 1;
+		switch (ObjectType(entry.type))
 		{
-			Value dyn(kObjectType);
-			dyn.AddMember("flags", pipe.info.pDynamicState->flags, alloc);
-			Value dynamics(kArrayType);
-			for (uint32_t i = 0; i < pipe.info.pDynamicState->dynamicStateCount; i++)
-				dynamics.PushBack(pipe.info.pDynamicState->pDynamicStates[i], alloc);
-			dyn.AddMember("dynamicState", dynamics, alloc);
-			p.AddMember("dynamicState", dyn, alloc);
+		case ObjectType::DescriptorSetLayout:
+		{
+			auto &info = (*in.set_layouts)[index].info;
+			for (uint32_t i = 0; i < info.bindingCount; i++)
+				if (info.pBindings[i].pImmutableSamplers)
+					for (uint32_t j = 0; j < info.pBindings[i].descriptorCount; j++)
+						add(uint32_t(ObjectType::Sampler), remap.sampler(info.pBindings[i].pImmutableSamplers[j]));
+			break;
 		}
 
-		if (pipe.info.pMultisampleState)
+		case ObjectType::PipelineLayout:
 		{
-			Value ms(kObjectType);
-			ms.AddMember("flags", pipe.info.pMultisampleState->flags, alloc);
-			ms.AddMember("rasterizationSamples", pipe.info.pMultisampleState->rasterizationSamples, alloc);
-			ms.AddMember("sampleShadingEnable", pipe.info.pMultisampleState->sampleShadingEnable, alloc);
-			ms.AddMember("minSampleShading", pipe.info.pMultisampleState->minSampleShading, alloc);
-			ms.AddMember("alphaToOneEnable", pipe.info.pMultisampleState->alphaToOneEnable, alloc);
-			ms.AddMember("alphaToCoverageEnable", pipe.info.pMultisampleState->alphaToCoverageEnable, alloc);
-
-			Value sm(kArrayType);
-			if (pipe.info.pMultisampleState->pSampleMask)
-			{
-				auto entries = uint32_t(pipe.info.pMultisampleState->rasterizationSamples + 31) / 32;
-				for (uint32_t i = 0; i < entries; i++)
-					sm.PushBack(pipe.info.pMultisampleState->pSampleMask[i], alloc);
-				ms.AddMember("sampleMask", sm, alloc);
-			}
-
-			p.AddMember("multisampleState", ms, alloc);
+			auto &info = (*in.pipeline_layouts)[index].info;
+			for (uint32_t i = 0; i < info.setLayoutCount; i++)
+				add(uint32_t(ObjectType::DescriptorSetLayout), remap.set_layout(info.pSetLayouts[i]));
+			break;
 		}
 
-		if (pipe.info.pVertexInputState)
+		case ObjectType::ComputePipeline:
 		{
-			Value vi(kObjectType);
-
-			Value attribs(kArrayType);
-			Value bindings(kArrayType);
-			vi.AddMember("flags", pipe.info.pVertexInputState->flags, alloc);
+			auto &info = (*in.compute_pipelines)[index].info;
+			add(uint32_t(ObjectType::PipelineLayout), remap.pipeline_layout(info.layout));
+			add(uint32_t(ObjectType::ShaderModule), remap.shader_module(info.stage.module));
+			add(uint32_t(ObjectType::ComputePipeline), remap.compute_pipeline(info.basePipelineHandle));
+			break;
+		}
 
-			for (uint32_t i = 0; i < pipe.info.pVertexInputState->vertexAttributeDescriptionCount; i++)
-			{
-				auto &a = pipe.info.pVertexInputState->pVertexAttributeDescriptions[i];
-				Value attrib(kObjectType);
-				attrib.AddMember("location", a.location, alloc);
-				attrib.AddMember("binding", a.binding, alloc);
-				attrib.AddMember("offset", a.offset, alloc);
-				attrib.AddMember("format", a.format, alloc);
-				attribs.PushBack(attrib, alloc);
-			}
+		case ObjectType::GraphicsPipeline:
+		{
+			auto &info = (*in.graphics_pipelines)[index].info;
+			add(uint32_t(ObjectType::PipelineLayout), remap.pipeline_layout(info.layout));
+			add(uint32_t(ObjectType::RenderPass), remap.render_pass(info.renderPass));
+			for (uint32_t i = 0; i < info.stageCount; i++)
+				add(uint32_t(ObjectType::ShaderModule), remap.shader_module(info.pStages[i].module));
+			add(uint32_t(ObjectType::GraphicsPipeline), remap.graphics_pipeline(info.basePipelineHandle));
+			add_state(FOSSILIZE_INDEX_TESSELLATION_STATE, states.tessellation_state, info.pTessellationState);
+			add_state(FOSSILIZE_INDEX_DYNAMIC_STATE, states.dynamic_state, info.pDynamicState);
+			add_state(FOSSILIZE_INDEX_MULTISAMPLE_STATE, states.multisample_state, info.pMultisampleState);
+			add_state(FOSSILIZE_INDEX_VERTEX_INPUT_STATE, states.vertex_input_state, info.pVertexInputState);
+			add_state(FOSSILIZE_INDEX_RASTERIZATION_STATE, states.rasterization_state, info.pRasterizationState);
+			add_state(FOSSILIZE_INDEX_INPUT_ASSEMBLY_STATE, states.input_assembly_state, info.pInputAssemblyState);
+			add_state(FOSSILIZE_INDEX_COLOR_BLEND_STATE, states.color_blend_state, info.pColorBlendState);
+			add_state(FOSSILIZE_INDEX_VIEWPORT_STATE, states.viewport_state, info.pViewportState);
+			add_state(FOSSILIZE_INDEX_DEPTH_STENCIL_STATE, states.depth_stencil_state, info.pDepthStencilState);
+			break;
+		}
 
-			for (uint32_t i = 0; i < pipe.info.pVertexInputState->vertexBindingDescriptionCount; i++)
-			{
-				auto &b = pipe.info.pVertexInputState->pVertexBindingDescriptions[i];
-				Value binding(kObjectType);
-				binding.AddMember("binding", b.binding, alloc);
-				binding.AddMember("stride", b.stride, alloc);
-				binding.AddMember("inputRate", b.inputRate, alloc);
-				bindings.PushBack(binding, alloc);
-			}
-			vi.AddMember("attributes", attribs, alloc);
-			vi.AddMember("bindings", bindings, alloc);
-
-			p.AddMember("vertexInputState", vi, alloc);
-		}
-
-		if (pipe.info.pRasterizationState)
-		{
-			Value rs(kObjectType);
-			rs.AddMember("flags", pipe.info.pRasterizationState->flags, alloc);
-			rs.AddMember("depthBiasConstantFactor", pipe.info.pRasterizationState->depthBiasConstantFactor, alloc);
-			rs.AddMember("depthBiasSlopeFactor", pipe.info.pRasterizationState->depthBiasSlopeFactor, alloc);
-			rs.AddMember("depthBiasClamp", pipe.info.pRasterizationState->depthBiasClamp, alloc);
-			rs.AddMember("depthBiasEnable", pipe.info.pRasterizationState->depthBiasEnable, alloc);
-			rs.AddMember("depthClampEnable", pipe.info.pRasterizationState->depthClampEnable, alloc);
-			rs.AddMember("polygonMode", pipe.info.pRasterizationState->polygonMode, alloc);
-			rs.AddMember("rasterizerDiscardEnable", pipe.info.pRasterizationState->rasterizerDiscardEnable, alloc);
-			rs.AddMember("frontFace", pipe.info.pRasterizationState->frontFace, alloc);
-			rs.AddMember("lineWidth", pipe.info.pRasterizationState->lineWidth, alloc);
-			rs.AddMember("cullMode", pipe.info.pRasterizationState->cullMode, alloc);
-			p.AddMember("rasterizationState", rs, alloc);
-		}
-
-		if (pipe.info.pInputAssemblyState)
-		{
-			Value ia(kObjectType);
-			ia.AddMember("flags", pipe.info.pInputAssemblyState->flags, alloc);
-			ia.AddMember("topology", pipe.info.pInputAssemblyState->topology, alloc);
-			ia.AddMember("primitiveRestartEnable", pipe.info.pInputAssemblyState->primitiveRestartEnable, alloc);
-			p.AddMember("inputAssemblyState", ia, alloc);
-		}
-
-		if (pipe.info.pColorBlendState)
-		{
-			Value cb(kObjectType);
-			cb.AddMember("flags", pipe.info.pColorBlendState->flags, alloc);
-			cb.AddMember("logicOp", pipe.info.pColorBlendState->logicOp, alloc);
-			cb.AddMember("logicOpEnable", pipe.info.pColorBlendState->logicOpEnable, alloc);
-			Value blend_constants(kArrayType);
-			for (auto &c : pipe.info.pColorBlendState->blendConstants)
-				blend_constants.PushBack(c, alloc);
-			cb.AddMember("blendConstants", blend_constants, alloc);
-			Value attachments(kArrayType);
-			for (uint32_t i = 0; i < pipe.info.pColorBlendState->attachmentCount; i++)
-			{
-				auto &a = pipe.info.pColorBlendState->pAttachments[i];
-				Value att(kObjectType);
-				att.AddMember("dstAlphaBlendFactor", a.dstAlphaBlendFactor, alloc);
-				att.AddMember("srcAlphaBlendFactor", a.srcAlphaBlendFactor, alloc);
-				att.AddMember("dstColorBlendFactor", a.dstColorBlendFactor, alloc);
-				att.AddMember("srcColorBlendFactor", a.srcColorBlendFactor, alloc);
-				att.AddMember("colorWriteMask", a.colorWriteMask, alloc);
-				att.AddMember("alphaBlendOp", a.alphaBlendOp, alloc);
-				att.AddMember("colorBlendOp", a.colorBlendOp, alloc);
-				att.AddMember("blendEnable", a.blendEnable, alloc);
-				attachments.PushBack(att, alloc);
-			}
-			cb.AddMember("attachments", attachments, alloc);
-			p.AddMember("colorBlendState", cb, alloc);
+		default:
+			break;
 		}
+	}
 
-		if (pipe.info.pViewportState)
+	// Entries are sorted by type and hash, so readers can binary search for an object.
+	// Objects in `in` must be in archive order.
+	vector<uint8_t> build(vector<IndexEntry> &entries)
+	{
+		for (auto &entry : entries)
+			entry.hash = get_hash(entry);
+
+		sort(begin(entries), end(entries), [](const IndexEntry &a, const IndexEntry &b) {
+			if (a.type != b.type)
+				return a.type < b.type;
+			if (a.hash != b.hash)
+				return a.hash < b.hash;
+			return a.ordinal < b.ordinal;
+		});
+
+		for (uint32_t i = 0; i < entries.size(); i++)
 		{
-			Value vp(kObjectType);
-			vp.AddMember("flags", pipe.info.pViewportState->flags, alloc);
-			vp.AddMember("viewportCount", pipe.info.pViewportState->viewportCount, alloc);
-			vp.AddMember("scissorCount", pipe.info.pViewportState->scissorCount, alloc);
-			if (pipe.info.pViewportState->pViewports)
-			{
-				Value viewports(kArrayType);
-				for (uint32_t i = 0; i < pipe.info.pViewportState->viewportCount; i++)
-				{
-					Value viewport(kObjectType);
-					viewport.AddMember("x", pipe.info.pViewportState->pViewports[i].x, alloc);
-					viewport.AddMember("y", pipe.info.pViewportState->pViewports[i].y, alloc);
-					viewport.AddMember("width", pipe.info.pViewportState->pViewports[i].width, alloc);
-					viewport.AddMember("height", pipe.info.pViewportState->pViewports[i].height, alloc);
-					viewport.AddMember("minDepth", pipe.info.pViewportState->pViewports[i].minDepth, alloc);
-					viewport.AddMember("maxDepth", pipe.info.pViewportState->pViewports[i].maxDepth, alloc);
-					viewports.PushBack(viewport, alloc);
-				}
-				vp.AddMember("viewports", viewports, alloc);
-			}
+			auto &table = positions[entries[i].type];
+			if (table.size() < entries[i].ordinal)
+				table.resize(entries[i].ordinal);
+			table[entries[i].ordinal - 1] = i;
+		}
 
-			if (pipe.info.pViewportState->pScissors)
-			{
-				Value scissors(kArrayType);
-				for (uint32_t i = 0; i < pipe.info.pViewportState->scissorCount; i++)
-				{
-					Value scissor(kObjectType);
-					scissor.AddMember("x", pipe.info.pViewportState->pScissors[i].offset.x, alloc);
-					scissor.AddMember("y", pipe.info.pViewportState->pScissors[i].offset.y, alloc);
-					scissor.AddMember("width", pipe.info.pViewportState->pScissors[i].extent.width, alloc);
-					scissor.AddMember("height", pipe.info.pViewportState->pScissors[i].extent.height, alloc);
-					scissors.PushBack(scissor, alloc);
-				}
-				vp.AddMember("scissors", scissors, alloc);
-			}
-			p.AddMember("viewportState", vp, alloc);
-		}
-
-		if (pipe.info.pDepthStencilState)
-		{
-			Value ds(kObjectType);
-			ds.AddMember("flags", pipe.info.pDepthStencilState->flags, alloc);
-			ds.AddMember("stencilTestEnable", pipe.info.pDepthStencilState->stencilTestEnable, alloc);
-			ds.AddMember("maxDepthBounds", pipe.info.pDepthStencilState->maxDepthBounds, alloc);
-			ds.AddMember("minDepthBounds", pipe.info.pDepthStencilState->minDepthBounds, alloc);
-			ds.AddMember("depthBoundsTestEnable", pipe.info.pDepthStencilState->depthBoundsTestEnable, alloc);
-			ds.AddMember("depthWriteEnable", pipe.info.pDepthStencilState->depthWriteEnable, alloc);
-			ds.AddMember("depthTestEnable", pipe.info.pDepthStencilState->depthTestEnable, alloc);
-			ds.AddMember("depthCompareOp", pipe.info.pDepthStencilState->depthCompareOp, alloc);
-
-			const auto serialize_stencil = [&](Value &v, const VkStencilOpState &state) {
-				v.AddMember("compareOp", state.compareOp, alloc);
-				v.AddMember("writeMask", state.writeMask, alloc);
-				v.AddMember("reference", state.reference, alloc);
-				v.AddMember("compareMask", state.compareMask, alloc);
-				v.AddMember("passOp", state.passOp, alloc);
-				v.AddMember("failOp", state.failOp, alloc);
-				v.AddMember("depthFailOp", state.depthFailOp, alloc);
-			};
-			Value front(kObjectType);
-			Value back(kObjectType);
-			serialize_stencil(front, pipe.info.pDepthStencilState->front);
-			serialize_stencil(back, pipe.info.pDepthStencilState->back);
-			ds.AddMember("front", front, alloc);
-			ds.AddMember("back", back, alloc);
-			p.AddMember("depthStencilState", ds, alloc);
-		}
-
-		Value stages(kArrayType);
-		for (uint32_t i = 0; i < pipe.info.stageCount; i++)
+		for (auto &entry : entries)
 		{
-			auto &s = pipe.info.pStages[i];
-			Value stage(kObjectType);
-			stage.AddMember("flags", s.flags, alloc);
-			stage.AddMember("name", StringRef(s.pName), alloc);
-			stage.AddMember("module", api_object_cast<uint64_t>(s.module), alloc);
-			stage.AddMember("stage", s.stage, alloc);
-			if (s.pSpecializationInfo)
-			{
-				Value spec(kObjectType);
-				spec.AddMember("dataSize", s.pSpecializationInfo->dataSize, alloc);
-				spec.AddMember("data",
-				               encode_base64(s.pSpecializationInfo->pData,
-				                             s.pSpecializationInfo->dataSize), alloc);
-				Value map_entries(kArrayType);
-				for (uint32_t i = 0; i < s.pSpecializationInfo->mapEntryCount; i++)
-				{
-					auto &e = s.pSpecializationInfo->pMapEntries[i];
-					Value map_entry(kObjectType);
-					map_entry.AddMember("offset", e.offset, alloc);
-					map_entry.AddMember("size", e.size, alloc);
-					map_entry.AddMember("constantID", e.constantID, alloc);
-					map_entries.PushBack(map_entry, alloc);
-				}
-				spec.AddMember("mapEntries", map_entries, alloc);
-				stage.AddMember("specializationInfo", spec, alloc);
-			}
-			stages.PushBack(stage, alloc);
+			entry.first_dependency = uint32_t(dependencies.size());
+			add_dependencies(entry);
+			entry.dependency_count = uint32_t(dependencies.size()) - entry.first_dependency;
 		}
-		p.AddMember("stages", stages, alloc);
 
-		graphics_pipelines.PushBack(p, alloc);
+		// FIXME: Lazy native endian encoding.
+		vector<uint8_t> chunk;
+		append_value<uint32_t>(chunk, uint32_t(entries.size()));
+		append_value<uint32_t>(chunk, uint32_t(dependencies.size()));
+		auto *entry_data = reinterpret_cast<const uint8_t *>(entries.data());
+		chunk.insert(chunk.end(), entry_data, entry_data + entries.size() * sizeof(IndexEntry));
+		auto *dependency_data = reinterpret_cast<const uint8_t *>(dependencies.data());
+		chunk.insert(chunk.end(), dependency_data, dependency_data + dependencies.size() * sizeof(uint32_t));
+		return chunk;
 	}
-	doc.AddMember("graphicsPipelines", graphics_pipelines, alloc);
+};
+}
 
+vector<uint8_t> StateRecorder::serialize_archive(const SerializedObjects &objects, const RecordedObjects &in,
+                                                 const ReferenceRemap &remap, SerializationJobs &jobs) const
+{
 	StringBuffer buffer;
-	PrettyWriter<StringBuffer> writer(buffer);
-	doc.Accept(writer);
-	const char *json = buffer.GetString();
-	uint64_t json_len = buffer.GetSize();
-
-	uint64_t serialized_size = FOSSILIZE_MAGIC_LEN;
-	serialized_size += sizeof(uint64_t); // Total size.
-	serialized_size += sizeof(uint64_t); // JSON magic.
-	serialized_size += sizeof(uint64_t); // JSON chunk size.
-	serialized_size += json_len; // JSON data.
-	serialized_size += sizeof(uint64_t); // SPIR-V chunk magic.
-	serialized_size += sizeof(uint64_t); // SPIR-V size.
-	serialized_size += varint_spirv_offset; // SPIR-V data.
+	vector<IndexEntry> index_entries;
+	CachedFragments fragments = { objects };
+	write_json_chunk(buffer, fragments, compact_json, write_index ? &index_entries : nullptr);
+
+	auto *json = reinterpret_cast<const uint8_t *>(buffer.GetString());
+	size_t json_len = buffer.GetSize();
+	const char *spirv_magic = spirv_encoding == SpirvEncoding::SmolV ? FOSSILIZE_SMOLV_MAGIC : FOSSILIZE_SPIRV_MAGIC;
+	auto &spirv_blob = objects.spirv_blob;
 
 	// FIXME: Lazy native endian encoding.
-	vector<uint8_t> serialize_buffer(serialized_size);
-	auto *buf = serialize_buffer.data();
-
-	memcpy(buf, FOSSILIZE_MAGIC, FOSSILIZE_MAGIC_LEN);
-	buf += FOSSILIZE_MAGIC_LEN;
-	memcpy(buf, &serialized_size, sizeof(uint64_t));
-	buf += sizeof(uint64_t);
-
-	// Encode JSON block.
-	memcpy(buf, FOSSILIZE_JSON_MAGIC, sizeof(uint64_t));
-	buf += sizeof(uint64_t);
-	memcpy(buf, &json_len, sizeof(uint64_t));
-	buf += sizeof(uint64_t);
-	memcpy(buf, json, json_len);
-	buf += json_len;
-
-	// Encode SPIR-V block.
-	memcpy(buf, FOSSILIZE_SPIRV_MAGIC, sizeof(uint64_t));
-	buf += sizeof(uint64_t);
-	memcpy(buf, &varint_spirv_offset, sizeof(uint64_t));
-	buf += sizeof(uint64_t);
-
-	for (auto &module : this->shader_modules)
-		buf = encode_varint(buf, module.info.pCode, module.info.codeSize / sizeof(uint32_t));
-
-	assert(uint64_t(buf - serialize_buffer.data()) == serialized_size);
+	vector<uint8_t> serialize_buffer;
+	serialize_buffer.reserve(FOSSILIZE_MAGIC_LEN + 5 * sizeof(uint64_t) + json_len + spirv_blob.size());
+	serialize_buffer.insert(serialize_buffer.end(), FOSSILIZE_MAGIC, FOSSILIZE_MAGIC + FOSSILIZE_MAGIC_LEN);
+	append_value<uint64_t>(serialize_buffer, 0); // Total size, filled in below.
+
+	if (compression)
+	{
+		append_compressed_chunk(serialize_buffer, FOSSILIZE_JSON_MAGIC, json, json_len, jobs);
+		append_compressed_chunk(serialize_buffer, spirv_magic, spirv_blob.data(), spirv_blob.size(), jobs);
+	}
+	else
+	{
+		append_chunk(serialize_buffer, FOSSILIZE_JSON_MAGIC, json, json_len);
+		append_chunk(serialize_buffer, spirv_magic, spirv_blob.data(), spirv_blob.size());
+	}
+
+	// The index is small and read up front, so it is never compressed.
+	if (write_index)
+	{
+		IndexBuilder builder = { in, remap, objects.states };
+		auto index = builder.build(index_entries);
+		append_chunk(serialize_buffer, FOSSILIZE_INDEX_MAGIC, index.data(), index.size());
+	}
+
+	uint64_t serialized_size = serialize_buffer.size();
+	memcpy(serialize_buffer.data() + FOSSILIZE_MAGIC_LEN, &serialized_size, sizeof(uint64_t));
 	return serialize_buffer;
 }
 
+unsigned StateRecorder::get_num_unreferenced_objects(ObjectType type) const
+{
+	RecordedObjects in = {
+		&samplers, &descriptor_sets, &pipeline_layouts, &shader_modules,
+		&render_passes, &compute_pipelines, &graphics_pipelines,
+	};
+
+	ReachableObjects reachable;
+	find_reachable_objects(in, reachable);
+
+	const vector<bool> *objects = nullptr;
+	switch (type)
+	{
+	case ObjectType::Sampler:
+		objects = &reachable.samplers;
+		break;
+	case ObjectType::DescriptorSetLayout:
+		objects = &reachable.set_layouts;
+		break;
+	case ObjectType::PipelineLayout:
+		objects = &reachable.pipeline_layouts;
+		break;
+	case ObjectType::ShaderModule:
+		objects = &reachable.shader_modules;
+		break;
+	case ObjectType::RenderPass:
+		objects = &reachable.render_passes;
+		break;
+	default:
+		return 0;
+	}
+
+	return unsigned(count(begin(*objects), end(*objects), false));
+}
+
+// Copies of the recorded objects, reordered or with objects dropped, and how references translate to them.
+struct RemappedObjects
+{
+	vector<HashedInfo<VkSamplerCreateInfo>> samplers;
+	vector<HashedInfo<VkDescriptorSetLayoutCreateInfo>> set_layouts;
+	vector<HashedInfo<VkPipelineLayoutCreateInfo>> pipeline_layouts;
+	vector<HashedInfo<VkShaderModuleCreateInfo>> shader_modules;
+	vector<HashedInfo<VkRenderPassCreateInfo>> render_passes;
+	vector<HashedInfo<VkComputePipelineCreateInfo>> compute_pipelines;
+	vector<HashedInfo<VkGraphicsPipelineCreateInfo>> graphics_pipelines;
+	ReferenceRemap remap;
+
+	RecordedObjects get_objects() const
+	{
+		RecordedObjects in = {
+			&samplers, &set_layouts, &pipeline_layouts, &shader_modules,
+			&render_passes, &compute_pipelines, &graphics_pipelines,
+		};
+		return in;
+	}
+};
+
+static void remap_objects(const RecordedObjects &recorded, bool canonical_order, bool prune_unreferenced, RemappedObjects &out)
+{
+	// Empty sets keep all objects.
+	ReachableObjects reachable;
+	if (prune_unreferenced)
+		find_reachable_objects(recorded, reachable);
+	const vector<bool> all;
+
+	auto &remap = out.remap;
+	if (canonical_order)
+	{
+		canonicalize_objects(*recorded.samplers, reachable.samplers, out.samplers, remap.samplers);
+		canonicalize_objects(*recorded.set_layouts, reachable.set_layouts, out.set_layouts, remap.set_layouts);
+		canonicalize_objects(*recorded.pipeline_layouts, reachable.pipeline_layouts, out.pipeline_layouts, remap.pipeline_layouts);
+		canonicalize_objects(*recorded.shader_modules, reachable.shader_modules, out.shader_modules, remap.shader_modules);
+		canonicalize_objects(*recorded.render_passes, reachable.render_passes, out.render_passes, remap.render_passes);
+		canonicalize_objects(*recorded.compute_pipelines, all, out.compute_pipelines, remap.compute_pipelines);
+		canonicalize_objects(*recorded.graphics_pipelines, all, out.graphics_pipelines, remap.graphics_pipelines);
+	}
+	else
+	{
+		filter_objects(*recorded.samplers, reachable.samplers, out.samplers, remap.samplers);
+		filter_objects(*recorded.set_layouts, reachable.set_layouts, out.set_layouts, remap.set_layouts);
+		filter_objects(*recorded.pipeline_layouts, reachable.pipeline_layouts, out.pipeline_layouts, remap.pipeline_layouts);
+		filter_objects(*recorded.shader_modules, reachable.shader_modules, out.shader_modules, remap.shader_modules);
+		filter_objects(*recorded.render_passes, reachable.render_passes, out.render_passes, remap.render_passes);
+		filter_objects(*recorded.compute_pipelines, all, out.compute_pipelines, remap.compute_pipelines);
+		filter_objects(*recorded.graphics_pipelines, all, out.graphics_pipelines, remap.graphics_pipelines);
+	}
+}
+
+// Serializes everything from scratch, with objects reordered or dropped and references translated.
+vector<uint8_t> StateRecorder::serialize_remapped(SerializationJobs &jobs) const
+{
+	RecordedObjects recorded = {
+		&samplers, &descriptor_sets, &pipeline_layouts, &shader_modules,
+		&render_passes, &compute_pipelines, &graphics_pipelines,
+	};
+
+	RemappedObjects remapped;
+	remap_objects(recorded, canonical_order, prune_unreferenced, remapped);
+	RecordedObjects in = remapped.get_objects();
+
+	SerializedObjects objects;
+	serialize_new_objects(jobs, objects, in, remapped.remap, spirv_encoding, spirv_store);
+	return serialize_archive(objects, in, remapped.remap, jobs);
+}
+
+// Encodes shader modules in batches of about FOSSILIZE_STREAM_BUFFER_SIZE bytes of SPIR-V, and passes them on in order.
+template <typename Func>
+static void stream_shader_modules(SerializationJobs &jobs, const vector<HashedInfo<VkShaderModuleCreateInfo>> &modules,
+                                  SpirvEncoding encoding, const Func &func)
+{
+	vector<vector<uint8_t>> encoded;
+	size_t first = 0;
+	while (first < modules.size())
+	{
+		size_t last = first;
+		size_t batch_size = 0;
+		while (last < modules.size() && (last == first || batch_size < FOSSILIZE_STREAM_BUFFER_SIZE))
+			batch_size += modules[last++].info.codeSize;
+
+		encoded.resize(last - first);
+		jobs.run(last - first, 1, [&encoded, &modules, encoding, first](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++)
+				encode_shader_module(encoded[i], modules[first + i].info, encoding);
+		});
+		jobs.wait();
+
+		for (size_t i = 0; i < last - first; i++)
+			func(encoded[i]);
+		first = last;
+	}
+}
+
+void StateRecorder::serialize_to_file(const char *path) const
+{
+	SerializationJobs jobs(num_threads);
+
+	RecordedObjects in = {
+		&samplers, &descriptor_sets, &pipeline_layouts, &shader_modules,
+		&render_passes, &compute_pipelines, &graphics_pipelines,
+	};
+
+	// Without remapping, the recorded objects are serialized as they are, and the empty remap keeps references.
+	RemappedObjects remapped;
+	if (canonical_order || prune_unreferenced)
+	{
+		remap_objects(in, canonical_order, prune_unreferenced, remapped);
+		in = remapped.get_objects();
+	}
+
+	StateTables states;
+	for (auto &pipe : *in.graphics_pipelines)
+		states.add(pipe.info);
+
+	// Modules are encoded once to place them in the SPIR-V chunk, and once more to write them.
+	auto &modules = *in.shader_modules;
+	vector<uint64_t> module_offsets;
+	if (spirv_store)
+	{
+		jobs.run(modules.size(), FOSSILIZE_SERIALIZE_BATCH_SIZE, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++)
+				if (!spirv_store->store(modules[i].hash, modules[i].info.pCode, modules[i].info.codeSize))
+					FOSSILIZE_THROW("Failed to write shader module to SPIR-V store.");
+		});
+		jobs.wait();
+	}
+	else
+	{
+		module_offsets.push_back(0);
+		stream_shader_modules(jobs, modules, spirv_encoding, [&](const vector<uint8_t> &encoded) {
+			module_offsets.push_back(module_offsets.back() + encoded.size());
+		});
+	}
+
+	StreamedFragments fragments = { jobs, in, remapped.remap, states, module_offsets };
+
+	// Compressed chunks need their size up front, which costs an extra pass over the JSON.
+	uint64_t json_size = 0;
+	if (compression)
+	{
+		CountingStream counter;
+		write_json_chunk(counter, fragments, compact_json, nullptr);
+		json_size = counter.GetSize();
+	}
+
+	ArchiveFileWriter file(path);
+	file.write(FOSSILIZE_MAGIC, FOSSILIZE_MAGIC_LEN);
+	file.write_value<uint64_t>(0); // Total size, filled in below.
+
+	vector<IndexEntry> index_entries;
+	ChunkWriter json(file, jobs, FOSSILIZE_JSON_MAGIC, compression, json_size);
+	write_json_chunk(json, fragments, compact_json, write_index ? &index_entries : nullptr);
+	json.finish();
+
+	const char *spirv_magic = spirv_encoding == SpirvEncoding::SmolV ? FOSSILIZE_SMOLV_MAGIC : FOSSILIZE_SPIRV_MAGIC;
+	ChunkWriter spirv(file, jobs, spirv_magic, compression, module_offsets.empty() ? 0 : module_offsets.back());
+	if (!spirv_store)
+	{
+		stream_shader_modules(jobs, modules, spirv_encoding, [&](const vector<uint8_t> &encoded) {
+			spirv.write(encoded.data(), encoded.size());
+		});
+	}
+	spirv.finish();
+
+	if (write_index)
+	{
+		IndexBuilder builder = { in, remapped.remap, states };
+		auto index = builder.build(index_entries);
+		file.write(FOSSILIZE_INDEX_MAGIC, sizeof(uint64_t));
+		file.write_value<uint64_t>(index.size());
+		file.write(index.data(), index.size());
+	}
+
+	uint64_t serialized_size = file.get_offset();
+	file.patch(FOSSILIZE_MAGIC_LEN, &serialized_size, sizeof(uint64_t));
+	file.close();
+}
+
+vector<uint8_t> StateRecorder::serialize() const
+{
+	SerializationJobs jobs(num_threads);
+	if (canonical_order || prune_unreferenced)
+		return serialize_remapped(jobs);
+
+	auto &cache = *serialization_cache;
+	lock_guard<mutex> holder{ cache.lock };
+
+	if (cache.spirv_encoding != spirv_encoding || cache.spirv_store != spirv_store)
+	{
+		cache.shader_modules.clear();
+		cache.spirv_blob.clear();
+		cache.spirv_encoding = spirv_encoding;
+		cache.spirv_store = spirv_store;
+	}
+
+	RecordedObjects in = {
+		&samplers, &descriptor_sets, &pipeline_layouts, &shader_modules,
+		&render_passes, &compute_pipelines, &graphics_pipelines,
+	};
+
+	ReferenceRemap remap;
+	try
+	{
+		serialize_new_objects(jobs, cache, in, remap, spirv_encoding, spirv_store);
+	}
+	catch (...)
+	{
+		// Slots for new objects might not have been filled in.
+		cache.clear();
+		throw;
+	}
+
+	return serialize_archive(cache, in, remap, jobs);
+}
+
 }
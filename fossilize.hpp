@@ -23,10 +23,13 @@
 #pragma once
 
 #include "vulkan.h"
+#include "handle_map.hpp"
 #include <stdint.h>
 #include <vector>
 #include <memory>
 #include <unordered_map>
+#include <mutex>
+#include <thread>
 
 #define RAPIDJSON_HAS_STDSTRING 1
 #include "rapidjson/document.h"
@@ -62,15 +65,54 @@ private:
 #define FOSSILIZE_MAGIC "FOSSILIZE0000001"
 #define FOSSILIZE_JSON_MAGIC "JSON    "
 #define FOSSILIZE_SPIRV_MAGIC "SPIR-V  "
+#define FOSSILIZE_SMOLV_MAGIC "SMOL-V  "
+#define FOSSILIZE_BLOCK_LZ_MAGIC "BLOCK-LZ"
+#define FOSSILIZE_INDEX_MAGIC "INDEX   "
 #define FOSSILIZE_MAGIC_LEN 16
 
 enum
 {
-	FOSSILIZE_FORMAT_VERSION = 1
+	FOSSILIZE_FORMAT_VERSION = 2
 };
 
 using Hash = uint64_t;
 
+// How the SPIR-V chunk of an archive is encoded.
+// The encoding is identified by the chunk magic, so it can be chosen per archive.
+enum class SpirvEncoding
+{
+	Varint,
+	SmolV
+};
+
+// Holds SPIR-V of shader modules outside of archives, keyed by shader module hash,
+// so archives which share modules can refer to a single copy. See DirectorySpirvStore.
+class SpirvStore
+{
+public:
+	virtual ~SpirvStore() = default;
+
+	// Sizes are in bytes. Storing a module which is already present must succeed without rewriting it.
+	// Must be safe to call from multiple threads.
+	virtual bool store(Hash hash, const uint32_t *code, size_t size) = 0;
+
+	// Returns nullptr if the module is not in the store.
+	// The code must stay valid and unchanged for as long as the store exists.
+	virtual const uint32_t *load(Hash hash, size_t *size) = 0;
+};
+
+// Object types which can be looked up by hash in an indexed archive.
+enum class ObjectType : uint32_t
+{
+	Sampler = 1,
+	DescriptorSetLayout,
+	PipelineLayout,
+	ShaderModule,
+	RenderPass,
+	ComputePipeline,
+	GraphicsPipeline
+};
+
 class Hasher
 {
 public:
@@ -146,6 +188,25 @@ private:
 	Hash h = 0xcbf29ce484222325ull;
 };
 
+// Thread-safe pool of fixed size pages which ScratchAllocators carve their blocks from.
+// Pages are recycled when an allocator backed by the pool is destroyed.
+class ScratchPagePool
+{
+public:
+	ScratchPagePool() = default;
+	~ScratchPagePool();
+	ScratchPagePool(const ScratchPagePool &) = delete;
+	void operator=(const ScratchPagePool &) = delete;
+
+	uint8_t *allocate_page();
+	void free_page(uint8_t *page);
+	size_t get_page_size() const;
+
+private:
+	std::mutex lock;
+	std::vector<uint8_t *> free_pages;
+};
+
 class ScratchAllocator
 {
 public:
@@ -178,21 +239,132 @@ public:
 		return static_cast<T *>(allocate_raw_cleared(sizeof(T) * count, 16));
 	}
 
+	// Memory returned by allocate_raw() is uninitialized.
 	void *allocate_raw(size_t size, size_t alignment);
 	void *allocate_raw_cleared(size_t size, size_t alignment);
 
+	// Rewinds all allocations. Blocks are kept around for reuse, dedicated allocations are freed.
+	void reset();
+
+	struct Marker
+	{
+		size_t block_index;
+		size_t offset;
+		size_t dedicated_count;
+		size_t bytes_dedicated;
+		size_t bytes_used;
+		size_t bytes_wasted;
+	};
+
+	// Everything allocated after get_marker() is invalidated by rewind().
+	Marker get_marker() const;
+	void rewind(const Marker &marker);
+
+	class ScopedMarker
+	{
+	public:
+		explicit ScopedMarker(ScratchAllocator &allocator);
+		~ScopedMarker();
+		ScopedMarker(const ScopedMarker &) = delete;
+		void operator=(const ScopedMarker &) = delete;
+
+	private:
+		ScratchAllocator &allocator;
+		Marker marker;
+	};
+
+	// Bytes handed out to callers, and bytes lost to alignment padding and unused block tails.
+	size_t get_bytes_used() const;
+	size_t get_bytes_wasted() const;
+
+	// Bytes currently owned by the allocator.
+	size_t get_bytes_reserved() const;
+
+	// If pool is non-null, blocks are taken from and returned to the pool.
+	explicit ScratchAllocator(ScratchPagePool *pool = nullptr);
+	~ScratchAllocator();
+	ScratchAllocator(const ScratchAllocator &) = delete;
+	void operator=(const ScratchAllocator &) = delete;
+
 private:
 	struct Block
 	{
-		Block(size_t size);
-		size_t offset = 0;
-		std::vector<uint8_t> blob;
+		size_t offset;
+		uint8_t *blob;
 	};
+	ScratchPagePool *pool;
 	std::vector<Block> blocks;
+	std::vector<std::unique_ptr<uint8_t[]>> dedicated;
+	size_t current_block = 0;
+	size_t bytes_used = 0;
+	size_t bytes_wasted = 0;
+	size_t bytes_dedicated = 0;
 
-	void add_block(size_t minimum_size);
+	void *allocate_dedicated(size_t size, size_t alignment);
 };
 
+// Hands out one ScratchAllocator per thread, all backed by a shared page pool.
+// After the first allocation on a thread, looking up its allocator does not take any locks.
+class ConcurrentScratchAllocator
+{
+public:
+	ConcurrentScratchAllocator();
+	ConcurrentScratchAllocator(const ConcurrentScratchAllocator &) = delete;
+	void operator=(const ConcurrentScratchAllocator &) = delete;
+
+	ScratchAllocator &get_thread_allocator();
+
+	template <typename T>
+	T *allocate()
+	{
+		return get_thread_allocator().allocate<T>();
+	}
+
+	template <typename T>
+	T *allocate_cleared()
+	{
+		return get_thread_allocator().allocate_cleared<T>();
+	}
+
+	template <typename T>
+	T *allocate_n(size_t count)
+	{
+		return get_thread_allocator().allocate_n<T>(count);
+	}
+
+	template <typename T>
+	T *allocate_n_cleared(size_t count)
+	{
+		return get_thread_allocator().allocate_n_cleared<T>(count);
+	}
+
+	void *allocate_raw(size_t size, size_t alignment);
+	void *allocate_raw_cleared(size_t size, size_t alignment);
+
+	// Resets every per-thread allocator. Must not race with allocations on other threads.
+	void reset();
+
+	size_t get_bytes_used() const;
+	size_t get_bytes_wasted() const;
+	size_t get_bytes_reserved() const;
+
+private:
+	ScratchPagePool pool;
+	uint64_t id;
+
+	mutable std::mutex lock;
+	struct ThreadAllocator
+	{
+		std::thread::id thread;
+		std::unique_ptr<ScratchAllocator> allocator;
+	};
+	std::vector<ThreadAllocator> thread_allocators;
+};
+
+// Content-addressed sub-states, bucketed by hash.
+template <typename T>
+using StateInternTable = std::unordered_map<Hash, std::vector<const T *>>;
+
 template <typename T>
 struct HashedInfo
 {
@@ -225,10 +397,50 @@ public:
 class StateReplayer
 {
 public:
+	StateReplayer();
+	~StateReplayer();
+
 	void parse(StateCreatorInterface &iface, const void *buffer, size_t size);
 
+	// Reads only the container and the index of an archive written with StateRecorder::set_write_index(true).
+	// Object counts are reported through set_num_*, but nothing is created until parse_object() is called.
+	// The buffer must stay valid until reset() or the next parse_index().
+	void parse_index(StateCreatorInterface &iface, const void *buffer, size_t size);
+
+	// Creates one object and everything it refers to, decompressing and parsing only those parts of the archive.
+	// Objects which were already created are not created again. Returns false if the index has no such object.
+	bool parse_object(StateCreatorInterface &iface, ObjectType type, Hash hash);
+
+	// Like parse_object(), but selects the object by the index parse() would report it with.
+	bool parse_object_at(StateCreatorInterface &iface, ObjectType type, unsigned index);
+
+	// Returns true if the buffer is an archive with an index, i.e. parse_index() can be used.
+	static bool has_index(const void *buffer, size_t size);
+
+	// Resolves shader modules which were written to a shared SPIR-V store rather than the archive.
+	// Their create infos point straight at the code returned by the store.
+	void set_spirv_store(SpirvStore *store);
+
+	// Creates shader modules with a null pCode, but the real codeSize. The SPIR-V chunk is neither
+	// decompressed nor decoded, which makes parsing much faster for tools which only inspect create infos.
+	void set_skip_shader_code(bool skip);
+
+	// Threads used to decompress block compressed archives.
+	// 0 (default) uses one thread per hardware thread.
+	void set_num_threads(unsigned count);
+
+	// Frees all create infos handed out by earlier calls to parse(), but keeps the memory around
+	// so the replayer can be reused for another archive.
+	void reset();
+
 private:
-	ScratchAllocator allocator;
+	ConcurrentScratchAllocator allocator;
+	unsigned num_threads = 0;
+	SpirvStore *spirv_store = nullptr;
+	bool skip_shader_code = false;
+
+	struct IndexedArchive;
+	std::unique_ptr<IndexedArchive> archive;
 
 	std::vector<VkSampler> replayed_samplers;
 	std::vector<VkDescriptorSetLayout> replayed_descriptor_set_layouts;
@@ -238,13 +450,42 @@ private:
 	std::vector<VkPipeline> replayed_compute_pipelines;
 	std::vector<VkPipeline> replayed_graphics_pipelines;
 
+	// Shared fixed-function states, referenced by ID from graphics pipelines.
+	std::vector<const VkPipelineTessellationStateCreateInfo *> replayed_tessellation_states;
+	std::vector<const VkPipelineColorBlendStateCreateInfo *> replayed_color_blend_states;
+	std::vector<const VkPipelineVertexInputStateCreateInfo *> replayed_vertex_input_states;
+	std::vector<const VkPipelineMultisampleStateCreateInfo *> replayed_multisample_states;
+	std::vector<const VkPipelineDynamicStateCreateInfo *> replayed_dynamic_states;
+	std::vector<const VkPipelineViewportStateCreateInfo *> replayed_viewport_states;
+	std::vector<const VkPipelineInputAssemblyStateCreateInfo *> replayed_input_assembly_states;
+	std::vector<const VkPipelineDepthStencilStateCreateInfo *> replayed_depth_stencil_states;
+	std::vector<const VkPipelineRasterizationStateCreateInfo *> replayed_rasterization_states;
+
+	void parse_sampler(StateCreatorInterface &iface, const rapidjson::Value &obj, unsigned index);
+	void parse_descriptor_set_layout(StateCreatorInterface &iface, const rapidjson::Value &obj, unsigned index);
+	void parse_pipeline_layout(StateCreatorInterface &iface, const rapidjson::Value &obj, unsigned index);
+	void parse_shader_module(StateCreatorInterface &iface, const rapidjson::Value &obj, unsigned index,
+	                         const uint8_t *buffer, size_t size, SpirvEncoding encoding);
+	void parse_render_pass(StateCreatorInterface &iface, const rapidjson::Value &obj, unsigned index);
+	void parse_compute_pipeline(StateCreatorInterface &iface, const rapidjson::Value &obj, unsigned index);
+	void parse_graphics_pipeline(StateCreatorInterface &iface, const rapidjson::Value &obj, unsigned index);
+	void materialize_object(StateCreatorInterface &iface, uint32_t entry);
+	void parse_indexed_object(StateCreatorInterface &iface, uint32_t entry);
 	void parse_samplers(StateCreatorInterface &iface, const rapidjson::Value &samplers);
 	void parse_descriptor_set_layouts(StateCreatorInterface &iface, const rapidjson::Value &layouts);
 	void parse_pipeline_layouts(StateCreatorInterface &iface, const rapidjson::Value &layouts);
-	void parse_shader_modules(StateCreatorInterface &iface, const rapidjson::Value &modules, const uint8_t *buffer, size_t size);
+	void parse_shader_modules(StateCreatorInterface &iface, const rapidjson::Value &modules, const uint8_t *buffer, size_t size,
+	                          SpirvEncoding encoding);
 	void parse_render_passes(StateCreatorInterface &iface, const rapidjson::Value &passes);
 	void parse_compute_pipelines(StateCreatorInterface &iface, const rapidjson::Value &pipelines);
 	void parse_graphics_pipelines(StateCreatorInterface &iface, const rapidjson::Value &pipelines);
+	void parse_states(const rapidjson::Value &states);
+	template <typename T>
+	void parse_state_table(const rapidjson::Value &states, const char *name, std::vector<const T *> &table,
+	                       T *(StateReplayer::*parse)(const rapidjson::Value &));
+	template <typename T>
+	const T *resolve_state(const rapidjson::Value &value, const std::vector<const T *> &states,
+	                       T *(StateReplayer::*parse)(const rapidjson::Value &));
 	VkPushConstantRange *parse_push_constant_ranges(const rapidjson::Value &ranges);
 	VkDescriptorSetLayout *parse_set_layouts(const rapidjson::Value &layouts);
 	VkDescriptorSetLayoutBinding *parse_descriptor_set_bindings(const rapidjson::Value &bindings);
@@ -278,9 +519,17 @@ private:
 	T *copy(const T *src, size_t count);
 };
 
+class SerializationJobs;
+struct SerializedObjects;
+struct RecordedObjects;
+struct ReferenceRemap;
+
 class StateRecorder
 {
 public:
+	StateRecorder();
+	~StateRecorder();
+
 	// TODO: create_device which can capture which features/exts are used to create the device.
 	// This can be relevant when using more exotic features.
 
@@ -300,6 +549,16 @@ public:
 	void set_render_pass_handle(unsigned index, VkRenderPass render_pass);
 	void set_sampler_handle(unsigned index, VkSampler sampler);
 
+	// Unmaps handles of destroyed objects, so a recycled handle value cannot alias an old object.
+	// Create infos which are already recorded are kept.
+	void remove_descriptor_set_layout_handle(VkDescriptorSetLayout layout);
+	void remove_pipeline_layout_handle(VkPipelineLayout layout);
+	void remove_shader_module_handle(VkShaderModule module);
+	void remove_graphics_pipeline_handle(VkPipeline pipeline);
+	void remove_compute_pipeline_handle(VkPipeline pipeline);
+	void remove_render_pass_handle(VkRenderPass render_pass);
+	void remove_sampler_handle(VkSampler sampler);
+
 	Hash get_hash_for_descriptor_set_layout(VkDescriptorSetLayout layout) const;
 	Hash get_hash_for_pipeline_layout(VkPipelineLayout layout) const;
 	Hash get_hash_for_shader_module(VkShaderModule module) const;
@@ -308,10 +567,77 @@ public:
 	Hash get_hash_for_render_pass(VkRenderPass render_pass) const;
 	Hash get_hash_for_sampler(VkSampler sampler) const;
 
+	// Pipelines are deep-copied into one contiguous, cache-line aligned blob.
+	// These return the size of that blob, excluding the top-level create info.
+	// Fixed-function sub-states of graphics pipelines are interned separately and are not part of the blob.
+	static size_t compute_graphics_pipeline_footprint(const VkGraphicsPipelineCreateInfo &create_info);
+	static size_t compute_compute_pipeline_footprint(const VkComputePipelineCreateInfo &create_info);
+
+	// Defaults to SpirvEncoding::Varint.
+	void set_spirv_encoding(SpirvEncoding encoding);
+
+	// Splits the JSON and SPIR-V chunks into independently LZ compressed blocks. Disabled by default.
+	void set_compression(bool enable);
+
+	// Writes the JSON chunk without whitespace. Disabled by default.
+	void set_compact_json(bool enable);
+
+	// Sorts objects by hash and drops duplicates, so the same set of state always serializes to the same archive,
+	// regardless of the order it was recorded in. This re-serializes every object on each call. Disabled by default.
+	void set_canonical_order(bool enable);
+
+	// Drops samplers, layouts, shader modules and render passes which no recorded pipeline refers to, directly or
+	// through other objects. Like canonical order, this re-serializes every object on each call. Disabled by default.
+	void set_prune_unreferenced(bool enable);
+
+	// Number of recorded objects of a type which set_prune_unreferenced(true) drops. Pipelines are never dropped.
+	unsigned get_num_unreferenced_objects(ObjectType type) const;
+
+	// Strips OpSource*, OpName, OpMemberName, OpString, OpLine, OpNoLine and OpModuleProcessed from shader modules
+	// as they are registered, and makes Hashing::compute_hash_shader_module() hash the stripped module.
+	// Modules which only differ in debug info then share one hash, and so do pipelines using them. Disabled by default.
+	void set_strip_debug_info(bool enable);
+	bool get_strip_debug_info() const;
+
+	// Writes SPIR-V of shader modules to a shared store instead of the archive, and only refers to them by hash.
+	// The store must outlive the recorder. nullptr (default) embeds SPIR-V in the archive.
+	void set_spirv_store(SpirvStore *store);
+
+	// Appends an index of all objects with their dependencies and JSON offsets,
+	// so StateReplayer::parse_index() can create single objects. Disabled by default.
+	void set_write_index(bool enable);
+
+	// Threads used to serialize new objects and compress blocks. The archive does not depend on the thread count.
+	// 1 (default) serializes on the calling thread, 0 uses one thread per hardware thread.
+	void set_num_threads(unsigned count);
+
+	// Objects are converted to JSON once and cached, so repeated calls only pay for objects recorded in between.
 	std::vector<uint8_t> serialize() const;
 
+	// Writes the same archive as serialize() to a file, but serializes and compresses objects in bounded batches
+	// as it goes, so memory use does not grow with the size of the archive. Nothing is cached between calls.
+	// The archive is written to a temporary file which replaces path once complete. On failure, this throws,
+	// the temporary file is removed, and an archive which already existed at path is left as it was.
+	void serialize_to_file(const char *path) const;
+
+	// Forgets all recorded state and handles. Encoding and compression settings are kept,
+	// and allocated memory is reused for subsequent recording.
+	void reset();
+
 private:
-	ScratchAllocator allocator;
+	ConcurrentScratchAllocator allocator;
+	SpirvEncoding spirv_encoding = SpirvEncoding::Varint;
+	bool compression = false;
+	unsigned num_threads = 1;
+	bool compact_json = false;
+	bool canonical_order = false;
+	bool prune_unreferenced = false;
+	bool strip_debug_info = false;
+	bool write_index = false;
+	SpirvStore *spirv_store = nullptr;
+
+	struct SerializationCache;
+	std::unique_ptr<SerializationCache> serialization_cache;
 
 	std::vector<HashedInfo<VkDescriptorSetLayoutCreateInfo>> descriptor_sets;
 	std::vector<HashedInfo<VkPipelineLayoutCreateInfo>> pipeline_layouts;
@@ -321,13 +647,23 @@ private:
 	std::vector<HashedInfo<VkRenderPassCreateInfo>> render_passes;
 	std::vector<HashedInfo<VkSamplerCreateInfo>> samplers;
 
-	std::unordered_map<VkDescriptorSetLayout, unsigned> descriptor_set_layout_to_index;
-	std::unordered_map<VkPipelineLayout, unsigned> pipeline_layout_to_index;
-	std::unordered_map<VkShaderModule, unsigned> shader_module_to_index;
-	std::unordered_map<VkPipeline, unsigned> graphics_pipeline_to_index;
-	std::unordered_map<VkPipeline, unsigned> compute_pipeline_to_index;
-	std::unordered_map<VkRenderPass, unsigned> render_pass_to_index;
-	std::unordered_map<VkSampler, unsigned> sampler_to_index;
+	StateInternTable<VkPipelineTessellationStateCreateInfo> tessellation_states;
+	StateInternTable<VkPipelineColorBlendStateCreateInfo> color_blend_states;
+	StateInternTable<VkPipelineVertexInputStateCreateInfo> vertex_input_states;
+	StateInternTable<VkPipelineMultisampleStateCreateInfo> multisample_states;
+	StateInternTable<VkPipelineDynamicStateCreateInfo> dynamic_states;
+	StateInternTable<VkPipelineViewportStateCreateInfo> viewport_states;
+	StateInternTable<VkPipelineInputAssemblyStateCreateInfo> input_assembly_states;
+	StateInternTable<VkPipelineDepthStencilStateCreateInfo> depth_stencil_states;
+	StateInternTable<VkPipelineRasterizationStateCreateInfo> rasterization_states;
+
+	HandleMap<VkDescriptorSetLayout, unsigned> descriptor_set_layout_to_index;
+	HandleMap<VkPipelineLayout, unsigned> pipeline_layout_to_index;
+	HandleMap<VkShaderModule, unsigned> shader_module_to_index;
+	HandleMap<VkPipeline, unsigned> graphics_pipeline_to_index;
+	HandleMap<VkPipeline, unsigned> compute_pipeline_to_index;
+	HandleMap<VkRenderPass, unsigned> render_pass_to_index;
+	HandleMap<VkSampler, unsigned> sampler_to_index;
 
 	VkDescriptorSetLayoutCreateInfo copy_descriptor_set_layout(const VkDescriptorSetLayoutCreateInfo &create_info);
 	VkPipelineLayoutCreateInfo copy_pipeline_layout(const VkPipelineLayoutCreateInfo &create_info);
@@ -337,7 +673,12 @@ private:
 	VkSamplerCreateInfo copy_sampler(const VkSamplerCreateInfo &create_info);
 	VkRenderPassCreateInfo copy_render_pass(const VkRenderPassCreateInfo &create_info);
 
-	VkSpecializationInfo *copy_specialization_info(const VkSpecializationInfo *info);
+	template <typename T, typename... Args>
+	const T *intern_state(StateInternTable<T> &table, const T *state, Args... args);
+
+	std::vector<uint8_t> serialize_archive(const SerializedObjects &objects, const RecordedObjects &in,
+	                                       const ReferenceRemap &remap, SerializationJobs &jobs) const;
+	std::vector<uint8_t> serialize_remapped(SerializationJobs &jobs) const;
 
 	VkSampler remap_sampler_handle(VkSampler sampler) const;
 	VkDescriptorSetLayout remap_descriptor_set_layout_handle(VkDescriptorSetLayout layout) const;
@@ -351,6 +692,11 @@ private:
 	T *copy(const T *src, size_t count);
 };
 
+// Returns the module without the debug info which StateRecorder::set_strip_debug_info() removes.
+// OpString is kept if the module imports extended debug info instructions, which refer to it.
+// Code which does not parse as SPIR-V is returned unchanged.
+std::vector<uint32_t> strip_spirv_debug_info(const uint32_t *code, size_t size);
+
 namespace Hashing
 {
 Hash compute_hash_descriptor_set_layout(const StateRecorder &recorder, const VkDescriptorSetLayoutCreateInfo &layout);
@@ -0,0 +1,247 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <utility>
+
+namespace Fossilize
+{
+static inline uint64_t handle_map_key(uint64_t handle)
+{
+	return handle;
+}
+
+// Dispatchable handles, and non-dispatchable handles on 64-bit targets, are pointers.
+template <typename T>
+static inline uint64_t handle_map_key(T *handle)
+{
+	return uint64_t(reinterpret_cast<uintptr_t>(handle));
+}
+
+// Flat open-addressing hashmap from 64-bit handles to values.
+// Entries live inline in a power-of-two sized table with linear probing, so there is no per-entry allocation.
+// Erasing uses backward-shift deletion, so the table never fills up with tombstones.
+// A key of 0 marks an empty slot, VK_NULL_HANDLE is stored out of line.
+template <typename Key, typename Value>
+class HandleMap
+{
+public:
+	explicit HandleMap(float max_load_factor = 0.5f)
+	{
+		set_max_load_factor(max_load_factor);
+	}
+
+	// Rehashing happens when the table would become fuller than this. Clamped to [0.1, 0.9].
+	void set_max_load_factor(float factor)
+	{
+		if (factor < 0.1f)
+			factor = 0.1f;
+		else if (factor > 0.9f)
+			factor = 0.9f;
+		max_load_factor = factor;
+
+		if (count > get_max_count())
+			rehash(entries.size() * 2);
+	}
+
+	Value *find(Key handle)
+	{
+		return const_cast<Value *>(static_cast<const HandleMap *>(this)->find(handle));
+	}
+
+	const Value *find(Key handle) const
+	{
+		uint64_t key = handle_map_key(handle);
+		if (key == 0)
+			return has_null_entry ? &null_value : nullptr;
+		if (entries.empty())
+			return nullptr;
+
+		size_t mask = entries.size() - 1;
+		for (size_t i = bucket(key);; i = (i + 1) & mask)
+		{
+			auto &entry = entries[i];
+			if (entry.key == key)
+				return &entry.value;
+			else if (entry.key == 0)
+				return nullptr;
+		}
+	}
+
+	// Inserts a value-initialized entry if the handle is not present.
+	Value &operator[](Key handle)
+	{
+		uint64_t key = handle_map_key(handle);
+		if (key == 0)
+		{
+			has_null_entry = true;
+			return null_value;
+		}
+
+		if (count + 1 > get_max_count())
+			rehash(entries.empty() ? 16 : entries.size() * 2);
+
+		size_t mask = entries.size() - 1;
+		for (size_t i = bucket(key);; i = (i + 1) & mask)
+		{
+			auto &entry = entries[i];
+			if (entry.key == key)
+				return entry.value;
+			else if (entry.key == 0)
+			{
+				entry.key = key;
+				count++;
+				return entry.value;
+			}
+		}
+	}
+
+	bool erase(Key handle)
+	{
+		uint64_t key = handle_map_key(handle);
+		if (key == 0)
+		{
+			bool erased = has_null_entry;
+			has_null_entry = false;
+			null_value = Value();
+			return erased;
+		}
+
+		if (entries.empty())
+			return false;
+
+		size_t mask = entries.size() - 1;
+		size_t hole = bucket(key);
+		while (entries[hole].key != key)
+		{
+			if (entries[hole].key == 0)
+				return false;
+			hole = (hole + 1) & mask;
+		}
+
+		// Pull back any entry further down the probe sequence which may legally live in the hole.
+		for (size_t i = (hole + 1) & mask; entries[i].key != 0; i = (i + 1) & mask)
+		{
+			size_t home = bucket(entries[i].key);
+			if (((i - home) & mask) >= ((i - hole) & mask))
+			{
+				entries[hole] = std::move(entries[i]);
+				hole = i;
+			}
+		}
+
+		entries[hole].key = 0;
+		entries[hole].value = Value();
+		count--;
+		return true;
+	}
+
+	// Removes all entries, but keeps the table allocated.
+	void clear()
+	{
+		for (auto &entry : entries)
+		{
+			if (entry.key != 0)
+			{
+				entry.key = 0;
+				entry.value = Value();
+			}
+		}
+		count = 0;
+		has_null_entry = false;
+		null_value = Value();
+	}
+
+	void reserve(size_t size)
+	{
+		size_t capacity = entries.empty() ? 16 : entries.size();
+		while (size > size_t(capacity * max_load_factor))
+			capacity *= 2;
+		if (capacity > entries.size())
+			rehash(capacity);
+	}
+
+	size_t size() const
+	{
+		return count + (has_null_entry ? 1 : 0);
+	}
+
+	bool empty() const
+	{
+		return size() == 0;
+	}
+
+private:
+	struct Entry
+	{
+		uint64_t key = 0;
+		Value value = Value();
+	};
+
+	std::vector<Entry> entries;
+	size_t count = 0;
+	unsigned shift = 64;
+	float max_load_factor = 0.5f;
+	bool has_null_entry = false;
+	Value null_value = Value();
+
+	// Fibonacci hashing spreads aligned pointer values evenly over the table.
+	size_t bucket(uint64_t key) const
+	{
+		return size_t((key * 0x9e3779b97f4a7c15ull) >> shift);
+	}
+
+	size_t get_max_count() const
+	{
+		return size_t(entries.size() * max_load_factor);
+	}
+
+	void rehash(size_t capacity)
+	{
+		while (count + 1 > size_t(capacity * max_load_factor))
+			capacity *= 2;
+
+		std::vector<Entry> old_entries(capacity);
+		std::swap(old_entries, entries);
+
+		shift = 64;
+		for (size_t c = capacity; c > 1; c >>= 1)
+			shift--;
+
+		size_t mask = capacity - 1;
+		for (auto &old_entry : old_entries)
+		{
+			if (old_entry.key == 0)
+				continue;
+
+			size_t i = bucket(old_entry.key);
+			while (entries[i].key != 0)
+				i = (i + 1) & mask;
+			entries[i] = std::move(old_entry);
+		}
+	}
+};
+}
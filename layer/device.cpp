@@ -80,6 +80,35 @@ void Device::init(VkPhysicalDevice gpu, VkDevice device, VkLayerInstanceDispatch
 		paranoidMode = true;
 		LOGI("Enabling paranoid serialization mode.\n");
 	}
+
+	auto smolv = getSystemProperty("debug.fossilize.smolv");
+	if (!smolv.empty() && strtoul(smolv.c_str(), nullptr, 0) != 0)
+	{
+		recorder.set_spirv_encoding(SpirvEncoding::SmolV);
+		LOGI("Enabling SMOL-V encoding of SPIR-V.\n");
+	}
+
+	auto compress = getSystemProperty("debug.fossilize.compress");
+	if (!compress.empty() && strtoul(compress.c_str(), nullptr, 0) != 0)
+	{
+		recorder.set_compression(true);
+		LOGI("Enabling block compression.\n");
+	}
+
+	auto stripDebugInfo = getSystemProperty("debug.fossilize.strip_debug_info");
+	if (!stripDebugInfo.empty() && strtoul(stripDebugInfo.c_str(), nullptr, 0) != 0)
+	{
+		recorder.set_strip_debug_info(true);
+		LOGI("Stripping debug info from shader modules.\n");
+	}
+
+	auto spirvStorePath = getSystemProperty("debug.fossilize.spirv_store");
+	if (!spirvStorePath.empty())
+	{
+		spirvStore.reset(new DirectorySpirvStore(spirvStorePath));
+		recorder.set_spirv_store(spirvStore.get());
+		LOGI("Writing SPIR-V to shared store: \"%s\".\n", spirvStorePath.c_str());
+	}
 #else
 	const char *path = getenv("FOSSILIZE_DUMP_PATH");
 	if (path)
@@ -94,6 +123,35 @@ void Device::init(VkPhysicalDevice gpu, VkDevice device, VkLayerInstanceDispatch
 		paranoidMode = true;
 		LOGI("Enabling paranoid serialization mode.\n");
 	}
+
+	const char *smolv = getenv("FOSSILIZE_SMOLV");
+	if (smolv && strtoul(smolv, nullptr, 0) != 0)
+	{
+		recorder.set_spirv_encoding(SpirvEncoding::SmolV);
+		LOGI("Enabling SMOL-V encoding of SPIR-V.\n");
+	}
+
+	const char *compress = getenv("FOSSILIZE_COMPRESS");
+	if (compress && strtoul(compress, nullptr, 0) != 0)
+	{
+		recorder.set_compression(true);
+		LOGI("Enabling block compression.\n");
+	}
+
+	const char *stripDebugInfo = getenv("FOSSILIZE_STRIP_DEBUG_INFO");
+	if (stripDebugInfo && strtoul(stripDebugInfo, nullptr, 0) != 0)
+	{
+		recorder.set_strip_debug_info(true);
+		LOGI("Stripping debug info from shader modules.\n");
+	}
+
+	const char *spirvStorePath = getenv("FOSSILIZE_SPIRV_STORE");
+	if (spirvStorePath)
+	{
+		spirvStore.reset(new DirectorySpirvStore(spirvStorePath));
+		recorder.set_spirv_store(spirvStore.get());
+		LOGI("Writing SPIR-V to shared store: \"%s\".\n", spirvStorePath);
+	}
 #endif
 
 #ifndef _WIN32
@@ -24,6 +24,8 @@
 
 #include "dispatch_helper.hpp"
 #include "fossilize.hpp"
+#include "spirv_store.hpp"
+#include <memory>
 
 namespace Fossilize
 {
@@ -66,6 +68,7 @@ private:
 	VkLayerInstanceDispatchTable *pInstanceTable = nullptr;
 	VkLayerDispatchTable *pTable = nullptr;
 
+	std::unique_ptr<DirectorySpirvStore> spirvStore;
 	StateRecorder recorder;
 
 #ifdef ANDROID
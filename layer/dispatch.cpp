@@ -41,8 +41,8 @@ namespace Fossilize
 static mutex globalLock;
 static InstanceTable instanceDispatch;
 static DeviceTable deviceDispatch;
-static unordered_map<void *, unique_ptr<Instance>> instanceData;
-static unordered_map<void *, unique_ptr<Device>> deviceData;
+static LayerDataMap<Instance> instanceData;
+static LayerDataMap<Device> deviceData;
 
 static VKAPI_ATTR VkResult VKAPI_CALL CreateDevice(VkPhysicalDevice gpu, const VkDeviceCreateInfo *pCreateInfo,
                                                    const VkAllocationCallbacks *pAllocator, VkDevice *pDevice)
@@ -200,7 +200,7 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateGraphicsPipelines(VkDevice device, V
 		}
 
 		if (registerHandle)
-			layer->getRecorder().set_compute_pipeline_handle(index, pPipelines[i]);
+			layer->getRecorder().set_graphics_pipeline_handle(index, pPipelines[i]);
 	}
 
 	return VK_SUCCESS;
@@ -312,6 +312,41 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateDescriptorSetLayout(VkDevice device,
 	return result;
 }
 
+static VKAPI_ATTR void VKAPI_CALL DestroyPipeline(VkDevice device, VkPipeline pipeline,
+                                                  const VkAllocationCallbacks *pAllocator)
+{
+	lock_guard<mutex> holder{ globalLock };
+	void *key = getDispatchKey(device);
+	auto *layer = getLayerData(key, deviceData);
+
+	// We cannot tell graphics and compute pipelines apart here.
+	layer->getRecorder().remove_graphics_pipeline_handle(pipeline);
+	layer->getRecorder().remove_compute_pipeline_handle(pipeline);
+	layer->getTable()->DestroyPipeline(device, pipeline, pAllocator);
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroyPipelineLayout(VkDevice device, VkPipelineLayout pipelineLayout,
+                                                        const VkAllocationCallbacks *pAllocator)
+{
+	lock_guard<mutex> holder{ globalLock };
+	void *key = getDispatchKey(device);
+	auto *layer = getLayerData(key, deviceData);
+
+	layer->getRecorder().remove_pipeline_layout_handle(pipelineLayout);
+	layer->getTable()->DestroyPipelineLayout(device, pipelineLayout, pAllocator);
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroyDescriptorSetLayout(VkDevice device, VkDescriptorSetLayout descriptorSetLayout,
+                                                             const VkAllocationCallbacks *pAllocator)
+{
+	lock_guard<mutex> holder{ globalLock };
+	void *key = getDispatchKey(device);
+	auto *layer = getLayerData(key, deviceData);
+
+	layer->getRecorder().remove_descriptor_set_layout_handle(descriptorSetLayout);
+	layer->getTable()->DestroyDescriptorSetLayout(device, descriptorSetLayout, pAllocator);
+}
+
 static PFN_vkVoidFunction interceptCoreInstanceCommand(const char *pName)
 {
 	static const struct
@@ -429,6 +464,38 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateRenderPass(VkDevice device, const Vk
 	return res;
 }
 
+static VKAPI_ATTR void VKAPI_CALL DestroySampler(VkDevice device, VkSampler sampler, const VkAllocationCallbacks *pCallbacks)
+{
+	lock_guard<mutex> holder{ globalLock };
+	void *key = getDispatchKey(device);
+	auto *layer = getLayerData(key, deviceData);
+
+	layer->getRecorder().remove_sampler_handle(sampler);
+	layer->getTable()->DestroySampler(device, sampler, pCallbacks);
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroyShaderModule(VkDevice device, VkShaderModule shaderModule,
+                                                      const VkAllocationCallbacks *pCallbacks)
+{
+	lock_guard<mutex> holder{ globalLock };
+	void *key = getDispatchKey(device);
+	auto *layer = getLayerData(key, deviceData);
+
+	layer->getRecorder().remove_shader_module_handle(shaderModule);
+	layer->getTable()->DestroyShaderModule(device, shaderModule, pCallbacks);
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroyRenderPass(VkDevice device, VkRenderPass renderPass,
+                                                    const VkAllocationCallbacks *pCallbacks)
+{
+	lock_guard<mutex> holder{ globalLock };
+	void *key = getDispatchKey(device);
+	auto *layer = getLayerData(key, deviceData);
+
+	layer->getRecorder().remove_render_pass_handle(renderPass);
+	layer->getTable()->DestroyRenderPass(device, renderPass, pCallbacks);
+}
+
 static PFN_vkVoidFunction interceptCoreDeviceCommand(const char *pName)
 {
 	static const struct
@@ -446,6 +513,13 @@ static PFN_vkVoidFunction interceptCoreDeviceCommand(const char *pName)
 		{ "vkCreateSampler", reinterpret_cast<PFN_vkVoidFunction>(CreateSampler) },
 		{ "vkCreateShaderModule", reinterpret_cast<PFN_vkVoidFunction>(CreateShaderModule) },
 		{ "vkCreateRenderPass", reinterpret_cast<PFN_vkVoidFunction>(CreateRenderPass) },
+
+		{ "vkDestroyDescriptorSetLayout", reinterpret_cast<PFN_vkVoidFunction>(DestroyDescriptorSetLayout) },
+		{ "vkDestroyPipelineLayout", reinterpret_cast<PFN_vkVoidFunction>(DestroyPipelineLayout) },
+		{ "vkDestroyPipeline", reinterpret_cast<PFN_vkVoidFunction>(DestroyPipeline) },
+		{ "vkDestroySampler", reinterpret_cast<PFN_vkVoidFunction>(DestroySampler) },
+		{ "vkDestroyShaderModule", reinterpret_cast<PFN_vkVoidFunction>(DestroyShaderModule) },
+		{ "vkDestroyRenderPass", reinterpret_cast<PFN_vkVoidFunction>(DestroyRenderPass) },
 	};
 
 	for (auto &cmd : coreDeviceCommands)
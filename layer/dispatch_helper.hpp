@@ -28,15 +28,17 @@
 
 #include <memory>
 #include <string.h>
-#include <unordered_map>
 #include <algorithm>
 #include "vk_layer.h"
 #include "vulkan.h"
+#include "handle_map.hpp"
 
 namespace Fossilize
 {
-using InstanceTable = std::unordered_map<void *, std::unique_ptr<VkLayerInstanceDispatchTable>>;
-using DeviceTable = std::unordered_map<void *, std::unique_ptr<VkLayerDispatchTable>>;
+template <typename T>
+using LayerDataMap = HandleMap<void *, std::unique_ptr<T>>;
+using InstanceTable = LayerDataMap<VkLayerInstanceDispatchTable>;
+using DeviceTable = LayerDataMap<VkLayerDispatchTable>;
 
 static inline VkLayerDeviceCreateInfo *getChainInfo(const VkInstanceCreateInfo *pCreateInfo, VkLayerFunction func)
 {
@@ -67,17 +69,17 @@ static inline void *getDispatchKey(void *ptr)
 }
 
 template <typename T>
-static inline T *getLayerData(void *key, const std::unordered_map<void *, std::unique_ptr<T>> &m)
+static inline T *getLayerData(void *key, const LayerDataMap<T> &m)
 {
-	auto itr = m.find(key);
-	if (itr != end(m))
-		return itr->second.get();
+	auto *data = m.find(key);
+	if (data)
+		return data->get();
 	else
 		return nullptr;
 }
 
 template <typename T, typename... TArgs>
-static inline T *createLayerData(void *key, std::unordered_map<void *, std::unique_ptr<T>> &m, TArgs &&... args)
+static inline T *createLayerData(void *key, LayerDataMap<T> &m, TArgs &&... args)
 {
 	auto *ptr = new T(std::forward<TArgs>(args)...);
 	m[key] = std::unique_ptr<T>(ptr);
@@ -85,25 +87,19 @@ static inline T *createLayerData(void *key, std::unordered_map<void *, std::uniq
 }
 
 template <typename T>
-static inline void destroyLayerData(void *key, std::unordered_map<void *, std::unique_ptr<T>> &m)
+static inline void destroyLayerData(void *key, LayerDataMap<T> &m)
 {
-	auto itr = m.find(key);
-	m.erase(itr);
+	m.erase(key);
 }
 
 static inline VkLayerInstanceDispatchTable *initInstanceTable(VkInstance instance, const PFN_vkGetInstanceProcAddr gpa,
                                                               InstanceTable &table)
 {
 	auto key = getDispatchKey(instance);
-	auto itr = table.find(key);
-	VkLayerInstanceDispatchTable *pTable = nullptr;
-	if (itr == end(table))
-	{
-		pTable = new VkLayerInstanceDispatchTable;
-		table[key] = std::unique_ptr<VkLayerInstanceDispatchTable>(pTable);
-	}
-	else
-		pTable = itr->second.get();
+	auto &entry = table[key];
+	if (!entry)
+		entry.reset(new VkLayerInstanceDispatchTable);
+	VkLayerInstanceDispatchTable *pTable = entry.get();
 
 	layerInitInstanceDispatchTable(instance, pTable, gpa);
 	return pTable;
@@ -113,15 +109,10 @@ static inline VkLayerDispatchTable *initDeviceTable(VkDevice device, const PFN_v
                                                     DeviceTable &table)
 {
 	auto key = getDispatchKey(device);
-	auto itr = table.find(key);
-	VkLayerDispatchTable *pTable = nullptr;
-	if (itr == end(table))
-	{
-		pTable = new VkLayerDispatchTable;
-		table[key] = std::unique_ptr<VkLayerDispatchTable>(pTable);
-	}
-	else
-		pTable = itr->second.get();
+	auto &entry = table[key];
+	if (!entry)
+		entry.reset(new VkLayerDispatchTable);
+	VkLayerDispatchTable *pTable = entry.get();
 
 	layerInitDeviceDispatchTable(device, pTable, gpa);
 	return pTable;
@@ -0,0 +1,211 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "lz.hpp"
+#include <string.h>
+#include <vector>
+
+namespace Fossilize
+{
+enum
+{
+	LZ_MIN_MATCH = 4,
+	LZ_LAST_LITERALS = 5,
+	LZ_MATCH_SEARCH_LIMIT = 12,
+	LZ_MAX_OFFSET = 0xffff,
+	LZ_HASH_BITS = 14,
+	LZ_SKIP_TRIGGER = 6,
+	LZ_LENGTH_MASK = 15
+};
+
+static inline uint32_t read_u32(const uint8_t *ptr)
+{
+	uint32_t v;
+	memcpy(&v, ptr, sizeof(v));
+	return v;
+}
+
+static inline uint32_t hash_sequence(uint32_t seq)
+{
+	return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t *write_length(uint8_t *op, size_t len)
+{
+	while (len >= 255)
+	{
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = uint8_t(len);
+	return op;
+}
+
+static inline bool read_length(const uint8_t *&ip, const uint8_t *iend, size_t &len)
+{
+	uint8_t c;
+	do
+	{
+		if (ip >= iend)
+			return false;
+		c = *ip++;
+		len += c;
+	} while (c == 255);
+	return true;
+}
+
+static uint8_t *write_literals(uint8_t *op, const uint8_t *literals, size_t literal_len, size_t match_len)
+{
+	uint8_t *token = op++;
+
+	if (literal_len >= LZ_LENGTH_MASK)
+	{
+		*token = LZ_LENGTH_MASK << 4;
+		op = write_length(op, literal_len - LZ_LENGTH_MASK);
+	}
+	else
+		*token = uint8_t(literal_len << 4);
+
+	memcpy(op, literals, literal_len);
+	op += literal_len;
+
+	if (match_len)
+	{
+		size_t match_code = match_len - LZ_MIN_MATCH;
+		*token |= uint8_t(match_code >= LZ_LENGTH_MASK ? size_t(LZ_LENGTH_MASK) : match_code);
+	}
+	return op;
+}
+
+size_t compute_max_size_lz(size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+// Each sequence is a token (literal length in the high nibble, match length minus 4 in the low nibble),
+// extended literal length, literals, 16-bit match offset and extended match length.
+// The final sequence only contains literals.
+size_t encode_lz(uint8_t *buffer, const uint8_t *data, size_t size)
+{
+	std::vector<uint32_t> table(1u << LZ_HASH_BITS);
+	const uint8_t *ip = data;
+	const uint8_t *anchor = data;
+	const uint8_t *end = data + size;
+	const uint8_t *match_limit = size > LZ_MATCH_SEARCH_LIMIT ? end - LZ_MATCH_SEARCH_LIMIT : data;
+	uint8_t *op = buffer;
+
+	while (ip < match_limit)
+	{
+		uint32_t seq = read_u32(ip);
+		uint32_t h = hash_sequence(seq);
+		const uint8_t *ref = data + table[h];
+		table[h] = uint32_t(ip - data);
+
+		if (ref >= ip || size_t(ip - ref) > LZ_MAX_OFFSET || read_u32(ref) != seq)
+		{
+			// Step faster through data which does not compress.
+			ip += 1 + (size_t(ip - anchor) >> LZ_SKIP_TRIGGER);
+			continue;
+		}
+
+		const uint8_t *match_end = ip + LZ_MIN_MATCH;
+		const uint8_t *ref_end = ref + LZ_MIN_MATCH;
+		while (match_end < end - LZ_LAST_LITERALS && *match_end == *ref_end)
+		{
+			match_end++;
+			ref_end++;
+		}
+
+		size_t match_len = size_t(match_end - ip);
+		op = write_literals(op, anchor, size_t(ip - anchor), match_len);
+
+		size_t offset = size_t(ip - ref);
+		*op++ = uint8_t(offset & 0xff);
+		*op++ = uint8_t(offset >> 8);
+		if (match_len - LZ_MIN_MATCH >= LZ_LENGTH_MASK)
+			op = write_length(op, match_len - LZ_MIN_MATCH - LZ_LENGTH_MASK);
+
+		ip = match_end;
+		anchor = ip;
+	}
+
+	op = write_literals(op, anchor, size_t(end - anchor), 0);
+	return size_t(op - buffer);
+}
+
+bool decode_lz(uint8_t *data, size_t size, const uint8_t *buffer, size_t buffer_size)
+{
+	const uint8_t *ip = buffer;
+	const uint8_t *iend = buffer + buffer_size;
+	uint8_t *op = data;
+	uint8_t *oend = data + size;
+
+	for (;;)
+	{
+		if (ip >= iend)
+			return false;
+		unsigned token = *ip++;
+
+		size_t literal_len = token >> 4;
+		if (literal_len == LZ_LENGTH_MASK && !read_length(ip, iend, literal_len))
+			return false;
+		if (literal_len > size_t(iend - ip) || literal_len > size_t(oend - op))
+			return false;
+
+		memcpy(op, ip, literal_len);
+		op += literal_len;
+		ip += literal_len;
+
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return false;
+		size_t offset = size_t(ip[0]) | (size_t(ip[1]) << 8);
+		ip += 2;
+		if (offset == 0 || offset > size_t(op - data))
+			return false;
+
+		size_t match_len = token & LZ_LENGTH_MASK;
+		if (match_len == LZ_LENGTH_MASK && !read_length(ip, iend, match_len))
+			return false;
+		match_len += LZ_MIN_MATCH;
+		if (match_len > size_t(oend - op))
+			return false;
+
+		const uint8_t *ref = op - offset;
+		if (offset >= match_len)
+		{
+			memcpy(op, ref, match_len);
+			op += match_len;
+		}
+		else
+		{
+			// Overlapping copy, this repeats the pattern.
+			for (size_t i = 0; i < match_len; i++)
+				*op++ = *ref++;
+		}
+	}
+
+	return op == oend;
+}
+}
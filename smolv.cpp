@@ -0,0 +1,431 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "smolv.hpp"
+#include "varint.hpp"
+#include <algorithm>
+
+namespace Fossilize
+{
+enum
+{
+	SPIRV_MAGIC = 0x07230203,
+	SPIRV_HEADER_WORDS = 5,
+	SMOLV_MODE_VARINT = 0,
+	SMOLV_MODE_SPLIT = 1,
+	SMOLV_LENGTH_BITS = 4,
+	SMOLV_LENGTH_ESCAPE = (1 << SMOLV_LENGTH_BITS) - 1,
+	SMOLV_ID_ALL = 0xff
+};
+
+// The most frequent opcodes are swapped with opcodes 0-15 so that an instruction header
+// for these typically fits in a single varint byte. The mapping is its own inverse.
+static const uint16_t hot_opcodes[16] = {
+	71,  // OpDecorate
+	61,  // OpLoad
+	62,  // OpStore
+	65,  // OpAccessChain
+	72,  // OpMemberDecorate
+	81,  // OpCompositeExtract
+	79,  // OpVectorShuffle
+	80,  // OpCompositeConstruct
+	133, // OpFMul
+	129, // OpFAdd
+	248, // OpLabel
+	249, // OpBranch
+	59,  // OpVariable
+	32,  // OpTypePointer
+	43,  // OpConstant
+	148, // OpDot
+};
+
+static inline uint32_t swizzle_opcode(uint32_t op)
+{
+	if (op < 16)
+		return hot_opcodes[op];
+
+	for (uint32_t i = 0; i < 16; i++)
+		if (hot_opcodes[i] == op)
+			return i;
+	return op;
+}
+
+struct OpLayout
+{
+	bool has_type;
+	bool has_result;
+	bool has_target;
+	uint8_t id_operands;
+};
+
+// Only affects how well operands compress, unknown opcodes simply store their operands verbatim.
+static OpLayout get_op_layout(uint32_t op)
+{
+	switch (op)
+	{
+	case 5: // OpName
+	case 6: // OpMemberName
+	case 71: // OpDecorate
+	case 72: // OpMemberDecorate
+		return { false, false, true, 0 };
+
+	case 19: // OpTypeVoid
+	case 20: // OpTypeBool
+	case 21: // OpTypeInt
+	case 22: // OpTypeFloat
+	case 26: // OpTypeSampler
+	case 32: // OpTypePointer
+	case 248: // OpLabel
+		return { false, true, false, 0 };
+
+	case 23: // OpTypeVector
+	case 24: // OpTypeMatrix
+	case 25: // OpTypeImage
+	case 27: // OpTypeSampledImage
+	case 29: // OpTypeRuntimeArray
+		return { false, true, false, 1 };
+
+	case 28: // OpTypeArray
+		return { false, true, false, 2 };
+
+	case 30: // OpTypeStruct
+	case 33: // OpTypeFunction
+		return { false, true, false, SMOLV_ID_ALL };
+
+	case 1: // OpUndef
+	case 41: // OpConstantTrue
+	case 42: // OpConstantFalse
+	case 43: // OpConstant
+	case 46: // OpConstantNull
+	case 48: // OpSpecConstantTrue
+	case 49: // OpSpecConstantFalse
+	case 50: // OpSpecConstant
+	case 52: // OpSpecConstantOp
+	case 54: // OpFunction
+	case 55: // OpFunctionParameter
+	case 59: // OpVariable
+		return { true, true, false, 0 };
+
+	case 12: // OpExtInst
+	case 61: // OpLoad
+	case 81: // OpCompositeExtract
+	case 83: // OpCopyObject
+	case 84: // OpTranspose
+	case 100: // OpImage
+	case 101: // OpImageQueryFormat
+	case 102: // OpImageQueryOrder
+	case 104: // OpImageQuerySize
+	case 106: // OpImageQueryLevels
+	case 107: // OpImageQuerySamples
+		return { true, true, false, 1 };
+
+	case 79: // OpVectorShuffle
+	case 82: // OpCompositeInsert
+	case 86: // OpSampledImage
+	case 87: // OpImageSampleImplicitLod
+	case 88: // OpImageSampleExplicitLod
+	case 91: // OpImageSampleProjImplicitLod
+	case 92: // OpImageSampleProjExplicitLod
+	case 95: // OpImageFetch
+	case 98: // OpImageRead
+	case 103: // OpImageQuerySizeLod
+	case 105: // OpImageQueryLod
+		return { true, true, false, 2 };
+
+	case 89: // OpImageSampleDrefImplicitLod
+	case 90: // OpImageSampleDrefExplicitLod
+	case 93: // OpImageSampleProjDrefImplicitLod
+	case 94: // OpImageSampleProjDrefExplicitLod
+	case 96: // OpImageGather
+	case 97: // OpImageDrefGather
+		return { true, true, false, 3 };
+
+	case 44: // OpConstantComposite
+	case 51: // OpSpecConstantComposite
+	case 57: // OpFunctionCall
+	case 60: // OpImageTexelPointer
+	case 65: // OpAccessChain
+	case 66: // OpInBoundsAccessChain
+	case 67: // OpPtrAccessChain
+	case 77: // OpVectorExtractDynamic
+	case 78: // OpVectorInsertDynamic
+	case 80: // OpCompositeConstruct
+	case 245: // OpPhi
+		return { true, true, false, SMOLV_ID_ALL };
+
+	case 247: // OpSelectionMerge
+	case 249: // OpBranch
+	case 254: // OpReturnValue
+		return { false, false, false, 1 };
+
+	case 62: // OpStore
+	case 63: // OpCopyMemory
+	case 246: // OpLoopMerge
+	case 251: // OpSwitch
+		return { false, false, false, 2 };
+
+	case 99: // OpImageWrite
+	case 250: // OpBranchConditional
+		return { false, false, false, 3 };
+
+	default:
+		break;
+	}
+
+	// Conversions, arithmetic, relational, logical, bit and derivative instructions only take IDs.
+	if ((op >= 109 && op <= 124) || (op >= 126 && op <= 152) || (op >= 154 && op <= 191) ||
+	    (op >= 194 && op <= 205) || (op >= 207 && op <= 215))
+		return { true, true, false, SMOLV_ID_ALL };
+
+	return { false, false, false, 0 };
+}
+
+struct SmolvState
+{
+	uint32_t last_result = 0;
+	uint32_t last_target = 0;
+};
+
+static inline uint32_t zigzag(uint32_t delta)
+{
+	return (delta << 1) ^ uint32_t(int32_t(delta) >> 31);
+}
+
+static inline uint32_t unzigzag(uint32_t value)
+{
+	return (value >> 1) ^ (0u - (value & 1));
+}
+
+static inline void push_varint(std::vector<uint8_t> &buffer, uint32_t word)
+{
+	uint8_t encoded[5];
+	auto *end = encode_varint(encoded, &word, 1);
+	buffer.insert(buffer.end(), encoded, end);
+}
+
+static inline bool read_varint(const uint8_t *&buffer, const uint8_t *end, uint32_t &word)
+{
+	word = 0;
+	uint32_t shift = 0;
+	uint8_t c;
+	do
+	{
+		if (buffer >= end || shift >= 32u)
+			return false;
+		c = *buffer++;
+		word |= uint32_t(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return true;
+}
+
+static bool validate_spirv(const uint32_t *words, size_t word_count)
+{
+	if (word_count < SPIRV_HEADER_WORDS || words[0] != SPIRV_MAGIC)
+		return false;
+
+	size_t offset = SPIRV_HEADER_WORDS;
+	while (offset < word_count)
+	{
+		uint32_t len = words[offset] >> 16;
+		if (len == 0 || len > word_count - offset)
+			return false;
+		offset += len;
+	}
+	return true;
+}
+
+static void encode_operands(std::vector<uint8_t> &buffer, SmolvState &state, uint32_t op,
+                            const uint32_t *operands, uint32_t count)
+{
+	auto layout = get_op_layout(op);
+	uint32_t i = 0;
+
+	if (layout.has_target && count >= 1)
+	{
+		push_varint(buffer, zigzag(operands[0] - state.last_target));
+		state.last_target = operands[0];
+		i = 1;
+	}
+	else if (count >= uint32_t(layout.has_type) + uint32_t(layout.has_result))
+	{
+		uint32_t base = state.last_result;
+		if (layout.has_type)
+			push_varint(buffer, operands[i++]);
+		if (layout.has_result)
+		{
+			base = operands[i++];
+			push_varint(buffer, zigzag(base - state.last_result - 1));
+			state.last_result = base;
+		}
+
+		uint32_t id_end = layout.id_operands == SMOLV_ID_ALL ? count : std::min(count, i + layout.id_operands);
+		for (; i < id_end; i++)
+			push_varint(buffer, zigzag(base - operands[i]));
+	}
+
+	for (; i < count; i++)
+		push_varint(buffer, operands[i]);
+}
+
+static bool decode_operands(const uint8_t *&buffer, const uint8_t *end, SmolvState &state, uint32_t op,
+                            uint32_t *operands, uint32_t count)
+{
+	auto layout = get_op_layout(op);
+	uint32_t i = 0;
+	uint32_t word;
+
+	if (layout.has_target && count >= 1)
+	{
+		if (!read_varint(buffer, end, word))
+			return false;
+		operands[0] = state.last_target + unzigzag(word);
+		state.last_target = operands[0];
+		i = 1;
+	}
+	else if (count >= uint32_t(layout.has_type) + uint32_t(layout.has_result))
+	{
+		uint32_t base = state.last_result;
+		if (layout.has_type && !read_varint(buffer, end, operands[i++]))
+			return false;
+		if (layout.has_result)
+		{
+			if (!read_varint(buffer, end, word))
+				return false;
+			base = state.last_result + 1 + unzigzag(word);
+			operands[i++] = base;
+			state.last_result = base;
+		}
+
+		uint32_t id_end = layout.id_operands == SMOLV_ID_ALL ? count : std::min(count, i + layout.id_operands);
+		for (; i < id_end; i++)
+		{
+			if (!read_varint(buffer, end, word))
+				return false;
+			operands[i] = base - unzigzag(word);
+		}
+	}
+
+	for (; i < count; i++)
+		if (!read_varint(buffer, end, operands[i]))
+			return false;
+
+	return true;
+}
+
+void encode_smolv(std::vector<uint8_t> &buffer, const uint32_t *words, size_t word_count)
+{
+	if (!validate_spirv(words, word_count))
+	{
+		buffer.push_back(SMOLV_MODE_VARINT);
+		size_t offset = buffer.size();
+		buffer.resize(offset + compute_size_varint(words, word_count));
+		encode_varint(buffer.data() + offset, words, word_count);
+		return;
+	}
+
+	std::vector<uint8_t> headers;
+	std::vector<uint8_t> operands;
+	headers.reserve(word_count);
+	operands.reserve(word_count * 2);
+
+	// The magic number is implied.
+	for (unsigned i = 1; i < SPIRV_HEADER_WORDS; i++)
+		push_varint(operands, words[i]);
+
+	SmolvState state;
+	size_t offset = SPIRV_HEADER_WORDS;
+	while (offset < word_count)
+	{
+		uint32_t op = words[offset] & 0xffff;
+		uint32_t operand_count = (words[offset] >> 16) - 1;
+		uint32_t length_code = std::min<uint32_t>(operand_count, SMOLV_LENGTH_ESCAPE);
+
+		push_varint(headers, (swizzle_opcode(op) << SMOLV_LENGTH_BITS) | length_code);
+		if (length_code == SMOLV_LENGTH_ESCAPE)
+			push_varint(headers, operand_count - SMOLV_LENGTH_ESCAPE);
+
+		encode_operands(operands, state, op, words + offset + 1, operand_count);
+		offset += operand_count + 1;
+	}
+
+	buffer.push_back(SMOLV_MODE_SPLIT);
+	push_varint(buffer, uint32_t(headers.size()));
+	buffer.insert(buffer.end(), headers.begin(), headers.end());
+	buffer.insert(buffer.end(), operands.begin(), operands.end());
+}
+
+bool decode_smolv(uint32_t *words, size_t words_size, const uint8_t *buffer, size_t buffer_size)
+{
+	if (buffer_size < 1)
+		return false;
+
+	const uint8_t *end = buffer + buffer_size;
+	uint8_t mode = *buffer++;
+	if (mode == SMOLV_MODE_VARINT)
+		return decode_varint(words, words_size, buffer, buffer_size - 1);
+	else if (mode != SMOLV_MODE_SPLIT || words_size < SPIRV_HEADER_WORDS)
+		return false;
+
+	uint32_t headers_size;
+	if (!read_varint(buffer, end, headers_size) || headers_size > size_t(end - buffer))
+		return false;
+
+	const uint8_t *headers = buffer;
+	const uint8_t *headers_end = buffer + headers_size;
+	const uint8_t *operands = headers_end;
+
+	words[0] = SPIRV_MAGIC;
+	for (unsigned i = 1; i < SPIRV_HEADER_WORDS; i++)
+		if (!read_varint(operands, end, words[i]))
+			return false;
+
+	SmolvState state;
+	size_t offset = SPIRV_HEADER_WORDS;
+	while (offset < words_size)
+	{
+		uint32_t header;
+		if (!read_varint(headers, headers_end, header))
+			return false;
+
+		uint32_t op = swizzle_opcode(header >> SMOLV_LENGTH_BITS);
+		uint32_t operand_count = header & SMOLV_LENGTH_ESCAPE;
+		if (operand_count == SMOLV_LENGTH_ESCAPE)
+		{
+			uint32_t extra;
+			if (!read_varint(headers, headers_end, extra) || extra > 0xffff)
+				return false;
+			operand_count += extra;
+		}
+
+		if (op > 0xffff || operand_count >= 0xffff || operand_count >= words_size - offset)
+			return false;
+
+		words[offset] = ((operand_count + 1) << 16) | op;
+		if (!decode_operands(operands, end, state, op, words + offset + 1, operand_count))
+			return false;
+		offset += operand_count + 1;
+	}
+
+	return headers == headers_end && operands == end;
+}
+}
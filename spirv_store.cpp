@@ -0,0 +1,184 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "spirv_store.hpp"
+#include <stdio.h>
+#include <inttypes.h>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace Fossilize
+{
+static bool file_exists(const string &path)
+{
+	FILE *file = fopen(path.c_str(), "rb");
+	if (!file)
+		return false;
+	fclose(file);
+	return true;
+}
+
+static unsigned get_process_id()
+{
+#ifdef _WIN32
+	return unsigned(_getpid());
+#else
+	return unsigned(getpid());
+#endif
+}
+
+DirectorySpirvStore::DirectorySpirvStore(string path)
+	: path(move(path))
+{
+}
+
+DirectorySpirvStore::~DirectorySpirvStore()
+{
+	for (auto &mapping : mappings)
+	{
+#ifndef _WIN32
+		if (mapping.second.mapped)
+		{
+			munmap(const_cast<uint32_t *>(mapping.second.code), mapping.second.size);
+			continue;
+		}
+#endif
+		delete[] mapping.second.code;
+	}
+}
+
+string DirectorySpirvStore::get_path(Hash hash) const
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/%016" PRIx64 ".spv", hash);
+	return path + name;
+}
+
+bool DirectorySpirvStore::store(Hash hash, const uint32_t *code, size_t size)
+{
+	auto target = get_path(hash);
+	if (file_exists(target))
+		return true;
+
+	// Write to a temporary file first, so readers never see a partially written module.
+	char suffix[64];
+	{
+		lock_guard<mutex> holder{ lock };
+		snprintf(suffix, sizeof(suffix), ".%u.%u.tmp", get_process_id(), temp_counter++);
+	}
+	auto temp = target + suffix;
+
+	FILE *file = fopen(temp.c_str(), "wb");
+	if (!file)
+		return false;
+
+	bool written = fwrite(code, 1, size, file) == size;
+	if (fclose(file) != 0)
+		written = false;
+
+	if (!written || rename(temp.c_str(), target.c_str()) != 0)
+	{
+		remove(temp.c_str());
+		// Someone else might have stored the same module in the meantime.
+		return file_exists(target);
+	}
+
+	return true;
+}
+
+const uint32_t *DirectorySpirvStore::load(Hash hash, size_t *size)
+{
+	lock_guard<mutex> holder{ lock };
+	auto itr = mappings.find(hash);
+	if (itr != end(mappings))
+	{
+		*size = itr->second.size;
+		return itr->second.code;
+	}
+
+	auto file_path = get_path(hash);
+	Mapping mapping;
+
+#ifdef _WIN32
+	FILE *file = fopen(file_path.c_str(), "rb");
+	if (!file)
+		return nullptr;
+
+	if (fseek(file, 0, SEEK_END) < 0)
+	{
+		fclose(file);
+		return nullptr;
+	}
+
+	long len = ftell(file);
+	rewind(file);
+	if (len <= 0 || len % sizeof(uint32_t) != 0)
+	{
+		fclose(file);
+		return nullptr;
+	}
+
+	auto *code = new uint32_t[len / sizeof(uint32_t)];
+	bool read = fread(code, 1, size_t(len), file) == size_t(len);
+	fclose(file);
+	if (!read)
+	{
+		delete[] code;
+		return nullptr;
+	}
+
+	mapping = { code, size_t(len), false };
+#else
+	int fd = open(file_path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return nullptr;
+
+	struct stat s;
+	if (fstat(fd, &s) != 0 || s.st_size <= 0 || s.st_size % sizeof(uint32_t) != 0)
+	{
+		close(fd);
+		return nullptr;
+	}
+
+	// Modules are never modified once stored, so a private read-only mapping is safe to keep around.
+	void *ptr = mmap(nullptr, size_t(s.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED)
+		return nullptr;
+
+	mapping = { static_cast<const uint32_t *>(ptr), size_t(s.st_size), true };
+#endif
+
+	mappings[hash] = mapping;
+	*size = mapping.size;
+	return mapping.code;
+}
+}
@@ -0,0 +1,62 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "fossilize.hpp"
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace Fossilize
+{
+// Shared SPIR-V store backed by a directory with one file per shader module, named by its hash.
+// Several processes can add to the same directory, a file only appears once it is completely written.
+// On POSIX systems, modules are memory mapped and handed out without a copy.
+class DirectorySpirvStore : public SpirvStore
+{
+public:
+	// The directory must exist.
+	explicit DirectorySpirvStore(std::string path);
+	~DirectorySpirvStore() override;
+
+	DirectorySpirvStore(const DirectorySpirvStore &) = delete;
+	void operator=(const DirectorySpirvStore &) = delete;
+
+	bool store(Hash hash, const uint32_t *code, size_t size) override;
+	const uint32_t *load(Hash hash, size_t *size) override;
+
+private:
+	struct Mapping
+	{
+		const uint32_t *code;
+		size_t size;
+		bool mapped;
+	};
+
+	std::string path;
+	std::mutex lock;
+	std::unordered_map<Hash, Mapping> mappings;
+	unsigned temp_counter = 0;
+
+	std::string get_path(Hash hash) const;
+};
+}
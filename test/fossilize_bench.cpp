@@ -0,0 +1,556 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "fossilize.hpp"
+#include "varint.hpp"
+#include "base64.hpp"
+#include "lz.hpp"
+#include "test_data.hpp"
+#include <chrono>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace Fossilize;
+
+template <typename T>
+static inline T fake_handle(uint64_t value)
+{
+	return (T)value;
+}
+
+struct Options
+{
+	unsigned pipelines = 10000;
+	unsigned iterations = 5;
+	size_t buffer_size = 16 * 1024 * 1024;
+	const char *json_path = nullptr;
+};
+
+struct Result
+{
+	std::string name;
+	const char *unit;
+	double ns_per_op;
+	double mb_per_second;
+	uint64_t peak_rss_growth_kb;
+};
+
+static std::vector<Result> results;
+
+// Peak resident set size of the process so far. Not tracked on Windows.
+static uint64_t get_peak_rss_kb()
+{
+#ifndef _WIN32
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#ifdef __APPLE__
+	return uint64_t(usage.ru_maxrss) / 1024;
+#else
+	return uint64_t(usage.ru_maxrss);
+#endif
+#else
+	return 0;
+#endif
+}
+
+// Runs func() the given number of times and reports the fastest run, which is the least noisy estimate.
+// Each run processes ops units and bytes bytes. setup() runs before each run and is not timed.
+// The peak RSS only ever grows over the life of the process, so what is reported is how far the benchmark
+// raised it, which is zero if an earlier benchmark peaked higher.
+template <typename Setup, typename Func>
+static void run_benchmark(const Options &options, const char *name, const char *unit, uint64_t ops, uint64_t bytes,
+                          const Setup &setup, const Func &func)
+{
+	uint64_t peak_rss_kb = get_peak_rss_kb();
+	double best = 0.0;
+	for (unsigned i = 0; i < options.iterations; i++)
+	{
+		setup();
+		auto start = std::chrono::steady_clock::now();
+		func();
+		auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (i == 0 || elapsed < best)
+			best = elapsed;
+	}
+
+	Result result = { name, unit, 0.0, 0.0, get_peak_rss_kb() - peak_rss_kb };
+	if (ops)
+		result.ns_per_op = best * 1e9 / double(ops);
+	if (best > 0.0)
+		result.mb_per_second = double(bytes) / (1024.0 * 1024.0) / best;
+
+	printf("%-52s %12.2f ns/%-8s %10.1f MB/s %10llu KiB peak RSS growth\n", name, result.ns_per_op, unit,
+	       result.mb_per_second, static_cast<unsigned long long>(result.peak_rss_growth_kb));
+	results.push_back(result);
+}
+
+template <typename Func>
+static void run_benchmark(const Options &options, const char *name, const char *unit, uint64_t ops, uint64_t bytes, const Func &func)
+{
+	run_benchmark(options, name, unit, ops, bytes, []() {}, func);
+}
+
+// Mostly small values, like IDs and literals in SPIR-V.
+static std::vector<uint32_t> make_words(std::mt19937 &rnd, size_t count)
+{
+	std::vector<uint32_t> words(count);
+	for (auto &word : words)
+	{
+		uint32_t bits = rnd() % 8 == 0 ? 29 : 12;
+		word = uint32_t(rnd()) & ((1u << bits) - 1);
+	}
+	return words;
+}
+
+static void bench_hasher(const Options &options, std::mt19937 &rnd)
+{
+	auto words = make_words(rnd, options.buffer_size / sizeof(uint32_t));
+	volatile Hash sink = 0;
+	run_benchmark(options, "Hasher::data", "word", words.size(), words.size() * sizeof(uint32_t), [&]() {
+		Hasher h;
+		h.data(words.data(), words.size() * sizeof(uint32_t));
+		sink = h.get();
+	});
+	(void)sink;
+}
+
+static void bench_varint(const Options &options, std::mt19937 &rnd)
+{
+	auto words = make_words(rnd, options.buffer_size / sizeof(uint32_t));
+	std::vector<uint8_t> encoded(compute_size_varint(words.data(), words.size()));
+	std::vector<uint32_t> decoded(words.size());
+	uint64_t bytes = words.size() * sizeof(uint32_t);
+
+	run_benchmark(options, "encode_varint", "word", words.size(), bytes, [&]() {
+		encode_varint(encoded.data(), words.data(), words.size());
+	});
+
+	run_benchmark(options, "decode_varint", "word", words.size(), bytes, [&]() {
+		if (!decode_varint(decoded.data(), decoded.size(), encoded.data(), encoded.size()))
+			throw std::runtime_error("Failed to decode varint.");
+	});
+
+	if (decoded != words)
+		throw std::runtime_error("Varint did not round-trip.");
+}
+
+// Specialization constant data is stored as base64 in the JSON chunk.
+static void bench_base64(const Options &options, std::mt19937 &rnd)
+{
+	std::vector<uint8_t> data(options.buffer_size);
+	for (auto &byte : data)
+		byte = uint8_t(rnd());
+
+	std::string encoded;
+	std::vector<uint8_t> decoded(data.size());
+
+	run_benchmark(options, "encode_base64", "byte", data.size(), data.size(), [&]() {
+		encoded = encode_base64(data.data(), data.size());
+	});
+
+	run_benchmark(options, "decode_base64", "byte", data.size(), data.size(), [&]() {
+		decode_base64(decoded.data(), decoded.size(), encoded.c_str());
+	});
+
+	if (decoded != data)
+		throw std::runtime_error("Base64 did not round-trip.");
+}
+
+static void bench_lz(const Options &options, std::mt19937 &rnd)
+{
+	auto text = make_text(rnd, options.buffer_size);
+
+	std::vector<uint8_t> encoded(compute_max_size_lz(text.size()));
+	std::vector<uint8_t> decoded(text.size());
+	size_t encoded_size = 0;
+
+	run_benchmark(options, "encode_lz", "byte", text.size(), text.size(), [&]() {
+		encoded_size = encode_lz(encoded.data(), text.data(), text.size());
+	});
+
+	run_benchmark(options, "decode_lz", "byte", text.size(), text.size(), [&]() {
+		if (!decode_lz(decoded.data(), decoded.size(), encoded.data(), encoded_size))
+			throw std::runtime_error("Failed to decode LZ.");
+	});
+
+	if (decoded != text)
+		throw std::runtime_error("LZ did not round-trip.");
+}
+
+// Synthetic capture with one module per eight pipelines. Three quarters of the pipelines are graphics pipelines
+// with two stages, the rest compute pipelines. Every pipeline differs in some state, so none are deduplicated.
+static void record_synthetic_state(StateRecorder &recorder, unsigned num_pipelines, const std::vector<std::vector<uint32_t>> &modules)
+{
+	VkDescriptorSetLayoutBinding bindings[2] = {};
+	bindings[0].binding = 0;
+	bindings[0].descriptorCount = 1;
+	bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	bindings[0].stageFlags = VK_SHADER_STAGE_ALL;
+	bindings[1].binding = 1;
+	bindings[1].descriptorCount = 4;
+	bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	bindings[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+	VkDescriptorSetLayoutCreateInfo set_layout = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
+	set_layout.bindingCount = 2;
+	set_layout.pBindings = bindings;
+	unsigned index = recorder.register_descriptor_set_layout(Hashing::compute_hash_descriptor_set_layout(recorder, set_layout), set_layout);
+	recorder.set_descriptor_set_layout_handle(index, fake_handle<VkDescriptorSetLayout>(1000));
+
+	const VkDescriptorSetLayout set_layouts[1] = { fake_handle<VkDescriptorSetLayout>(1000) };
+	static const VkPushConstantRange range = { VK_SHADER_STAGE_VERTEX_BIT, 0, 64 };
+	VkPipelineLayoutCreateInfo layout = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+	layout.setLayoutCount = 1;
+	layout.pSetLayouts = set_layouts;
+	layout.pushConstantRangeCount = 1;
+	layout.pPushConstantRanges = &range;
+	index = recorder.register_pipeline_layout(Hashing::compute_hash_pipeline_layout(recorder, layout), layout);
+	recorder.set_pipeline_layout_handle(index, fake_handle<VkPipelineLayout>(10000));
+
+	VkAttachmentDescription attachment = {};
+	attachment.format = VK_FORMAT_R8G8B8A8_UNORM;
+	attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+	attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	attachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	static const VkAttachmentReference color = { 0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
+	VkSubpassDescription subpass = {};
+	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	subpass.colorAttachmentCount = 1;
+	subpass.pColorAttachments = &color;
+	VkRenderPassCreateInfo pass = { VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO };
+	pass.attachmentCount = 1;
+	pass.pAttachments = &attachment;
+	pass.subpassCount = 1;
+	pass.pSubpasses = &subpass;
+	index = recorder.register_render_pass(Hashing::compute_hash_render_pass(recorder, pass), pass);
+	recorder.set_render_pass_handle(index, fake_handle<VkRenderPass>(30000));
+
+	for (size_t i = 0; i < modules.size(); i++)
+	{
+		VkShaderModuleCreateInfo info = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+		info.pCode = modules[i].data();
+		info.codeSize = modules[i].size() * sizeof(uint32_t);
+		index = recorder.register_shader_module(Hashing::compute_hash_shader_module(recorder, info), info);
+		recorder.set_shader_module_handle(index, fake_handle<VkShaderModule>(50000 + i));
+	}
+
+	unsigned num_modules = unsigned(modules.size());
+	VkPipelineShaderStageCreateInfo stages[2] = {};
+	stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+	stages[0].pName = "main";
+	stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+	stages[1].pName = "main";
+
+	VkPipelineVertexInputStateCreateInfo vi = { VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
+	static const VkVertexInputAttributeDescription attrs[2] = {
+		{ 0, 0, VK_FORMAT_R32G32B32_SFLOAT, 0 },
+		{ 1, 0, VK_FORMAT_R8G8B8A8_UNORM, 12 },
+	};
+	static const VkVertexInputBindingDescription bind = { 0, 16, VK_VERTEX_INPUT_RATE_VERTEX };
+	vi.vertexBindingDescriptionCount = 1;
+	vi.pVertexBindingDescriptions = &bind;
+	vi.vertexAttributeDescriptionCount = 2;
+	vi.pVertexAttributeDescriptions = attrs;
+
+	VkPipelineInputAssemblyStateCreateInfo ia = { VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO };
+	ia.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	VkPipelineViewportStateCreateInfo vp = { VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO };
+	vp.viewportCount = 1;
+	vp.scissorCount = 1;
+	VkPipelineMultisampleStateCreateInfo ms = { VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO };
+	ms.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+	static const VkDynamicState dynamic_states[2] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+	VkPipelineDynamicStateCreateInfo dyn = { VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO };
+	dyn.dynamicStateCount = 2;
+	dyn.pDynamicStates = dynamic_states;
+	static const VkPipelineColorBlendAttachmentState blend_attachment = {
+		VK_TRUE,
+		VK_BLEND_FACTOR_SRC_ALPHA, VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA, VK_BLEND_OP_ADD,
+		VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ZERO, VK_BLEND_OP_ADD,
+		0xf
+	};
+	VkPipelineColorBlendStateCreateInfo blend = { VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO };
+	blend.attachmentCount = 1;
+	blend.pAttachments = &blend_attachment;
+	VkPipelineDepthStencilStateCreateInfo ds = { VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO };
+	ds.depthTestEnable = VK_TRUE;
+	ds.depthWriteEnable = VK_TRUE;
+	ds.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+	VkPipelineRasterizationStateCreateInfo rs = { VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO };
+	rs.cullMode = VK_CULL_MODE_BACK_BIT;
+	rs.depthBiasEnable = VK_TRUE;
+
+	VkGraphicsPipelineCreateInfo graphics = { VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
+	graphics.stageCount = 2;
+	graphics.pStages = stages;
+	graphics.pVertexInputState = &vi;
+	graphics.pInputAssemblyState = &ia;
+	graphics.pViewportState = &vp;
+	graphics.pRasterizationState = &rs;
+	graphics.pMultisampleState = &ms;
+	graphics.pDepthStencilState = &ds;
+	graphics.pColorBlendState = &blend;
+	graphics.pDynamicState = &dyn;
+	graphics.layout = fake_handle<VkPipelineLayout>(10000);
+	graphics.renderPass = fake_handle<VkRenderPass>(30000);
+
+	static const VkSpecializationMapEntry entry = { 0, 0, sizeof(uint32_t) };
+	uint32_t spec_data = 0;
+	VkSpecializationInfo spec = {};
+	spec.mapEntryCount = 1;
+	spec.pMapEntries = &entry;
+	spec.dataSize = sizeof(spec_data);
+	spec.pData = &spec_data;
+
+	VkComputePipelineCreateInfo compute = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+	compute.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	compute.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	compute.stage.pName = "main";
+	compute.stage.pSpecializationInfo = &spec;
+	compute.layout = fake_handle<VkPipelineLayout>(10000);
+
+	for (unsigned i = 0; i < num_pipelines; i++)
+	{
+		if (i % 4 == 3)
+		{
+			compute.stage.module = fake_handle<VkShaderModule>(50000 + i % num_modules);
+			spec_data = i;
+			index = recorder.register_compute_pipeline(Hashing::compute_hash_compute_pipeline(recorder, compute), compute);
+			recorder.set_compute_pipeline_handle(index, fake_handle<VkPipeline>(1000000 + i));
+		}
+		else
+		{
+			stages[0].module = fake_handle<VkShaderModule>(50000 + i % num_modules);
+			stages[1].module = fake_handle<VkShaderModule>(50000 + (i + 1) % num_modules);
+			rs.depthBiasConstantFactor = float(i);
+			index = recorder.register_graphics_pipeline(Hashing::compute_hash_graphics_pipeline(recorder, graphics), graphics);
+			recorder.set_graphics_pipeline_handle(index, fake_handle<VkPipeline>(1000000 + i));
+		}
+	}
+}
+
+// Hands out fake handles, so parsing is measured without any object creation.
+struct NullReplayer : StateCreatorInterface
+{
+	bool enqueue_create_sampler(Hash, unsigned index, const VkSamplerCreateInfo *, VkSampler *sampler) override
+	{
+		*sampler = fake_handle<VkSampler>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_descriptor_set_layout(Hash, unsigned index, const VkDescriptorSetLayoutCreateInfo *, VkDescriptorSetLayout *layout) override
+	{
+		*layout = fake_handle<VkDescriptorSetLayout>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_pipeline_layout(Hash, unsigned index, const VkPipelineLayoutCreateInfo *, VkPipelineLayout *layout) override
+	{
+		*layout = fake_handle<VkPipelineLayout>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_shader_module(Hash, unsigned index, const VkShaderModuleCreateInfo *, VkShaderModule *module) override
+	{
+		*module = fake_handle<VkShaderModule>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_render_pass(Hash, unsigned index, const VkRenderPassCreateInfo *, VkRenderPass *render_pass) override
+	{
+		*render_pass = fake_handle<VkRenderPass>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_compute_pipeline(Hash, unsigned index, const VkComputePipelineCreateInfo *, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_graphics_pipeline(Hash, unsigned index, const VkGraphicsPipelineCreateInfo *, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(index + 1);
+		return true;
+	}
+};
+
+static void bench_archive(const Options &options, std::mt19937 &rnd)
+{
+	unsigned num_modules = options.pipelines / 8 + 1;
+	std::vector<std::vector<uint32_t>> modules;
+	modules.reserve(num_modules);
+	for (unsigned i = 0; i < num_modules; i++)
+	{
+		auto words = make_words(rnd, 256 + rnd() % 1024);
+		words[0] = 0x07230203u;
+		modules.push_back(std::move(words));
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "StateRecorder::register (%u)", options.pipelines);
+	run_benchmark(options, name, "pipeline", options.pipelines, 0, [&]() {
+		StateRecorder recorder;
+		record_synthetic_state(recorder, options.pipelines, modules);
+	});
+
+	for (unsigned compress = 0; compress < 2; compress++)
+	{
+		const char *suffix = compress ? ", compressed" : "";
+
+		// serialize() caches the JSON of every object it writes, so a cold run needs a freshly recorded state.
+		std::unique_ptr<StateRecorder> recorder;
+		auto record = [&]() {
+			recorder.reset(new StateRecorder);
+			recorder->set_compression(compress != 0);
+			record_synthetic_state(*recorder, options.pipelines, modules);
+		};
+
+		record();
+		auto archive = recorder->serialize();
+		snprintf(name, sizeof(name), "StateRecorder::serialize (%u%s)", options.pipelines, suffix);
+		run_benchmark(options, name, "pipeline", options.pipelines, archive.size(), record, [&]() {
+			archive = recorder->serialize();
+		});
+
+		snprintf(name, sizeof(name), "StateRecorder::serialize (%u%s, cached)", options.pipelines, suffix);
+		run_benchmark(options, name, "pipeline", options.pipelines, archive.size(), [&]() {
+			archive = recorder->serialize();
+		});
+
+		snprintf(name, sizeof(name), "StateReplayer::parse (%u%s)", options.pipelines, suffix);
+		run_benchmark(options, name, "pipeline", options.pipelines, archive.size(), [&]() {
+			NullReplayer iface;
+			StateReplayer replayer;
+			replayer.parse(iface, archive.data(), archive.size());
+		});
+	}
+}
+
+static bool write_json(const Options &options)
+{
+	FILE *file = fopen(options.json_path, "w");
+	if (!file)
+		return false;
+
+	fprintf(file, "{\n\t\"pipelines\": %u,\n\t\"iterations\": %u,\n\t\"bufferSize\": %llu,\n\t\"benchmarks\": [",
+	        options.pipelines, options.iterations, static_cast<unsigned long long>(options.buffer_size));
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		auto &result = results[i];
+		fprintf(file, "%s\n\t\t{ \"name\": \"%s\", \"unit\": \"%s\", \"nsPerOp\": %.3f, \"mbPerSecond\": %.3f, \"peakRssGrowthKb\": %llu }",
+		        i ? "," : "", result.name.c_str(), result.unit, result.ns_per_op, result.mb_per_second,
+		        static_cast<unsigned long long>(result.peak_rss_growth_kb));
+	}
+	fprintf(file, "\n\t]\n}\n");
+	return fclose(file) == 0;
+}
+
+static void print_help()
+{
+	fprintf(stderr, "fossilize-bench\n"
+	                "\t[--help]\n"
+	                "\t[--pipelines <count>]\n"
+	                "\t[--iterations <count>]\n"
+	                "\t[--buffer-size <MiB>]\n"
+	                "\t[--quick]\n"
+	                "\t[--json <path>]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	Options options;
+	for (int i = 1; i < argc; i++)
+	{
+		bool has_value = i + 1 < argc;
+		if (strcmp(argv[i], "--help") == 0)
+		{
+			print_help();
+			return EXIT_SUCCESS;
+		}
+		else if (strcmp(argv[i], "--pipelines") == 0 && has_value)
+			options.pipelines = unsigned(strtoul(argv[++i], nullptr, 0));
+		else if (strcmp(argv[i], "--iterations") == 0 && has_value)
+			options.iterations = unsigned(strtoul(argv[++i], nullptr, 0));
+		else if (strcmp(argv[i], "--buffer-size") == 0 && has_value)
+			options.buffer_size = size_t(strtoul(argv[++i], nullptr, 0)) * 1024 * 1024;
+		else if (strcmp(argv[i], "--json") == 0 && has_value)
+			options.json_path = argv[++i];
+		else if (strcmp(argv[i], "--quick") == 0)
+		{
+			// Small enough to run as part of the test suite, so the benchmarks keep working.
+			options.pipelines = 1000;
+			options.iterations = 1;
+			options.buffer_size = 1024 * 1024;
+		}
+		else
+		{
+			print_help();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (options.pipelines == 0 || options.iterations == 0 || options.buffer_size < sizeof(uint32_t))
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+
+	try
+	{
+		// Fixed seed, so every run measures the same data.
+		// The archive benchmarks use the most memory, so they run first, before the codec buffers raise the peak RSS.
+		std::mt19937 rnd;
+		bench_archive(options, rnd);
+		bench_hasher(options, rnd);
+		bench_varint(options, rnd);
+		bench_base64(options, rnd);
+		bench_lz(options, rnd);
+	}
+	catch (const std::exception &e)
+	{
+		fprintf(stderr, "Benchmark failed: %s\n", e.what());
+		return EXIT_FAILURE;
+	}
+
+	if (options.json_path && !write_json(options))
+	{
+		fprintf(stderr, "Failed to write %s.\n", options.json_path);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,217 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Runs fossilize-opt, whose path is passed as the only argument, on a generated archive.
+
+#include "fossilize.hpp"
+#include <exception>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace Fossilize;
+
+template <typename T>
+static inline T fake_handle(uint64_t value)
+{
+	return (T)value;
+}
+
+struct CountingInterface : StateCreatorInterface
+{
+	unsigned compute_pipelines = 0;
+	unsigned specialized_stages = 0;
+
+	bool enqueue_create_sampler(Hash, unsigned index, const VkSamplerCreateInfo *, VkSampler *sampler) override
+	{
+		*sampler = fake_handle<VkSampler>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_descriptor_set_layout(Hash, unsigned index, const VkDescriptorSetLayoutCreateInfo *, VkDescriptorSetLayout *layout) override
+	{
+		*layout = fake_handle<VkDescriptorSetLayout>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_pipeline_layout(Hash, unsigned index, const VkPipelineLayoutCreateInfo *, VkPipelineLayout *layout) override
+	{
+		*layout = fake_handle<VkPipelineLayout>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_shader_module(Hash, unsigned index, const VkShaderModuleCreateInfo *, VkShaderModule *module) override
+	{
+		*module = fake_handle<VkShaderModule>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_render_pass(Hash, unsigned index, const VkRenderPassCreateInfo *, VkRenderPass *render_pass) override
+	{
+		*render_pass = fake_handle<VkRenderPass>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_compute_pipeline(Hash, unsigned index, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		compute_pipelines++;
+		if (create_info->stage.pSpecializationInfo)
+			specialized_stages++;
+		*pipeline = fake_handle<VkPipeline>(index + 1);
+		return true;
+	}
+
+	bool enqueue_create_graphics_pipeline(Hash, unsigned index, const VkGraphicsPipelineCreateInfo *, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(index + 1);
+		return true;
+	}
+};
+
+static bool write_file(const char *path, const std::vector<uint8_t> &data)
+{
+	FILE *file = fopen(path, "wb");
+	if (!file)
+		return false;
+	bool success = fwrite(data.data(), 1, data.size(), file) == data.size();
+	return fclose(file) == 0 && success;
+}
+
+static std::vector<uint8_t> read_file(const char *path)
+{
+	std::vector<uint8_t> data;
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return data;
+
+	uint8_t buffer[4096];
+	size_t read_size;
+	while ((read_size = fread(buffer, 1, sizeof(buffer), file)) != 0)
+		data.insert(data.end(), buffer, buffer + read_size);
+	fclose(file);
+	return data;
+}
+
+// Two compute pipelines which only differ in the value of a specialization constant the shader never uses.
+// Once the constants are folded, both pipelines are the same, and must be recorded once.
+static std::vector<uint8_t> record_foldable_pipelines()
+{
+	StateRecorder recorder;
+
+	VkPipelineLayoutCreateInfo layout = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+	unsigned index = recorder.register_pipeline_layout(Hashing::compute_hash_pipeline_layout(recorder, layout), layout);
+	recorder.set_pipeline_layout_handle(index, fake_handle<VkPipelineLayout>(1));
+
+	static const uint32_t code[] = {
+		0x07230203, 0x00010000, 0, 7, 0,
+		(2u << 16) | 17, 1, // OpCapability Shader
+		(3u << 16) | 14, 0, 1, // OpMemoryModel Logical GLSL450
+		(5u << 16) | 15, 5, 1, 0x6e69616d, 0, // OpEntryPoint GLCompute %1 "main"
+		(6u << 16) | 16, 1, 17, 1, 1, 1, // OpExecutionMode %1 LocalSize 1 1 1
+		(4u << 16) | 71, 2, 1, 0, // OpDecorate %2 SpecId 0
+		(2u << 16) | 19, 3, // %3 = OpTypeVoid
+		(3u << 16) | 33, 4, 3, // %4 = OpTypeFunction %3
+		(4u << 16) | 21, 5, 32, 1, // %5 = OpTypeInt 32 1
+		(4u << 16) | 50, 5, 2, 0, // %2 = OpSpecConstant %5 0
+		(5u << 16) | 54, 3, 1, 0, 4, // %1 = OpFunction %3 None %4
+		(2u << 16) | 248, 6, // %6 = OpLabel
+		(1u << 16) | 253, // OpReturn
+		(1u << 16) | 56, // OpFunctionEnd
+	};
+	VkShaderModuleCreateInfo module = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+	module.pCode = code;
+	module.codeSize = sizeof(code);
+	index = recorder.register_shader_module(Hashing::compute_hash_shader_module(recorder, module), module);
+	recorder.set_shader_module_handle(index, fake_handle<VkShaderModule>(1));
+
+	static const VkSpecializationMapEntry entry = { 0, 0, sizeof(int32_t) };
+	for (int32_t value = 1; value <= 2; value++)
+	{
+		VkSpecializationInfo spec = {};
+		spec.mapEntryCount = 1;
+		spec.pMapEntries = &entry;
+		spec.dataSize = sizeof(value);
+		spec.pData = &value;
+
+		VkComputePipelineCreateInfo pipe = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+		pipe.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+		pipe.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+		pipe.stage.module = fake_handle<VkShaderModule>(1);
+		pipe.stage.pName = "main";
+		pipe.stage.pSpecializationInfo = &spec;
+		pipe.layout = fake_handle<VkPipelineLayout>(1);
+		index = recorder.register_compute_pipeline(Hashing::compute_hash_compute_pipeline(recorder, pipe), pipe);
+		recorder.set_compute_pipeline_handle(index, fake_handle<VkPipeline>(index + 1));
+	}
+
+	return recorder.serialize();
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "Usage: fossilize-opt-test <path to fossilize-opt>\n");
+		return EXIT_FAILURE;
+	}
+
+	static const char input_path[] = "fossilize-opt-test-input.foz";
+	static const char output_path[] = "fossilize-opt-test-output.foz";
+	if (!write_file(input_path, record_foldable_pipelines()))
+	{
+		fprintf(stderr, "Failed to write %s.\n", input_path);
+		return EXIT_FAILURE;
+	}
+
+	std::string command = std::string("\"") + argv[1] + "\" --fold-spec-constants --threads 1 --output " +
+	                      output_path + " " + input_path;
+	int status = system(command.c_str());
+	auto output = read_file(output_path);
+	remove(input_path);
+	remove(output_path);
+	if (status != 0 || output.empty())
+	{
+		fprintf(stderr, "fossilize-opt failed.\n");
+		return EXIT_FAILURE;
+	}
+
+	try
+	{
+		CountingInterface iface;
+		StateReplayer replayer;
+		replayer.parse(iface, output.data(), output.size());
+		if (iface.specialized_stages != 0 || iface.compute_pipelines != 1)
+		{
+			fprintf(stderr, "Pipelines which fold to the same SPIR-V were not deduplicated (%u pipelines, %u specialized).\n",
+			        iface.compute_pipelines, iface.specialized_stages);
+			return EXIT_FAILURE;
+		}
+	}
+	catch (const std::exception &e)
+	{
+		fprintf(stderr, "Failed to parse optimized archive: %s\n", e.what());
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
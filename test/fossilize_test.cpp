@@ -21,7 +21,12 @@
  */
 
 #include "fossilize.hpp"
+#include <algorithm>
+#include <mutex>
 #include <stdexcept>
+#include <unordered_map>
+#include <vector>
+#include <string.h>
 
 using namespace Fossilize;
 
@@ -36,6 +41,7 @@ static inline T fake_handle(uint64_t value)
 struct ReplayInterface : StateCreatorInterface
 {
 	StateRecorder recorder;
+	std::vector<const VkPipelineRasterizationStateCreateInfo *> rasterization_states;
 
 	bool enqueue_create_sampler(Hash hash, unsigned, const VkSamplerCreateInfo *create_info, VkSampler *sampler) override
 	{
@@ -115,6 +121,7 @@ struct ReplayInterface : StateCreatorInterface
 		if (recorded_hash != hash)
 			return false;
 
+		rasterization_states.push_back(create_info->pRasterizationState);
 		unsigned pipe_index = recorder.register_graphics_pipeline(hash, *create_info);
 		*pipeline = fake_handle<VkPipeline>(pipe_index + 600000);
 		recorder.set_graphics_pipeline_handle(pipe_index, *pipeline);
@@ -122,6 +129,47 @@ struct ReplayInterface : StateCreatorInterface
 	}
 };
 
+// Fails the first shader module it is asked to create.
+struct FailOnceInterface : ReplayInterface
+{
+	bool failed = false;
+
+	bool enqueue_create_shader_module(Hash hash, unsigned index, const VkShaderModuleCreateInfo *create_info, VkShaderModule *module) override
+	{
+		if (!failed)
+		{
+			failed = true;
+			return false;
+		}
+		return ReplayInterface::enqueue_create_shader_module(hash, index, create_info, module);
+	}
+};
+
+struct MemorySpirvStore : SpirvStore
+{
+	std::mutex lock;
+	std::unordered_map<Hash, std::vector<uint32_t>> modules;
+
+	bool store(Hash hash, const uint32_t *code, size_t size) override
+	{
+		std::lock_guard<std::mutex> holder{ lock };
+		auto &module = modules[hash];
+		if (module.empty())
+			module.assign(code, code + size / sizeof(uint32_t));
+		return true;
+	}
+
+	const uint32_t *load(Hash hash, size_t *size) override
+	{
+		std::lock_guard<std::mutex> holder{ lock };
+		auto itr = modules.find(hash);
+		if (itr == modules.end())
+			return nullptr;
+		*size = itr->second.size() * sizeof(uint32_t);
+		return itr->second.data();
+	}
+};
+
 static void record_samplers(StateRecorder &recorder)
 {
 	VkSamplerCreateInfo sampler = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
@@ -232,6 +280,34 @@ static void record_shader_modules(StateRecorder &recorder)
 	info.codeSize = sizeof(code2);
 	index = recorder.register_shader_module(Hashing::compute_hash_shader_module(recorder, info), info);
 	recorder.set_shader_module_handle(index, fake_handle<VkShaderModule>(5001));
+
+	// Well-formed SPIR-V, so SMOL-V encoding does not fall back to plain varint.
+	static const uint32_t code3[] = {
+		0x07230203, 0x00010000, 0x00080001, 0x00000006, 0x00000000,
+		0x00020011, 0x00000001,
+		0x0003000e, 0x00000000, 0x00000001,
+		0x0005000f, 0x00000005, 0x00000004, 0x6e69616d, 0x00000000,
+		0x00060010, 0x00000004, 0x00000011, 0x00000001, 0x00000001, 0x00000001,
+		0x00020013, 0x00000002,
+		0x00030021, 0x00000003, 0x00000002,
+		0x00050036, 0x00000002, 0x00000004, 0x00000000, 0x00000003,
+		0x000200f8, 0x00000005,
+		0x000100fd,
+		0x00010038,
+	};
+	info.pCode = code3;
+	info.codeSize = sizeof(code3);
+	index = recorder.register_shader_module(Hashing::compute_hash_shader_module(recorder, info), info);
+	recorder.set_shader_module_handle(index, fake_handle<VkShaderModule>(5002));
+
+	// Large enough to span several compressed blocks.
+	std::vector<uint32_t> code4;
+	for (uint32_t i = 0; i < 1024 * 1024; i++)
+		code4.push_back((i * 7) & 0xfff);
+	info.pCode = code4.data();
+	info.codeSize = code4.size() * sizeof(uint32_t);
+	index = recorder.register_shader_module(Hashing::compute_hash_shader_module(recorder, info), info);
+	recorder.set_shader_module_handle(index, fake_handle<VkShaderModule>(5003));
 }
 
 static void record_render_passes(StateRecorder &recorder)
@@ -483,9 +559,14 @@ static void record_graphics_pipelines(StateRecorder &recorder)
 
 	unsigned index = recorder.register_graphics_pipeline(Hashing::compute_hash_graphics_pipeline(recorder, pipe), pipe);
 	recorder.set_graphics_pipeline_handle(index, fake_handle<VkPipeline>(100000));
+	size_t footprint = StateRecorder::compute_graphics_pipeline_footprint(pipe);
 
 	vp.viewportCount = 0;
 	vp.scissorCount = 0;
+	// Fixed-function state is interned on its own, so it does not count towards the footprint.
+	if (footprint != StateRecorder::compute_graphics_pipeline_footprint(pipe))
+		throw std::runtime_error("Unexpected graphics pipeline footprint.");
+
 	pipe.basePipelineHandle = fake_handle<VkPipeline>(100000);
 	pipe.basePipelineIndex = 200;
 	index = recorder.register_graphics_pipeline(Hashing::compute_hash_graphics_pipeline(recorder, pipe), pipe);
@@ -497,8 +578,6 @@ int main()
 	try
 	{
 		StateRecorder recorder;
-		StateReplayer replayer;
-		ReplayInterface iface;
 
 		record_samplers(recorder);
 		record_set_layouts(recorder);
@@ -508,8 +587,427 @@ int main()
 		record_compute_pipelines(recorder);
 		record_graphics_pipelines(recorder);
 
-		auto res = recorder.serialize();
-		replayer.parse(iface, res.data(), res.size());
+		// The same replayer is reused for every archive.
+		StateReplayer replayer;
+		const SpirvEncoding encodings[] = { SpirvEncoding::Varint, SpirvEncoding::SmolV };
+		for (auto encoding : encodings)
+		{
+			for (unsigned compress = 0; compress < 2; compress++)
+			{
+				ReplayInterface iface;
+				recorder.set_spirv_encoding(encoding);
+				recorder.set_compression(compress != 0);
+				auto res = recorder.serialize();
+				replayer.reset();
+				replayer.parse(iface, res.data(), res.size());
+
+				// Replayed state must serialize to the exact same archive.
+				iface.recorder.set_spirv_encoding(encoding);
+				iface.recorder.set_compression(compress != 0);
+				if (iface.recorder.serialize() != res)
+				{
+					fprintf(stderr, "Replayed state does not round-trip.\n");
+					return EXIT_FAILURE;
+				}
+
+				// Both graphics pipelines share the same rasterization state.
+				if (iface.rasterization_states.size() != 2 ||
+				    iface.rasterization_states[0] != iface.rasterization_states[1])
+				{
+					fprintf(stderr, "Rasterization state was not shared.\n");
+					return EXIT_FAILURE;
+				}
+			}
+		}
+
+		// A reset recorder must produce the same archive when recording the same state again.
+		// Serializing in between must not leave stale cached objects behind either.
+		auto reference = recorder.serialize();
+		recorder.reset();
+		record_samplers(recorder);
+		record_set_layouts(recorder);
+		record_pipeline_layouts(recorder);
+		recorder.serialize();
+		record_shader_modules(recorder);
+		record_render_passes(recorder);
+		record_compute_pipelines(recorder);
+		record_graphics_pipelines(recorder);
+		if (recorder.serialize() != reference)
+		{
+			fprintf(stderr, "Reset recorder produced a different archive.\n");
+			return EXIT_FAILURE;
+		}
+
+		// Serializing on multiple threads must not change the archive.
+		for (unsigned compress = 0; compress < 2; compress++)
+		{
+			StateRecorder threaded;
+			threaded.set_num_threads(4);
+			threaded.set_spirv_encoding(SpirvEncoding::SmolV);
+			threaded.set_compression(compress != 0);
+			record_samplers(threaded);
+			record_set_layouts(threaded);
+			record_pipeline_layouts(threaded);
+			record_shader_modules(threaded);
+			record_render_passes(threaded);
+			record_compute_pipelines(threaded);
+			record_graphics_pipelines(threaded);
+
+			recorder.set_compression(compress != 0);
+			if (threaded.serialize() != recorder.serialize())
+			{
+				fprintf(stderr, "Threaded serialization produced a different archive.\n");
+				return EXIT_FAILURE;
+			}
+		}
+
+		// Canonical archives do not depend on duplicates or recording order, and compact JSON must parse.
+		{
+			StateRecorder canonical;
+			canonical.set_canonical_order(true);
+			canonical.set_compact_json(true);
+			record_samplers(canonical);
+			record_set_layouts(canonical);
+			record_pipeline_layouts(canonical);
+			record_shader_modules(canonical);
+			record_render_passes(canonical);
+			record_compute_pipelines(canonical);
+			record_graphics_pipelines(canonical);
+			auto canonical_archive = canonical.serialize();
+
+			record_samplers(canonical);
+			record_shader_modules(canonical);
+			record_graphics_pipelines(canonical);
+			if (canonical.serialize() != canonical_archive)
+			{
+				fprintf(stderr, "Duplicate objects changed the canonical archive.\n");
+				return EXIT_FAILURE;
+			}
+
+			ReplayInterface iface;
+			replayer.reset();
+			replayer.parse(iface, canonical_archive.data(), canonical_archive.size());
+			iface.recorder.set_canonical_order(true);
+			iface.recorder.set_compact_json(true);
+			if (iface.recorder.serialize() != canonical_archive)
+			{
+				fprintf(stderr, "Canonical archive does not round-trip.\n");
+				return EXIT_FAILURE;
+			}
+		}
+
+		// Pruned archives only keep objects which pipelines refer to, and replay to the same archive.
+		{
+			StateRecorder pruned;
+			record_samplers(pruned);
+			record_set_layouts(pruned);
+			record_pipeline_layouts(pruned);
+			record_shader_modules(pruned);
+			record_render_passes(pruned);
+			record_compute_pipelines(pruned);
+			record_graphics_pipelines(pruned);
+			unsigned unreferenced_modules = pruned.get_num_unreferenced_objects(ObjectType::ShaderModule);
+			pruned.set_prune_unreferenced(true);
+			auto pruned_archive = pruned.serialize();
+
+			ReplayInterface iface;
+			replayer.reset();
+			replayer.parse(iface, pruned_archive.data(), pruned_archive.size());
+			if (unreferenced_modules != 2 || iface.recorder.get_num_unreferenced_objects(ObjectType::ShaderModule) != 0 ||
+			    iface.recorder.serialize() != pruned_archive)
+			{
+				fprintf(stderr, "Unreferenced objects were not pruned.\n");
+				return EXIT_FAILURE;
+			}
+		}
+
+		// Modules which only differ in debug info hash the same when debug info is stripped.
+		{
+			static const uint32_t plain[] = {
+				0x07230203, 0x10000, 0, 4, 0,
+				(2u << 16) | 17, 1, // OpCapability Shader
+				(3u << 16) | 14, 0, 1, // OpMemoryModel Logical GLSL450
+			};
+			static const uint32_t debug[] = {
+				0x07230203, 0x10000, 0, 4, 0,
+				(2u << 16) | 17, 1,
+				(3u << 16) | 3, 2, 450, // OpSource GLSL 450
+				(3u << 16) | 14, 0, 1,
+				(4u << 16) | 5, 1, 0x6e69616d, 0, // OpName %1 "main"
+				(4u << 16) | 8, 2, 10, 0, // OpLine %2 10 0
+			};
+			static const uint32_t malformed[] = { 0x07230203, 0x10000, 0, 4, 0, 5, 1 };
+
+			VkShaderModuleCreateInfo plain_info = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+			plain_info.pCode = plain;
+			plain_info.codeSize = sizeof(plain);
+			VkShaderModuleCreateInfo debug_info = plain_info;
+			debug_info.pCode = debug;
+			debug_info.codeSize = sizeof(debug);
+
+			StateRecorder stripping;
+			stripping.set_strip_debug_info(true);
+			StateRecorder plain_recorder;
+			auto stripped = strip_spirv_debug_info(debug, sizeof(debug));
+			auto unchanged = strip_spirv_debug_info(malformed, sizeof(malformed));
+			if (Hashing::compute_hash_shader_module(stripping, debug_info) != Hashing::compute_hash_shader_module(plain_recorder, plain_info) ||
+			    Hashing::compute_hash_shader_module(plain_recorder, debug_info) == Hashing::compute_hash_shader_module(plain_recorder, plain_info) ||
+			    stripped != std::vector<uint32_t>(plain, plain + sizeof(plain) / sizeof(uint32_t)) ||
+			    unchanged != std::vector<uint32_t>(malformed, malformed + sizeof(malformed) / sizeof(uint32_t)))
+			{
+				fprintf(stderr, "Debug info was not stripped.\n");
+				return EXIT_FAILURE;
+			}
+		}
+
+		// Indexed archives can create a single pipeline along with only the objects it depends on.
+		Hash pipeline_hash = recorder.get_hash_for_graphics_pipeline_handle(fake_handle<VkPipeline>(100000));
+		recorder.set_write_index(true);
+		for (unsigned compress = 0; compress < 2; compress++)
+		{
+			recorder.set_compression(compress != 0);
+			auto indexed = recorder.serialize();
+
+			ReplayInterface iface;
+			replayer.reset();
+			replayer.parse_index(iface, indexed.data(), indexed.size());
+			if (!replayer.parse_object(iface, ObjectType::GraphicsPipeline, pipeline_hash) ||
+			    !replayer.parse_object(iface, ObjectType::GraphicsPipeline, pipeline_hash) ||
+			    iface.rasterization_states.size() != 1)
+			{
+				fprintf(stderr, "Failed to create single pipeline from index.\n");
+				return EXIT_FAILURE;
+			}
+
+			if (replayer.parse_object(iface, ObjectType::GraphicsPipeline, pipeline_hash + 1))
+			{
+				fprintf(stderr, "Index returned an object which does not exist.\n");
+				return EXIT_FAILURE;
+			}
+
+			// A pipeline whose dependency failed to create can be retried.
+			FailOnceInterface retry;
+			replayer.reset();
+			replayer.parse_index(retry, indexed.data(), indexed.size());
+			bool threw = false;
+			try
+			{
+				replayer.parse_object(retry, ObjectType::GraphicsPipeline, pipeline_hash);
+			}
+			catch (const std::exception &)
+			{
+				threw = true;
+			}
+			if (!threw || !retry.failed ||
+			    !replayer.parse_object(retry, ObjectType::GraphicsPipeline, pipeline_hash) ||
+			    retry.rasterization_states.size() != 1)
+			{
+				fprintf(stderr, "Failed to retry pipeline after a failed create.\n");
+				return EXIT_FAILURE;
+			}
+
+			ReplayInterface by_position;
+			replayer.reset();
+			replayer.parse_index(by_position, indexed.data(), indexed.size());
+			if (!StateReplayer::has_index(indexed.data(), indexed.size()) ||
+			    !replayer.parse_object_at(by_position, ObjectType::GraphicsPipeline, 0) ||
+			    replayer.parse_object_at(by_position, ObjectType::GraphicsPipeline, 1000) ||
+			    by_position.rasterization_states.size() != 1)
+			{
+				fprintf(stderr, "Failed to create pipeline by position from index.\n");
+				return EXIT_FAILURE;
+			}
+
+			// Readers which do not know about the index skip it.
+			ReplayInterface full;
+			replayer.reset();
+			replayer.parse(full, indexed.data(), indexed.size());
+			full.recorder.set_write_index(true);
+			full.recorder.set_spirv_encoding(SpirvEncoding::SmolV);
+			full.recorder.set_compression(compress != 0);
+			if (full.recorder.serialize() != indexed)
+			{
+				fprintf(stderr, "Indexed archive does not round-trip.\n");
+				return EXIT_FAILURE;
+			}
+		}
+		recorder.set_write_index(false);
+		{
+			auto plain = recorder.serialize();
+			if (StateReplayer::has_index(plain.data(), plain.size()))
+			{
+				fprintf(stderr, "Archive without index reported an index.\n");
+				return EXIT_FAILURE;
+			}
+		}
+
+		// Archives which keep SPIR-V in a shared store only refer to modules by hash.
+		{
+			MemorySpirvStore store;
+			StateRecorder split;
+			split.set_spirv_store(&store);
+			split.set_num_threads(4);
+			record_samplers(split);
+			record_set_layouts(split);
+			record_pipeline_layouts(split);
+			record_shader_modules(split);
+			record_render_passes(split);
+			record_compute_pipelines(split);
+			record_graphics_pipelines(split);
+			auto split_archive = split.serialize();
+			if (store.modules.size() != 4)
+			{
+				fprintf(stderr, "Shader modules were not written to the SPIR-V store.\n");
+				return EXIT_FAILURE;
+			}
+
+			bool missing_store_threw = false;
+			try
+			{
+				ReplayInterface iface;
+				replayer.reset();
+				replayer.parse(iface, split_archive.data(), split_archive.size());
+			}
+			catch (const std::exception &)
+			{
+				missing_store_threw = true;
+			}
+
+			ReplayInterface iface;
+			replayer.reset();
+			replayer.set_spirv_store(&store);
+			replayer.parse(iface, split_archive.data(), split_archive.size());
+			replayer.set_spirv_store(nullptr);
+			iface.recorder.set_spirv_store(&store);
+			if (!missing_store_threw || iface.recorder.serialize() != split_archive)
+			{
+				fprintf(stderr, "Archive with SPIR-V store does not round-trip.\n");
+				return EXIT_FAILURE;
+			}
+		}
+
+		// Corrupt block sizes are rejected before anything is allocated for the inflated chunk.
+		{
+			// The loops above leave the recorder compressing.
+			auto corrupt = recorder.serialize();
+
+			static const char block_magic[] = FOSSILIZE_BLOCK_LZ_MAGIC;
+			auto itr = std::search(corrupt.begin(), corrupt.end(), block_magic, block_magic + 8);
+			if (itr == corrupt.end())
+			{
+				fprintf(stderr, "Compressed archive has no block LZ chunk.\n");
+				return EXIT_FAILURE;
+			}
+
+			// The chunk header follows the magic and chunk size: wrapped magic, inflated size, block size, block count.
+			size_t header = size_t(itr - corrupt.begin()) + 2 * sizeof(uint64_t);
+			const uint64_t inflated_size = 0xffff0000ull;
+			const uint32_t block_size = 0xffffffffu;
+			memcpy(corrupt.data() + header + sizeof(uint64_t), &inflated_size, sizeof(inflated_size));
+			memcpy(corrupt.data() + header + 2 * sizeof(uint64_t), &block_size, sizeof(block_size));
+
+			bool rejected = false;
+			try
+			{
+				ReplayInterface iface;
+				replayer.reset();
+				replayer.parse(iface, corrupt.data(), corrupt.size());
+			}
+			catch (const Exception &)
+			{
+				rejected = true;
+			}
+
+			if (!rejected)
+			{
+				fprintf(stderr, "Corrupt block size was not rejected.\n");
+				return EXIT_FAILURE;
+			}
+		}
+
+		// Archives streamed to a file match serialize() byte for byte. The state spans several stream batches and blocks.
+		{
+			StateRecorder streamed;
+			streamed.set_num_threads(4);
+			record_samplers(streamed);
+			record_set_layouts(streamed);
+			record_pipeline_layouts(streamed);
+			record_shader_modules(streamed);
+			record_render_passes(streamed);
+			record_compute_pipelines(streamed);
+			record_graphics_pipelines(streamed);
+
+			VkSamplerCreateInfo sampler = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+			for (unsigned i = 0; i < 10000; i++)
+			{
+				sampler.maxLod = float(i);
+				streamed.register_sampler(Hashing::compute_hash_sampler(streamed, sampler), sampler);
+			}
+
+			std::vector<uint32_t> code(1500 * 1000);
+			for (size_t i = 0; i < code.size(); i++)
+				code[i] = uint32_t(i * 2654435761u);
+			VkShaderModuleCreateInfo module = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+			module.pCode = code.data();
+			module.codeSize = code.size() * sizeof(uint32_t);
+			streamed.register_shader_module(Hashing::compute_hash_shader_module(streamed, module), module);
+
+			static const char path[] = "fossilize-stream-test.foz";
+			for (unsigned variant = 0; variant < 8; variant++)
+			{
+				streamed.set_compression((variant & 1) != 0);
+				streamed.set_write_index((variant & 2) != 0);
+				streamed.set_compact_json((variant & 2) != 0);
+				streamed.set_canonical_order((variant & 4) != 0);
+				streamed.set_prune_unreferenced((variant & 4) != 0);
+				auto archive = streamed.serialize();
+				streamed.serialize_to_file(path);
+
+				std::vector<uint8_t> file_archive;
+				FILE *file = fopen(path, "rb");
+				if (file)
+				{
+					uint8_t buffer[4096];
+					size_t read_size;
+					while ((read_size = fread(buffer, 1, sizeof(buffer), file)) != 0)
+						file_archive.insert(file_archive.end(), buffer, buffer + read_size);
+					fclose(file);
+				}
+				remove(path);
+
+				if (file_archive != archive)
+				{
+					fprintf(stderr, "Archive streamed to a file does not match the serialized archive.\n");
+					return EXIT_FAILURE;
+				}
+			}
+		}
+
+		// Destroyed handles are unmapped, but their recorded state stays in the archive.
+		recorder.remove_graphics_pipeline_handle(fake_handle<VkPipeline>(100000));
+		recorder.remove_sampler_handle(fake_handle<VkSampler>(100));
+		if (recorder.serialize() != reference)
+		{
+			fprintf(stderr, "Removing handles changed the archive.\n");
+			return EXIT_FAILURE;
+		}
+
+		bool threw = false;
+		try
+		{
+			recorder.get_hash_for_graphics_pipeline_handle(fake_handle<VkPipeline>(100000));
+		}
+		catch (const std::exception &)
+		{
+			threw = true;
+		}
+
+		if (!threw)
+		{
+			fprintf(stderr, "Removed handle is still mapped.\n");
+			return EXIT_FAILURE;
+		}
+
 		return EXIT_SUCCESS;
 	}
 	catch (const std::exception &e)
@@ -0,0 +1,166 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "handle_map.hpp"
+#include <unordered_map>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <vector>
+#include <stdlib.h>
+#include <stdio.h>
+
+using namespace Fossilize;
+
+static bool test_against_reference()
+{
+	std::mt19937_64 rnd;
+	HandleMap<uint64_t, unsigned> map(0.75f);
+	std::unordered_map<uint64_t, unsigned> reference;
+
+	// A small key range forces plenty of collisions, re-insertions and erases of existing keys.
+	for (unsigned i = 0; i < 200000; i++)
+	{
+		uint64_t key = rnd() % 4096;
+		switch (rnd() % 3)
+		{
+		case 0:
+			map[key] = i;
+			reference[key] = i;
+			break;
+
+		case 1:
+			if (map.erase(key) != (reference.erase(key) != 0))
+				return false;
+			break;
+
+		default:
+		{
+			auto *value = map.find(key);
+			auto itr = reference.find(key);
+			if ((value != nullptr) != (itr != reference.end()))
+				return false;
+			if (value && *value != itr->second)
+				return false;
+			break;
+		}
+		}
+
+		if (map.size() != reference.size())
+			return false;
+	}
+
+	for (auto &entry : reference)
+	{
+		auto *value = map.find(entry.first);
+		if (!value || *value != entry.second)
+			return false;
+	}
+
+	map.clear();
+	return map.empty() && !map.find(0) && !map.find(1);
+}
+
+static bool test_move_only_values()
+{
+	HandleMap<void *, std::unique_ptr<int>> map;
+	int objects[64];
+	for (int i = 0; i < 64; i++)
+		map[&objects[i]].reset(new int(i));
+
+	for (int i = 0; i < 64; i += 2)
+		if (!map.erase(&objects[i]))
+			return false;
+
+	for (int i = 0; i < 64; i++)
+	{
+		auto *value = map.find(&objects[i]);
+		if ((i & 1) != (value != nullptr))
+			return false;
+		if (value && **value != i)
+			return false;
+	}
+
+	return map.size() == 32;
+}
+
+static double get_rate(std::chrono::steady_clock::time_point start, size_t lookups)
+{
+	auto end = std::chrono::steady_clock::now();
+	return double(lookups) / std::chrono::duration<double>(end - start).count();
+}
+
+// Not a pass/fail criterion, but reports lookup throughput against std::unordered_map.
+static void benchmark()
+{
+	const unsigned count = 200000;
+	const unsigned iterations = 20;
+	std::mt19937_64 rnd(1234);
+	std::vector<uint64_t> keys;
+	HandleMap<uint64_t, unsigned> flat;
+	std::unordered_map<uint64_t, unsigned> node;
+
+	// Look like heap allocated handles.
+	for (unsigned i = 0; i < count; i++)
+	{
+		uint64_t key = (rnd() & 0x00007ffffffffff0ull) | 0x10;
+		keys.push_back(key);
+		flat[key] = i;
+		node[key] = i;
+	}
+	std::shuffle(keys.begin(), keys.end(), rnd);
+
+	uint64_t checksum = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned i = 0; i < iterations; i++)
+		for (auto key : keys)
+			checksum += *flat.find(key);
+	double flat_rate = get_rate(start, keys.size() * iterations);
+
+	start = std::chrono::steady_clock::now();
+	for (unsigned i = 0; i < iterations; i++)
+		for (auto key : keys)
+			checksum += node.find(key)->second;
+	double node_rate = get_rate(start, keys.size() * iterations);
+
+	printf("Lookups with %u handles: HandleMap %.1f M/s, std::unordered_map %.1f M/s (checksum %llu).\n",
+	       count, flat_rate * 1e-6, node_rate * 1e-6, static_cast<unsigned long long>(checksum));
+}
+
+int main()
+{
+	if (!test_against_reference())
+	{
+		fprintf(stderr, "HandleMap does not match reference.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (!test_move_only_values())
+	{
+		fprintf(stderr, "HandleMap failed with move-only values.\n");
+		return EXIT_FAILURE;
+	}
+
+	benchmark();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,102 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "lz.hpp"
+#include "test_data.hpp"
+#include <random>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+using namespace Fossilize;
+
+static bool round_trip(const std::vector<uint8_t> &data, size_t *encoded_size)
+{
+	std::vector<uint8_t> encoded(compute_max_size_lz(data.size()));
+	size_t size = encode_lz(encoded.data(), data.data(), data.size());
+	if (size > encoded.size())
+		return false;
+	encoded.resize(size);
+	if (encoded_size)
+		*encoded_size = size;
+
+	std::vector<uint8_t> decoded(data.size());
+	if (!decode_lz(decoded.data(), decoded.size(), encoded.data(), encoded.size()))
+		return false;
+	if (!data.empty() && memcmp(data.data(), decoded.data(), data.size()))
+		return false;
+
+	// Truncated or mis-sized input must be rejected.
+	if (decode_lz(decoded.data(), decoded.size(), encoded.data(), encoded.size() - 1))
+		return false;
+	decoded.push_back(0);
+	if (decode_lz(decoded.data(), decoded.size(), encoded.data(), encoded.size()))
+		return false;
+
+	return true;
+}
+
+int main()
+{
+	std::mt19937 rnd;
+
+	auto text = make_text(rnd, 4 * 1024 * 1024);
+
+	size_t encoded_size = 0;
+	if (!round_trip(text, &encoded_size))
+	{
+		fprintf(stderr, "Failed to round-trip text.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (encoded_size >= text.size() / 2)
+	{
+		fprintf(stderr, "Text did not compress (%u -> %u bytes).\n", unsigned(text.size()), unsigned(encoded_size));
+		return EXIT_FAILURE;
+	}
+
+	// Incompressible data.
+	std::vector<uint8_t> noise;
+	for (unsigned i = 0; i < 1024 * 1024; i++)
+		noise.push_back(uint8_t(rnd()));
+	if (!round_trip(noise, nullptr))
+		return EXIT_FAILURE;
+
+	// Long runs exercise overlapping matches and long length encodings.
+	std::vector<uint8_t> runs;
+	for (unsigned i = 0; i < 64; i++)
+		runs.insert(runs.end(), rnd() % 10000, uint8_t(rnd()));
+	if (!round_trip(runs, nullptr))
+		return EXIT_FAILURE;
+
+	for (unsigned size = 0; size < 64; size++)
+	{
+		std::vector<uint8_t> small;
+		for (unsigned i = 0; i < size; i++)
+			small.push_back(uint8_t(rnd() & 3));
+		if (!round_trip(small, nullptr))
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
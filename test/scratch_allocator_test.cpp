@@ -0,0 +1,161 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "fossilize.hpp"
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+using namespace Fossilize;
+
+static bool is_aligned(const void *ptr, size_t alignment)
+{
+	return (reinterpret_cast<uintptr_t>(ptr) & (alignment - 1)) == 0;
+}
+
+static bool test_concurrent()
+{
+	ConcurrentScratchAllocator allocator;
+	const unsigned num_threads = 8;
+	const unsigned num_allocations = 20000;
+	std::vector<std::vector<uint32_t *>> results(num_threads);
+	std::vector<std::thread> threads;
+
+	for (unsigned t = 0; t < num_threads; t++)
+	{
+		threads.emplace_back([&, t]() {
+			for (unsigned i = 0; i < num_allocations; i++)
+			{
+				unsigned count = 1 + (i % 13);
+				auto *values = allocator.allocate_n<uint32_t>(count);
+				for (unsigned j = 0; j < count; j++)
+					values[j] = t * num_allocations + i;
+				results[t].push_back(values);
+			}
+		});
+	}
+
+	for (auto &thread : threads)
+		thread.join();
+
+	// Allocations from different threads must never overlap.
+	for (unsigned t = 0; t < num_threads; t++)
+	{
+		for (unsigned i = 0; i < num_allocations; i++)
+		{
+			unsigned count = 1 + (i % 13);
+			for (unsigned j = 0; j < count; j++)
+				if (results[t][i][j] != t * num_allocations + i)
+					return false;
+		}
+	}
+
+	size_t reserved = allocator.get_bytes_reserved();
+	allocator.reset();
+	if (allocator.get_bytes_used() != 0 || allocator.get_bytes_reserved() != reserved)
+		return false;
+
+	return true;
+}
+
+int main()
+{
+	if (!test_concurrent())
+	{
+		fprintf(stderr, "Concurrent allocation failed.\n");
+		return EXIT_FAILURE;
+	}
+
+	ScratchAllocator allocator;
+
+	for (unsigned i = 0; i < 10000; i++)
+	{
+		size_t alignment = size_t(1) << (i % 7);
+		void *ptr = allocator.allocate_raw(1 + i % 200, alignment);
+		if (!is_aligned(ptr, alignment))
+		{
+			fprintf(stderr, "Misaligned allocation.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	size_t reserved = allocator.get_bytes_reserved();
+	if (allocator.get_bytes_used() + allocator.get_bytes_wasted() > reserved)
+	{
+		fprintf(stderr, "Counters exceed reserved memory.\n");
+		return EXIT_FAILURE;
+	}
+
+	// Large allocations bypass the blocks.
+	auto *large = allocator.allocate_n_cleared<uint32_t>(1024 * 1024);
+	if (!large || large[1024 * 1024 - 1] != 0 || !is_aligned(large, 16))
+		return EXIT_FAILURE;
+	if (allocator.get_bytes_reserved() < reserved + 4 * 1024 * 1024)
+		return EXIT_FAILURE;
+
+	// Rewinding restores the counters and frees the dedicated allocation.
+	{
+		ScratchAllocator::Marker before = allocator.get_marker();
+		size_t used = allocator.get_bytes_used();
+		size_t wasted = allocator.get_bytes_wasted();
+		{
+			ScratchAllocator::ScopedMarker scoped(allocator);
+			allocator.allocate_n<uint8_t>(100000);
+			for (unsigned i = 0; i < 1000; i++)
+				allocator.allocate_n<uint64_t>(100);
+		}
+
+		if (allocator.get_bytes_used() != used || allocator.get_bytes_wasted() != wasted)
+		{
+			fprintf(stderr, "Scoped marker did not rewind.\n");
+			return EXIT_FAILURE;
+		}
+
+		ScratchAllocator::Marker after = allocator.get_marker();
+		if (after.block_index != before.block_index || after.offset != before.offset ||
+		    after.dedicated_count != before.dedicated_count)
+			return EXIT_FAILURE;
+	}
+
+	// Reset keeps block capacity around.
+	allocator.reset();
+	if (allocator.get_bytes_used() != 0 || allocator.get_bytes_wasted() != 0)
+		return EXIT_FAILURE;
+	if (allocator.get_bytes_reserved() < reserved)
+	{
+		fprintf(stderr, "Reset did not keep capacity.\n");
+		return EXIT_FAILURE;
+	}
+	reserved = allocator.get_bytes_reserved();
+
+	for (unsigned i = 0; i < 10000; i++)
+		allocator.allocate_raw(1 + i % 200, size_t(1) << (i % 7));
+	if (allocator.get_bytes_reserved() != reserved)
+	{
+		fprintf(stderr, "Reused allocator grew.\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,129 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "smolv.hpp"
+#include "varint.hpp"
+#include <algorithm>
+#include <random>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+using namespace Fossilize;
+
+static std::vector<uint32_t> generate_module(std::mt19937 &rnd, unsigned instruction_count)
+{
+	static const uint32_t opcodes[] = { 5, 43, 61, 62, 65, 71, 79, 81, 129, 133, 248, 249, 253, 0x1234 };
+	std::vector<uint32_t> words = { 0x07230203, 0x00010000, 0, 0, 0 };
+	uint32_t next_id = 1;
+
+	for (unsigned i = 0; i < instruction_count; i++)
+	{
+		uint32_t op = opcodes[rnd() % (sizeof(opcodes) / sizeof(opcodes[0]))];
+		uint32_t operand_count = rnd() % 8;
+		if ((rnd() & 255) == 0)
+			operand_count += 40;
+
+		words.push_back(((operand_count + 1) << 16) | op);
+		for (uint32_t j = 0; j < operand_count; j++)
+		{
+			// Mostly IDs close to the most recent result, sometimes arbitrary literals.
+			if (rnd() & 3)
+				words.push_back(next_id - uint32_t(rnd() % std::min(next_id, 16u)));
+			else
+				words.push_back(uint32_t(rnd()));
+		}
+		next_id++;
+	}
+
+	words[3] = next_id;
+	return words;
+}
+
+static bool round_trip(const std::vector<uint32_t> &words, size_t *encoded_size)
+{
+	std::vector<uint8_t> encoded;
+	encode_smolv(encoded, words.data(), words.size());
+	if (encoded_size)
+		*encoded_size = encoded.size();
+
+	std::vector<uint32_t> decoded(words.size());
+	if (!decode_smolv(decoded.data(), decoded.size(), encoded.data(), encoded.size()))
+		return false;
+	if (!words.empty() && memcmp(words.data(), decoded.data(), words.size() * sizeof(uint32_t)))
+		return false;
+
+	// Truncated or mis-sized input must be rejected.
+	if (!encoded.empty() && decode_smolv(decoded.data(), decoded.size(), encoded.data(), encoded.size() - 1))
+		return false;
+	decoded.push_back(0);
+	if (decode_smolv(decoded.data(), decoded.size(), encoded.data(), encoded.size()))
+		return false;
+
+	return true;
+}
+
+int main()
+{
+	std::mt19937 rnd;
+	size_t smolv_size = 0;
+	size_t varint_size = 0;
+
+	for (unsigned i = 0; i < 64; i++)
+	{
+		auto module = generate_module(rnd, 10000);
+		size_t encoded_size = 0;
+		if (!round_trip(module, &encoded_size))
+		{
+			fprintf(stderr, "Failed to round-trip SPIR-V module.\n");
+			return EXIT_FAILURE;
+		}
+		smolv_size += encoded_size;
+		varint_size += compute_size_varint(module.data(), module.size());
+	}
+
+	if (smolv_size >= varint_size)
+	{
+		fprintf(stderr, "SMOL-V encoding (%u bytes) is not smaller than varint (%u bytes).\n",
+		        unsigned(smolv_size), unsigned(varint_size));
+		return EXIT_FAILURE;
+	}
+
+	// Arbitrary words which are not SPIR-V must also round-trip.
+	std::vector<uint32_t> garbage;
+	for (unsigned i = 0; i < 4096; i++)
+		garbage.push_back(uint32_t(rnd()));
+	if (!round_trip(garbage, nullptr))
+		return EXIT_FAILURE;
+
+	// Valid header, but the last instruction overruns the module.
+	auto broken = generate_module(rnd, 100);
+	broken.pop_back();
+	if (!round_trip(broken, nullptr))
+		return EXIT_FAILURE;
+
+	if (!round_trip({}, nullptr))
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,44 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <random>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+
+namespace Fossilize
+{
+// Text-like data with plenty of repetition, like the JSON chunk. The same seed always gives the same text.
+static inline std::vector<uint8_t> make_text(std::mt19937 &rnd, size_t size)
+{
+	static const char *words[] = { "\"hash\": ", "\"flags\": 0,\n", "\"stages\": [\n", "{\n", "}\n", "        ", "\"module\": " };
+	std::vector<uint8_t> text;
+	while (text.size() < size)
+	{
+		const char *word = words[rnd() % (sizeof(words) / sizeof(words[0]))];
+		text.insert(text.end(), word, word + strlen(word));
+		text.push_back(uint8_t('0' + rnd() % 10));
+	}
+	return text;
+}
+}
@@ -0,0 +1,92 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "thread_pool.hpp"
+
+namespace Fossilize
+{
+unsigned ThreadPool::get_default_num_threads()
+{
+	unsigned count = std::thread::hardware_concurrency();
+	return count ? count : 1;
+}
+
+ThreadPool::ThreadPool(unsigned num_threads)
+{
+	if (num_threads == 0)
+		num_threads = get_default_num_threads();
+
+	threads.reserve(num_threads);
+	for (unsigned i = 0; i < num_threads; i++)
+		threads.emplace_back(&ThreadPool::thread_loop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> holder{ lock };
+		shutdown = true;
+	}
+	task_cond.notify_all();
+
+	for (auto &thread : threads)
+		thread.join();
+}
+
+void ThreadPool::enqueue(std::function<void ()> func)
+{
+	{
+		std::lock_guard<std::mutex> holder{ lock };
+		tasks.push_back(std::move(func));
+		pending++;
+	}
+	task_cond.notify_one();
+}
+
+void ThreadPool::wait_idle()
+{
+	std::unique_lock<std::mutex> holder{ lock };
+	idle_cond.wait(holder, [this] { return pending == 0; });
+}
+
+void ThreadPool::thread_loop()
+{
+	for (;;)
+	{
+		std::function<void ()> func;
+		{
+			std::unique_lock<std::mutex> holder{ lock };
+			task_cond.wait(holder, [this] { return shutdown || !tasks.empty(); });
+			if (tasks.empty())
+				return;
+			func = std::move(tasks.front());
+			tasks.pop_front();
+		}
+
+		func();
+
+		std::lock_guard<std::mutex> holder{ lock };
+		if (--pending == 0)
+			idle_cond.notify_all();
+	}
+}
+}
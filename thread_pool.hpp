@@ -0,0 +1,65 @@
+/* Copyright (c) 2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <deque>
+
+namespace Fossilize
+{
+class ThreadPool
+{
+public:
+	// 0 threads means one thread per hardware thread.
+	explicit ThreadPool(unsigned num_threads = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool &) = delete;
+	void operator=(const ThreadPool &) = delete;
+
+	// Tasks must not throw.
+	void enqueue(std::function<void ()> func);
+	void wait_idle();
+
+	unsigned get_num_threads() const
+	{
+		return unsigned(threads.size());
+	}
+
+	static unsigned get_default_num_threads();
+
+private:
+	std::vector<std::thread> threads;
+	std::deque<std::function<void ()>> tasks;
+	std::mutex lock;
+	std::condition_variable task_cond;
+	std::condition_variable idle_cond;
+	unsigned pending = 0;
+	bool shutdown = false;
+
+	void thread_loop();
+};
+}